@@ -0,0 +1,28 @@
+#!/bin/sh
+# Arithmetic benchmark: time the ((i++)) loop of bench/arith.noosh with
+# the bytecode VM, with the tree walker (set +o bytecode), and with bash
+# and zsh when they are installed.
+#   usage: bench/arith.sh [path/to/noosh]
+
+dir=$(dirname "$0")
+noosh=${1:-./noosh}
+script=$dir/arith.noosh
+
+now() {
+  date +%s%N
+}
+
+run() {
+  start=$(now)
+  "$@" > /dev/null
+  end=$(now)
+  printf '%-9s %6d ms\n' "$name" $(( (end - start) / 1000000 ))
+}
+
+name=bytecode run "$noosh" "$script"
+name=tree run sh -c '{ echo "set +o bytecode"; cat "$1"; } | "$2"' sh "$script" "$noosh"
+for shell in bash zsh; do
+  if command -v $shell > /dev/null; then
+    name=$shell run $shell "$script"
+  fi
+done
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Array benchmark: time bench/arrays.noosh (100,000 associative array
+# insertions and lookups, 100,000 appends, one "${list[@]}" expansion)
+# in noosh and in bash when installed, and the same map emulated with
+# eval, one variable per element, as scripts do without arrays.
+#   usage: bench/arrays.sh [path/to/noosh]
+
+dir=$(dirname "$0")
+noosh=${1:-./noosh}
+
+now() {
+  date +%s%N
+}
+
+run() {
+  start=$(now)
+  "$@" > /dev/null
+  end=$(now)
+  printf '%-11s %6d ms\n' "$name" $(( (end - start) / 1000000 ))
+}
+
+name=arrays run "$noosh" "$dir/arrays.noosh"
+name=eval run "$noosh" "$dir/arrays_eval.noosh"
+if command -v bash > /dev/null; then
+  name=bash run bash "$dir/arrays.noosh"
+fi
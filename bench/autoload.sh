@@ -0,0 +1,54 @@
+#!/bin/sh
+# Autoload benchmark: generate 40 library files of 50 functions each,
+# then time a shell that calls two of the functions after sourcing every
+# library (with a warm bytecode cache), and after autoloading them from
+# NOOSHFPATH (with a warm index).
+#   usage: bench/autoload.sh [path/to/noosh]
+
+noosh=${1:-./noosh}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+mkdir "$dir/lib" "$dir/cache"
+
+for l in $(seq 1 40); do
+  for f in $(seq 1 50); do
+    cat <<FN
+lib${l}_fn$f() {
+  for arg in "\$@"; do
+    case \$arg in
+      -v|--verbose) verbose=1 ;;
+      -*) echo "lib${l}_fn$f: unknown option \$arg" ;;
+      *) result="\${result}\$arg" ;;
+    esac
+  done
+  if [ -n "\$verbose" ]; then echo "lib${l}_fn$f: \$result"; fi
+}
+FN
+  done > "$dir/lib/lib$l.sh"
+done
+for l in $(seq 1 40); do
+  echo ". $dir/lib/lib$l.sh"
+done > "$dir/source.sh"
+echo "lib3_fn7 a; lib38_fn50 b" >> "$dir/source.sh"
+cat > "$dir/autoload.sh" <<EOF2
+autoload lib3_fn7 lib38_fn50
+lib3_fn7 a; lib38_fn50 b
+EOF2
+
+now() {
+  date +%s%N
+}
+
+run() {
+  "$noosh" "$1"
+  start=$(now)
+  for i in 1 2 3 4 5 6 7 8 9 10; do
+    "$noosh" "$1"
+  done
+  end=$(now)
+  printf '%-8s %6d ms per shell\n' "$2" $(( (end - start) / 10000000 ))
+}
+
+export NOOSH_CACHE_DIR="$dir/cache" NOOSHFPATH="$dir/lib"
+run "$dir/source.sh" "source"
+run "$dir/autoload.sh" "autoload"
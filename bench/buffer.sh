@@ -0,0 +1,25 @@
+#!/bin/sh
+# Buffer benchmark: a producer bursts 128 MB into a consumer that starts
+# reading 2 seconds late, with nothing between them, with a 256 MB
+# buffer held in memory and with one that spills past 32 MB to a memfd.
+# Shows how long the producer took to get all of its data out, and the
+# buffer's own report (-v).
+#   usage: bench/buffer.sh [path/to/noosh]
+
+noosh=${1:-./noosh}
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/noosh-buffer.XXXXXX")
+trap 'rm -rf "$tmp"' EXIT
+
+# run name stage: time the producer of a pipeline with the stage (or
+# none) before the late consumer
+run() {
+  printf '%-8s ' "$1"
+  (cd "$tmp" && "$noosh" -c "start=\$(date +%s%N)
+{ head -c 134217728 /dev/zero; date +%s%N > done; } | $2 { sleep 2; cat > /dev/null; }
+end=\$(cat done)
+echo producer \$(( (end - start) / 1000000 )) ms") 2>&1 | paste -sd ' '
+}
+
+run none ''
+run memory 'buffer -s 256M -v |'
+run spill 'buffer -s 256M -m 32M -v |'
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Conditional benchmark: time the [[ =~ ]], [[ == ]] and numeric tests of
+# bench/cond.noosh with the bytecode VM, with the tree walker (set +o
+# bytecode), and with bash and zsh when they are installed; noosh's
+# `stats' line shows the regex cache and prefilter counters.
+#   usage: bench/cond.sh [path/to/noosh]
+
+dir=$(dirname "$0")
+noosh=${1:-./noosh}
+script=$dir/cond.noosh
+
+now() {
+  date +%s%N
+}
+
+run() {
+  start=$(now)
+  "$@" > /dev/null
+  end=$(now)
+  printf '%-9s %6d ms\n' "$name" $(( (end - start) / 1000000 ))
+}
+
+name=bytecode run "$noosh" "$script"
+name=tree run sh -c '{ echo "set +o bytecode"; cat "$1"; } | "$2"' sh "$script" "$noosh"
+for shell in bash zsh; do
+  if command -v $shell > /dev/null; then
+    name=$shell run $shell "$script"
+  fi
+done
+{ cat "$script"; echo 'stats | grep regex'; } | "$noosh" | tail -1
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Control flow benchmark: run bench/loop1m.noosh, a 1M-iteration loop made
+# only of builtins, and report the time it took and how many processes
+# noosh forked for it (there should be none).
+#   usage: bench/control_flow.sh [path/to/noosh]
+# Other shells given in SHELLS (default: dash bash) run the same loop for
+# comparison.
+
+dir=$(dirname "$0")
+noosh=${1:-./noosh}
+script=$dir/loop1m.noosh
+
+now() {
+  date +%s%N
+}
+
+start=$(now)
+out=$("$noosh" "$script")
+end=$(now)
+forks=$(printf '%s\n' "$out" | sed -n 's/^forks //p')
+printf 'noosh  %6d ms  forks %s\n' $(( (end - start) / 1000000 )) "$forks"
+
+for sh in ${SHELLS-dash bash}; do
+  command -v "$sh" > /dev/null || continue
+  start=$(now)
+  grep -v '^stats$' "$script" | "$sh" > /dev/null
+  end=$(now)
+  printf '%-6s %6d ms\n' "$sh" $(( (end - start) / 1000000 ))
+done
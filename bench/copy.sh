@@ -0,0 +1,45 @@
+#!/bin/sh
+# Copy benchmark: make a 256 MB file, 8 parts of 32 MB and a tree of
+# 2,000 files of 32 KB in 40 directories, then time `cat file > copy',
+# `cat part* > whole' and `cp -r tree copy' with the noosh builtins and
+# with the system cat and cp run by noosh. An untimed copy first warms
+# the page cache, and each copy is removed after its run.
+#   usage: bench/copy.sh [path/to/noosh]
+
+noosh=${1:-./noosh}
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/noosh-copy.XXXXXX")
+trap 'rm -rf "$tmp"' EXIT
+
+head -c $((256 * 1024 * 1024)) /dev/urandom > "$tmp/file"
+for i in 1 2 3 4 5 6 7 8; do
+  head -c $((32 * 1024 * 1024)) /dev/urandom > "$tmp/part$i"
+done
+head -c $((32 * 1024)) /dev/urandom > "$tmp/one"
+for d in $(seq 40); do
+  mkdir -p "$tmp/tree/d$d"
+  for f in $(seq 50); do
+    cp "$tmp/one" "$tmp/tree/d$d/f$f"
+  done
+done
+
+now() {
+  date +%s%N
+}
+
+# run name commands: time the commands in noosh, in the directory of the
+# files, then remove what they made
+run() {
+  start=$(now)
+  (cd "$tmp" && "$noosh" -c "$2")
+  end=$(now)
+  printf '%-16s %6d ms\n' "$1" $(( (end - start) / 1000000 ))
+  rm -rf "$tmp/copy" "$tmp/whole"
+}
+
+(cd "$tmp" && cat file > copy && rm copy)
+run 'cat builtin' 'cat file > copy'
+run 'cat system' '/bin/cat file > copy'
+run 'cat parts' 'cat part* > whole'
+run 'cat parts system' '/bin/cat part* > whole'
+run 'cp -r builtin' 'cp -r tree copy'
+run 'cp -r system' '/bin/cp -r tree copy'
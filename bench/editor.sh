@@ -0,0 +1,40 @@
+#!/bin/sh
+# Line editor benchmark: type a long line (10,000 characters by default)
+# into an interactive noosh through script(1), then 200 keys one at a time
+# at its end or at its start, and show the editor counters and the CPU
+# time the shell used. The bytes sent to the terminal per key are what
+# each keystroke costs over a slow link; the CPU time, with a line of a
+# megabyte, is what it costs to edit a line that long.
+#   usage: bench/editor.sh [path/to/noosh [characters]]
+
+noosh=${1:-./noosh}
+chars=${2:-10000}
+tck=$(getconf CLK_TCK)
+
+session() {
+  # $1: keys sent before the 200 a's, ^A to go to the start
+  printf 'stats -r > /dev/null\r'
+  sleep 0.2
+  head -c "$chars" /dev/zero | tr '\0' x
+  sleep $((1 + chars / 200000))
+  printf "$1"
+  sleep 0.2
+  i=0
+  while [ $i -lt 200 ]; do
+    printf a
+    sleep 0.01
+    i=$((i + 1))
+  done
+  sleep 0.2
+  printf '\005\025stats | grep editor\r'
+  printf "awk '{ print \"cpu\", (\$14 + \$15) * 1000 / $tck, \"ms\" }' /proc/\$\$/stat\rexit\r"
+  sleep 0.2
+}
+
+for where in end start; do
+  keys=
+  [ $where = start ] && keys='\001'
+  printf '%-6s ' $where
+  session "$keys" | TERM=xterm script -qfc "$noosh" /dev/null |
+    grep -ao -e 'editor keys.*' -e 'cpu [0-9][0-9]* ms' | tr -d '\r' | paste -sd ' '
+done
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Environment benchmark: start noosh with 600 exported variables and
+# spawn /bin/true 2,000 times while nothing changes, while a shell
+# variable changes on every iteration, and while an exported variable
+# does; report the time and how often noosh rebuilt the environment.
+#   usage: bench/env.sh [path/to/noosh]
+
+noosh=${1:-./noosh}
+
+for i in $(seq 1 600); do
+  export "CI_VAR_$i=value of variable number $i in the CI environment"
+done
+
+now() {
+  date +%s%N
+}
+
+run() {
+  start=$(now)
+  builds=$("$noosh" -c "i=0; while ((i < 2000)); do $2 /bin/true; ((i++)); done; stats" |
+           sed -n 's/.*environment builds //p')
+  end=$(now)
+  printf '%-10s %6d ms  environment builds %s\n' "$1" $(( (end - start) / 1000000 )) "$builds"
+}
+
+run unchanged ""
+run shell "x=\$i;"
+run exported "export x=\$i;"
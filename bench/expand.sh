@@ -0,0 +1,27 @@
+#!/bin/sh
+# Word expansion benchmark: time bench/expand.noosh, 100,000-word
+# argument lists made by brace, tilde and parameter expansion and field
+# splitting, with the bytecode VM, with the tree walker (set +o bytecode),
+# and with bash when it is installed.
+#   usage: bench/expand.sh [path/to/noosh]
+
+dir=$(dirname "$0")
+noosh=${1:-./noosh}
+script=$dir/expand.noosh
+
+now() {
+  date +%s%N
+}
+
+run() {
+  start=$(now)
+  "$@" > /dev/null
+  end=$(now)
+  printf '%-9s %6d ms\n' "$name" $(( (end - start) / 1000000 ))
+}
+
+name=bytecode run "$noosh" "$script"
+name=tree run sh -c '{ echo "set +o bytecode"; cat "$1"; } | "$2"' sh "$script" "$noosh"
+if command -v bash > /dev/null; then
+  name=bash run bash "$script"
+fi
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Glob benchmark: make a tree of 20 x 20 x 10 directories with 12 files
+# each, then time the ** and flat matches of bench/glob.noosh over it with
+# the bytecode VM, with the tree walker (set +o bytecode), unsorted (set +o
+# globsort), and with bash (globstar on) and zsh when they are installed.
+#   usage: bench/glob.sh [path/to/noosh]
+
+dir=$(dirname "$0")
+noosh=${1:-./noosh}
+script=$dir/glob.noosh
+tree=${TMPDIR:-/tmp}/noosh-glob-bench
+
+now() {
+  date +%s%N
+}
+
+run() {
+  start=$(now)
+  "$@" > /dev/null
+  end=$(now)
+  printf '%-9s %6d ms\n' "$name" $(( (end - start) / 1000000 ))
+}
+
+if [ ! -d "$tree" ]; then
+  for a in $(seq 0 19); do
+    for b in $(seq 0 19); do
+      for c in $(seq 0 9); do
+        d=$tree/d$a/$b/$c
+        mkdir -p "$d"
+        (cd "$d" && touch f0.c f1.c f2.c f3.h f4.h f5.txt f6 f7 f8 f9 .f0.c .f1.h)
+      done
+    done
+  done
+fi
+
+name=bytecode run "$noosh" "$script" "$tree"
+name=tree run sh -c '{ echo "set +o bytecode"; cat "$1"; } | "$2" /dev/stdin "$3"' sh "$script" "$noosh" "$tree"
+name=unsorted run sh -c '{ echo "set +o globsort"; cat "$1"; } | "$2" /dev/stdin "$3"' sh "$script" "$noosh" "$tree"
+if command -v bash > /dev/null; then
+  name=bash run bash -O globstar "$script" "$tree"
+fi
+if command -v zsh > /dev/null; then
+  name=zsh run zsh "$script" "$tree"
+fi
+"$noosh" "$script" "$tree"
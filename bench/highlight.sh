@@ -0,0 +1,46 @@
+#!/bin/sh
+# Syntax highlighting benchmark: paste a script of a megabyte, 16,384
+# lines of 64 bytes with strings, variables, pipes and comments, into an
+# interactive noosh through script(1) without running it, then type 200
+# keys one at a time at its start. Shows the highlighting counters (bytes
+# lexed and tokens made, over the paste and the keys) and the CPU time the
+# shell used, with highlighting on and off. Bytes lexed near 1,000,000
+# mean each key relexed only around the cursor.
+#   usage: bench/highlight.sh [path/to/noosh]
+
+noosh=${1:-./noosh}
+tck=$(getconf CLK_TCK)
+
+session() {
+  # $1: + or -, to set highlighting on or off
+  printf 'set %so highlight; stats -r > /dev/null\r' "$1"
+  sleep 0.2
+  printf '\033[200~'
+  i=0
+  while [ $i -lt 16384 ]; do
+    printf 'echo "$n" | tr a b > /dev/null # %032d\r' $i
+    i=$((i + 1))
+  done
+  printf '\033[201~'
+  sleep 2
+  printf '\001'
+  sleep 0.2
+  i=0
+  while [ $i -lt 200 ]; do
+    printf a
+    sleep 0.01
+    i=$((i + 1))
+  done
+  sleep 0.2
+  printf '\003stats | grep highlight\r'
+  printf "awk '{ print \"cpu\", (\$14 + \$15) * 1000 / $tck, \"ms\" }' /proc/\$\$/stat\rexit\r"
+  sleep 0.5
+}
+
+for mode in on off; do
+  flag=+
+  [ $mode = on ] && flag=-
+  printf '%-4s ' $mode
+  session $flag | TERM=xterm script -qfc "$noosh" /dev/null |
+    grep -ao -e 'highlight lexed.*' -e 'cpu [0-9][0-9]* ms' | tr -d '\r' | paste -sd ' '
+done
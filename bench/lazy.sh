@@ -0,0 +1,35 @@
+#!/bin/sh
+# Lazy loop benchmark: time the for loops of bench/lazy.noosh over large
+# brace and seq ranges and a 44,000-path tree with the bytecode VM, with
+# the tree walker (set +o bytecode), and with bash (globstar on) and zsh
+# when they are installed, then show each shell's peak memory.
+#   usage: bench/lazy.sh [path/to/noosh]
+
+dir=$(dirname "$0")
+noosh=${1:-./noosh}
+script=$dir/lazy.noosh
+tree=${TMPDIR:-/tmp}/noosh-glob-bench
+
+now() {
+  date +%s%N
+}
+
+run() {
+  start=$(now)
+  peak=$("$@" | tail -1)
+  end=$(now)
+  printf '%-9s %6d ms  %s\n' "$name" $(( (end - start) / 1000000 )) "$peak"
+}
+
+if [ ! -d "$tree" ]; then
+  "$dir/glob.sh" "$noosh" > /dev/null
+fi
+
+name=bytecode run "$noosh" "$script" "$tree"
+name=tree run sh -c '{ echo "set +o bytecode"; cat "$1"; } | "$2" /dev/stdin "$3"' sh "$script" "$noosh" "$tree"
+if command -v bash > /dev/null; then
+  name=bash run bash -O globstar "$script" "$tree"
+fi
+if command -v zsh > /dev/null; then
+  name=zsh run zsh "$script" "$tree"
+fi
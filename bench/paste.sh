@@ -0,0 +1,40 @@
+#!/bin/sh
+# Bracketed paste benchmark: paste a script of a megabyte, 16,384 lines
+# of 64 bytes, into an interactive shell through script(1), the way a
+# terminal does it (between the paste marks, newlines sent as returns),
+# then run it with one Enter. Shows how many lines ran, the editor
+# counters for noosh, and the CPU time each shell used.
+#   usage: bench/paste.sh [path/to/noosh [other shell...]]
+
+noosh=${1:-./noosh}
+[ $# -gt 0 ] && shift
+tck=$(getconf CLK_TCK)
+
+session() {
+  printf 'n=0\r'
+  sleep 0.2
+  printf '\033[200~'
+  i=0
+  while [ $i -lt 16384 ]; do
+    printf 'n=$((n + 1)) # %050d\r' $i
+    i=$((i + 1))
+  done
+  printf '\033[201~'
+  sleep 2
+  printf '\r'
+  sleep 2
+  printf 'echo lines run: $n\r'
+  [ "$1" = noosh ] && printf 'stats | grep editor\r'
+  printf "awk '{ print \"cpu\", (\$14 + \$15) * 1000 / $tck, \"ms\" }' /proc/\$\$/stat\rexit\r"
+  sleep 0.5
+}
+
+for sh in "$noosh" "$@"; do
+  kind=other
+  case $sh in
+    *noosh*) kind=noosh ;;
+  esac
+  printf '%-12s ' "$(basename "$sh")"
+  session $kind | TERM=xterm script -qfc "$sh" /dev/null |
+    grep -ao -e 'lines run: [0-9][0-9]*' -e 'editor keys.*' -e 'cpu [0-9][0-9]* ms' | tr -d '\r' | paste -sd ' '
+done
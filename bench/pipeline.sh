@@ -0,0 +1,32 @@
+#!/bin/sh
+# Pipeline benchmark: run bench/pipeline.noosh, 40,000 pipelines whose
+# stages are all builtins, with the stages as threads of the shell and
+# with set -o lastpipe running the last one on the shell's own thread,
+# and report the time and how many processes noosh forked for each.
+#   usage: bench/pipeline.sh [path/to/noosh]
+# bash runs the same loop for comparison when installed.
+
+dir=$(dirname "$0")
+noosh=${1:-./noosh}
+script=$dir/pipeline.noosh
+
+now() {
+  date +%s%N
+}
+
+run() {
+  start=$(now)
+  out=$("$@")
+  end=$(now)
+  forks=$(printf '%s\n' "$out" | sed -n 's/^forks \([0-9]*\).*/\1/p')
+  printf '%-9s %6d ms  forks %s\n' "$name" $(( (end - start) / 1000000 )) "$forks"
+}
+
+name=threads run "$noosh" "$script"
+name=lastpipe run sh -c '{ echo "set -o lastpipe"; cat "$2"; } | "$1"' sh "$noosh" "$script"
+if command -v bash > /dev/null; then
+  start=$(now)
+  grep -v '^stats$' "$script" | bash > /dev/null
+  end=$(now)
+  printf '%-9s %6d ms\n' bash $(( (end - start) / 1000000 ))
+fi
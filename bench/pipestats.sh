@@ -0,0 +1,20 @@
+#!/bin/sh
+# Pipeline statistics benchmark: time a three-stage pipeline moving
+# 256 MB (head, tr and the cat builtin) with set -o pipestats off and on,
+# for what relaying every pipe costs, and show the report it prints.
+#   usage: bench/pipestats.sh [path/to/noosh]
+
+noosh=${1:-./noosh}
+pipeline="head -c 268435456 /dev/zero | tr '\\0' a | cat > /dev/null"
+
+now() {
+  date +%s%N
+}
+
+for opt in +o -o; do
+  start=$(now)
+  report=$("$noosh" -c "set $opt pipestats; $pipeline" 2>&1)
+  end=$(now)
+  printf 'set %s pipestats %6d ms\n' $opt $(( (end - start) / 1000000 ))
+done
+printf '%s\n' "$report"
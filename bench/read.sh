@@ -0,0 +1,34 @@
+#!/bin/sh
+# read benchmark: time bench/read.noosh over a generated file of 200,000
+# lines, with a while read loop over the redirected file and over a
+# pipe, and with mapfile, in noosh and in bash and zsh when installed
+# (zsh has no mapfile builtin).
+#   usage: bench/read.sh [path/to/noosh]
+
+dir=$(dirname "$0")
+noosh=${1:-./noosh}
+script=$dir/read.noosh
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+awk 'BEGIN { for (i = 0; i < 200000; i++) printf "%d,user%d,/home/user%d,%d\n", i, i, i, i * 7 }' > "$tmp/in.csv"
+
+now() {
+  date +%s%N
+}
+
+run() {
+  start=$(now)
+  "$@" > /dev/null
+  end=$(now)
+  printf '%-15s %6d ms\n' "$name" $(( (end - start) / 1000000 ))
+}
+
+for mode in file pipe mapfile; do
+  name="noosh $mode" run "$noosh" "$script" "$tmp/in.csv" $mode
+  for shell in bash zsh; do
+    if command -v $shell > /dev/null && [ "$shell $mode" != "zsh mapfile" ]; then
+      name="$shell $mode" run $shell "$script" "$tmp/in.csv" $mode
+    fi
+  done
+done
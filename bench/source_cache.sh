@@ -0,0 +1,48 @@
+#!/bin/sh
+# Bytecode cache benchmark: generate 40 library files of 50 functions
+# each, then time a shell that sources all of them, with the cache turned
+# off and with a warm cache.
+#   usage: bench/source_cache.sh [path/to/noosh]
+
+noosh=${1:-./noosh}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+mkdir "$dir/lib" "$dir/cache"
+
+for l in $(seq 1 40); do
+  for f in $(seq 1 50); do
+    cat <<FN
+lib${l}_fn$f() {
+  for arg in "\$@"; do
+    case \$arg in
+      -v|--verbose) verbose=1 ;;
+      -*) echo "lib${l}_fn$f: unknown option \$arg" ;;
+      *) result="\${result}\$arg" ;;
+    esac
+  done
+  if [ -n "\$verbose" ]; then echo "lib${l}_fn$f: \$result"; fi
+}
+FN
+  done > "$dir/lib/lib$l.sh"
+done
+for l in $(seq 1 40); do
+  echo ". $dir/lib/lib$l.sh"
+done > "$dir/login.sh"
+
+now() {
+  date +%s%N
+}
+
+run() {
+  start=$(now)
+  for i in 1 2 3 4 5 6 7 8 9 10; do
+    NOOSH_CACHE_DIR=$1 "$noosh" "$dir/login.sh"
+  done
+  end=$(now)
+  printf '%-8s %6d ms per shell\n' "$2" $(( (end - start) / 10000000 ))
+}
+
+run "" "off"
+NOOSH_CACHE_DIR=$dir/cache "$noosh" "$dir/login.sh"
+run "$dir/cache" "warm"
+NOOSH_CACHE_DIR=$dir/cache "$noosh" --cache-stats
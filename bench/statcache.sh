@@ -0,0 +1,35 @@
+#!/bin/sh
+# Stat cache benchmark: time the file tests of bench/statcache.noosh with
+# the stat cache off and on, with the bytecode VM and the tree walker, and
+# with bash and zsh when they are installed; the last line shows the
+# cache counters.
+#   usage: bench/statcache.sh [path/to/noosh]
+
+dir=$(dirname "$0")
+noosh=${1:-./noosh}
+script=$dir/statcache.noosh
+
+now() {
+  date +%s%N
+}
+
+run() {
+  start=$(now)
+  "$@" > /dev/null
+  end=$(now)
+  printf '%-9s %6d ms\n' "$name" $(( (end - start) / 1000000 ))
+}
+
+with() {
+  { echo "$1"; cat "$script"; echo "$2"; } | "$noosh"
+}
+
+name=off run with 'set +o statcache'
+name=on run with 'set -o statcache'
+name=tree run with 'set -o statcache; set +o bytecode'
+for shell in bash zsh; do
+  if command -v $shell > /dev/null; then
+    name=$shell run $shell "$script"
+  fi
+done
+with 'set -o statcache' 'stats | grep stat' | tail -1
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Subshell benchmark: run bench/subshell.noosh, 20,000 command
+# substitutions and ( ... ) subshells made only of builtins, with
+# in-process subshells and with set -o forksubshells, and report the
+# time and how many processes noosh forked for each.
+#   usage: bench/subshell.sh [path/to/noosh]
+# bash runs the same loop for comparison when installed.
+
+dir=$(dirname "$0")
+noosh=${1:-./noosh}
+script=$dir/subshell.noosh
+
+now() {
+  date +%s%N
+}
+
+run() {
+  start=$(now)
+  out=$("$@")
+  end=$(now)
+  forks=$(printf '%s\n' "$out" | sed -n 's/^forks \([0-9]*\).*/\1/p')
+  printf '%-13s %6d ms  forks %s\n' "$name" $(( (end - start) / 1000000 )) "$forks"
+}
+
+name=in-process run "$noosh" "$script"
+name=forking run sh -c '{ echo "set -o forksubshells"; cat "$2"; } | "$1"' sh "$noosh" "$script"
+if command -v bash > /dev/null; then
+  start=$(now)
+  grep -v '^stats$' "$script" | bash > /dev/null
+  end=$(now)
+  printf '%-13s %6d ms\n' bash $(( (end - start) / 1000000 ))
+fi
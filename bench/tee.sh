@@ -0,0 +1,31 @@
+#!/bin/sh
+# Fan-out benchmark: send 256 MB from a pipe to two files and on down a
+# pipe, with the tee builtin, with the system tee run by noosh, with a
+# multiple redirection (`> a > b |'), and with tee in bash.
+#   usage: bench/tee.sh [path/to/noosh]
+
+noosh=${1:-./noosh}
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/noosh-tee.XXXXXX")
+trap 'rm -rf "$tmp"' EXIT
+size=$((256 * 1024 * 1024))
+
+now() {
+  date +%s%N
+}
+
+# run name shell commands: time the commands, in the directory of the
+# files, then remove the files they wrote
+run() {
+  start=$(now)
+  (cd "$tmp" && "$2" -c "$3")
+  end=$(now)
+  printf '%-12s %6d ms\n' "$1" $(( (end - start) / 1000000 ))
+  rm -f "$tmp/a" "$tmp/b"
+}
+
+run 'tee builtin' "$noosh" "head -c $size /dev/zero | tee a b | cat > /dev/null"
+run 'tee system' "$noosh" "head -c $size /dev/zero | $(command -v tee) a b | cat > /dev/null"
+run 'multios' "$noosh" "head -c $size /dev/zero > a > b | cat > /dev/null"
+if command -v bash > /dev/null; then
+  run 'bash tee' bash "head -c $size /dev/zero | tee a b | cat > /dev/null"
+fi
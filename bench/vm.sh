@@ -0,0 +1,28 @@
+#!/bin/sh
+# Bytecode benchmark: run a script with the bytecode VM and again with the
+# tree walker (set +o bytecode), and report both times and the speedup.
+#   usage: bench/vm.sh [path/to/noosh] [script]
+# The script defaults to bench/strings.noosh. It is fed on stdin, where
+# each top-level command is compiled (or walked) as it is read.
+
+dir=$(dirname "$0")
+noosh=${1:-./noosh}
+script=${2:-$dir/strings.noosh}
+
+now() {
+  date +%s%N
+}
+
+start=$(now)
+"$noosh" < "$script" > /dev/null
+end=$(now)
+vm=$(( (end - start) / 1000000 ))
+
+start=$(now)
+{ echo 'set +o bytecode'; cat "$script"; } | "$noosh" > /dev/null
+end=$(now)
+tree=$(( (end - start) / 1000000 ))
+
+printf 'bytecode  %6d ms\n' "$vm"
+printf 'tree      %6d ms\n' "$tree"
+printf 'speedup   %6s x\n' "$(awk "BEGIN { printf \"%.1f\", $tree / ($vm ? $vm : 1) }")"
@@ -1,9 +1,35 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <libgen.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <poll.h>
+#include <pwd.h>
+#include <regex.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <linux/fs.h>
 #include <linux/limits.h>
 #include <bits/local_lim.h>
 
@@ -15,19 +41,33 @@
   color config struct
     username and cwd color
     user@host:/home/user$
+    colors of the line being edited, by what each part of it is
 */
 struct ColorConfig {
   int username_color;
   int cwd_color;
+  int command_color;
+  int missing_color;
+  int keyword_color;
+  int string_color;
+  int variable_color;
+  int operator_color;
+  int comment_color;
+  int error_color;
 };
 
+/*
+  the colors in use, the defaults until the config file is read
+*/
+struct ColorConfig noosh_colors = {32, 35, 32, 31, 34, 33, 35, 36, 90, 31};
+
 /*
   @brief reads config file
   @params filename: string containing filename of config
   @returns color config struct
 */
 struct ColorConfig read_config(const char *filename) {
-  struct ColorConfig config = {32, 35};
+  struct ColorConfig config = noosh_colors;
 
   char exePath[PATH_MAX];
   char dirPath[PATH_MAX];
@@ -64,6 +104,22 @@ struct ColorConfig read_config(const char *filename) {
         config.username_color = value;
       } else if (strcmp(token, "cwd_color") == 0) {
         config.cwd_color = value;
+      } else if (strcmp(token, "command_color") == 0) {
+        config.command_color = value;
+      } else if (strcmp(token, "missing_color") == 0) {
+        config.missing_color = value;
+      } else if (strcmp(token, "keyword_color") == 0) {
+        config.keyword_color = value;
+      } else if (strcmp(token, "string_color") == 0) {
+        config.string_color = value;
+      } else if (strcmp(token, "variable_color") == 0) {
+        config.variable_color = value;
+      } else if (strcmp(token, "operator_color") == 0) {
+        config.operator_color = value;
+      } else if (strcmp(token, "comment_color") == 0) {
+        config.comment_color = value;
+      } else if (strcmp(token, "error_color") == 0) {
+        config.error_color = value;
       }
     }
   }
@@ -95,272 +151,18698 @@ char* get_cwd(char ** args) {
 }
 
 /*
-    function declarations for builtin shell commands:
+  Memory helpers
 */
-int noosh_cd(char ** args);
-int noosh_pwd(char ** args);
-int noosh_help(char ** args);
-int noosh_exit(char ** args);
 
 /*
-    list of builtin commands, followed by their corresponding functions.
+    @brief malloc that exits the shell on failure
+    @param size: number of bytes to allocate
+    @returns pointer to the allocation
 */
-char * builtin_str[] = {
-  "cd",
-  "pwd",
-  "help",
-  "exit"
+void * noosh_malloc(size_t size) {
+  void * p = malloc(size ? size : 1);
+  if (!p) {
+    fprintf(stderr, "noosh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/*
+    @brief realloc that exits the shell on failure
+    @param old: previous allocation, may be NULL
+    @param size: new size in bytes
+    @returns pointer to the resized allocation
+*/
+void * noosh_realloc(void * old, size_t size) {
+  void * p = realloc(old, size ? size : 1);
+  if (!p) {
+    fprintf(stderr, "noosh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/*
+    @brief strdup that exits the shell on failure
+    @param s: string to copy
+    @returns the copy
+*/
+char * noosh_strdup(const char * s) {
+  size_t n = strlen(s) + 1;
+  return memcpy(noosh_malloc(n), s, n);
+}
+
+/*
+  growable byte buffer, always kept null terminated
+*/
+struct noosh_buf {
+  char * data;
+  size_t len;
+  size_t cap;
 };
 
-int( * builtin_func[])(char ** ) = {
-  &
-  noosh_cd,
-  &
-  noosh_pwd,
-  &
-  noosh_help,
-  &
-  noosh_exit
+# define NOOSH_BUF_INITSIZE 128
+/*
+    @brief make room for extra bytes (plus a terminator) in a buffer
+    @param buf: the buffer
+    @param extra: number of bytes about to be appended
+*/
+void noosh_buf_reserve(struct noosh_buf * buf, size_t extra) {
+  size_t cap = buf->cap ? buf->cap : NOOSH_BUF_INITSIZE;
+
+  if (buf->data && buf->len + extra + 1 <= buf->cap) {
+    return;
+  }
+  while (cap < buf->len + extra + 1) {
+    cap *= 2;
+  }
+  buf->data = noosh_realloc(buf->data, cap);
+  buf->cap = cap;
+  buf->data[buf->len] = '\0';
+}
+
+/*
+    @brief append bytes to a buffer
+    @param buf: the buffer
+    @param s: bytes to append
+    @param n: number of bytes
+*/
+void noosh_buf_append(struct noosh_buf * buf, const char * s, size_t n) {
+  noosh_buf_reserve(buf, n);
+  memcpy(buf->data + buf->len, s, n);
+  buf->len += n;
+  buf->data[buf->len] = '\0';
+}
+
+/*
+  bump allocator for data that dies together, such as the syntax tree of
+  a command: nothing is freed on its own, the arena is reset as a whole
+*/
+struct noosh_arena_chunk {
+  struct noosh_arena_chunk * next;
+  size_t used;
+  size_t cap;
+  char data[];
 };
 
-int noosh_num_builtins() {
-  return sizeof(builtin_str) / sizeof(char * );
+struct noosh_arena {
+  struct noosh_arena_chunk * head;
+};
+
+# define NOOSH_ARENA_CHUNK 4096
+/*
+    @brief allocate from an arena
+    @param a: the arena
+    @param size: number of bytes
+    @return zeroed, suitably aligned memory that lives until the arena is reset
+*/
+void * noosh_arena_alloc(struct noosh_arena * a, size_t size) {
+  struct noosh_arena_chunk * c = a->head;
+  size_t cap;
+  void * p;
+
+  size = (size + 15) & ~(size_t) 15;
+  if (c == NULL || c->used + size > c->cap) {
+    cap = size > NOOSH_ARENA_CHUNK ? size : NOOSH_ARENA_CHUNK;
+    c = noosh_malloc(sizeof(*c) + cap);
+    c->used = 0;
+    c->cap = cap;
+    c->next = a->head;
+    a->head = c;
+  }
+  p = c->data + c->used;
+  c->used += size;
+  return memset(p, 0, size);
 }
 
 /*
-    builtin function implementations
+    @brief copy a string into an arena
+    @param a: the arena
+    @param s: bytes to copy
+    @param n: number of bytes
+    @return null terminated copy
 */
+char * noosh_arena_strndup(struct noosh_arena * a, const char * s, size_t n) {
+  char * p = noosh_arena_alloc(a, n + 1);
+  memcpy(p, s, n);
+  return p;
+}
 
 /*
-    @brief builtin command: change director.
-    @param args: list of args
-        args[0] is  cd, args[1] is the directory
-    @return always returns 1 to continue executing
+    @brief free everything allocated from an arena, keeping one chunk
+        around for the next use
+    @param a: the arena
 */
-int noosh_cd(char ** args) {
-  if (args[1] == NULL) {
-    fprintf(stderr, "noosh: expected argument to \"cd\"\n");
-  } else {
-    if (chdir(args[1]) != 0) {
-      perror("noosh");
-    }
+void noosh_arena_reset(struct noosh_arena * a) {
+  struct noosh_arena_chunk * c;
+
+  while (a->head && a->head->next) {
+    c = a->head;
+    a->head = c->next;
+    free(c);
+  }
+  if (a->head) {
+    a->head->used = 0;
   }
-  return 1;
 }
 
 /*
-    @brief builtin command: print working directory
-    @param args: list of args, not examined
-    @return always returns 1 to continue executing
+    @brief release an arena entirely
+    @param a: the arena
 */
-int noosh_pwd(char ** args) {
-  printf("%s\n", get_cwd(NULL));
-  return 1;
+void noosh_arena_free(struct noosh_arena * a) {
+  noosh_arena_reset(a);
+  free(a->head);
+  a->head = NULL;
 }
+/*
+  I/O redirection
+*/
+
+# define NOOSH_IO_FDS 10
+# define NOOSH_IO_MAX_OWNED 16
+# define NOOSH_IO_MAX_MULTI 8
 
 /*
-    @brief builtin command: print help info
-    @param args: list of args, not examined
-    @return always returns 1 to continue executing
+  descriptor table of a command
+    fd[n] is the real descriptor the command sees as n, -1 if n is closed
+    owned holds descriptors opened for the command, closed when it is done
+    outs collects the outputs redirected to each fd; when there are
+    several, a helper thread fans the command's output out to all of them
+    helpers are joined after the command
 */
-int noosh_help(char ** args) {
+struct noosh_io {
+  int fd[NOOSH_IO_FDS];
+  int owned[NOOSH_IO_MAX_OWNED];
+  int nowned;
+  int outs[NOOSH_IO_FDS][NOOSH_IO_MAX_MULTI];
+  int nouts[NOOSH_IO_FDS];
+  pthread_t helpers[NOOSH_IO_FDS];
+  int nhelpers;
+};
+
+struct noosh_io noosh_io_shell = {.fd = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9}};
+
+int noosh_fanout(int in, int * outs, int nouts);
+
+/*
+  descriptor table of the command currently running on this thread;
+  builtins do all their I/O through it instead of the process's 0, 1
+  and 2, which is what lets them run as pipeline threads
+*/
+__thread struct noosh_io * noosh_cur_io = &noosh_io_shell;
+
+/*
+  set on threads running a pipeline stage other than a lastpipe one:
+  like a subshell, the stage cannot change the shell's state
+*/
+__thread int noosh_stage_isolated = 0;
+
+/*
+  set on stage threads that have their own working directory
+  (unshare(CLONE_FS)), where cd can change it for the stage alone
+*/
+__thread int noosh_stage_own_cwd = 0;
+
+# define NOOSH_FD(n) (noosh_cur_io->fd[n])
+
+/*
+    @brief start a descriptor table that inherits the current one
+    @param io: table to initialize
+*/
+void noosh_io_init(struct noosh_io * io) {
+  memcpy(io->fd, noosh_cur_io->fd, sizeof(io->fd));
+  memset(io->nouts, 0, sizeof(io->nouts));
+  io->nowned = 0;
+  io->nhelpers = 0;
+}
+
+/*
+    @brief close every descriptor opened for a command
+    @param io: the command's descriptor table
+*/
+void noosh_io_close(struct noosh_io * io) {
   int i;
-  printf("noosh\n");
-  printf("Type program names and arguments, and hit enter.\n");
-  printf("The following are built in:\n");
 
-  for (i = 0; i < noosh_num_builtins(); i++) {
-    printf("  %s\n", builtin_str[i]);
+  for (i = 0; i < io->nowned; i++) {
+    close(io->owned[i]);
   }
+  io->nowned = 0;
+}
 
-  printf("Use the man command for information on other programs.\n");
-  return 1;
+/*
+    @brief wait for the fan-out helpers of a command, after noosh_io_close
+    @param io: the command's descriptor table
+*/
+void noosh_io_wait(struct noosh_io * io) {
+  int i;
+
+  for (i = 0; i < io->nhelpers; i++) {
+    pthread_join(io->helpers[i], NULL);
+  }
+  io->nhelpers = 0;
 }
 
 /*
-    @brief builtin command: exit
-    @param args: list of args, not examined
-    @return always returns 0 to terminate execution
+    @brief create a close-on-exec pipe above the redirectable range
+    @param p: receives the read and write ends
+    @return 0 on success, -1 on error
 */
-int noosh_exit(char ** args) {
+int noosh_pipe(int p[2]) {
+  int low[2], i;
+
+  if (pipe2(low, O_CLOEXEC) < 0) {
+    return -1;
+  }
+  for (i = 0; i < 2; i++) {
+    p[i] = low[i];
+    if (low[i] < NOOSH_IO_FDS) {
+      p[i] = fcntl(low[i], F_DUPFD_CLOEXEC, NOOSH_IO_FDS);
+      close(low[i]);
+    }
+  }
   return 0;
 }
 
 /*
-    @brief launch a program and wait for it to terminate
-    @param args: null terminated list of arguments
-        args[0] is program, *args[1] is progrm args
-    @return always return 1 to continue execution
+    @brief install a descriptor table as 0-9 of the calling (child) process
+    @param io: the table
 */
-int noosh_launch(char ** args) {
-  pid_t pid, wpid;
-  int status;
+void noosh_io_apply(struct noosh_io * io) {
+  int src[NOOSH_IO_FDS];
+  int i;
 
-  pid = fork();
-  if (pid == 0) {
-    // Child process
-    if (execvp(args[0], args) == -1) {
-      perror("noosh");
+  // Move low sources out of the way first so a dup2 cannot clobber them.
+  for (i = 0; i < NOOSH_IO_FDS; i++) {
+    src[i] = io->fd[i];
+    if (src[i] >= 0 && src[i] < NOOSH_IO_FDS && src[i] != i) {
+      src[i] = fcntl(src[i], F_DUPFD_CLOEXEC, NOOSH_IO_FDS);
+    }
+  }
+  for (i = 0; i < NOOSH_IO_FDS; i++) {
+    if (src[i] < 0) {
+      close(i);
+    } else if (src[i] != i) {
+      dup2(src[i], i);
     }
-    exit(EXIT_FAILURE);
-  } else if (pid < 0) {
-    // Error forking
-    perror("noosh");
-  } else {
-    // Parent process
-    do {
-      wpid = waitpid(pid, & status, WUNTRACED);
-    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
   }
-
-  return 1;
 }
 
 /*
-    @brief execute shell programs
-    @param args null terminated list of arguments
-    @return 1 if the shell could continue running,
-        0 if it should terminate
+  private pipe `read' peeks into, one per thread
+*/
+__thread int noosh_peek_pipe[2] = {-1, -1};
+
+/*
+  fan-out helper of a multiply redirected fd; owns all its descriptors
+*/
+struct noosh_multio {
+  int in;
+  int outs[NOOSH_IO_MAX_MULTI];
+  int nouts;
+};
+
+/*
+    @brief fan-out helper thread body
+    @param arg: the helper's struct noosh_multio
+    @return NULL
 */
-int noosh_execute(char ** args) {
+void * noosh_multio_thread(void * arg) {
+  struct noosh_multio * m = arg;
+  int outs[NOOSH_IO_MAX_MULTI];
   int i;
 
-  if (args[0] == NULL) {
-    // An empty command was entered.
-    return 1;
+  // noosh_fanout marks failed outputs -1; keep the originals to close.
+  memcpy(outs, m->outs, sizeof(outs));
+  noosh_fanout(m->in, outs, m->nouts);
+  close(m->in);
+  for (i = 0; i < m->nouts; i++) {
+    close(m->outs[i]);
   }
+  free(m);
+  return NULL;
+}
 
-  for (i = 0; i < noosh_num_builtins(); i++) {
-    if (strcmp(args[0], builtin_str[i]) == 0) {
-      return ( * builtin_func[i])(args);
-    }
+/*
+    @brief finish the output redirections collected for one fd
+        with several outputs (`cmd > a > b`) the fd becomes a pipe into a
+        helper that copies everything to each of them
+    @param io: descriptor table
+    @param n: the fd
+    @return 0 on success, -1 on error
+*/
+int noosh_multio_flush(struct noosh_io * io, int n) {
+  struct noosh_multio * m;
+  int p[2], i, count = io->nouts[n];
+
+  io->nouts[n] = 0;
+  if (count < 2) {
+    return 0;
+  }
+  if (io->nowned >= NOOSH_IO_MAX_OWNED || noosh_pipe(p) < 0) {
+    fprintf(stderr, "noosh: cannot set up multiple redirections\n");
+    return -1;
   }
 
-  return noosh_launch(args);
+  // The helper gets its own copies, so it may outlive the command's.
+  m = noosh_malloc(sizeof(*m));
+  m->in = p[0];
+  m->nouts = count;
+  for (i = 0; i < count; i++) {
+    m->outs[i] = fcntl(io->outs[n][i], F_DUPFD_CLOEXEC, NOOSH_IO_FDS);
+  }
+  if (pthread_create(&io->helpers[io->nhelpers], NULL, noosh_multio_thread, m) != 0) {
+    fprintf(stderr, "noosh: cannot set up multiple redirections\n");
+    for (i = 0; i < count; i++) {
+      close(m->outs[i]);
+    }
+    free(m);
+    close(p[0]);
+    close(p[1]);
+    return -1;
+  }
+  io->nhelpers++;
+  io->owned[io->nowned++] = p[1];
+  io->fd[n] = p[1];
+  return 0;
 }
 
-# define NOOSH_RL_BUFSIZE 1024
 /*
-    @brief read a line of input from stdin
-    @return the line from stdin
+    @brief open a file on a descriptor above the redirectable range
+    @param path: file to open
+    @param flags: open(2) flags
+    @return close-on-exec descriptor >= NOOSH_IO_FDS, or -1
 */
-char * noosh_read_line(void) {
-  int bufsize = NOOSH_RL_BUFSIZE;
-  int position = 0;
-  char * buffer = malloc(sizeof(char) * bufsize);
-  int c;
+int noosh_open_high(const char * path, int flags) {
+  int fd = open(path, flags | O_CLOEXEC, 0666);
+  int high;
 
-  if (!buffer) {
-    fprintf(stderr, "noosh: allocation error\n");
-    exit(EXIT_FAILURE);
+  if (fd < 0 || fd >= NOOSH_IO_FDS) {
+    return fd;
   }
+  high = fcntl(fd, F_DUPFD_CLOEXEC, NOOSH_IO_FDS);
+  close(fd);
+  return high;
+}
 
-  while (1) {
-    // Read a character
-    c = getchar();
+/*
+    @brief strip redirection operators from args and open their targets
+    @param args: null terminated list of arguments, compacted in place
+        supports [n]<word, [n]>word, [n]>>word, [n]<>word, [n]>&m, [n]<&m, [n]>&-
+        outputs redirected more than once are all written (zsh multios)
+    @param io: descriptor table to update
+    @return 0 on success, -1 if a redirection failed
+*/
+int noosh_redirect(char ** args, struct noosh_io * io) {
+  int i, j = 0;
+
+  for (i = 0; args[i] != NULL; i++) {
+    char * tok = args[i];
+    char * p = tok;
+    int n = -1, def, dup = 0, flags = 0, fd;
+
+    if (isdigit((unsigned char) p[0]) && (p[1] == '<' || p[1] == '>')) {
+      n = *p++ - '0';
+    }
+    if (*p != '<' && *p != '>') {
+      args[j++] = tok;
+      continue;
+    }
 
-    // If we hit EOF, replace it with a null character and return.
-    if (c == EOF || c == '\n') {
-      buffer[position] = '\0';
-      return buffer;
+    def = (*p == '<') ? 0 : 1;
+    if (p[1] == '&') {
+      dup = 1;
+      p += 2;
+    } else if (p[0] == '>' && p[1] == '>') {
+      flags = O_WRONLY | O_CREAT | O_APPEND;
+      p += 2;
+    } else if (p[0] == '<' && p[1] == '>') {
+      flags = O_RDWR | O_CREAT;
+      p += 2;
+    } else if (p[0] == '>') {
+      flags = O_WRONLY | O_CREAT | O_TRUNC;
+      p++;
     } else {
-      buffer[position] = c;
+      flags = O_RDONLY;
+      p++;
+    }
+    if (n < 0) {
+      n = def;
+    }
+
+    if (*p == '\0') {
+      p = args[++i];
+      if (p == NULL) {
+        fprintf(stderr, "noosh: syntax error: expected word after `%s'\n", tok);
+        return -1;
+      }
+    }
+
+    // Only repeated output redirections accumulate; anything else on n,
+    // or a dup of n, needs n's outputs settled first.
+    if (dup && isdigit((unsigned char) p[0]) && noosh_multio_flush(io, p[0] - '0') < 0) {
+      return -1;
+    }
+    if ((dup || !(flags & O_WRONLY)) && noosh_multio_flush(io, n) < 0) {
+      return -1;
     }
-    position++;
 
-    // If we have exceeded the buffer, reallocate.
-    if (position >= bufsize) {
-      bufsize += NOOSH_RL_BUFSIZE;
-      buffer = realloc(buffer, bufsize);
-      if (!buffer) {
-        fprintf(stderr, "noosh: allocation error\n");
-        exit(EXIT_FAILURE);
+    if (dup) {
+      if (strcmp(p, "-") == 0) {
+        io->fd[n] = -1;
+      } else if (isdigit((unsigned char) p[0]) && p[1] == '\0' && io->fd[p[0] - '0'] >= 0) {
+        io->fd[n] = io->fd[p[0] - '0'];
+      } else {
+        fprintf(stderr, "noosh: %s: bad file descriptor\n", p);
+        return -1;
       }
+      continue;
+    }
+
+    if (io->nowned >= NOOSH_IO_MAX_OWNED) {
+      fprintf(stderr, "noosh: too many redirections\n");
+      return -1;
+    }
+    fd = noosh_open_high(p, flags);
+    if (fd < 0) {
+      fprintf(stderr, "noosh: %s: %s\n", p, strerror(errno));
+      return -1;
+    }
+    io->owned[io->nowned++] = fd;
+    io->fd[n] = fd;
+    if ((flags & O_WRONLY) && io->nouts[n] < NOOSH_IO_MAX_MULTI) {
+      io->outs[n][io->nouts[n]++] = fd;
     }
   }
+  args[j] = NULL;
+
+  for (i = 0; i < NOOSH_IO_FDS; i++) {
+    if (noosh_multio_flush(io, i) < 0) {
+      return -1;
+    }
+  }
+  return 0;
 }
 
-#define NOOSH_TOK_BUFSIZE 64
-#define NOOSH_TOK_DELIM " \t\r\n\a"
 /*
-    @brief split a line into tokens
-    @param line: the line
-    @return null-terminated array of tokens
+  Record input
+
+  `read` must not consume input past its delimiter, since whatever comes
+  next belongs to the next reader, which may be a child process sharing
+  the descriptor. Instead of reading a byte per syscall:
+    regular files are mapped once and scanned in place; the file offset
+    is moved to just past the record, so a `while read` loop over a
+    redirected file walks a single cached mapping; if another process
+    truncates the file meanwhile, the pages past its new end read as
+    zeros and the record is read again as below
+    other seekable files are read in blocks and seeked back
+    pipes are peeked with tee(2) into a private pipe, sockets with
+    MSG_PEEK, and exactly one record is then consumed
+    a canonical-mode terminal never returns more than one line per read
+  Anything else falls back to one byte at a time.
 */
-char ** noosh_split_line(char * line) {
-  int bufsize = NOOSH_TOK_BUFSIZE, position = 0;
-  char ** tokens = malloc(bufsize * sizeof(char * ));
-  char * token;
 
-  if (!tokens) {
-    fprintf(stderr, "noosh: allocation error\n");
-    exit(EXIT_FAILURE);
+# define NOOSH_READ_BLOCK 4096
+# define NOOSH_MAP_SLOTS 4
+
+/*
+  cached read-only mapping of a whole regular file
+*/
+struct noosh_map {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  char * base;
+};
+
+struct noosh_map noosh_maps[NOOSH_MAP_SLOTS];
+int noosh_map_next = 0;
+
+/*
+  held while a cached mapping is in use, so another stage thread cannot
+  evict it underneath
+*/
+pthread_mutex_t noosh_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  mapping a thread is reading, and whether it shrank meanwhile
+    a page past the end of a file that another process truncated raises
+    SIGBUS; the handler puts zeros in place of the rest of the mapping,
+    so the reader runs to its end, then finds shrank set and reads the
+    file again with read(2)
+*/
+__thread const char * noosh_map_reading = NULL;
+__thread size_t noosh_map_reading_len = 0;
+__thread volatile sig_atomic_t noosh_map_shrank = 0;
+long noosh_page_size = 4096;
+
+/*
+    @brief SIGBUS handler: fill the part of a mapping that is gone with
+        zeros, or die of the signal as without a handler
+*/
+void noosh_map_sigbus(int sig, siginfo_t * info, void * ctx) {
+  const char * base = noosh_map_reading, * end = base + noosh_map_reading_len;
+  char * page = (char *) ((uintptr_t) info->si_addr & ~(uintptr_t) (noosh_page_size - 1));
+
+  if (base && (char *) info->si_addr >= base && (char *) info->si_addr < end &&
+      mmap(page, end - page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+    noosh_map_shrank = 1;
+    return;
   }
+  // Returning faults again, with the default action.
+  signal(sig, SIG_DFL);
+}
+
+/*
+    @brief start or end reading a mapping, see noosh_map_sigbus
+    @param base: the mapping, NULL when done
+    @param len: its length
+    @return whether it shrank since it was started (when done)
+*/
+int noosh_map_read(const char * base, size_t len) {
+  int shrank = noosh_map_shrank;
 
-  token = strtok(line, NOOSH_TOK_DELIM);
-  while (token != NULL) {
-    tokens[position] = token;
-    position++;
+  noosh_map_reading = base;
+  noosh_map_reading_len = len;
+  noosh_map_shrank = 0;
+  return shrank;
+}
 
-    if (position >= bufsize) {
-      bufsize += NOOSH_TOK_BUFSIZE;
-      tokens = realloc(tokens, bufsize * sizeof(char * ));
-      if (!tokens) {
-        fprintf(stderr, "noosh: allocation error\n");
-        exit(EXIT_FAILURE);
-      }
+/*
+    @brief map a regular file, reusing a cached mapping of the same file
+        the caller holds noosh_map_lock while using the mapping
+    @param fd: descriptor of the file
+    @param st: fstat result for fd
+    @return base of a read-only mapping of the whole file, NULL if it
+        cannot be mapped
+*/
+char * noosh_map_file(int fd, struct stat * st) {
+  struct noosh_map * slot;
+  char * base;
+  int i;
+
+  for (i = 0; i < NOOSH_MAP_SLOTS; i++) {
+    slot = &noosh_maps[i];
+    if (slot->base && slot->dev == st->st_dev && slot->ino == st->st_ino &&
+        slot->size == st->st_size) {
+      return slot->base;
     }
+  }
+
+  if (st->st_size <= 0) {
+    return NULL;
+  }
+  base = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  madvise(base, st->st_size, MADV_SEQUENTIAL);
 
-    token = strtok(NULL, NOOSH_TOK_DELIM);
+  slot = &noosh_maps[noosh_map_next++ % NOOSH_MAP_SLOTS];
+  if (slot->base) {
+    munmap(slot->base, slot->size);
   }
-  tokens[position] = NULL;
-  return tokens;
+  slot->dev = st->st_dev;
+  slot->ino = st->st_ino;
+  slot->size = st->st_size;
+  slot->base = base;
+  return base;
 }
 
 /*
-    @brief loop parsing and executing input
+    @brief forget a cached mapping of a file that shrank; the caller holds
+        noosh_map_lock
+    @param base: the mapping
 */
-void noosh_loop(void) {
-  struct ColorConfig config = read_config("noosh_config.txt");
+void noosh_map_drop(const char * base) {
+  int i;
 
-  char * line;
-  char ** args;
-  int status;
-  char hostname[HOST_NAME_MAX];
-  char *username;
-  char *cwd;
+  for (i = 0; i < NOOSH_MAP_SLOTS; i++) {
+    if (noosh_maps[i].base == base) {
+      munmap(noosh_maps[i].base, noosh_maps[i].size);
+      noosh_maps[i].base = NULL;
+    }
+  }
+}
 
-  gethostname(hostname, HOST_NAME_MAX);
-  username = getenv("USER");
+/*
+    @brief read(2) that retries on EINTR
+*/
+ssize_t noosh_read_fd(int fd, void * buf, size_t n) {
+  ssize_t r;
 
   do {
-    cwd = get_cwd(NULL);
+    r = read(fd, buf, n);
+  } while (r < 0 && errno == EINTR);
+  return r;
+}
+
+/*
+    @brief write a whole buffer, retrying on EINTR and short writes
+    @return 0 on success, -1 on error
+*/
+int noosh_write_all(int fd, const void * buf, size_t n) {
+  const char * p = buf;
+  ssize_t w;
 
-    printf("\033[0;%dm%s@\033[0;%dm%s\033[0m:\033[0;%dm%s\033[0m$ ",
-               config.username_color, username,
-               config.username_color, hostname,
-               config.cwd_color, cwd);
+  while (n > 0) {
+    w = write(fd, p, n);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w < 0) {
+      return -1;
+    }
+    p += w;
+    n -= w;
+  }
+  return 0;
+}
 
-    line = noosh_read_line();
-    args = noosh_split_line(line);
-    status = noosh_execute(args);
+/*
+    @brief read exactly n bytes
+    @return 0 on success, -1 on error or early end of input
+*/
+int noosh_read_full(int fd, char * buf, size_t n) {
+  ssize_t r;
 
-    free(line);
-    free(args);
-  } while (status);
+  while (n > 0) {
+    r = noosh_read_fd(fd, buf, n);
+    if (r <= 0) {
+      return -1;
+    }
+    buf += r;
+    n -= r;
+  }
+  return 0;
 }
 
 /*
-    @brief main func entry point
-    @param argc arg count
-    @param argv arg vector
-    @return status code
+    @brief consume exactly n bytes that are known to be available
+    @return 0 on success, -1 on error
 */
-int main(int argc, char ** argv) {
-  // TODO: implement config files
+int noosh_consume(int fd, struct noosh_buf * buf, size_t n) {
+  ssize_t r;
 
-  // Run command loop.
-  noosh_loop();
+  noosh_buf_reserve(buf, n);
+  while (n > 0) {
+    r = noosh_read_fd(fd, buf->data + buf->len, n);
+    if (r <= 0) {
+      return -1;
+    }
+    buf->len += r;
+    n -= r;
+  }
+  buf->data[buf->len] = '\0';
+  return 0;
+}
+
+/*
+    @brief close this thread's peek pipe, before the thread exits
+*/
+void noosh_peek_close(void) {
+  if (noosh_peek_pipe[0] >= 0) {
+    close(noosh_peek_pipe[0]);
+    close(noosh_peek_pipe[1]);
+    noosh_peek_pipe[0] = noosh_peek_pipe[1] = -1;
+  }
+}
 
-  return EXIT_SUCCESS;
+/*
+    @brief look at pending input on a pipe or socket without consuming it
+    @param fd: the pipe or socket
+    @param sock: nonzero if fd is a socket
+    @param tmp: destination for the peeked bytes
+    @param cap: size of tmp
+    @return number of bytes peeked, 0 at end of input, -1 on error
+*/
+ssize_t noosh_peek(int fd, int sock, char * tmp, size_t cap) {
+  int * scratch = noosh_peek_pipe;
+  ssize_t n, got = 0, r;
+
+  if (sock) {
+    do {
+      n = recv(fd, tmp, cap, MSG_PEEK);
+    } while (n < 0 && errno == EINTR);
+    return n;
+  }
+
+  if (scratch[0] < 0 && noosh_pipe(scratch) < 0) {
+    return -1;
+  }
+
+  do {
+    n = tee(fd, scratch[1], cap, 0);
+  } while (n < 0 && errno == EINTR);
+  while (got < n) {
+    r = noosh_read_fd(scratch[0], tmp + got, n - got);
+    if (r <= 0) {
+      return -1;
+    }
+    got += r;
+  }
+  return n;
+}
+
+/*
+    @brief record reader over a mapped regular file
+*/
+int noosh_read_mapped(int fd, const char * base, off_t off, off_t size,
+                      int delim, struct noosh_buf * buf) {
+  const char * start = base + off;
+  const char * end;
+  size_t n;
+
+  if (off >= size) {
+    return 0;
+  }
+  end = memchr(start, delim, size - off);
+  n = end ? (size_t) (end - start) : (size_t) (size - off);
+  noosh_buf_append(buf, start, n);
+  lseek(fd, off + n + (end ? 1 : 0), SEEK_SET);
+  return end ? 1 : 2;
+}
+
+/*
+    @brief record reader using large reads
+    @param seekable: seek back over bytes read past the delimiter
+*/
+int noosh_read_blocks(int fd, int delim, struct noosh_buf * buf, int seekable) {
+  char tmp[NOOSH_READ_BLOCK];
+  size_t start = buf->len;
+  ssize_t n;
+  char * end;
+
+  while (1) {
+    n = noosh_read_fd(fd, tmp, sizeof(tmp));
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      return buf->len > start ? 2 : 0;
+    }
+    end = memchr(tmp, delim, n);
+    if (end) {
+      noosh_buf_append(buf, tmp, end - tmp);
+      if (seekable && end + 1 < tmp + n) {
+        lseek(fd, -(off_t) (tmp + n - end - 1), SEEK_CUR);
+      }
+      return 1;
+    }
+    noosh_buf_append(buf, tmp, n);
+  }
+}
+
+/*
+    @brief record reader over a pipe or socket, peeking before consuming
+    @return as noosh_read_record, or -2 if peeking is not supported
+*/
+int noosh_read_peeked(int fd, int sock, int delim, struct noosh_buf * buf) {
+  char tmp[NOOSH_READ_BLOCK];
+  size_t start = buf->len;
+  ssize_t n;
+  char * end;
+
+  while (1) {
+    n = noosh_peek(fd, sock, tmp, sizeof(tmp));
+    if (n < 0) {
+      return buf->len > start ? -1 : -2;
+    }
+    if (n == 0) {
+      return buf->len > start ? 2 : 0;
+    }
+    end = memchr(tmp, delim, n);
+    if (end) {
+      if (noosh_consume(fd, buf, end - tmp + 1) < 0) {
+        return -1;
+      }
+      buf->data[--buf->len] = '\0';
+      return 1;
+    }
+    if (noosh_consume(fd, buf, n) < 0) {
+      return -1;
+    }
+  }
+}
+
+/*
+    @brief record reader of last resort, one byte per read
+*/
+int noosh_read_bytes(int fd, int delim, struct noosh_buf * buf) {
+  size_t start = buf->len;
+  ssize_t n;
+  char c;
+
+  while (1) {
+    n = noosh_read_fd(fd, &c, 1);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      return buf->len > start ? 2 : 0;
+    }
+    if (c == delim) {
+      return 1;
+    }
+    noosh_buf_append(buf, &c, 1);
+  }
+}
+
+/*
+    @brief read one delimited record without consuming input past it
+    @param fd: descriptor to read from
+    @param delim: record delimiter, not stored
+    @param buf: buffer the record is appended to
+    @return 1 if a record ended by delim was read, 2 if input ended
+        after a partial record, 0 at end of input, -1 on error
+*/
+int noosh_read_record(int fd, int delim, struct noosh_buf * buf) {
+  size_t len = buf->len;
+  struct termios tio;
+  struct stat st;
+  char * base;
+  off_t off;
+  int r;
+
+  noosh_buf_reserve(buf, 0);
+  if (fstat(fd, &st) < 0) {
+    return -1;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    pthread_mutex_lock(&noosh_map_lock);
+    if ((base = noosh_map_file(fd, &st)) != NULL && (off = lseek(fd, 0, SEEK_CUR)) >= 0) {
+      noosh_map_read(base, st.st_size);
+      r = noosh_read_mapped(fd, base, off, st.st_size, delim, buf);
+      if (!noosh_map_read(NULL, 0)) {
+        pthread_mutex_unlock(&noosh_map_lock);
+        return r;
+      }
+      // The file shrank under the mapping: read the record again, from
+      // where it started, with the blocks below.
+      noosh_map_drop(base);
+      lseek(fd, off, SEEK_SET);
+      buf->len = len;
+      buf->data[len] = '\0';
+    }
+    pthread_mutex_unlock(&noosh_map_lock);
+  }
+
+  if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) {
+    r = noosh_read_peeked(fd, S_ISSOCK(st.st_mode), delim, buf);
+    if (r != -2) {
+      return r;
+    }
+    return noosh_read_bytes(fd, delim, buf);
+  }
+
+  if (delim == '\n' && tcgetattr(fd, &tio) == 0 && (tio.c_lflag & ICANON)) {
+    return noosh_read_blocks(fd, delim, buf, 0);
+  }
+  if (lseek(fd, 0, SEEK_CUR) >= 0) {
+    return noosh_read_blocks(fd, delim, buf, 1);
+  }
+  return noosh_read_bytes(fd, delim, buf);
+}
+
+/*
+  Shell variables
+*/
+
+/*
+    @brief check that a string is a valid variable name
+    @param name: the name
+    @return 1 if valid, 0 otherwise
+*/
+int noosh_valid_name(const char * name) {
+  if (!(isalpha((unsigned char) *name) || *name == '_')) {
+    return 0;
+  }
+  while (*++name) {
+    if (!(isalnum((unsigned char) *name) || *name == '_')) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+  variable cell
+    cells are never freed, so compiled code can hold on to them: unset
+    variables keep their cell with a NULL value. A value shorter than
+    NOOSH_VAR_SMALL lives in the cell itself (small), so most assignments
+    allocate nothing; longer ones are allocated
+  arithmetic keeps numbers as they are: num holds the value when isnum is
+  set, and a value stored by arithmetic is only written out as a string
+  (stale is set until then) when something reads it as one
+  attrs are the NOOSH_VAR_* attributes set by declare, export and
+  readonly
+  array or assoc holds the elements of an array variable, whose value is
+  then NULL: used as a scalar, it is element 0
+  cow is the level of the in-process subshell that last saved the cell
+  before changing it, 0 outside of them
+*/
+# define NOOSH_VAR_SMALL 24
+
+# define NOOSH_VAR_INTEGER 1
+# define NOOSH_VAR_EXPORT 2
+# define NOOSH_VAR_READONLY 4
+// Not kept in attrs, where the array pointers tell: for declare -a, -A.
+# define NOOSH_VAR_ARRAY 8
+# define NOOSH_VAR_ASSOC 16
+
+struct noosh_var {
+  const char * name;
+  size_t name_len;
+  unsigned long hash;
+  char * value;
+  long long num;
+  int isnum;
+  int stale;
+  int attrs;
+  struct noosh_array * array;
+  struct noosh_assoc * assoc;
+  int cow;
+  char small[NOOSH_VAR_SMALL];
+};
+
+/*
+  variable table
+    open addressing with linear probing over a power-of-two array of cell
+    pointers, at most half full; cells are never removed, so there are no
+    tombstones. Names are interned in names, which lives as long as the
+    shell, and cells are allocated from the same arena
+*/
+struct noosh_var_table {
+  struct noosh_var ** slots;
+  size_t cap;
+  size_t n;
+  struct noosh_arena names;
+};
+
+struct noosh_var_table noosh_vars = {0};
+
+/*
+  environment handed to children
+    envp is rebuilt, as one allocation holding the pointers and the
+    NAME=value strings, only when an exported variable changed since the
+    last child was started (envp_stale); the previous block is kept until
+    the next rebuild, for a thread that fetched it just before; builds
+    counts the rebuilds, for stats
+*/
+char ** noosh_envp = NULL;
+char ** noosh_envp_old = NULL;
+int noosh_envp_stale = 1;
+unsigned long noosh_envp_builds = 0;
+
+/*
+  serializes the variables, which stage threads read while the main
+  thread may be assigning; only the main thread (or a forked subshell)
+  ever writes them
+*/
+pthread_mutex_t noosh_var_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  values replaced while builtin stage threads run
+    a stage thread goes on using the value noosh_var_value returned once
+    the lock is released, so a value the shell's thread (a lastpipe
+    stage) replaces meanwhile is kept in retired, under noosh_var_lock,
+    until the pipeline is over (noosh_var_reclaim); stage_threads counts
+    the stage threads running
+*/
+int noosh_stage_threads = 0;
+char ** noosh_var_retired = NULL;
+size_t noosh_var_nretired = 0;
+size_t noosh_var_retired_cap = 0;
+
+/*
+    @brief hash a string (FNV-1a)
+*/
+unsigned long noosh_hash(const char * s, size_t len) {
+  unsigned long h = 14695981039346656037UL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char) s[i]) * 1099511628211UL;
+  }
+  return h;
+}
+
+/*
+    @brief continue a hash made by noosh_hash over more bytes
+    @param h: the hash so far
+    @param p: the bytes
+    @param len: their number
+    @return the hash of all the bytes
+*/
+unsigned long noosh_hash_more(unsigned long h, const void * p, size_t len) {
+  const unsigned char * s = p;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ s[i]) * 1099511628211UL;
+  }
+  return h;
+}
+
+/*
+  indexed array
+    items in index order; keys is NULL while the array is dense (the key
+    of items[i] is i), and is only made once an element is unset or set
+    past the end, so lists and appends stay a bare vector and a lookup is
+    an index or a binary search. Items are allocated one by one, except
+    those mapfile stores, which point into block, a single allocation of
+    block_len bytes owned by the array
+*/
+struct noosh_array {
+  char ** items;
+  long long * keys;
+  size_t n;
+  size_t cap;
+  char * block;
+  size_t block_len;
+};
+
+/*
+  associative array
+    a compact hash table: entries are kept in insertion order, which is
+    the order of ${!map[@]}, and index is an open-addressing table of
+    entry numbers plus one (0 for a free slot), at most half full.
+    Removing an entry frees its key and value and leaves it dead in
+    place; dead entries are dropped when the table is rebuilt to grow
+*/
+struct noosh_assoc_entry {
+  char * key;
+  char * value;
+  unsigned long hash;
+};
+
+struct noosh_assoc {
+  struct noosh_assoc_entry * entries;
+  size_t n;
+  size_t cap;
+  size_t count;
+  size_t * index;
+  size_t icap;
+};
+
+/*
+    @brief copy a string of known length into a new allocation
+*/
+char * noosh_strndup(const char * s, size_t len) {
+  char * p = noosh_malloc(len + 1);
+
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+/*
+    @brief the key of the item at a position of an indexed array
+*/
+long long noosh_array_key(const struct noosh_array * a, size_t i) {
+  return a->keys ? a->keys[i] : (long long) i;
+}
+
+/*
+    @brief find the position of a key, or where it would be inserted
+    @param a: the array
+    @param key: the key
+    @param pos: receives the position
+    @return 1 if the key is there, 0 if not
+*/
+int noosh_array_find(const struct noosh_array * a, long long key, size_t * pos) {
+  size_t lo = 0, hi = a->n, mid;
+
+  if (a->keys == NULL) {
+    *pos = key < (long long) a->n ? (size_t) key : a->n;
+    return key < (long long) a->n;
+  }
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (a->keys[mid] < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *pos = lo;
+  return lo < a->n && a->keys[lo] == key;
+}
+
+/*
+    @brief free an item unless it lives in the array's block
+*/
+void noosh_array_free_item(struct noosh_array * a, char * item) {
+  if (item < a->block || item >= a->block + a->block_len) {
+    free(item);
+  }
+}
+
+/*
+    @brief the value of an element
+    @return the value, NULL if the element is not set
+*/
+const char * noosh_array_get(const struct noosh_array * a, long long key) {
+  size_t pos;
+
+  return noosh_array_find(a, key, &pos) ? a->items[pos] : NULL;
+}
+
+/*
+    @brief set an element
+    @param a: the array
+    @param key: its index, not negative
+    @param value: the value, copied
+    @param len: its length
+*/
+void noosh_array_set(struct noosh_array * a, long long key, const char * value, size_t len) {
+  char * copy = noosh_strndup(value, len);
+  size_t pos, i;
+
+  if (noosh_array_find(a, key, &pos)) {
+    noosh_array_free_item(a, a->items[pos]);
+    a->items[pos] = copy;
+    return;
+  }
+  if (a->n == a->cap) {
+    a->cap = a->cap ? 2 * a->cap : 8;
+    a->items = noosh_realloc(a->items, a->cap * sizeof(*a->items));
+    if (a->keys) {
+      a->keys = noosh_realloc(a->keys, a->cap * sizeof(*a->keys));
+    }
+  }
+  if (a->keys == NULL && key != (long long) a->n) {
+    // A hole: from now on the keys are kept.
+    a->keys = noosh_malloc(a->cap * sizeof(*a->keys));
+    for (i = 0; i < a->n; i++) {
+      a->keys[i] = i;
+    }
+  }
+  memmove(a->items + pos + 1, a->items + pos, (a->n - pos) * sizeof(*a->items));
+  a->items[pos] = copy;
+  if (a->keys) {
+    memmove(a->keys + pos + 1, a->keys + pos, (a->n - pos) * sizeof(*a->keys));
+    a->keys[pos] = key;
+  }
+  a->n++;
+}
+
+/*
+    @brief unset an element, if it is set
+*/
+void noosh_array_unset(struct noosh_array * a, long long key) {
+  size_t pos, i;
+
+  if (!noosh_array_find(a, key, &pos)) {
+    return;
+  }
+  noosh_array_free_item(a, a->items[pos]);
+  if (a->keys == NULL && pos + 1 < a->n) {
+    a->keys = noosh_malloc(a->cap * sizeof(*a->keys));
+    for (i = 0; i < a->n; i++) {
+      a->keys[i] = i;
+    }
+  }
+  memmove(a->items + pos, a->items + pos + 1, (a->n - pos - 1) * sizeof(*a->items));
+  if (a->keys) {
+    memmove(a->keys + pos, a->keys + pos + 1, (a->n - pos - 1) * sizeof(*a->keys));
+  }
+  a->n--;
+}
+
+/*
+    @brief free an indexed array
+*/
+void noosh_array_free(struct noosh_array * a) {
+  size_t i;
+
+  if (a == NULL) {
+    return;
+  }
+  for (i = 0; i < a->n; i++) {
+    noosh_array_free_item(a, a->items[i]);
+  }
+  free(a->items);
+  free(a->keys);
+  free(a->block);
+  free(a);
+}
+
+/*
+    @brief find the entry of a key
+    @param m: the table
+    @param key: the key, not null terminated
+    @param len: its length
+    @param h: its hash
+    @param slot: receives its index slot, or the free slot it would take
+    @return the entry, NULL if the key is not there
+*/
+struct noosh_assoc_entry * noosh_assoc_find(struct noosh_assoc * m, const char * key, size_t len,
+                                            unsigned long h, size_t * slot) {
+  struct noosh_assoc_entry * e;
+  size_t i;
+
+  if (m->icap == 0) {
+    return NULL;
+  }
+  for (i = h & (m->icap - 1); m->index[i]; i = (i + 1) & (m->icap - 1)) {
+    e = &m->entries[m->index[i] - 1];
+    if (e->key && e->hash == h && strncmp(e->key, key, len) == 0 && e->key[len] == '\0') {
+      *slot = i;
+      return e;
+    }
+  }
+  *slot = i;
+  return NULL;
+}
+
+/*
+    @brief drop the dead entries and size the table for one more
+*/
+void noosh_assoc_rebuild(struct noosh_assoc * m) {
+  size_t i, j, n = 0;
+
+  for (i = 0; i < m->n; i++) {
+    if (m->entries[i].key) {
+      m->entries[n++] = m->entries[i];
+    }
+  }
+  m->n = n;
+  if (n + 1 > m->cap / 2) {
+    m->cap = m->cap ? 2 * m->cap : 8;
+    m->entries = noosh_realloc(m->entries, m->cap * sizeof(*m->entries));
+  }
+  m->icap = 2 * m->cap;
+  free(m->index);
+  m->index = noosh_malloc(m->icap * sizeof(*m->index));
+  memset(m->index, 0, m->icap * sizeof(*m->index));
+  for (i = 0; i < n; i++) {
+    for (j = m->entries[i].hash & (m->icap - 1); m->index[j]; j = (j + 1) & (m->icap - 1));
+    m->index[j] = i + 1;
+  }
+}
+
+/*
+    @brief the value of a key
+    @return the value, NULL if the key is not set
+*/
+const char * noosh_assoc_get(struct noosh_assoc * m, const char * key, size_t len) {
+  struct noosh_assoc_entry * e;
+  size_t slot;
+
+  e = noosh_assoc_find(m, key, len, noosh_hash(key, len), &slot);
+  return e ? e->value : NULL;
+}
+
+/*
+    @brief set a key
+    @param m: the table
+    @param key: the key, not null terminated
+    @param len: its length
+    @param value: the value, copied
+    @param vlen: its length
+*/
+void noosh_assoc_set(struct noosh_assoc * m, const char * key, size_t len,
+                     const char * value, size_t vlen) {
+  unsigned long h = noosh_hash(key, len);
+  struct noosh_assoc_entry * e;
+  size_t slot;
+
+  if ((e = noosh_assoc_find(m, key, len, h, &slot)) != NULL) {
+    free(e->value);
+    e->value = noosh_strndup(value, vlen);
+    return;
+  }
+  if (m->n == m->cap) {
+    noosh_assoc_rebuild(m);
+    noosh_assoc_find(m, key, len, h, &slot);
+  }
+  e = &m->entries[m->n++];
+  e->key = noosh_strndup(key, len);
+  e->value = noosh_strndup(value, vlen);
+  e->hash = h;
+  m->index[slot] = m->n;
+  m->count++;
+}
+
+/*
+    @brief unset a key, if it is set
+*/
+void noosh_assoc_unset(struct noosh_assoc * m, const char * key, size_t len) {
+  struct noosh_assoc_entry * e;
+  size_t slot;
+
+  if ((e = noosh_assoc_find(m, key, len, noosh_hash(key, len), &slot)) != NULL) {
+    free(e->key);
+    free(e->value);
+    e->key = e->value = NULL;
+    m->count--;
+  }
+}
+
+/*
+    @brief free an associative array
+*/
+void noosh_assoc_free(struct noosh_assoc * m) {
+  size_t i;
+
+  if (m == NULL) {
+    return;
+  }
+  for (i = 0; i < m->n; i++) {
+    free(m->entries[i].key);
+    free(m->entries[i].value);
+  }
+  free(m->entries);
+  free(m->index);
+  free(m);
+}
+
+/*
+    @brief copy an indexed array
+    @return the copy, NULL for NULL
+*/
+struct noosh_array * noosh_array_copy(const struct noosh_array * a) {
+  struct noosh_array * c;
+  size_t i;
+
+  if (a == NULL) {
+    return NULL;
+  }
+  c = noosh_malloc(sizeof(*c));
+  memset(c, 0, sizeof(*c));
+  c->cap = c->n = a->n;
+  if (a->n > 0) {
+    c->items = noosh_malloc(a->n * sizeof(*c->items));
+    for (i = 0; i < a->n; i++) {
+      c->items[i] = noosh_strdup(a->items[i]);
+    }
+    if (a->keys) {
+      c->keys = noosh_malloc(a->n * sizeof(*c->keys));
+      memcpy(c->keys, a->keys, a->n * sizeof(*c->keys));
+    }
+  }
+  return c;
+}
+
+/*
+    @brief copy an associative array, in the same order
+    @return the copy, NULL for NULL
+*/
+struct noosh_assoc * noosh_assoc_copy(const struct noosh_assoc * m) {
+  struct noosh_assoc * c;
+  size_t i;
+
+  if (m == NULL) {
+    return NULL;
+  }
+  c = noosh_malloc(sizeof(*c));
+  memset(c, 0, sizeof(*c));
+  for (i = 0; i < m->n; i++) {
+    if (m->entries[i].key) {
+      noosh_assoc_set(c, m->entries[i].key, strlen(m->entries[i].key),
+                      m->entries[i].value, strlen(m->entries[i].value));
+    }
+  }
+  return c;
+}
+
+/*
+    @brief double the variable table; the caller holds noosh_var_lock
+*/
+void noosh_var_grow(void) {
+  struct noosh_var_table * t = &noosh_vars;
+  size_t cap = t->cap ? 2 * t->cap : 256, i, j;
+  struct noosh_var ** slots = noosh_malloc(cap * sizeof(*slots));
+
+  memset(slots, 0, cap * sizeof(*slots));
+  for (i = 0; i < t->cap; i++) {
+    if (t->slots[i]) {
+      for (j = t->slots[i]->hash & (cap - 1); slots[j]; j = (j + 1) & (cap - 1));
+      slots[j] = t->slots[i];
+    }
+  }
+  free(t->slots);
+  t->slots = slots;
+  t->cap = cap;
+}
+
+/*
+    @brief find the cell of a variable, creating it if needed; the
+        caller holds noosh_var_lock
+    @param name: variable name, assumed valid, not necessarily terminated
+    @param len: its length
+    @return the cell
+*/
+struct noosh_var * noosh_var_intern(const char * name, size_t len) {
+  struct noosh_var_table * t = &noosh_vars;
+  unsigned long h = noosh_hash(name, len);
+  struct noosh_var * v;
+  size_t i;
+
+  if (2 * (t->n + 1) > t->cap) {
+    noosh_var_grow();
+  }
+  for (i = h & (t->cap - 1); (v = t->slots[i]) != NULL; i = (i + 1) & (t->cap - 1)) {
+    if (v->hash == h && v->name_len == len && memcmp(v->name, name, len) == 0) {
+      return v;
+    }
+  }
+  v = noosh_arena_alloc(&t->names, sizeof(*v));
+  v->name = noosh_arena_strndup(&t->names, name, len);
+  v->name_len = len;
+  v->hash = h;
+  t->slots[i] = v;
+  t->n++;
+  return v;
+}
+
+/*
+    @brief find the cell of a variable, creating it if needed
+    @param name: variable name, assumed valid
+    @return the cell
+*/
+struct noosh_var * noosh_var_cell(const char * name) {
+  struct noosh_var * v;
+
+  pthread_mutex_lock(&noosh_var_lock);
+  v = noosh_var_intern(name, strlen(name));
+  pthread_mutex_unlock(&noosh_var_lock);
+  return v;
+}
+
+/*
+    @brief replace the string value of a cell; the caller holds
+        noosh_var_lock
+    @param v: the cell
+    @param s: new value, NULL to unset; it may be the current value
+    @param len: its length
+*/
+void noosh_var_store(struct noosh_var * v, const char * s, size_t len) {
+  char * old = v->value == v->small ? NULL : v->value;
+
+  if (s == NULL) {
+    v->value = NULL;
+  } else if (len < NOOSH_VAR_SMALL) {
+    memmove(v->small, s, len);
+    v->small[len] = '\0';
+    v->value = v->small;
+  } else {
+    v->value = noosh_malloc(len + 1);
+    memcpy(v->value, s, len);
+    v->value[len] = '\0';
+  }
+  if (old && __atomic_load_n(&noosh_stage_threads, __ATOMIC_RELAXED) > 0) {
+    if (noosh_var_nretired == noosh_var_retired_cap) {
+      noosh_var_retired_cap = noosh_var_retired_cap ? 2 * noosh_var_retired_cap : 16;
+      noosh_var_retired = noosh_realloc(noosh_var_retired,
+                                        noosh_var_retired_cap * sizeof(*noosh_var_retired));
+    }
+    noosh_var_retired[noosh_var_nretired++] = old;
+  } else {
+    free(old);
+  }
+}
+
+/*
+    @brief free the values replaced while stage threads ran, once none is
+        left
+*/
+void noosh_var_reclaim(void) {
+  size_t i;
+
+  pthread_mutex_lock(&noosh_var_lock);
+  if (__atomic_load_n(&noosh_stage_threads, __ATOMIC_RELAXED) == 0) {
+    for (i = 0; i < noosh_var_nretired; i++) {
+      free(noosh_var_retired[i]);
+    }
+    noosh_var_nretired = 0;
+  }
+  pthread_mutex_unlock(&noosh_var_lock);
+}
+
+/*
+    @brief note that a cell changed: the environment is rebuilt if it is
+        exported; the caller holds noosh_var_lock
+*/
+void noosh_var_changed(struct noosh_var * v) {
+  if (v->attrs & NOOSH_VAR_EXPORT) {
+    noosh_envp_stale = 1;
+  }
+}
+
+/*
+    @brief write out the number arithmetic left in a cell as its string
+        value; the caller holds noosh_var_lock
+*/
+void noosh_var_write_out(struct noosh_var * v) {
+  char tmp[24];
+
+  if (v->stale) {
+    noosh_var_store(v, tmp, sprintf(tmp, "%lld", v->num));
+    v->stale = 0;
+  }
+}
+
+/*
+    @brief the string value of a cell, written out first if arithmetic
+        left only a number
+    @param v: the cell
+    @return the value, NULL if unset; on a stage thread it stays valid
+        until the pipeline is over
+*/
+const char * noosh_var_value(struct noosh_var * v) {
+  if (v->stale) {
+    pthread_mutex_lock(&noosh_var_lock);
+    noosh_var_write_out(v);
+    pthread_mutex_unlock(&noosh_var_lock);
+  }
+  if (v->array) {
+    return noosh_array_get(v->array, 0);
+  }
+  if (v->assoc) {
+    return noosh_assoc_get(v->assoc, "0", 1);
+  }
+  return v->value;
+}
+
+/*
+  nesting of in-process subshells, see noosh_var_cow
+*/
+int noosh_cow_level = 0;
+
+void noosh_var_cow(struct noosh_var * v);
+
+/*
+    @brief refuse to change a readonly cell; a cell that may change is
+        saved first if an in-process subshell has not saved it yet
+    @return 0, -1 after printing an error if it is readonly
+*/
+int noosh_var_writable(struct noosh_var * v) {
+  if (v->attrs & NOOSH_VAR_READONLY) {
+    dprintf(NOOSH_FD(2), "noosh: %s: readonly variable\n", v->name);
+    return -1;
+  }
+  if (v->cow < noosh_cow_level) {
+    noosh_var_cow(v);
+  }
+  return 0;
+}
+
+int noosh_arith_string(const char * s, long long * out);
+int noosh_arith_text(const char * s, size_t len, long long * out);
+int noosh_var_set_elem(struct noosh_var * v, const char * key, size_t len, const char * value);
+
+/*
+    @brief give a cell a number as its value, without making it a string;
+        a no-op in an isolated pipeline stage
+    @param v: the cell
+    @param n: the number
+    @return 0, -1 if the variable is readonly
+*/
+int noosh_var_set_num(struct noosh_var * v, long long n) {
+  char tmp[24];
+
+  if (noosh_stage_isolated) {
+    return 0;
+  }
+  if (v->array || v->assoc) {
+    sprintf(tmp, "%lld", n);
+    return noosh_var_set_elem(v, "0", 1, tmp);
+  }
+  if (noosh_var_writable(v) < 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&noosh_var_lock);
+  noosh_var_store(v, NULL, 0);
+  v->num = n;
+  v->isnum = v->stale = 1;
+  noosh_var_changed(v);
+  pthread_mutex_unlock(&noosh_var_lock);
+  return 0;
+}
+
+/*
+    @brief change the value of a cell; a no-op in an isolated pipeline stage
+    @param v: the cell
+    @param value: new value, NULL to unset; the value of an integer
+        variable is evaluated as an arithmetic expression; an array
+        variable gets it as element 0, or is dropped for NULL
+    @return 0, -1 after printing an error (readonly variable, bad
+        expression)
+*/
+int noosh_var_set(struct noosh_var * v, const char * value) {
+  long long n;
+
+  if (noosh_stage_isolated) {
+    return 0;
+  }
+  if (noosh_var_writable(v) < 0) {
+    return -1;
+  }
+  if ((v->array || v->assoc) && value) {
+    return noosh_var_set_elem(v, "0", 1, value);
+  }
+  if (v->array || v->assoc) {
+    pthread_mutex_lock(&noosh_var_lock);
+    noosh_array_free(v->array);
+    noosh_assoc_free(v->assoc);
+    v->array = NULL;
+    v->assoc = NULL;
+    pthread_mutex_unlock(&noosh_var_lock);
+  }
+  if ((v->attrs & NOOSH_VAR_INTEGER) && value) {
+    if (noosh_arith_string(value, &n) < 0) {
+      return -1;
+    }
+    return noosh_var_set_num(v, n);
+  }
+  pthread_mutex_lock(&noosh_var_lock);
+  noosh_var_store(v, value, value ? strlen(value) : 0);
+  v->isnum = v->stale = 0;
+  noosh_var_changed(v);
+  pthread_mutex_unlock(&noosh_var_lock);
+  return 0;
+}
+
+/*
+    @brief set or clear attributes of a cell; a no-op in an isolated
+        pipeline stage
+    @param v: the cell
+    @param set: NOOSH_VAR_* attributes to set
+    @param clear: NOOSH_VAR_* attributes to clear
+*/
+void noosh_var_attrs(struct noosh_var * v, int set, int clear) {
+  if (noosh_stage_isolated) {
+    return;
+  }
+  if (v->cow < noosh_cow_level) {
+    noosh_var_cow(v);
+  }
+  pthread_mutex_lock(&noosh_var_lock);
+  if ((v->attrs & NOOSH_VAR_EXPORT) != (((v->attrs | set) & ~clear) & NOOSH_VAR_EXPORT)) {
+    noosh_envp_stale = 1;
+  }
+  v->attrs = (v->attrs | set) & ~clear;
+  pthread_mutex_unlock(&noosh_var_lock);
+}
+
+/*
+    @brief the value of a cell as a number, for arithmetic; a string value
+        is evaluated as an expression, and remembered if it is a plain
+        integer
+    @param v: the cell
+    @param out: receives the number, 0 if unset or empty
+    @return 0, -1 after printing an error
+*/
+int noosh_var_num(struct noosh_var * v, long long * out) {
+  const char * s;
+  char * end;
+  long long n;
+
+  if (v->isnum) {
+    *out = v->num;
+    return 0;
+  }
+  if ((s = noosh_var_value(v)) == NULL) {
+    *out = 0;
+    return 0;
+  }
+  errno = 0;
+  n = strtoll(s, &end, 10);
+  if (*end == '\0' && errno == 0 && (strcmp(s, "0") == 0 ||
+      (s[s[0] == '-'] >= '1' && s[s[0] == '-'] <= '9'))) {
+    // A decimal integer: no need to parse it again.
+    pthread_mutex_lock(&noosh_var_lock);
+    if (v->value == s) {
+      v->num = n;
+      v->isnum = 1;
+    }
+    pthread_mutex_unlock(&noosh_var_lock);
+    *out = n;
+    return 0;
+  }
+  return noosh_arith_string(s, out);
+}
+
+/*
+    @brief make cells for the environment the shell started with, all of
+        them exported
+*/
+void noosh_var_import(void) {
+  extern char ** environ;
+  struct noosh_var * v;
+  const char * eq;
+  char ** e;
+
+  pthread_mutex_lock(&noosh_var_lock);
+  for (e = environ; *e; e++) {
+    if ((eq = strchr(*e, '=')) == NULL || eq == *e) {
+      continue;
+    }
+    v = noosh_var_intern(*e, eq - *e);
+    if (v->value == NULL) {
+      noosh_var_store(v, eq + 1, strlen(eq + 1));
+      v->attrs |= NOOSH_VAR_EXPORT;
+    }
+  }
+  noosh_envp_stale = 1;
+  pthread_mutex_unlock(&noosh_var_lock);
+}
+
+/*
+    @brief the environment for a child, rebuilt only if an exported
+        variable changed since the last call
+    @return NULL terminated NAME=value list
+*/
+char ** noosh_env(void) {
+  struct noosh_var_table * t = &noosh_vars;
+  struct noosh_var * v;
+  size_t i, n = 0, size = 0;
+  char ** envp, * p;
+
+  pthread_mutex_lock(&noosh_var_lock);
+  if (noosh_envp_stale) {
+    for (i = 0; i < t->cap; i++) {
+      if ((v = t->slots[i]) != NULL && (v->attrs & NOOSH_VAR_EXPORT) && (v->value || v->stale)) {
+        noosh_var_write_out(v);
+        n++;
+        size += v->name_len + strlen(v->value) + 2;
+      }
+    }
+    envp = noosh_malloc((n + 1) * sizeof(*envp) + size);
+    p = (char *) (envp + n + 1);
+    for (i = 0, n = 0; i < t->cap; i++) {
+      if ((v = t->slots[i]) != NULL && (v->attrs & NOOSH_VAR_EXPORT) && v->value) {
+        envp[n++] = p;
+        p += sprintf(p, "%s=%s", v->name, v->value) + 1;
+      }
+    }
+    envp[n] = NULL;
+    free(noosh_envp_old);
+    noosh_envp_old = noosh_envp;
+    noosh_envp = envp;
+    noosh_envp_stale = 0;
+    noosh_envp_builds++;
+  }
+  envp = noosh_envp;
+  pthread_mutex_unlock(&noosh_var_lock);
+  return envp;
+}
+
+/*
+  saved variable of a function scope or in-process subshell
+    local pushes the cell's previous state, and the function's return
+    pops and restores it; depth is the function depth of the local
+*/
+struct noosh_var_saved {
+  struct noosh_var * cell;
+  struct noosh_array * array;
+  struct noosh_assoc * assoc;
+  char * value;
+  long long num;
+  int isnum;
+  int attrs;
+  int depth;
+};
+
+struct noosh_var_saved * noosh_locals = NULL;
+size_t noosh_nlocals = 0;
+
+/*
+    @brief make a variable local to the function running at depth: it
+        starts unset and without attributes, and gets its value back
+        when the function returns; a no-op if it is already local there
+        or in an isolated pipeline stage
+    @param v: the cell
+    @param depth: the function depth
+    @return 0, -1 after printing an error if it is readonly
+*/
+int noosh_var_local(struct noosh_var * v, int depth) {
+  struct noosh_var_saved * s;
+  size_t i;
+
+  if (noosh_stage_isolated) {
+    return 0;
+  }
+  for (i = noosh_nlocals; i > 0 && noosh_locals[i - 1].depth == depth; i--) {
+    if (noosh_locals[i - 1].cell == v) {
+      return 0;
+    }
+  }
+  if (noosh_var_writable(v) < 0) {
+    return -1;
+  }
+  if ((noosh_nlocals & (noosh_nlocals - 1)) == 0) {
+    noosh_locals = noosh_realloc(noosh_locals, (noosh_nlocals ? 2 * noosh_nlocals : 1) * sizeof(*noosh_locals));
+  }
+  s = &noosh_locals[noosh_nlocals++];
+  pthread_mutex_lock(&noosh_var_lock);
+  s->cell = v;
+  s->array = v->array;
+  s->assoc = v->assoc;
+  v->array = NULL;
+  v->assoc = NULL;
+  s->value = v->value ? noosh_strdup(v->value) : NULL;
+  s->num = v->num;
+  s->isnum = v->isnum;
+  s->attrs = v->attrs;
+  s->depth = depth;
+  noosh_var_changed(v);
+  noosh_var_store(v, NULL, 0);
+  v->isnum = v->stale = v->attrs = 0;
+  pthread_mutex_unlock(&noosh_var_lock);
+  return 0;
+}
+
+/*
+    @brief put a saved cell back; the caller holds noosh_var_lock
+    @param s: the saved state, whose value and arrays are taken
+*/
+void noosh_var_restore(struct noosh_var_saved * s) {
+  struct noosh_var * v = s->cell;
+
+  noosh_var_changed(v);
+  noosh_var_store(v, s->value, s->value ? strlen(s->value) : 0);
+  free(s->value);
+  noosh_array_free(v->array);
+  noosh_assoc_free(v->assoc);
+  v->array = s->array;
+  v->assoc = s->assoc;
+  v->num = s->num;
+  v->isnum = s->isnum;
+  v->stale = s->isnum && v->value == NULL;
+  v->attrs = s->attrs;
+  noosh_var_changed(v);
+}
+
+/*
+    @brief put back the variables made local at depth or deeper, when a
+        function returns
+*/
+void noosh_var_unwind(int depth) {
+  if (noosh_stage_isolated) {
+    return;
+  }
+  pthread_mutex_lock(&noosh_var_lock);
+  while (noosh_nlocals > 0 && noosh_locals[noosh_nlocals - 1].depth >= depth) {
+    noosh_var_restore(&noosh_locals[--noosh_nlocals]);
+  }
+  pthread_mutex_unlock(&noosh_var_lock);
+}
+
+/*
+  cells saved by in-process subshells, oldest first; there depth holds
+  the cow level the cell had before
+*/
+struct noosh_var_saved * noosh_cow = NULL;
+size_t noosh_ncow = 0;
+
+/*
+    @brief save a cell the running in-process subshell is about to change,
+        to put it back when the subshell ends: entering a subshell copies
+        nothing, and only the cells it changes are copied, once each
+    @param v: the cell
+*/
+void noosh_var_cow(struct noosh_var * v) {
+  struct noosh_var_saved * s;
+
+  pthread_mutex_lock(&noosh_var_lock);
+  if ((noosh_ncow & (noosh_ncow - 1)) == 0) {
+    noosh_cow = noosh_realloc(noosh_cow, (noosh_ncow ? 2 * noosh_ncow : 1) * sizeof(*noosh_cow));
+  }
+  s = &noosh_cow[noosh_ncow++];
+  s->cell = v;
+  s->array = noosh_array_copy(v->array);
+  s->assoc = noosh_assoc_copy(v->assoc);
+  s->value = v->value ? noosh_strdup(v->value) : NULL;
+  s->num = v->num;
+  s->isnum = v->isnum;
+  s->attrs = v->attrs;
+  s->depth = v->cow;
+  v->cow = noosh_cow_level;
+  pthread_mutex_unlock(&noosh_var_lock);
+}
+
+/*
+    @brief put back the cells an in-process subshell changed
+    @param ncow: length of noosh_cow when it started
+    @param nlocals: length of noosh_locals when it started
+*/
+void noosh_var_rollback(size_t ncow, size_t nlocals) {
+  struct noosh_var_saved * s;
+
+  pthread_mutex_lock(&noosh_var_lock);
+  while (noosh_nlocals > nlocals) {
+    noosh_var_restore(&noosh_locals[--noosh_nlocals]);
+  }
+  while (noosh_ncow > ncow) {
+    s = &noosh_cow[--noosh_ncow];
+    noosh_var_restore(s);
+    s->cell->cow = s->depth;
+  }
+  pthread_mutex_unlock(&noosh_var_lock);
+}
+
+/*
+    @brief get a shell variable
+    @param name: variable name
+    @return the value, NULL if unset
+*/
+const char * noosh_getvar(const char * name) {
+  if (!noosh_valid_name(name)) {
+    return NULL;
+  }
+  return noosh_var_value(noosh_var_cell(name));
+}
+
+/*
+    @brief set a shell variable; a no-op in an isolated pipeline stage
+    @param name: variable name
+    @param value: new value
+    @return 0 on success, -1 if name is not a valid identifier or the
+        variable cannot be set
+*/
+int noosh_setvar(const char * name, const char * value) {
+  if (!noosh_valid_name(name)) {
+    dprintf(NOOSH_FD(2), "noosh: `%s': not a valid identifier\n", name);
+    return -1;
+  }
+  return noosh_var_set(noosh_var_cell(name), value);
+}
+
+/*
+    @brief unset a shell variable; a no-op in an isolated pipeline stage
+    @param name: variable name
+*/
+void noosh_unsetvar(const char * name) {
+  if (noosh_valid_name(name)) {
+    noosh_var_set(noosh_var_cell(name), NULL);
+  }
+}
+
+/*
+    @brief make a cell an indexed array, its scalar value becoming
+        element 0; the caller holds noosh_var_lock
+    @return the array
+*/
+struct noosh_array * noosh_var_make_array(struct noosh_var * v) {
+  if (v->array == NULL) {
+    v->array = noosh_malloc(sizeof(*v->array));
+    memset(v->array, 0, sizeof(*v->array));
+    noosh_var_write_out(v);
+    if (v->value) {
+      noosh_array_set(v->array, 0, v->value, strlen(v->value));
+      noosh_var_changed(v);
+      noosh_var_store(v, NULL, 0);
+    }
+    v->isnum = 0;
+  }
+  return v->array;
+}
+
+/*
+    @brief make a cell an associative array, its scalar value becoming
+        key 0; the caller holds noosh_var_lock
+    @return the table, NULL if the cell is an indexed array
+*/
+struct noosh_assoc * noosh_var_make_assoc(struct noosh_var * v) {
+  if (v->array) {
+    return NULL;
+  }
+  if (v->assoc == NULL) {
+    v->assoc = noosh_malloc(sizeof(*v->assoc));
+    memset(v->assoc, 0, sizeof(*v->assoc));
+    noosh_var_write_out(v);
+    if (v->value) {
+      noosh_assoc_set(v->assoc, "0", 1, v->value, strlen(v->value));
+      noosh_var_changed(v);
+      noosh_var_store(v, NULL, 0);
+    }
+    v->isnum = 0;
+  }
+  return v->assoc;
+}
+
+/*
+    @brief turn a subscript of an indexed array into an index: the
+        subscript is an arithmetic expression, and negative indexes count
+        back from the end
+    @param v: the cell
+    @param key: the subscript, already expanded
+    @param len: its length
+    @param out: receives the index
+    @return 0, -1 after printing an error
+*/
+int noosh_var_index(struct noosh_var * v, const char * key, size_t len, long long * out) {
+  long long i;
+
+  if (noosh_arith_text(key, len, &i) < 0) {
+    return -1;
+  }
+  if (i < 0 && v->array && v->array->n > 0) {
+    i += noosh_array_key(v->array, v->array->n - 1) + 1;
+  }
+  if (i < 0) {
+    dprintf(NOOSH_FD(2), "noosh: %s[%.*s]: bad array subscript\n", v->name, (int) len, key);
+    return -1;
+  }
+  *out = i;
+  return 0;
+}
+
+/*
+    @brief get an element of a variable: a key of an associative array,
+        an index of an indexed array, or index 0 of a scalar
+    @param v: the cell
+    @param key: the subscript, already expanded
+    @param len: its length
+    @param out: receives the value, NULL if unset
+    @return 0, -1 after printing an error
+*/
+int noosh_var_get_elem(struct noosh_var * v, const char * key, size_t len, const char ** out) {
+  long long i;
+
+  if (v->assoc) {
+    *out = noosh_assoc_get(v->assoc, key, len);
+    return 0;
+  }
+  if (noosh_var_index(v, key, len, &i) < 0) {
+    return -1;
+  }
+  *out = v->array ? noosh_array_get(v->array, i) : i == 0 ? noosh_var_value(v) : NULL;
+  return 0;
+}
+
+/*
+    @brief set an element of a variable, making it an indexed array
+        unless it is an associative one; a no-op in an isolated pipeline
+        stage
+    @param v: the cell
+    @param key: the subscript, already expanded
+    @param len: its length
+    @param value: the value; an integer variable evaluates it
+    @return 0, -1 after printing an error
+*/
+int noosh_var_set_elem(struct noosh_var * v, const char * key, size_t len, const char * value) {
+  char tmp[24];
+  long long i, n;
+
+  if (noosh_stage_isolated) {
+    return 0;
+  }
+  if (noosh_var_writable(v) < 0 || (!v->assoc && noosh_var_index(v, key, len, &i) < 0)) {
+    return -1;
+  }
+  if (v->attrs & NOOSH_VAR_INTEGER) {
+    if (noosh_arith_string(value, &n) < 0) {
+      return -1;
+    }
+    sprintf(tmp, "%lld", n);
+    value = tmp;
+  }
+  pthread_mutex_lock(&noosh_var_lock);
+  if (v->assoc) {
+    noosh_assoc_set(v->assoc, key, len, value, strlen(value));
+  } else {
+    noosh_array_set(noosh_var_make_array(v), i, value, strlen(value));
+  }
+  pthread_mutex_unlock(&noosh_var_lock);
+  return 0;
+}
+
+/*
+    @brief append to an indexed array, after its last element; a no-op
+        in an isolated pipeline stage
+    @param v: the cell, made an indexed array if needed
+    @param value: the value; an integer variable evaluates it
+    @return 0, -1 after printing an error
+*/
+int noosh_var_push(struct noosh_var * v, const char * value) {
+  struct noosh_array * a;
+  char tmp[24];
+
+  if (v->assoc) {
+    dprintf(NOOSH_FD(2), "noosh: %s: must use subscript when assigning associative array\n", v->name);
+    return -1;
+  }
+  pthread_mutex_lock(&noosh_var_lock);
+  a = noosh_var_make_array(v);
+  sprintf(tmp, "%lld", a->n ? noosh_array_key(a, a->n - 1) + 1 : 0);
+  pthread_mutex_unlock(&noosh_var_lock);
+  return noosh_var_set_elem(v, tmp, strlen(tmp), value);
+}
+
+/*
+    @brief unset an element of a variable; a no-op in an isolated
+        pipeline stage
+    @param v: the cell
+    @param key: the subscript, already expanded
+    @param len: its length
+    @return 0, -1 after printing an error
+*/
+int noosh_var_unset_elem(struct noosh_var * v, const char * key, size_t len) {
+  long long i;
+
+  if (noosh_stage_isolated) {
+    return 0;
+  }
+  if (noosh_var_writable(v) < 0 || (!v->assoc && noosh_var_index(v, key, len, &i) < 0)) {
+    return -1;
+  }
+  pthread_mutex_lock(&noosh_var_lock);
+  if (v->assoc) {
+    noosh_assoc_unset(v->assoc, key, len);
+  } else if (v->array) {
+    noosh_array_unset(v->array, i);
+  } else if (i == 0) {
+    noosh_var_changed(v);
+    noosh_var_store(v, NULL, 0);
+    v->isnum = v->stale = 0;
+  }
+  pthread_mutex_unlock(&noosh_var_lock);
+  return 0;
+}
+
+/*
+    @brief empty a variable and make it an array of the given kind, for
+        name=(...) and declare -a/-A; a no-op in an isolated pipeline
+        stage
+    @param v: the cell
+    @param assoc: make it associative (the cell must not be an indexed
+        array), otherwise indexed
+    @param clear: drop the elements it has
+    @return 0, -1 after printing an error
+*/
+int noosh_var_reset_array(struct noosh_var * v, int assoc, int clear) {
+  if (noosh_stage_isolated) {
+    return 0;
+  }
+  if (noosh_var_writable(v) < 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&noosh_var_lock);
+  if (clear) {
+    if (v->array && !assoc) {
+      noosh_array_free(v->array);
+      v->array = NULL;
+    }
+    if (v->assoc) {
+      noosh_assoc_free(v->assoc);
+      v->assoc = NULL;
+    }
+    noosh_var_changed(v);
+    noosh_var_store(v, NULL, 0);
+    v->isnum = v->stale = 0;
+  }
+  if (assoc ? noosh_var_make_assoc(v) == NULL : (v->assoc == NULL && noosh_var_make_array(v) == NULL)) {
+    pthread_mutex_unlock(&noosh_var_lock);
+    dprintf(NOOSH_FD(2), "noosh: %s: cannot convert indexed to associative array\n", v->name);
+    return -1;
+  }
+  pthread_mutex_unlock(&noosh_var_lock);
+  return 0;
+}
+
+/*
+    @brief set an indexed array to items read by mapfile, replacing any
+        previous value; a no-op in an isolated pipeline stage
+    @param name: variable name
+    @param items: element pointers, ownership is taken
+    @param count: number of elements
+    @param block: storage the elements point into, ownership is taken
+    @param block_len: its size
+    @return 0 on success, -1 if name is not a valid identifier or the
+        variable cannot be set
+*/
+int noosh_set_array(const char * name, char ** items, size_t count, char * block, size_t block_len) {
+  struct noosh_var * v;
+  struct noosh_array * a;
+
+  if (!noosh_valid_name(name)) {
+    dprintf(NOOSH_FD(2), "noosh: `%s': not a valid identifier\n", name);
+    free(items);
+    free(block);
+    return -1;
+  }
+  v = noosh_var_cell(name);
+  if (noosh_stage_isolated || noosh_var_reset_array(v, 0, 1) < 0) {
+    free(items);
+    free(block);
+    return noosh_stage_isolated ? 0 : -1;
+  }
+  pthread_mutex_lock(&noosh_var_lock);
+  a = v->array;
+  a->items = items;
+  a->n = count;
+  a->cap = count + 1;
+  a->block = block;
+  a->block_len = block_len;
+  pthread_mutex_unlock(&noosh_var_lock);
+  return 0;
+}
+
+/*
+  File transfer
+
+  Data is moved between descriptors inside the kernel whenever the pair
+  allows it, trying in order:
+    reflink (FICLONE/FICLONERANGE) when both ends are regular files
+    copy_file_range(2) between regular files
+    splice(2) when either end is a pipe
+    sendfile(2) from a regular file to anything else
+    read/write through a buffer as the last resort
+  Each method works from the current file offsets, so when one gives up
+  part way the next continues where it stopped.
+*/
+
+# define NOOSH_COPY_CHUNK (1 << 30)
+# define NOOSH_SPLICE_CHUNK (1 << 20)
+# define NOOSH_COPY_BUFSIZE (128 * 1024)
+
+/*
+    @brief check whether a transfer error means "try another method"
+*/
+int noosh_copy_unsupported(int err) {
+  return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP ||
+         err == ENOTTY || err == EBADF || err == ETXTBSY || err == EPERM;
+}
+
+/*
+    @brief share the extents of in with out where out is empty or block aligned
+    @return 0 if cloned to the end of in, 1 if reflinks are not possible
+*/
+int noosh_copy_clone(int in, int out, struct stat * ist, struct stat * ost) {
+  struct file_clone_range range;
+  off_t ioff, ooff;
+
+  ioff = lseek(in, 0, SEEK_CUR);
+  ooff = lseek(out, 0, SEEK_CUR);
+  if (ioff < 0 || ooff < 0 || ioff >= ist->st_size || ost->st_blksize <= 0 ||
+      ioff % ost->st_blksize != 0 || ooff % ost->st_blksize != 0 || ooff < ost->st_size) {
+    return 1;
+  }
+
+  if (ioff == 0 && ooff == 0 && ost->st_size == 0) {
+    if (ioctl(out, FICLONE, in) < 0) {
+      return 1;
+    }
+  } else {
+    range.src_fd = in;
+    range.src_offset = ioff;
+    range.src_length = 0;
+    range.dest_offset = ooff;
+    if (ioctl(out, FICLONERANGE, &range) < 0) {
+      return 1;
+    }
+  }
+  lseek(out, ooff + (ist->st_size - ioff), SEEK_SET);
+  lseek(in, 0, SEEK_END);
+  return 0;
+}
+
+/*
+    @brief copy with copy_file_range(2), splice(2) or sendfile(2)
+    @param method: 'c', 's' or 'f' respectively
+    @return 0 at end of input, 1 if the method is not supported, -1 on error
+*/
+int noosh_copy_kernel(int in, int out, int method) {
+  ssize_t n;
+
+  while (1) {
+    switch (method) {
+    case 'c':
+      n = copy_file_range(in, NULL, out, NULL, NOOSH_COPY_CHUNK, 0);
+      break;
+    case 's':
+      n = splice(in, NULL, out, NULL, NOOSH_SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+      break;
+    default:
+      n = sendfile(out, in, NULL, NOOSH_COPY_CHUNK);
+      break;
+    }
+    if (n == 0) {
+      return 0;
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // Later methods carry on from the offsets this one left.
+      return noosh_copy_unsupported(errno) ? 1 : -1;
+    }
+  }
+}
+
+/*
+    @brief copy through a user space buffer
+    @return 0 at end of input, -1 on error
+*/
+int noosh_copy_rw(int in, int out) {
+  char * buf = noosh_malloc(NOOSH_COPY_BUFSIZE);
+  ssize_t n, w, done;
+
+  while ((n = noosh_read_fd(in, buf, NOOSH_COPY_BUFSIZE)) > 0) {
+    for (done = 0; done < n; done += w) {
+      w = write(out, buf + done, n - done);
+      if (w < 0 && errno == EINTR) {
+        w = 0;
+      } else if (w < 0) {
+        free(buf);
+        return -1;
+      }
+    }
+  }
+  free(buf);
+  return n < 0 ? -1 : 0;
+}
+
+/*
+    @brief copy everything from in (from its offset) to out
+    @param in: source descriptor
+    @param out: destination descriptor
+    @return 0 on success, -1 on error with errno set
+*/
+int noosh_copy_fd(int in, int out) {
+  struct stat ist, ost;
+  int r;
+
+  if (fstat(in, &ist) < 0 || fstat(out, &ost) < 0) {
+    return -1;
+  }
+
+  if (S_ISREG(ist.st_mode) && S_ISREG(ost.st_mode)) {
+    if (noosh_copy_clone(in, out, &ist, &ost) == 0) {
+      return 0;
+    }
+    if ((r = noosh_copy_kernel(in, out, 'c')) <= 0) {
+      return r;
+    }
+  }
+  if (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode)) {
+    if ((r = noosh_copy_kernel(in, out, 's')) <= 0) {
+      return r;
+    }
+  }
+  if (S_ISREG(ist.st_mode) || S_ISBLK(ist.st_mode)) {
+    if ((r = noosh_copy_kernel(in, out, 'f')) <= 0) {
+      return r;
+    }
+  }
+  return noosh_copy_rw(in, out);
+}
+
+/*
+    @brief write all of buf, dropping the output if it fails
+    @param out: pointer to the output descriptor, set to -1 on failure
+*/
+void noosh_write_or_drop(int * out, const char * buf, size_t n) {
+  ssize_t w;
+
+  while (*out >= 0 && n > 0) {
+    w = write(*out, buf, n);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      *out = -1;
+      return;
+    }
+    buf += w;
+    n -= w;
+  }
+}
+
+/*
+    @brief move n bytes from a pipe to an output, discarding them if the
+        output is gone or fails
+    @param from: pipe holding at least n bytes
+    @param out: pointer to the output descriptor, set to -1 on failure
+    @param n: number of bytes to move
+    @param buf: scratch buffer of NOOSH_COPY_BUFSIZE bytes
+*/
+void noosh_splice_or_drop(int from, int * out, size_t n, char * buf) {
+  ssize_t r;
+
+  while (n > 0 && *out >= 0) {
+    r = splice(from, NULL, *out, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      break;
+    }
+    n -= r;
+  }
+  // splice refused (append mode file, terminal, dead output): copy the rest.
+  while (n > 0) {
+    r = noosh_read_fd(from, buf, n < NOOSH_COPY_BUFSIZE ? n : NOOSH_COPY_BUFSIZE);
+    if (r <= 0) {
+      return;
+    }
+    noosh_write_or_drop(out, buf, r);
+    n -= r;
+  }
+}
+
+/*
+    @brief count outputs that are still alive
+*/
+int noosh_fanout_alive(int * outs, int nouts) {
+  int i, alive = 0;
+
+  for (i = 0; i < nouts; i++) {
+    alive += outs[i] >= 0;
+  }
+  return alive;
+}
+
+/*
+    @brief fan out a pipe without copying through user space
+        each round tee(2)s what is buffered in the input into a private
+        pipe per output but the last, splices those out, then splices the
+        input itself to the last output
+    @return 0 at end of input, -1 if every output failed, 1 if the input
+        does not support tee(2)
+*/
+int noosh_fanout_pipe(int in, int * outs, int nouts) {
+  int (* scratch)[2] = noosh_malloc((nouts - 1) * sizeof(*scratch));
+  size_t * got = noosh_malloc(nouts * sizeof(*got));
+  char * buf = noosh_malloc(NOOSH_COPY_BUFSIZE);
+  int i, r = 0, size, first = 1, made;
+  ssize_t n;
+
+  size = fcntl(in, F_GETPIPE_SZ);
+  for (made = 0; made < nouts - 1; made++) {
+    if (pipe2(scratch[made], O_CLOEXEC) < 0) {
+      r = -1;
+      goto done;
+    }
+    // As big as the input, so a tee of all of it always fits.
+    if (size > 0) {
+      fcntl(scratch[made][1], F_SETPIPE_SZ, size);
+    }
+  }
+
+  while (noosh_fanout_alive(outs, nouts) > 0) {
+    do {
+      n = tee(in, scratch[0][1], NOOSH_COPY_BUFSIZE, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && first) {
+      r = 1;
+      goto done;
+    }
+    if (n <= 0) {
+      r = n < 0 ? -1 : 0;
+      goto done;
+    }
+    first = 0;
+
+    got[0] = n;
+    for (i = 1; i < nouts - 1; i++) {
+      ssize_t m;
+      do {
+        m = tee(in, scratch[i][1], n, 0);
+      } while (m < 0 && errno == EINTR);
+      got[i] = m > 0 ? (size_t) m : 0;
+    }
+    for (i = 0; i < nouts - 1; i++) {
+      noosh_splice_or_drop(scratch[i][0], &outs[i], got[i], buf);
+    }
+
+    for (i = 0; i < nouts - 1 && got[i] == (size_t) n; i++);
+    if (i == nouts - 1) {
+      noosh_splice_or_drop(in, &outs[nouts - 1], n, buf);
+      continue;
+    }
+    // A private pipe took less than the rest: consume this round through
+    // a buffer and top up the short outputs from it.
+    if (noosh_read_full(in, buf, n) < 0) {
+      r = -1;
+      goto done;
+    }
+    noosh_write_or_drop(&outs[nouts - 1], buf, n);
+    for (i = 0; i < nouts - 1; i++) {
+      if (got[i] < (size_t) n) {
+        noosh_write_or_drop(&outs[i], buf + got[i], n - got[i]);
+      }
+    }
+  }
+  r = -1;
+
+done:
+  for (i = 0; i < made; i++) {
+    close(scratch[i][0]);
+    close(scratch[i][1]);
+  }
+  free(scratch);
+  free(got);
+  free(buf);
+  return r;
+}
+
+/*
+    @brief copy everything from in to each of several outputs
+        a pipe input is fanned out with tee(2) and splice(2); anything else
+        is read into a buffer and written to every output
+    @param in: source descriptor
+    @param outs: destination descriptors, an output that fails is dropped
+        (set to -1) and the rest keep receiving
+    @param nouts: number of destinations
+    @return 0 at end of input, -1 if every output failed or on a read error
+*/
+int noosh_fanout(int in, int * outs, int nouts) {
+  char * buf;
+  struct stat st;
+  ssize_t n = 0;
+  int i, r;
+
+  if (nouts == 1) {
+    return noosh_copy_fd(in, outs[0]);
+  }
+  if (fstat(in, &st) == 0 && S_ISFIFO(st.st_mode) &&
+      (r = noosh_fanout_pipe(in, outs, nouts)) != 1) {
+    return r;
+  }
+
+  buf = noosh_malloc(NOOSH_COPY_BUFSIZE);
+  while (noosh_fanout_alive(outs, nouts) > 0 &&
+         (n = noosh_read_fd(in, buf, NOOSH_COPY_BUFSIZE)) > 0) {
+    for (i = 0; i < nouts; i++) {
+      noosh_write_or_drop(&outs[i], buf, n);
+    }
+  }
+  free(buf);
+  return noosh_fanout_alive(outs, nouts) > 0 && n == 0 ? 0 : -1;
+}
+
+/*
+    @brief copy one regular file to a new path
+    @param src: source path
+    @param dst: destination path, created or truncated
+    @return 0 on success, -1 after printing an error
+*/
+int noosh_copy_file(const char * src, const char * dst) {
+  struct stat ist, ost;
+  int in, out, r = 0;
+
+  in = open(src, O_RDONLY | O_CLOEXEC);
+  if (in < 0 || fstat(in, &ist) < 0) {
+    dprintf(NOOSH_FD(2), "noosh: cp: %s: %s\n", src, strerror(errno));
+    if (in >= 0) {
+      close(in);
+    }
+    return -1;
+  }
+  if (stat(dst, &ost) == 0 && ost.st_dev == ist.st_dev && ost.st_ino == ist.st_ino) {
+    dprintf(NOOSH_FD(2), "noosh: cp: %s and %s are the same file\n", src, dst);
+    close(in);
+    return -1;
+  }
+
+  out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, ist.st_mode & 07777);
+  if (out < 0) {
+    dprintf(NOOSH_FD(2), "noosh: cp: %s: %s\n", dst, strerror(errno));
+    close(in);
+    return -1;
+  }
+  if (ioctl(out, FICLONE, in) < 0 && noosh_copy_fd(in, out) < 0) {
+    dprintf(NOOSH_FD(2), "noosh: cp: %s: %s\n", dst, strerror(errno));
+    r = -1;
+  }
+  if (close(out) < 0 && r == 0) {
+    dprintf(NOOSH_FD(2), "noosh: cp: %s: %s\n", dst, strerror(errno));
+    r = -1;
+  }
+  close(in);
+  return r;
+}
+
+/*
+  cp -r work queue
+    the walking thread creates directories in tree order and queues the
+    files found in them; a small pool of workers copies the files
+*/
+struct noosh_cp_job {
+  char * src;
+  char * dst;
+  mode_t mode;
+  struct noosh_cp_job * next;
+};
+
+struct noosh_cp_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct noosh_cp_job * head;
+  struct noosh_cp_job * tail;
+  struct noosh_cp_job * dirs;
+  int nthreads;
+  int done;
+  int errors;
+  dev_t skip_dev;
+  ino_t skip_ino;
+};
+
+# define NOOSH_CP_MAX_THREADS 8
+
+/*
+    @brief cp -r worker: copy queued files until the walk is done
+    @param arg: the pool
+    @return NULL
+*/
+void * noosh_cp_worker(void * arg) {
+  struct noosh_cp_pool * pool = arg;
+  struct noosh_cp_job * job;
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head == NULL && !pool->done) {
+      pthread_cond_wait(&pool->ready, &pool->lock);
+    }
+    job = pool->head;
+    if (job == NULL) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    pool->head = job->next;
+    if (pool->head == NULL) {
+      pool->tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (noosh_copy_file(job->src, job->dst) < 0) {
+      __atomic_add_fetch(&pool->errors, 1, __ATOMIC_RELAXED);
+    }
+    free(job->src);
+    free(job->dst);
+    free(job);
+  }
+}
+
+/*
+    @brief make a job holding copies of two paths
+*/
+struct noosh_cp_job * noosh_cp_job(const char * src, const char * dst, mode_t mode) {
+  struct noosh_cp_job * job = noosh_malloc(sizeof(*job));
+  job->src = noosh_strdup(src);
+  job->dst = noosh_strdup(dst);
+  job->mode = mode;
+  job->next = NULL;
+  return job;
+}
+
+/*
+    @brief hand a file copy to the workers, or copy it now without a pool
+*/
+void noosh_cp_queue(struct noosh_cp_pool * pool, const char * src, const char * dst) {
+  struct noosh_cp_job * job;
+
+  if (pool->nthreads == 0) {
+    if (noosh_copy_file(src, dst) < 0) {
+      pool->errors++;
+    }
+    return;
+  }
+  job = noosh_cp_job(src, dst, 0);
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail) {
+    pool->tail->next = job;
+  } else {
+    pool->head = job;
+  }
+  pool->tail = job;
+  pthread_cond_signal(&pool->ready);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+    @brief copy a path, queueing files and recursing into directories
+    @param pool: workers for file copies
+    @param src: source path
+    @param dst: destination path
+    @param top: nonzero for a path named on the command line, which is
+        followed if it is a symlink
+    @return 0 on success, -1 after printing an error
+*/
+int noosh_cp_tree(struct noosh_cp_pool * pool, const char * src, const char * dst, int top) {
+  struct noosh_buf s = {0}, d = {0};
+  struct dirent * ent;
+  struct stat st;
+  char link[PATH_MAX];
+  ssize_t n;
+  DIR * dir;
+  int r = 0;
+
+  if ((top ? stat(src, &st) : lstat(src, &st)) < 0) {
+    dprintf(NOOSH_FD(2), "noosh: cp: %s: %s\n", src, strerror(errno));
+    return -1;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    noosh_cp_queue(pool, src, dst);
+    return 0;
+  }
+  if (S_ISLNK(st.st_mode)) {
+    n = readlink(src, link, sizeof(link) - 1);
+    if (n < 0 || (link[n] = '\0', unlink(dst) < 0 && errno != ENOENT) || symlink(link, dst) < 0) {
+      dprintf(NOOSH_FD(2), "noosh: cp: %s: %s\n", dst, strerror(errno));
+      return -1;
+    }
+    return 0;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    dprintf(NOOSH_FD(2), "noosh: cp: %s: skipping special file\n", src);
+    return -1;
+  }
+  if (st.st_dev == pool->skip_dev && st.st_ino == pool->skip_ino) {
+    // The copy itself, when copying a directory into itself.
+    return 0;
+  }
+
+  // Keep the directory writable until the workers are done with it.
+  if (mkdir(dst, (st.st_mode & 07777) | S_IRWXU) < 0 && errno != EEXIST) {
+    dprintf(NOOSH_FD(2), "noosh: cp: %s: %s\n", dst, strerror(errno));
+    return -1;
+  }
+  if (top) {
+    struct stat dst_st;
+    if (stat(dst, &dst_st) == 0) {
+      pool->skip_dev = dst_st.st_dev;
+      pool->skip_ino = dst_st.st_ino;
+    }
+  }
+  if ((st.st_mode & 07777) != ((st.st_mode & 07777) | S_IRWXU)) {
+    struct noosh_cp_job * fix = noosh_cp_job(src, dst, st.st_mode & 07777);
+    fix->next = pool->dirs;
+    pool->dirs = fix;
+  }
+
+  dir = opendir(src);
+  if (dir == NULL) {
+    dprintf(NOOSH_FD(2), "noosh: cp: %s: %s\n", src, strerror(errno));
+    return -1;
+  }
+  while ((ent = readdir(dir)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    s.len = d.len = 0;
+    noosh_buf_append(&s, src, strlen(src));
+    noosh_buf_append(&s, "/", 1);
+    noosh_buf_append(&s, ent->d_name, strlen(ent->d_name));
+    noosh_buf_append(&d, dst, strlen(dst));
+    noosh_buf_append(&d, "/", 1);
+    noosh_buf_append(&d, ent->d_name, strlen(ent->d_name));
+    if (ent->d_type == DT_REG) {
+      // d_type saves a stat per file; the worker fstats what it opens.
+      noosh_cp_queue(pool, s.data, d.data);
+    } else if (noosh_cp_tree(pool, s.data, d.data, 0) < 0) {
+      r = -1;
+    }
+  }
+  closedir(dir);
+  free(s.data);
+  free(d.data);
+  return r;
+}
+
+/*
+    @brief number of cp -r workers: one per CPU, at least 2, at most 8
+*/
+int noosh_cp_nthreads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 2) {
+    return 2;
+  }
+  return n > NOOSH_CP_MAX_THREADS ? NOOSH_CP_MAX_THREADS : (int) n;
+}
+
+/*
+  Stream buffer
+
+  `buffer' sits between two pipeline stages and decouples them: a reader
+  thread keeps draining the producer into a large in-memory ring while the
+  stage thread writes the ring out to the consumer at the consumer's pace.
+  The ring is anonymous memory, on huge pages when the system has them;
+  past the memory limit further data spills into a memfd, which the
+  kernel can page out and whose consumed ranges are punched out again.
+  All data in the ring is older than all data in the spill, so the
+  writer empties the ring first and new data keeps going to the spill
+  until it is empty.
+*/
+
+# define NOOSH_HUGE_PAGE (2 * 1024 * 1024)
+# define NOOSH_BUFFER_IO (1024 * 1024)
+# define NOOSH_BUFFER_MEMLIMIT (64UL * 1024 * 1024)
+
+struct noosh_buffer {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  int in;
+  int out;
+  int err;
+  int wake;
+  char * ring;
+  size_t ring_cap;
+  size_t ring_head;
+  size_t ring_used;
+  int huge;
+  int spill;
+  size_t spill_cap;
+  off_t spill_r;
+  off_t spill_w;
+  off_t spill_freed;
+  size_t spill_len;
+  int eof;
+  int dead;
+  // Statistics, read without the lock by the SIGUSR1 handler.
+  size_t size;
+  size_t peak;
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+  unsigned long long spilled;
+  unsigned long long full_ns;
+  unsigned long long empty_ns;
+  struct timespec start;
+  struct noosh_buffer * next;
+};
+
+/*
+  buffers of the pipelines currently running, for SIGUSR1
+*/
+struct noosh_buffer * noosh_buffers = NULL;
+pthread_mutex_t noosh_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+int noosh_buffers_walkers = 0;
+
+/*
+    @brief parse a size such as 4096, 64K, 512M or 2G
+    @param s: the string
+    @param size: receives the size in bytes
+    @return 0 on success, -1 if s is not a size
+*/
+int noosh_parse_size(const char * s, size_t * size) {
+  char * end;
+  unsigned long long v = strtoull(s, &end, 10);
+
+  if (end == s) {
+    return -1;
+  }
+  switch (toupper((unsigned char) *end)) {
+  case 'G':
+    v <<= 10;
+    // fall through
+  case 'M':
+    v <<= 10;
+    // fall through
+  case 'K':
+    v <<= 10;
+    end++;
+    break;
+  }
+  if (*end != '\0' && !((end[0] == 'B' || end[0] == 'b') && end[1] == '\0')) {
+    return -1;
+  }
+  *size = v;
+  return 0;
+}
+
+/*
+    @brief monotonic time in nanoseconds
+*/
+unsigned long long noosh_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+    @brief allocate the ring, preferring huge pages
+    @return 0 on success, -1 on error
+*/
+int noosh_buffer_alloc(struct noosh_buffer * b) {
+  size_t cap = (b->ring_cap + NOOSH_HUGE_PAGE - 1) & ~(size_t) (NOOSH_HUGE_PAGE - 1);
+
+  b->ring = mmap(NULL, cap, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (b->ring != MAP_FAILED) {
+    b->huge = 1;
+    b->ring_cap = cap;
+    return 0;
+  }
+  b->ring = mmap(NULL, b->ring_cap, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (b->ring == MAP_FAILED) {
+    return -1;
+  }
+  // Transparent huge pages, where the kernel allows them for this range.
+  b->huge = madvise(b->ring, b->ring_cap, MADV_HUGEPAGE) == 0 ? 2 : 0;
+  return 0;
+}
+
+/*
+    @brief wait until the input is readable or the writer has gone away
+    @return 1 if readable, 0 if the buffer should stop
+*/
+int noosh_buffer_poll_in(struct noosh_buffer * b) {
+  struct pollfd fds[2] = {{b->in, POLLIN, 0}, {b->wake, POLLIN, 0}};
+
+  while (poll(fds, 2, -1) < 0) {
+    if (errno != EINTR) {
+      return 0;
+    }
+  }
+  return !(fds[1].revents & POLLIN);
+}
+
+/*
+    @brief reader thread: move input into the ring or the spill
+    @param arg: the struct noosh_buffer
+    @return NULL
+*/
+void * noosh_buffer_reader(void * arg) {
+  struct noosh_buffer * b = arg;
+  char * tmp = NULL;
+  size_t room, used, tail;
+  unsigned long long t;
+  ssize_t n;
+  int to_ring;
+  off_t off;
+
+  while (1) {
+    pthread_mutex_lock(&b->lock);
+    t = 0;
+    while (!b->dead && !(b->spill_len == 0 && b->ring_used < b->ring_cap) &&
+           b->spill_len >= b->spill_cap) {
+      if (t == 0) {
+        t = noosh_now_ns();
+      }
+      pthread_cond_wait(&b->not_full, &b->lock);
+    }
+    if (t != 0) {
+      b->full_ns += noosh_now_ns() - t;
+    }
+    if (b->dead) {
+      pthread_mutex_unlock(&b->lock);
+      break;
+    }
+    to_ring = b->spill_len == 0 && b->ring_used < b->ring_cap;
+    tail = (b->ring_head + b->ring_used) % b->ring_cap;
+    if (to_ring) {
+      room = b->ring_used == 0 || tail >= b->ring_head ? b->ring_cap - tail : b->ring_head - tail;
+      if (b->ring_used == 0) {
+        // Empty: restart at the beginning for the longest contiguous room.
+        b->ring_head = tail = 0;
+        room = b->ring_cap;
+      }
+    } else {
+      room = b->spill_cap - b->spill_len;
+    }
+    off = b->spill_w;
+    pthread_mutex_unlock(&b->lock);
+
+    if (room > NOOSH_BUFFER_IO) {
+      room = NOOSH_BUFFER_IO;
+    }
+    if (!noosh_buffer_poll_in(b)) {
+      break;
+    }
+    if (to_ring) {
+      n = noosh_read_fd(b->in, b->ring + tail, room);
+    } else {
+      n = splice(b->in, NULL, b->spill, &off, room, SPLICE_F_MOVE);
+      if (n < 0 && errno == EINVAL) {
+        // Not a pipe: go through a buffer.
+        if (tmp == NULL) {
+          tmp = noosh_malloc(NOOSH_BUFFER_IO);
+        }
+        n = noosh_read_fd(b->in, tmp, room);
+        if (n > 0 && pwrite(b->spill, tmp, n, off) != n) {
+          n = -1;
+        }
+      }
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    pthread_mutex_lock(&b->lock);
+    if (n <= 0) {
+      if (n < 0) {
+        dprintf(b->err, "noosh: buffer: %s\n", strerror(errno));
+      }
+      b->eof = 1;
+      pthread_cond_signal(&b->not_empty);
+      pthread_mutex_unlock(&b->lock);
+      break;
+    }
+    if (to_ring) {
+      b->ring_used += n;
+    } else {
+      b->spill_w += n;
+      b->spill_len += n;
+      b->spilled += n;
+    }
+    b->bytes_in += n;
+    used = b->ring_used + b->spill_len;
+    if (used > b->peak) {
+      b->peak = used;
+    }
+    pthread_cond_signal(&b->not_empty);
+    pthread_mutex_unlock(&b->lock);
+  }
+  free(tmp);
+  return NULL;
+}
+
+/*
+    @brief writer side, run on the stage's thread: drain ring then spill
+    @return 0 on success, -1 if the output failed
+*/
+int noosh_buffer_writer(struct noosh_buffer * b) {
+  char * tmp = NULL;
+  size_t len, head;
+  unsigned long long t;
+  int from_ring;
+  ssize_t n;
+  off_t off;
+
+  while (1) {
+    pthread_mutex_lock(&b->lock);
+    t = 0;
+    while (b->ring_used == 0 && b->spill_len == 0 && !b->eof) {
+      if (t == 0) {
+        t = noosh_now_ns();
+      }
+      pthread_cond_wait(&b->not_empty, &b->lock);
+    }
+    if (t != 0) {
+      b->empty_ns += noosh_now_ns() - t;
+    }
+    if (b->ring_used == 0 && b->spill_len == 0) {
+      pthread_mutex_unlock(&b->lock);
+      free(tmp);
+      return 0;
+    }
+    from_ring = b->ring_used > 0;
+    head = b->ring_head;
+    if (from_ring) {
+      len = b->ring_cap - head < b->ring_used ? b->ring_cap - head : b->ring_used;
+    } else {
+      len = b->spill_len;
+    }
+    off = b->spill_r;
+    pthread_mutex_unlock(&b->lock);
+
+    if (len > NOOSH_BUFFER_IO) {
+      len = NOOSH_BUFFER_IO;
+    }
+    if (from_ring) {
+      n = write(b->out, b->ring + head, len);
+    } else {
+      n = sendfile(b->out, b->spill, &off, len);
+      if (n < 0 && errno == EINVAL) {
+        if (tmp == NULL) {
+          tmp = noosh_malloc(NOOSH_BUFFER_IO);
+        }
+        n = pread(b->spill, tmp, len, off);
+        if (n > 0) {
+          n = write(b->out, tmp, n);
+        }
+      }
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      free(tmp);
+      return -1;
+    }
+
+    pthread_mutex_lock(&b->lock);
+    if (from_ring) {
+      b->ring_head = (b->ring_head + n) % b->ring_cap;
+      b->ring_used -= n;
+    } else {
+      b->spill_r += n;
+      b->spill_len -= n;
+      // Hand whole consumed chunks of the spill back to the kernel. Partial
+      // pages are left alone: punching them zeroes pages that sendfile may
+      // still have queued in the output pipe.
+      off = b->spill_r & ~(off_t) (NOOSH_BUFFER_IO - 1);
+      if (off > b->spill_freed) {
+        fallocate(b->spill, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  b->spill_freed, off - b->spill_freed);
+        b->spill_freed = off;
+      }
+    }
+    b->bytes_out += n;
+    pthread_cond_signal(&b->not_full);
+    pthread_mutex_unlock(&b->lock);
+  }
+}
+
+/*
+    @brief format an unsigned number, async-signal-safe
+    @param dst: at least 21 bytes
+    @return number of characters written
+*/
+int noosh_fmt_ull(char * dst, unsigned long long v) {
+  char tmp[21];
+  int n = 0, i;
+
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  for (i = 0; i < n; i++) {
+    dst[i] = tmp[n - 1 - i];
+  }
+  return n;
+}
+
+/*
+    @brief append a string and return the new end, async-signal-safe
+*/
+char * noosh_fmt_str(char * p, const char * s) {
+  while (*s) {
+    *p++ = *s++;
+  }
+  return p;
+}
+
+/*
+    @brief write one line of buffer statistics to fd, async-signal-safe
+*/
+void noosh_buffer_report(struct noosh_buffer * b, int fd) {
+  char line[512], * p = line;
+  size_t used = b->ring_used + b->spill_len;
+
+  p = noosh_fmt_str(p, "noosh: buffer: ");
+  p += noosh_fmt_ull(p, used);
+  p = noosh_fmt_str(p, "/");
+  p += noosh_fmt_ull(p, b->size);
+  p = noosh_fmt_str(p, " bytes (");
+  p += noosh_fmt_ull(p, b->size ? (unsigned long long) used * 100 / b->size : 0);
+  p = noosh_fmt_str(p, "%), ");
+  p += noosh_fmt_ull(p, b->spill_len);
+  p = noosh_fmt_str(p, " spilled, peak ");
+  p += noosh_fmt_ull(p, b->peak);
+  p = noosh_fmt_str(p, ", in ");
+  p += noosh_fmt_ull(p, b->bytes_in);
+  p = noosh_fmt_str(p, " out ");
+  p += noosh_fmt_ull(p, b->bytes_out);
+  p = noosh_fmt_str(p, ", full ");
+  p += noosh_fmt_ull(p, b->full_ns / 1000000);
+  p = noosh_fmt_str(p, "ms empty ");
+  p += noosh_fmt_ull(p, b->empty_ns / 1000000);
+  p = noosh_fmt_str(p, b->huge == 1 ? "ms, hugetlb ring\n" :
+                       b->huge == 2 ? "ms, thp ring\n" : "ms\n");
+  (void) !write(fd, line, p - line);
+}
+
+/*
+    @brief SIGUSR1 handler: report the fill level of every running buffer
+*/
+void noosh_buffer_sigusr1(int sig) {
+  struct noosh_buffer * b;
+  int saved = errno;
+
+  __atomic_add_fetch(&noosh_buffers_walkers, 1, __ATOMIC_ACQUIRE);
+  for (b = __atomic_load_n(&noosh_buffers, __ATOMIC_ACQUIRE); b; b = b->next) {
+    noosh_buffer_report(b, STDERR_FILENO);
+  }
+  __atomic_sub_fetch(&noosh_buffers_walkers, 1, __ATOMIC_RELEASE);
+  errno = saved;
+}
+
+/*
+    @brief add or remove a buffer from the SIGUSR1 list
+*/
+void noosh_buffer_register(struct noosh_buffer * b, int add) {
+  struct noosh_buffer ** pp;
+  sigset_t block, saved;
+
+  sigemptyset(&block);
+  sigaddset(&block, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &block, &saved);
+  pthread_mutex_lock(&noosh_buffers_lock);
+  if (add) {
+    b->next = noosh_buffers;
+    __atomic_store_n(&noosh_buffers, b, __ATOMIC_RELEASE);
+  } else {
+    for (pp = &noosh_buffers; *pp; pp = &(*pp)->next) {
+      if (*pp == b) {
+        __atomic_store_n(pp, b->next, __ATOMIC_RELEASE);
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&noosh_buffers_lock);
+  // A handler on another thread may still be looking at a removed buffer.
+  while (!add && __atomic_load_n(&noosh_buffers_walkers, __ATOMIC_ACQUIRE) > 0) {
+    sched_yield();
+  }
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+/*
+  Execution state
+*/
+
+/*
+  exit status of the last command, $?
+*/
+int noosh_last_status = 0;
+
+/*
+  pending `break n' and `continue n' levels, a pending `return' and a
+  pending `exit', which unwind the commands being executed up to the
+  enclosing loop, function, or the top; per thread, so that a builtin
+  stage cannot end the shell's loops
+*/
+__thread int noosh_breaking = 0;
+__thread int noosh_continuing = 0;
+__thread int noosh_returning = 0;
+__thread int noosh_exit_pending = 0;
+__thread int noosh_loop_depth = 0;
+__thread int noosh_func_depth = 0;
+__thread int noosh_source_depth = 0;
+int noosh_exit_code = 0;
+
+/*
+  set when commands are read from a terminal: errors that end a script,
+  such as ${name?word} on an unset name, only end the command there
+*/
+int noosh_interactive = 0;
+
+# define NOOSH_UNWINDING (noosh_breaking || noosh_continuing || noosh_returning || noosh_exit_pending)
+
+/*
+  $0 and the positional parameters
+*/
+char * noosh_arg0 = "noosh";
+char ** noosh_params = NULL;
+int noosh_nparams = 0;
+
+/*
+  number of processes the shell has forked, and of subshells it ran
+  without forking, shown by `stats'
+*/
+unsigned long noosh_forks = 0;
+unsigned long noosh_inproc = 0;
+
+/*
+  number of command substitutions run: a command of assignments only
+  takes the status of the last one
+*/
+unsigned long noosh_substs = 0;
+
+/*
+    @brief fork the shell, counting the fork
+    @return as fork(2)
+*/
+pid_t noosh_fork(void) {
+  pid_t pid;
+
+  // Anything left in stdio buffers would be written by both processes.
+  fflush(NULL);
+  pid = fork();
+  if (pid > 0) {
+    __atomic_add_fetch(&noosh_forks, 1, __ATOMIC_RELAXED);
+  } else if (pid == 0) {
+    // The stage threads of the shell are not in the copy.
+    noosh_stage_threads = 0;
+  }
+  return pid;
+}
+
+/*
+    @brief turn a forked copy of the shell into a subshell running with
+        the descriptors of io
+    @param io: descriptor table of the subshell
+*/
+void noosh_child_setup(struct noosh_io * io) {
+  noosh_io_apply(io);
+  // Pipe ends of other stages must not be kept open by the subshell.
+  close_range(NOOSH_IO_FDS, ~0U, 0);
+  noosh_peek_pipe[0] = noosh_peek_pipe[1] = -1;
+  noosh_cur_io = &noosh_io_shell;
+  noosh_stage_isolated = 0;
+  signal(SIGPIPE, SIG_DFL);
+}
+
+/*
+    @brief keep the shell's locks consistent across fork, which may
+        happen while a pipeline stage thread holds one
+*/
+void noosh_atfork_prepare(void) {
+  pthread_mutex_lock(&noosh_var_lock);
+}
+
+void noosh_atfork_release(void) {
+  pthread_mutex_unlock(&noosh_var_lock);
+}
+
+/*
+    @brief exit status of a reaped child
+    @param status: wait status
+    @return the exit code, or 128 plus the signal number
+*/
+int noosh_wait_status(int status) {
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+/*
+  Shell options
+*/
+
+/*
+  run the last stage of a pipeline in the shell itself when it is a
+  builtin, so that `... | read var' sets var
+*/
+int noosh_opt_lastpipe = 0;
+
+/*
+  relay every pipe of a pipeline through the shell and report per-stage
+  throughput, stall times and the bottleneck stage when it finishes
+*/
+int noosh_opt_pipestats = 0;
+
+/*
+  compile scripts and functions to bytecode before running them; off,
+  the syntax tree is walked instead
+*/
+int noosh_opt_bytecode = 1;
+
+/*
+  run ( ... ) subshells and $(...) substitutions in a forked copy of the
+  shell; off, they run in the shell process and their changes are undone
+*/
+int noosh_opt_forksubshells = 0;
+
+/*
+  leave unquoted *, ? and [...] in words as they are instead of
+  expanding them to the matching paths
+*/
+int noosh_opt_noglob = 0;
+
+/*
+  sort the paths a pattern expands to by byte value; off, they come in
+  the order directories list them
+*/
+int noosh_opt_globsort = 1;
+
+/*
+  keep the metadata of paths that tests, globs and the command search
+  look up, dropping it when inotify reports a change
+*/
+int noosh_opt_statcache = 0;
+
+/*
+  color the line being edited by what its parts are, command names by
+  whether they are found
+*/
+int noosh_opt_highlight = 1;
+
+/*
+  options known to `set -o', followed by their flags
+*/
+char * option_str[] = {
+  "lastpipe",
+  "pipestats",
+  "bytecode",
+  "forksubshells",
+  "noglob",
+  "globsort",
+  "statcache",
+  "highlight"
+};
+
+int * option_flag[] = {
+  &noosh_opt_lastpipe,
+  &noosh_opt_pipestats,
+  &noosh_opt_bytecode,
+  &noosh_opt_forksubshells,
+  &noosh_opt_noglob,
+  &noosh_opt_globsort,
+  &noosh_opt_statcache,
+  &noosh_opt_highlight
+};
+
+int noosh_num_options() {
+  return sizeof(option_str) / sizeof(char * );
+}
+
+/*
+    function declarations for builtin shell commands:
+*/
+int noosh_cd(char ** args);
+int noosh_pwd(char ** args);
+int noosh_help(char ** args);
+int noosh_exit(char ** args);
+int noosh_read(char ** args);
+int noosh_mapfile(char ** args);
+int noosh_cat(char ** args);
+int noosh_cp(char ** args);
+int noosh_tee(char ** args);
+int noosh_set(char ** args);
+int noosh_buffer(char ** args);
+int noosh_true(char ** args);
+int noosh_false(char ** args);
+int noosh_echo(char ** args);
+int noosh_break(char ** args);
+int noosh_return(char ** args);
+int noosh_source(char ** args);
+int noosh_eval(char ** args);
+int noosh_autoload(char ** args);
+int noosh_let(char ** args);
+int noosh_declare(char ** args);
+int noosh_export(char ** args);
+int noosh_readonly(char ** args);
+int noosh_local(char ** args);
+int noosh_unset(char ** args);
+int noosh_stats(char ** args);
+
+/*
+    in-process subshells, for cd
+*/
+void noosh_subshell_cwd(void);
+
+/*
+    external launcher, for builtins that leave some options to the system
+*/
+int noosh_launch(char ** args);
+
+/*
+    script runners, for source and eval
+*/
+int noosh_run_file(const char * path);
+int noosh_run_cached(const char * text, size_t len);
+void noosh_line_stats(int out, int reset);
+void noosh_regex_stats(int out, int reset);
+void noosh_ed_stats(int out, int reset);
+void noosh_hl_stats(int out, int reset);
+
+/*
+    stat cache, for source, cd, stats and the command search
+*/
+extern unsigned long noosh_stat_cwd;
+int noosh_stat(const char * path, struct stat * st, int follow);
+char * noosh_path_find(const char * name);
+void noosh_stat_stats(int out, int reset);
+
+/*
+    character widths, for the edit buffer
+*/
+int noosh_wcwidth(unsigned int c);
+size_t noosh_utf8_decode(const char * s, size_t len, unsigned int * c);
+
+/*
+    function table and NOOSHFPATH index, for autoload
+*/
+struct noosh_func * noosh_find_func(const char * name);
+int noosh_define_func(const char * name, const char * text);
+int noosh_autoload_list(int out);
+
+/*
+    arithmetic, for let
+*/
+int noosh_arith_text(const char * s, size_t len, long long * out);
+
+/*
+    arrays and assignments, for declare and unset
+*/
+const char * noosh_var_next(struct noosh_var * v, size_t * pos, int keys, char * tmp);
+size_t noosh_name_len(const char * s, size_t len);
+size_t noosh_subscript(const char * s, size_t len, const char ** sub, size_t * sublen);
+int noosh_is_assignment_text(const char * s);
+int noosh_assign_text(const char * s);
+
+/*
+    list of builtin commands, followed by their corresponding functions.
+*/
+char * builtin_str[] = {
+  "cd",
+  "pwd",
+  "help",
+  "exit",
+  "read",
+  "mapfile",
+  "readarray",
+  "cat",
+  "cp",
+  "tee",
+  "set",
+  "buffer",
+  ":",
+  "true",
+  "false",
+  "echo",
+  "break",
+  "continue",
+  "return",
+  "source",
+  ".",
+  "eval",
+  "autoload",
+  "let",
+  "declare",
+  "typeset",
+  "export",
+  "readonly",
+  "local",
+  "unset",
+  "stats"
+};
+
+int( * builtin_func[])(char ** ) = {
+  &
+  noosh_cd,
+  &
+  noosh_pwd,
+  &
+  noosh_help,
+  &
+  noosh_exit,
+  &
+  noosh_read,
+  &
+  noosh_mapfile,
+  &
+  noosh_mapfile,
+  &
+  noosh_cat,
+  &
+  noosh_cp,
+  &
+  noosh_tee,
+  &
+  noosh_set,
+  &
+  noosh_buffer,
+  &
+  noosh_true,
+  &
+  noosh_true,
+  &
+  noosh_false,
+  &
+  noosh_echo,
+  &
+  noosh_break,
+  &
+  noosh_break,
+  &
+  noosh_return,
+  &
+  noosh_source,
+  &
+  noosh_source,
+  &
+  noosh_eval,
+  &
+  noosh_autoload,
+  &
+  noosh_let,
+  &
+  noosh_declare,
+  &
+  noosh_declare,
+  &
+  noosh_export,
+  &
+  noosh_readonly,
+  &
+  noosh_local,
+  &
+  noosh_unset,
+  &
+  noosh_stats
+};
+
+int noosh_num_builtins() {
+  return sizeof(builtin_str) / sizeof(char * );
+}
+
+/*
+    builtin function implementations
+*/
+
+/*
+    @brief builtin command: change director.
+    @param args: list of args
+        args[0] is  cd, args[1] is the directory, or - for $OLDPWD;
+        PWD and OLDPWD are set to the new and the old directory
+    @return 0 on success, 1 on error
+*/
+int noosh_cd(char ** args) {
+  struct stat st;
+  char * dir, * old, * cwd;
+  int status = 0;
+
+  if (args[1] == NULL) {
+    fprintf(stderr, "noosh: expected argument to \"cd\"\n");
+    return 1;
+  }
+  if (strcmp(args[1], "-") != 0) {
+    dir = noosh_strdup(args[1]);
+  } else if (noosh_getvar("OLDPWD") != NULL) {
+    dir = noosh_strdup(noosh_getvar("OLDPWD"));
+  } else {
+    fprintf(stderr, "noosh: cd: OLDPWD not set\n");
+    return 1;
+  }
+  if (noosh_stage_isolated && !noosh_stage_own_cwd) {
+    // The working directory is shared with the shell: only check it.
+    if (stat(dir, &st) != 0 || (!S_ISDIR(st.st_mode) && (errno = ENOTDIR)) ||
+        access(dir, X_OK) != 0) {
+      perror("noosh");
+      status = 1;
+    }
+  } else {
+    noosh_subshell_cwd();
+    old = getcwd(NULL, 0);
+    if (chdir(dir) != 0) {
+      perror("noosh");
+      status = 1;
+    } else if ((cwd = getcwd(NULL, 0)) != NULL) {
+      // Children are given the directory they start in, not the one
+      // the shell was started in.
+      if (old) {
+        noosh_setvar("OLDPWD", old);
+      }
+      noosh_setvar("PWD", cwd);
+      if (strcmp(args[1], "-") == 0) {
+        dprintf(NOOSH_FD(1), "%s\n", cwd);
+      }
+      free(cwd);
+    }
+    free(old);
+    noosh_stat_cwd++;
+  }
+  free(dir);
+  return status;
+}
+
+/*
+    @brief builtin command: print working directory
+    @param args: list of args, not examined
+    @return 0
+*/
+int noosh_pwd(char ** args) {
+  char * cwd = get_cwd(NULL);
+  dprintf(NOOSH_FD(1), "%s\n", cwd);
+  free(cwd);
+  return 0;
+}
+
+/*
+    @brief builtin command: print help info
+    @param args: list of args, not examined
+    @return 0
+*/
+int noosh_help(char ** args) {
+  int i;
+  int out = NOOSH_FD(1);
+  dprintf(out, "noosh\n");
+  dprintf(out, "Type program names and arguments, and hit enter.\n");
+  dprintf(out, "The following are built in:\n");
+
+  for (i = 0; i < noosh_num_builtins(); i++) {
+    dprintf(out, "  %s\n", builtin_str[i]);
+  }
+
+  dprintf(out, "Use the man command for information on other programs.\n");
+  return 0;
+}
+
+/*
+    @brief builtin command: exit
+    @param args: list of args
+        exit [n], n defaults to the status of the last command
+    @return the exit status; the shell unwinds and exits
+*/
+int noosh_exit(char ** args) {
+  noosh_exit_code = args[1] ? atoi(args[1]) & 0xff : noosh_last_status;
+  noosh_exit_pending = 1;
+  return noosh_exit_code;
+}
+
+/*
+    @brief builtin command: do nothing, successfully (`:' and `true')
+    @param args: list of args, not examined
+    @return 0
+*/
+int noosh_true(char ** args) {
+  return 0;
+}
+
+/*
+    @brief builtin command: do nothing, unsuccessfully
+    @param args: list of args, not examined
+    @return 1
+*/
+int noosh_false(char ** args) {
+  return 1;
+}
+
+/*
+    @brief builtin command: write arguments to standard output
+    @param args: list of args
+        echo [-n] [arg ...], -n leaves out the trailing newline
+    @return 0, or 1 if the output failed
+*/
+int noosh_echo(char ** args) {
+  struct noosh_buf out = {0};
+  int i = 1, newline = 1, r;
+
+  if (args[1] && strcmp(args[1], "-n") == 0) {
+    newline = 0;
+    i++;
+  }
+  for (; args[i] != NULL; i++) {
+    noosh_buf_append(&out, args[i], strlen(args[i]));
+    if (args[i + 1] != NULL) {
+      noosh_buf_append(&out, " ", 1);
+    }
+  }
+  if (newline) {
+    noosh_buf_append(&out, "\n", 1);
+  }
+  r = out.len > 0 && noosh_write_all(NOOSH_FD(1), out.data, out.len) < 0;
+  free(out.data);
+  return r;
+}
+
+/*
+    @brief builtin command: leave or restart enclosing loops
+    @param args: list of args
+        break [n] and continue [n], n loops up (default 1)
+    @return 0, or 1 if n is not a positive number
+*/
+int noosh_break(char ** args) {
+  int n = args[1] ? atoi(args[1]) : 1;
+
+  if (n <= 0) {
+    dprintf(NOOSH_FD(2), "noosh: %s: %s: loop count out of range\n", args[0], args[1]);
+    return 1;
+  }
+  if (noosh_loop_depth == 0) {
+    dprintf(NOOSH_FD(2), "noosh: %s: only meaningful in a loop\n", args[0]);
+    return 0;
+  }
+  if (n > noosh_loop_depth) {
+    n = noosh_loop_depth;
+  }
+  if (args[0][0] == 'b') {
+    noosh_breaking = n;
+  } else {
+    noosh_continuing = n;
+  }
+  return 0;
+}
+
+/*
+    @brief builtin command: leave the function or sourced script being run
+    @param args: list of args
+        return [n], n defaults to the status of the last command
+    @return n; the function or script unwinds and returns it
+*/
+int noosh_return(char ** args) {
+  if (noosh_func_depth == 0 && noosh_source_depth == 0) {
+    dprintf(NOOSH_FD(2), "noosh: return: can only `return' from a function or sourced script\n");
+    return 1;
+  }
+  noosh_returning = 1;
+  return args[1] ? atoi(args[1]) & 0xff : noosh_last_status;
+}
+
+/*
+    @brief find the file source reads: a name without a slash is looked
+        up in PATH, then in the current directory
+    @param name: the name given
+    @return allocated path, NULL if there is no such file
+*/
+char * noosh_source_path(const char * name) {
+  const char * dirs = noosh_getvar("PATH"), * end;
+  struct stat st;
+  char * path;
+  size_t len;
+
+  if (strchr(name, '/') == NULL && dirs != NULL) {
+    for (; *dirs; dirs = *end ? end + 1 : end) {
+      end = strchrnul(dirs, ':');
+      len = end - dirs;
+      path = noosh_malloc(len + strlen(name) + 2);
+      sprintf(path, "%.*s%s%s", (int) len, dirs, len ? "/" : "", name);
+      if (noosh_stat(path, &st, 1) == 0 && S_ISREG(st.st_mode) && access(path, R_OK) == 0) {
+        return path;
+      }
+      free(path);
+    }
+  }
+  return access(name, R_OK) == 0 ? noosh_strdup(name) : NULL;
+}
+
+/*
+    @brief builtin command: run a script in the shell itself (`source'
+        and `.')
+    @param args: list of args
+        source file [arg ...], the args becoming the positional
+        parameters while it runs
+    @return exit status of the script's last command, 1 if it is not
+        found, 2 on a usage error
+*/
+int noosh_source(char ** args) {
+  char ** params = noosh_params, * path;
+  int nparams = noosh_nparams, status;
+
+  if (args[1] == NULL) {
+    dprintf(NOOSH_FD(2), "noosh: %s: usage: %s file [arg ...]\n", args[0], args[0]);
+    return 2;
+  }
+  if ((path = noosh_source_path(args[1])) == NULL) {
+    dprintf(NOOSH_FD(2), "noosh: %s: %s: not found\n", args[0], args[1]);
+    return 1;
+  }
+  if (args[2]) {
+    noosh_params = args + 2;
+    for (noosh_nparams = 0; args[noosh_nparams + 2]; noosh_nparams++);
+  }
+  noosh_source_depth++;
+  status = noosh_run_file(path);
+  noosh_source_depth--;
+  noosh_returning = 0;
+  noosh_params = params;
+  noosh_nparams = nparams;
+  free(path);
+  return status;
+}
+
+/*
+    @brief builtin command: run its args, joined by spaces, as commands
+    @param args: list of args
+        eval [arg ...]
+    @return exit status of the last command run, 0 if there is none
+*/
+int noosh_eval(char ** args) {
+  struct noosh_buf text = {0};
+  int i, status;
+
+  for (i = 1; args[i]; i++) {
+    if (i > 1) {
+      noosh_buf_append(&text, " ", 1);
+    }
+    noosh_buf_append(&text, args[i], strlen(args[i]));
+  }
+  if (text.len == 0) {
+    free(text.data);
+    return 0;
+  }
+  status = noosh_run_cached(text.data, text.len);
+  free(text.data);
+  return status;
+}
+
+/*
+    @brief builtin command: show shell counters
+    @param args: list of args
+        stats [-r], -r resets the counters after showing them
+    @return 0
+*/
+int noosh_stats(char ** args) {
+  int out = NOOSH_FD(1), reset = args[1] && strcmp(args[1], "-r") == 0;
+
+  dprintf(out, "forks %lu in-process subshells %lu\n", __atomic_load_n(&noosh_forks, __ATOMIC_RELAXED),
+          __atomic_load_n(&noosh_inproc, __ATOMIC_RELAXED));
+  pthread_mutex_lock(&noosh_var_lock);
+  dprintf(out, "variables %zu environment builds %lu\n", noosh_vars.n, noosh_envp_builds);
+  if (reset) {
+    __atomic_store_n(&noosh_forks, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&noosh_inproc, 0, __ATOMIC_RELAXED);
+    noosh_envp_builds = 0;
+  }
+  pthread_mutex_unlock(&noosh_var_lock);
+  noosh_line_stats(out, reset);
+  noosh_regex_stats(out, reset);
+  noosh_stat_stats(out, reset);
+  noosh_ed_stats(out, reset);
+  noosh_hl_stats(out, reset);
+  return 0;
+}
+
+/*
+  option scanner state for builtins
+*/
+struct noosh_opts {
+  char ** args;
+  int ind;
+  int pos;
+  char * arg;
+};
+
+/*
+    @brief scan the next option of a builtin, getopt style
+    @param o: scanner state, ind starts at 1
+    @param spec: option letters, a letter followed by ':' takes a value
+    @return option letter, 0 once options end (o->ind is then the first
+        operand), or '?' after printing an error
+*/
+int noosh_getopt(struct noosh_opts * o, const char * spec) {
+  char * cur = o->args[o->ind];
+  const char * s;
+  char c;
+
+  if (o->pos == 0) {
+    if (cur == NULL || cur[0] != '-' || cur[1] == '\0') {
+      return 0;
+    }
+    if (strcmp(cur, "--") == 0) {
+      o->ind++;
+      return 0;
+    }
+    o->pos = 1;
+  }
+
+  c = cur[o->pos++];
+  s = strchr(spec, c);
+  if (c == ':' || s == NULL) {
+    dprintf(NOOSH_FD(2), "noosh: %s: -%c: invalid option\n", o->args[0], c);
+    return '?';
+  }
+  if (s[1] == ':') {
+    if (cur[o->pos] != '\0') {
+      o->arg = cur + o->pos;
+    } else if (o->args[o->ind + 1] != NULL) {
+      o->arg = o->args[++o->ind];
+    } else {
+      dprintf(NOOSH_FD(2), "noosh: %s: -%c: option requires an argument\n", o->args[0], c);
+      return '?';
+    }
+    o->ind++;
+    o->pos = 0;
+  } else if (cur[o->pos] == '\0') {
+    o->ind++;
+    o->pos = 0;
+  }
+  return c;
+}
+
+/*
+    @brief parse a descriptor number given to -u
+    @return the real descriptor, or -1 after printing an error
+*/
+int noosh_opt_fd(const char * cmd, const char * arg) {
+  if (isdigit((unsigned char) arg[0]) && arg[1] == '\0' && NOOSH_FD(arg[0] - '0') >= 0) {
+    return NOOSH_FD(arg[0] - '0');
+  }
+  dprintf(NOOSH_FD(2), "noosh: %s: %s: invalid file descriptor\n", cmd, arg);
+  return -1;
+}
+
+/*
+    @brief check whether c is IFS whitespace
+*/
+int noosh_ifs_space(char c, const char * ifs) {
+  return (c == ' ' || c == '\t' || c == '\n') && strchr(ifs, c) != NULL;
+}
+
+/*
+    @brief split a line read by `read` into variables
+    @param names: null terminated variable names, the last takes the rest
+    @param s: the line
+    @param len: length of the line
+    @param raw: nonzero if backslashes are not escapes
+    @param split: zero to assign the whole line unsplit (REPLY)
+*/
+void noosh_read_assign(char ** names, const char * s, size_t len, int raw, int split) {
+  const char * ifs = noosh_getvar("IFS");
+  char * field = noosh_malloc(len + 1);
+  size_t pos = 0, n, keep;
+  int k, last;
+
+  if (ifs == NULL) {
+    ifs = " \t\n";
+  }
+  if (!split) {
+    ifs = "";
+  }
+
+  while (pos < len && noosh_ifs_space(s[pos], ifs)) {
+    pos++;
+  }
+
+  for (k = 0; names[k] != NULL; k++) {
+    last = names[k + 1] == NULL;
+    n = keep = 0;
+    while (pos < len) {
+      char c = s[pos];
+      if (!raw && c == '\\' && pos + 1 < len) {
+        field[n++] = s[pos + 1];
+        pos += 2;
+        keep = n;
+        continue;
+      }
+      if (!last && c != '\0' && strchr(ifs, c) != NULL) {
+        break;
+      }
+      field[n++] = c;
+      pos++;
+      if (!noosh_ifs_space(c, ifs)) {
+        keep = n;
+      }
+    }
+    if (!last) {
+      // Skip the separator: whitespace around at most one other IFS char.
+      while (pos < len && noosh_ifs_space(s[pos], ifs)) {
+        pos++;
+      }
+      if (pos < len && s[pos] != '\0' && strchr(ifs, s[pos]) != NULL) {
+        pos++;
+        while (pos < len && noosh_ifs_space(s[pos], ifs)) {
+          pos++;
+        }
+      }
+    } else if (split) {
+      n = keep;
+    }
+    field[n] = '\0';
+    noosh_setvar(names[k], field);
+  }
+  free(field);
+}
+
+/*
+    @brief builtin command: read a record into variables
+    @param args: list of args
+        read [-r] [-d delim] [-u fd] [name ...]
+        fields are split on IFS, the last name gets the rest of the line;
+        with no names the whole line goes to REPLY
+    @return 0 if a record was read, 1 at end of input or on error
+*/
+int noosh_read(char ** args) {
+  struct noosh_opts o = {args, 1, 0, NULL};
+  struct noosh_buf line = {0};
+  char * reply[] = {"REPLY", NULL};
+  int raw = 0, delim = '\n', fd = NOOSH_FD(0);
+  size_t bs;
+  int c, r;
+
+  while ((c = noosh_getopt(&o, "rd:u:")) != 0) {
+    switch (c) {
+    case 'r':
+      raw = 1;
+      break;
+    case 'd':
+      delim = (unsigned char) o.arg[0];
+      break;
+    case 'u':
+      if ((fd = noosh_opt_fd(args[0], o.arg)) < 0) {
+        return 2;
+      }
+      break;
+    default:
+      return 2;
+    }
+  }
+
+  while ((r = noosh_read_record(fd, delim, &line)) == 1 && !raw) {
+    // A trailing unescaped backslash continues the record.
+    for (bs = 0; bs < line.len && line.data[line.len - bs - 1] == '\\'; bs++);
+    if (bs % 2 == 0) {
+      break;
+    }
+    line.data[--line.len] = '\0';
+  }
+  if (r < 0) {
+    dprintf(NOOSH_FD(2), "noosh: read: %s\n", strerror(errno));
+  }
+
+  if (args[o.ind] == NULL) {
+    noosh_read_assign(reply, line.data, line.len, raw, 0);
+  } else {
+    noosh_read_assign(&args[o.ind], line.data, line.len, raw, 1);
+  }
+  free(line.data);
+  return r == 1 ? 0 : 1;
+}
+
+/*
+    @brief slurp the rest of a non-mappable descriptor
+    @param fd: descriptor to read until end of input
+    @param buf: buffer the data is appended to
+    @return 0 on success, -1 on error
+*/
+int noosh_slurp(int fd, struct noosh_buf * buf) {
+  ssize_t n;
+
+  while (1) {
+    noosh_buf_reserve(buf, 64 * 1024);
+    n = noosh_read_fd(fd, buf->data + buf->len, buf->cap - buf->len - 1);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      buf->data[buf->len] = '\0';
+      return 0;
+    }
+    buf->len += n;
+  }
+}
+
+/*
+    @brief builtin command: read records into an indexed array
+    @param args: list of args
+        mapfile [-t] [-d delim] [-n count] [-s skip] [-u fd] [array]
+        readarray is a synonym; the array defaults to MAPFILE
+        regular files are mapped once and split in a single pass
+    @return 0 on success, 2 on a usage error
+*/
+int noosh_mapfile(char ** args) {
+  struct noosh_opts o = {args, 1, 0, NULL};
+  struct noosh_buf block = {0}, data = {0};
+  const char * name = "MAPFILE";
+  const char * p, * end, * nl;
+  size_t * offs = NULL, nitems = 0, cap = 0, i;
+  long count = 0, skip = 0;
+  int trim = 0, delim = '\n', fd = NOOSH_FD(0);
+  struct stat st;
+  char ** items;
+  char * base = NULL;
+  off_t off;
+  int c, r;
+
+  while ((c = noosh_getopt(&o, "td:n:s:u:")) != 0) {
+    switch (c) {
+    case 't':
+      trim = 1;
+      break;
+    case 'd':
+      delim = (unsigned char) o.arg[0];
+      break;
+    case 'n':
+      count = atol(o.arg);
+      break;
+    case 's':
+      skip = atol(o.arg);
+      break;
+    case 'u':
+      if ((fd = noosh_opt_fd(args[0], o.arg)) < 0) {
+        return 2;
+      }
+      break;
+    default:
+      return 2;
+    }
+  }
+  if (args[o.ind] != NULL) {
+    name = args[o.ind];
+  }
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      (off = lseek(fd, 0, SEEK_CUR)) >= 0) {
+    pthread_mutex_lock(&noosh_map_lock);
+    base = noosh_map_file(fd, &st);
+    if (base == NULL) {
+      pthread_mutex_unlock(&noosh_map_lock);
+    }
+  }
+
+  if (base != NULL) {
+    noosh_map_read(base, st.st_size);
+    p = base + (off < st.st_size ? off : st.st_size);
+    end = base + st.st_size;
+  } else if (count == 0) {
+    if (noosh_slurp(fd, &data) < 0) {
+      dprintf(NOOSH_FD(2), "noosh: %s: %s\n", args[0], strerror(errno));
+    }
+    p = data.data ? data.data : "";
+    end = p + data.len;
+  } else {
+    // Input that cannot be mapped must not be read past the last record,
+    // so collect the records one by one, null separated.
+    char d = (char) delim;
+    while ((long) nitems < skip + count && (r = noosh_read_record(fd, delim, &data)) > 0) {
+      if (r == 1 && !trim) {
+        noosh_buf_append(&data, &d, 1);
+      }
+      noosh_buf_append(&data, "", 1);
+      nitems++;
+    }
+    nitems = 0;
+    p = data.data ? data.data : "";
+    end = p + data.len;
+    delim = '\0';
+    trim = 1;
+  }
+
+  // Single pass: split on delim, copying each record once into block.
+  noosh_buf_reserve(&block, end - p);
+  while (p < end && (count == 0 || (long) nitems < count)) {
+    nl = memchr(p, delim, end - p);
+    if (nl == NULL) {
+      nl = end;
+    }
+    if (skip > 0) {
+      skip--;
+    } else {
+      if (nitems == cap) {
+        cap = cap ? cap * 2 : 64;
+        offs = noosh_realloc(offs, cap * sizeof(*offs));
+      }
+      offs[nitems++] = block.len;
+      noosh_buf_append(&block, p, (nl - p) + (nl < end && !trim ? 1 : 0));
+      block.len++;
+      noosh_buf_reserve(&block, 0);
+    }
+    p = nl < end ? nl + 1 : end;
+  }
+
+  if (base != NULL && noosh_map_read(NULL, 0)) {
+    // The file shrank while it was split, and nothing was consumed:
+    // start over, mapping what is left of it.
+    noosh_map_drop(base);
+    pthread_mutex_unlock(&noosh_map_lock);
+    free(offs);
+    free(block.data);
+    return noosh_mapfile(args);
+  }
+  if (base != NULL) {
+    lseek(fd, p - base, SEEK_SET);
+    pthread_mutex_unlock(&noosh_map_lock);
+  }
+
+  items = noosh_malloc((nitems + 1) * sizeof(*items));
+  for (i = 0; i < nitems; i++) {
+    items[i] = block.data + offs[i];
+  }
+  items[nitems] = NULL;
+  free(offs);
+  free(data.data);
+  return noosh_set_array(name, items, nitems, block.data, block.len) < 0 ? 1 : 0;
+}
+
+/*
+    @brief builtin command: concatenate files to standard output
+    @param args: list of args
+        cat [-u] [file ...], `-' or no files reads standard input;
+        other options are left to the system cat
+    @return 0, or 1 if a file could not be copied
+*/
+int noosh_cat(char ** args) {
+  struct stat ist, ost;
+  int out = NOOSH_FD(1);
+  int i, in, files = 0, status = 0;
+
+  for (i = 1; args[i] != NULL; i++) {
+    if (args[i][0] == '-' && args[i][1] != '\0' && strcmp(args[i], "-u") != 0) {
+      return noosh_launch(args);
+    }
+  }
+
+  for (i = 1; args[i] != NULL || files == 0; i++) {
+    const char * name = args[i] ? args[i] : "-";
+    if (strcmp(name, "-u") == 0) {
+      continue;
+    }
+    files++;
+
+    if (strcmp(name, "-") == 0) {
+      in = NOOSH_FD(0);
+    } else if ((in = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+      dprintf(NOOSH_FD(2), "noosh: cat: %s: %s\n", name, strerror(errno));
+      status = 1;
+      continue;
+    }
+
+    if (fstat(in, &ist) == 0 && fstat(out, &ost) == 0 && S_ISREG(ist.st_mode) &&
+        ist.st_dev == ost.st_dev && ist.st_ino == ost.st_ino) {
+      dprintf(NOOSH_FD(2), "noosh: cat: %s: input file is output file\n", name);
+      status = 1;
+    } else if (noosh_copy_fd(in, out) < 0) {
+      if (errno != EPIPE) {
+        dprintf(NOOSH_FD(2), "noosh: cat: %s: %s\n", name, strerror(errno));
+      }
+      status = 1;
+    }
+
+    if (in != NOOSH_FD(0)) {
+      close(in);
+    }
+    if (args[i] == NULL) {
+      break;
+    }
+  }
+  return status;
+}
+
+/*
+    @brief builtin command: copy files and directory trees
+    @param args: list of args
+        cp [-r|-R] source ... dest, files inside copied trees are spread
+        over a small thread pool; other options are left to the system cp
+    @return 0, or 1 on a usage error or if anything was not copied
+*/
+int noosh_cp(char ** args) {
+  struct noosh_cp_pool pool;
+  struct noosh_cp_job * fix;
+  struct noosh_buf path = {0};
+  pthread_t threads[NOOSH_CP_MAX_THREADS];
+  int i, first, last, recursive = 0, into_dir, status = 0;
+  struct stat st;
+  char * dst, * base;
+
+  for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    }
+    if (strspn(args[i] + 1, "rR") != strlen(args[i] + 1)) {
+      return noosh_launch(args);
+    }
+    recursive = 1;
+  }
+  first = i;
+  for (last = first; args[last] != NULL; last++);
+  last--;
+  if (last - first < 1) {
+    dprintf(NOOSH_FD(2), "noosh: cp: missing destination operand\n");
+    return 1;
+  }
+  dst = args[last];
+  into_dir = stat(dst, &st) == 0 && S_ISDIR(st.st_mode);
+  if (last - first > 1 && !into_dir) {
+    dprintf(NOOSH_FD(2), "noosh: cp: %s: not a directory\n", dst);
+    return 1;
+  }
+
+  memset(&pool, 0, sizeof(pool));
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.ready, NULL);
+  if (recursive) {
+    pool.nthreads = noosh_cp_nthreads();
+    for (i = 0; i < pool.nthreads; i++) {
+      if (pthread_create(&threads[i], NULL, noosh_cp_worker, &pool) != 0) {
+        break;
+      }
+    }
+    pool.nthreads = i;
+  }
+
+  for (i = first; i < last; i++) {
+    if (!recursive && stat(args[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      dprintf(NOOSH_FD(2), "noosh: cp: -r not specified; omitting directory %s\n", args[i]);
+      status = 1;
+      continue;
+    }
+    path.len = 0;
+    noosh_buf_append(&path, dst, strlen(dst));
+    if (into_dir) {
+      char * copy = noosh_strdup(args[i]);
+      base = basename(copy);
+      noosh_buf_append(&path, "/", 1);
+      noosh_buf_append(&path, base, strlen(base));
+      free(copy);
+    }
+    if (noosh_cp_tree(&pool, args[i], path.data, 1) < 0) {
+      status = 1;
+    }
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.done = 1;
+  pthread_cond_broadcast(&pool.ready);
+  pthread_mutex_unlock(&pool.lock);
+  for (i = 0; i < pool.nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // Directories were created writable; give them their real modes now.
+  while ((fix = pool.dirs) != NULL) {
+    chmod(fix->dst, fix->mode);
+    pool.dirs = fix->next;
+    free(fix->src);
+    free(fix->dst);
+    free(fix);
+  }
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.ready);
+  free(path.data);
+  // Files the workers failed on have been reported already.
+  return pool.errors ? 1 : status;
+}
+
+/*
+    @brief builtin command: copy standard input to files and standard output
+    @param args: list of args
+        tee [-a] [file ...], a pipe on standard input is duplicated with
+        tee(2)/splice(2); other options are left to the system tee
+    @return 0, or 1 if a file could not be opened
+*/
+int noosh_tee(char ** args) {
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  int * outs, * files;
+  int i, first, nouts = 0, status = 0;
+
+  for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    }
+    if (strcmp(args[i], "-a") != 0) {
+      return noosh_launch(args);
+    }
+    flags = (flags & ~O_TRUNC) | O_APPEND;
+  }
+  first = i;
+  for (; args[i] != NULL; i++);
+
+  outs = noosh_malloc((i - first + 1) * sizeof(*outs));
+  files = noosh_malloc((i - first + 1) * sizeof(*files));
+  for (i = first; args[i] != NULL; i++) {
+    files[nouts] = open(args[i], flags, 0666);
+    if (files[nouts] < 0) {
+      dprintf(NOOSH_FD(2), "noosh: tee: %s: %s\n", args[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+    outs[nouts] = files[nouts];
+    nouts++;
+  }
+  // Standard output goes last: it gets the input spliced straight to it.
+  outs[nouts] = NOOSH_FD(1);
+
+  noosh_fanout(NOOSH_FD(0), outs, nouts + 1);
+
+  for (i = 0; i < nouts; i++) {
+    close(files[i]);
+  }
+  free(outs);
+  free(files);
+  return status;
+}
+
+/*
+    @brief builtin command: set or show shell options
+    @param args: list of args
+        set -o name turns an option on, set +o name turns it off,
+        set -o alone lists them
+    @return 0 on success, 2 on a usage error
+*/
+int noosh_set(char ** args) {
+  int i, j, on;
+
+  if (args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL)) {
+    for (j = 0; j < noosh_num_options(); j++) {
+      dprintf(NOOSH_FD(1), "%-15s %s\n", option_str[j], *option_flag[j] ? "on" : "off");
+    }
+    return 0;
+  }
+
+  for (i = 1; args[i] != NULL; i += 2) {
+    if ((strcmp(args[i], "-o") != 0 && strcmp(args[i], "+o") != 0) || args[i + 1] == NULL) {
+      dprintf(NOOSH_FD(2), "noosh: set: usage: set [-o|+o] option\n");
+      return 2;
+    }
+    on = args[i][0] == '-';
+    for (j = 0; j < noosh_num_options(); j++) {
+      if (strcmp(args[i + 1], option_str[j]) == 0) {
+        break;
+      }
+    }
+    if (j == noosh_num_options()) {
+      dprintf(NOOSH_FD(2), "noosh: set: %s: invalid option name\n", args[i + 1]);
+      return 2;
+    }
+    if (!noosh_stage_isolated) {
+      *option_flag[j] = on;
+    }
+  }
+  return 0;
+}
+
+/*
+    @brief builtin command: buffer a stream between two pipeline stages
+    @param args: list of args
+        buffer [-s size] [-m memory] [-v]
+        holds up to size bytes (default 64M) so a bursty producer is not
+        stalled by a slow consumer; past memory bytes of ring (default
+        64M) data spills into a memfd. SIGUSR1 to the shell reports the
+        fill level of running buffers, -v reports once more at the end
+    @return 0 on success, 1 on error, 2 on a usage error
+*/
+int noosh_buffer(char ** args) {
+  struct noosh_opts o = {args, 1, 0, NULL};
+  size_t size = NOOSH_BUFFER_MEMLIMIT, mem = NOOSH_BUFFER_MEMLIMIT;
+  struct noosh_buffer * b;
+  pthread_t reader;
+  uint64_t one = 1;
+  int c, verbose = 0, status = 1;
+
+  while ((c = noosh_getopt(&o, "s:m:v")) != 0) {
+    switch (c) {
+    case 's':
+    case 'm':
+      if (noosh_parse_size(o.arg, c == 's' ? &size : &mem) < 0) {
+        dprintf(NOOSH_FD(2), "noosh: buffer: %s: invalid size\n", o.arg);
+        return 2;
+      }
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      return 2;
+    }
+  }
+  if (size == 0) {
+    dprintf(NOOSH_FD(2), "noosh: buffer: size must be positive\n");
+    return 2;
+  }
+
+  b = noosh_malloc(sizeof(*b));
+  memset(b, 0, sizeof(*b));
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_cond_init(&b->not_empty, NULL);
+  pthread_cond_init(&b->not_full, NULL);
+  b->in = NOOSH_FD(0);
+  b->out = NOOSH_FD(1);
+  b->err = NOOSH_FD(2);
+  b->size = size;
+  b->ring_cap = size < mem || mem == 0 ? size : mem;
+  b->spill_cap = size - b->ring_cap;
+  b->spill = -1;
+  if (b->spill_cap > 0 && (b->spill = memfd_create("noosh-buffer", MFD_CLOEXEC)) < 0) {
+    dprintf(NOOSH_FD(2), "noosh: buffer: memfd: %s\n", strerror(errno));
+    b->spill_cap = 0;
+    b->size = b->ring_cap;
+  }
+  b->wake = eventfd(0, EFD_CLOEXEC);
+  if (b->ring_cap == 0 || noosh_buffer_alloc(b) < 0 || b->wake < 0) {
+    dprintf(NOOSH_FD(2), "noosh: buffer: %s\n", strerror(errno));
+    b->ring = b->ring == MAP_FAILED ? NULL : b->ring;
+    goto done;
+  }
+
+  noosh_buffer_register(b, 1);
+  if (pthread_create(&reader, NULL, noosh_buffer_reader, b) != 0) {
+    dprintf(NOOSH_FD(2), "noosh: buffer: cannot start reader\n");
+    noosh_buffer_register(b, 0);
+    goto done;
+  }
+  status = 0;
+  if (noosh_buffer_writer(b) < 0) {
+    status = 1;
+    // The consumer is gone: stop reading so the producer sees EPIPE.
+    pthread_mutex_lock(&b->lock);
+    b->dead = 1;
+    pthread_cond_broadcast(&b->not_full);
+    pthread_mutex_unlock(&b->lock);
+    (void) !write(b->wake, &one, sizeof(one));
+  }
+  pthread_join(reader, NULL);
+  if (verbose) {
+    noosh_buffer_report(b, NOOSH_FD(2));
+  }
+  noosh_buffer_register(b, 0);
+
+done:
+  if (b->ring) {
+    munmap(b->ring, b->ring_cap);
+  }
+  if (b->spill >= 0) {
+    close(b->spill);
+  }
+  if (b->wake >= 0) {
+    close(b->wake);
+  }
+  pthread_mutex_destroy(&b->lock);
+  pthread_cond_destroy(&b->not_empty);
+  pthread_cond_destroy(&b->not_full);
+  free(b);
+  return status;
+}
+
+/*
+    @brief builtin command: declare functions defined in the NOOSHFPATH
+        directories, read and compiled when first called
+    @param args: list of args
+        autoload [-Uz] [name ...], the zsh options being accepted and
+        ignored; without names it lists the functions found in NOOSHFPATH
+        and their files
+    @return 0, 1 if there is nothing to list, 2 on a bad name or option
+*/
+int noosh_autoload(char ** args) {
+  struct noosh_opts o = {args, 1, 0, NULL};
+  int c, status = 0;
+
+  while ((c = noosh_getopt(&o, "Uz")) != 0) {
+    if (c == '?') {
+      return 2;
+    }
+  }
+  if (args[o.ind] == NULL) {
+    return noosh_autoload_list(NOOSH_FD(1));
+  }
+  for (; args[o.ind]; o.ind++) {
+    if (!noosh_valid_name(args[o.ind])) {
+      dprintf(NOOSH_FD(2), "noosh: autoload: %s: bad function name\n", args[o.ind]);
+      status = 2;
+    } else if (noosh_find_func(args[o.ind]) == NULL) {
+      // Nothing is read yet, not even the index.
+      noosh_define_func(args[o.ind], NULL);
+    }
+  }
+  return status;
+}
+
+/*
+    @brief builtin command: evaluate arithmetic expressions
+    @param args: list of args
+        let expr [expr ...]
+    @return 0 if the last expression is not 0, 1 if it is or on an error,
+        2 without expressions
+*/
+int noosh_let(char ** args) {
+  long long n = 0;
+  int i;
+
+  if (args[1] == NULL) {
+    dprintf(NOOSH_FD(2), "noosh: let: expression expected\n");
+    return 2;
+  }
+  for (i = 1; args[i]; i++) {
+    if (noosh_arith_text(args[i], strlen(args[i]), &n) < 0) {
+      return 1;
+    }
+  }
+  return n == 0;
+}
+
+/*
+    @brief order variable cells by name, for qsort
+*/
+int noosh_var_cmp(const void * a, const void * b) {
+  return strcmp((*(struct noosh_var **) a)->name, (*(struct noosh_var **) b)->name);
+}
+
+/*
+    @brief print a variable as a declare command that recreates it
+    @param out: where to write
+    @param v: the cell
+*/
+void noosh_declare_print(int out, struct noosh_var * v) {
+  struct noosh_buf line = {0};
+  const char * value = noosh_var_value(v), * p;
+  char tmp[24];
+  size_t pos = 0, kpos = 0;
+
+  noosh_buf_append(&line, "declare -", 9);
+  if (v->array) {
+    noosh_buf_append(&line, "a", 1);
+  } else if (v->assoc) {
+    noosh_buf_append(&line, "A", 1);
+  }
+  if (v->attrs & NOOSH_VAR_INTEGER) {
+    noosh_buf_append(&line, "i", 1);
+  }
+  if (v->attrs & NOOSH_VAR_READONLY) {
+    noosh_buf_append(&line, "r", 1);
+  }
+  if (v->attrs & NOOSH_VAR_EXPORT) {
+    noosh_buf_append(&line, "x", 1);
+  }
+  if (v->attrs == 0 && !v->array && !v->assoc) {
+    noosh_buf_append(&line, "-", 1);
+  }
+  noosh_buf_append(&line, " ", 1);
+  noosh_buf_append(&line, v->name, v->name_len);
+  if (v->array || v->assoc) {
+    // declare -a name=([0]="a" [1]="b")
+    noosh_buf_append(&line, "=(", 2);
+    while ((value = noosh_var_next(v, &pos, 0, tmp)) != NULL) {
+      p = noosh_var_next(v, &kpos, 1, tmp);
+      noosh_buf_append(&line, kpos > 1 ? " [" : "[", kpos > 1 ? 2 : 1);
+      noosh_buf_append(&line, p, strlen(p));
+      noosh_buf_append(&line, "]=\"", 3);
+      for (p = value; *p; p++) {
+        if (strchr("\"\\$`", *p)) {
+          noosh_buf_append(&line, "\\", 1);
+        }
+        noosh_buf_append(&line, p, 1);
+      }
+      noosh_buf_append(&line, "\"", 1);
+    }
+    noosh_buf_append(&line, ")", 1);
+  } else if (value) {
+    noosh_buf_append(&line, "=\"", 2);
+    for (p = value; *p; p++) {
+      if (strchr("\"\\$`", *p)) {
+        noosh_buf_append(&line, "\\", 1);
+      }
+      noosh_buf_append(&line, p, 1);
+    }
+    noosh_buf_append(&line, "\"", 1);
+  }
+  noosh_buf_append(&line, "\n", 1);
+  noosh_write_all(out, line.data, line.len);
+  free(line.data);
+}
+
+/*
+    @brief list variables as declare commands, sorted by name
+    @param out: where to write
+    @param attrs: list only the variables with all these NOOSH_VAR_*
+        attributes; 0 lists every set variable
+*/
+void noosh_declare_list(int out, int attrs) {
+  struct noosh_var_table * t = &noosh_vars;
+  struct noosh_var * v, ** all = NULL;
+  size_t i, n = 0;
+
+  pthread_mutex_lock(&noosh_var_lock);
+  all = noosh_malloc((t->n + 1) * sizeof(*all));
+  for (i = 0; i < t->cap; i++) {
+    if ((v = t->slots[i]) != NULL && noosh_valid_name(v->name) && (v->attrs & attrs) == (attrs & 7) &&
+        (!(attrs & NOOSH_VAR_ARRAY) || v->array) && (!(attrs & NOOSH_VAR_ASSOC) || v->assoc) &&
+        (v->value || v->stale || v->array || v->assoc || (attrs && v->attrs))) {
+      all[n++] = v;
+    }
+  }
+  pthread_mutex_unlock(&noosh_var_lock);
+  qsort(all, n, sizeof(*all), noosh_var_cmp);
+  for (i = 0; i < n; i++) {
+    noosh_declare_print(out, all[i]);
+  }
+  free(all);
+}
+
+/*
+    @brief apply name[=value] operands of declare, export, readonly and
+        local: attributes are set before the value, except readonly,
+        which is set after it; the value may also be an array list,
+        name=(...), and the operand name[key]=value or name+=value
+    @param cmd: builtin name, for errors
+    @param args: the operands
+    @param set: NOOSH_VAR_* attributes to set, and NOOSH_VAR_ARRAY or
+        NOOSH_VAR_ASSOC to make the variables arrays
+    @param clear: NOOSH_VAR_* attributes to clear
+    @param depth: function depth to make the variables local to, 0 to
+        keep them global
+    @return 0, 1 if an operand failed
+*/
+int noosh_declare_names(const char * cmd, char ** args, int set, int clear, int depth) {
+  struct noosh_var * v;
+  int status = 0, eq;
+  char * name;
+  const char * value;
+  long long n;
+  size_t len;
+
+  for (; *args; args++) {
+    eq = noosh_is_assignment_text(*args);
+    len = eq ? noosh_name_len(*args, strlen(*args)) : strlen(*args);
+    name = noosh_strndup(*args, len);
+    if (!noosh_valid_name(name)) {
+      dprintf(NOOSH_FD(2), "noosh: %s: `%s': not a valid identifier\n", cmd, *args);
+      status = 1;
+      free(name);
+      continue;
+    }
+    v = noosh_var_cell(name);
+    free(name);
+    if (depth > 0 && noosh_var_local(v, depth) < 0) {
+      status = 1;
+      continue;
+    }
+    noosh_var_attrs(v, set & (NOOSH_VAR_INTEGER | NOOSH_VAR_EXPORT), clear);
+    if ((set & (NOOSH_VAR_ARRAY | NOOSH_VAR_ASSOC)) &&
+        noosh_var_reset_array(v, (set & NOOSH_VAR_ASSOC) != 0, 0) < 0) {
+      status = 1;
+      continue;
+    }
+    if (eq) {
+      if (noosh_assign_text(*args) < 0) {
+        status = 1;
+        continue;
+      }
+    } else if ((set & NOOSH_VAR_INTEGER) && !v->isnum && (value = noosh_var_value(v)) != NULL) {
+      // Existing text of a new integer becomes a number now.
+      if (noosh_arith_string(value, &n) < 0 || noosh_var_set_num(v, n) < 0) {
+        status = 1;
+        continue;
+      }
+    }
+    noosh_var_attrs(v, set & NOOSH_VAR_READONLY, 0);
+  }
+  return status;
+}
+
+/*
+    @brief builtin command: set variables and their attributes
+    @param args: list of args
+        declare [-aAgirxp] [name[=value] ...], also called typeset; -a
+        makes the variables indexed arrays and -A associative ones, -i
+        integers, whose assigned values are evaluated as arithmetic and
+        kept as numbers, -r readonly and -x exported; in a
+        function the variables are local unless -g is given; -p, or no
+        names, prints them (all set variables with the given attributes
+        when there are no names)
+    @return 0, 1 on a bad name or value, 2 on a bad option
+*/
+int noosh_declare(char ** args) {
+  struct noosh_opts o = {args, 1, 0, NULL};
+  int c, set = 0, print = 0, global = 0, status = 0;
+
+  while ((c = noosh_getopt(&o, "aAgirxp")) != 0) {
+    switch (c) {
+    case 'a':
+      set |= NOOSH_VAR_ARRAY;
+      break;
+    case 'A':
+      set |= NOOSH_VAR_ASSOC;
+      break;
+    case 'g':
+      global = 1;
+      break;
+    case 'i':
+      set |= NOOSH_VAR_INTEGER;
+      break;
+    case 'r':
+      set |= NOOSH_VAR_READONLY;
+      break;
+    case 'x':
+      set |= NOOSH_VAR_EXPORT;
+      break;
+    case 'p':
+      print = 1;
+      break;
+    default:
+      return 2;
+    }
+  }
+  if (args[o.ind] == NULL) {
+    noosh_declare_list(NOOSH_FD(1), set);
+    return 0;
+  }
+  if (!print) {
+    return noosh_declare_names(args[0], args + o.ind, set, 0, global ? 0 : noosh_func_depth);
+  }
+  for (; args[o.ind]; o.ind++) {
+    if (!noosh_valid_name(args[o.ind])) {
+      dprintf(NOOSH_FD(2), "noosh: %s: %s: not found\n", args[0], args[o.ind]);
+      status = 1;
+    } else {
+      noosh_declare_print(NOOSH_FD(1), noosh_var_cell(args[o.ind]));
+    }
+  }
+  return status;
+}
+
+/*
+    @brief builtin command: make variables part of the environment of
+        commands the shell starts
+    @param args: list of args
+        export [-n] [-p] [name[=value] ...]; -n takes them out of it;
+        without names it prints the exported variables
+    @return 0, 1 on a bad name or value, 2 on a bad option
+*/
+int noosh_export(char ** args) {
+  struct noosh_opts o = {args, 1, 0, NULL};
+  int c, remove = 0;
+
+  while ((c = noosh_getopt(&o, "np")) != 0) {
+    if (c == '?') {
+      return 2;
+    }
+    remove |= c == 'n';
+  }
+  if (args[o.ind] == NULL) {
+    noosh_declare_list(NOOSH_FD(1), NOOSH_VAR_EXPORT);
+    return 0;
+  }
+  return noosh_declare_names("export", args + o.ind, remove ? 0 : NOOSH_VAR_EXPORT,
+                             remove ? NOOSH_VAR_EXPORT : 0, 0);
+}
+
+/*
+    @brief builtin command: make variables readonly
+    @param args: list of args
+        readonly [-p] [name[=value] ...]; without names it prints the
+        readonly variables
+    @return 0, 1 on a bad name or value, 2 on a bad option
+*/
+int noosh_readonly(char ** args) {
+  struct noosh_opts o = {args, 1, 0, NULL};
+  int c;
+
+  while ((c = noosh_getopt(&o, "p")) != 0) {
+    if (c == '?') {
+      return 2;
+    }
+  }
+  if (args[o.ind] == NULL) {
+    noosh_declare_list(NOOSH_FD(1), NOOSH_VAR_READONLY);
+    return 0;
+  }
+  return noosh_declare_names("readonly", args + o.ind, NOOSH_VAR_READONLY, 0, 0);
+}
+
+/*
+    @brief builtin command: make variables local to the running function,
+        restored when it returns
+    @param args: list of args
+        local [-aAirx] name[=value] ..., the options being those of
+        declare
+    @return 0, 1 outside a function or on a bad name or value, 2 on a bad
+        option
+*/
+int noosh_local(char ** args) {
+  struct noosh_opts o = {args, 1, 0, NULL};
+  int c, set = 0;
+
+  while ((c = noosh_getopt(&o, "aAirx")) != 0) {
+    switch (c) {
+    case 'a':
+      set |= NOOSH_VAR_ARRAY;
+      break;
+    case 'A':
+      set |= NOOSH_VAR_ASSOC;
+      break;
+    case 'i':
+      set |= NOOSH_VAR_INTEGER;
+      break;
+    case 'r':
+      set |= NOOSH_VAR_READONLY;
+      break;
+    case 'x':
+      set |= NOOSH_VAR_EXPORT;
+      break;
+    default:
+      return 2;
+    }
+  }
+  if (noosh_func_depth == 0) {
+    dprintf(NOOSH_FD(2), "noosh: local: can only be used in a function\n");
+    return 1;
+  }
+  return noosh_declare_names("local", args + o.ind, set, 0, noosh_func_depth);
+}
+
+/*
+    @brief builtin command: unset variables and drop their attributes
+    @param args: list of args
+        unset [-v] name ..., where name[key] unsets one element
+    @return 0, 1 on a bad name or a readonly variable, 2 on a bad option
+*/
+int noosh_unset(char ** args) {
+  struct noosh_opts o = {args, 1, 0, NULL};
+  struct noosh_var * v;
+  const char * key;
+  size_t n, m, len;
+  char * name;
+  int c, status = 0;
+
+  while ((c = noosh_getopt(&o, "v")) != 0) {
+    if (c == '?') {
+      return 2;
+    }
+  }
+  for (; args[o.ind]; o.ind++) {
+    n = noosh_name_len(args[o.ind], strlen(args[o.ind]));
+    if (n > 0 && (m = noosh_subscript(args[o.ind] + n, strlen(args[o.ind] + n), &key, &len)) > 0 &&
+        args[o.ind][n + m] == '\0') {
+      name = noosh_strndup(args[o.ind], n);
+      v = noosh_var_cell(name);
+      free(name);
+      if (noosh_var_unset_elem(v, key, len) < 0) {
+        status = 1;
+      }
+      continue;
+    }
+    if (!noosh_valid_name(args[o.ind])) {
+      dprintf(NOOSH_FD(2), "noosh: unset: `%s': not a valid identifier\n", args[o.ind]);
+      status = 1;
+      continue;
+    }
+    v = noosh_var_cell(args[o.ind]);
+    if (v->attrs & NOOSH_VAR_READONLY) {
+      dprintf(NOOSH_FD(2), "noosh: unset: %s: cannot unset: readonly variable\n", v->name);
+      status = 1;
+    } else {
+      noosh_var_set(v, NULL);
+      noosh_var_attrs(v, 0, NOOSH_VAR_INTEGER | NOOSH_VAR_EXPORT);
+    }
+  }
+  return status;
+}
+
+/*
+    @brief look up a builtin by name
+    @param name: command name
+    @return index into builtin_str/builtin_func, -1 if not a builtin
+*/
+int noosh_find_builtin(const char * name) {
+  int i;
+
+  for (i = 0; i < noosh_num_builtins(); i++) {
+    if (strcmp(name, builtin_str[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+    @brief start an external program without waiting for it
+    @param args: null terminated list of arguments
+    @param assigns: NAME=value strings added to its environment, or NULL
+    @param io: descriptor table the program runs with
+    @return pid of the child, -1 if fork failed
+*/
+pid_t noosh_spawn(char ** args, char ** assigns, struct noosh_io * io) {
+  extern char ** environ;
+  char ** envp = noosh_env(), ** a, * path = NULL;
+  pid_t pid;
+
+  if (noosh_opt_statcache && !noosh_stage_isolated && strchr(args[0], '/') == NULL) {
+    // The stat cache remembers where PATH has the command, and where not.
+    for (a = assigns; a && *a && strncmp(*a, "PATH=", 5) != 0; a++);
+    if (a == NULL || *a == NULL) {
+      path = noosh_path_find(args[0]);
+    }
+  }
+  pid = noosh_fork();
+  if (pid == 0) {
+    // Child process
+    noosh_io_apply(io);
+    signal(SIGPIPE, SIG_DFL);
+    // execvp searches the PATH of the environment it is given.
+    environ = envp;
+    for (; assigns && *assigns; assigns++) {
+      putenv(*assigns);
+    }
+    if (path) {
+      execv(path, args);
+    }
+    if (execvp(args[0], args) == -1) {
+      dprintf(2, "noosh: %s: %s\n", args[0], strerror(errno));
+    }
+    exit(errno == ENOENT ? 127 : 126);
+  } else if (pid < 0) {
+    // Error forking
+    perror("noosh");
+  }
+  free(path);
+  return pid;
+}
+
+/*
+    @brief wait for a child to terminate
+    @param pid: the child
+    @return its exit status
+*/
+int noosh_wait(pid_t pid) {
+  int status;
+
+  do {
+    if (waitpid(pid, & status, WUNTRACED) < 0) {
+      return 1;
+    }
+  } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+  return noosh_wait_status(status);
+}
+
+/*
+    @brief launch a program and wait for it to terminate
+    @param args: null terminated list of arguments
+        args[0] is program, *args[1] is progrm args
+    @return its exit status
+*/
+int noosh_launch(char ** args) {
+  pid_t pid = noosh_spawn(args, NULL, noosh_cur_io);
+
+  return pid > 0 ? noosh_wait(pid) : 1;
+}
+
+/*
+  Parser
+
+  Input is lexed and parsed in a single pass into a syntax tree allocated
+  from an arena. Words keep their source text, quotes included: they are
+  expanded each time the command runs. The parser works on one complete
+  command (a line, or several when a construct is left open) at a time,
+  and tells the caller when it needs more input to finish one.
+*/
+
+enum noosh_tok {
+  NOOSH_T_EOF,
+  NOOSH_T_WORD,
+  NOOSH_T_NEWLINE,
+  NOOSH_T_SEMI,
+  NOOSH_T_DSEMI,
+  NOOSH_T_AMP,
+  NOOSH_T_AND,
+  NOOSH_T_OR,
+  NOOSH_T_PIPE,
+  NOOSH_T_LPAREN,
+  NOOSH_T_RPAREN,
+  NOOSH_T_REDIR
+};
+
+enum noosh_node_type {
+  NOOSH_N_CMD,
+  NOOSH_N_PIPE,
+  NOOSH_N_AND,
+  NOOSH_N_OR,
+  NOOSH_N_LIST,
+  NOOSH_N_IF,
+  NOOSH_N_WHILE,
+  NOOSH_N_UNTIL,
+  NOOSH_N_FOR,
+  NOOSH_N_CASE,
+  NOOSH_N_GROUP,
+  NOOSH_N_SUBSHELL,
+  NOOSH_N_FUNC,
+  NOOSH_N_ARITH,
+  NOOSH_N_COND
+};
+
+/*
+  how each node type shows in messages
+*/
+char * noosh_node_str[] = {
+  "command", "pipeline", "&&", "||", "list", "if", "while", "until",
+  "for", "case", "{", "(", "function", "((", "[["
+};
+
+# define NOOSH_W_QUOTED 1
+# define NOOSH_W_EXPAND 2
+# define NOOSH_W_ASSIGN 4
+# define NOOSH_W_BRACE 8
+# define NOOSH_W_TILDE 16
+# define NOOSH_W_GLOB 32
+
+/*
+  word of a command as written
+    QUOTED: it contains quotes or backslashes
+    EXPAND: it contains $ or ` expansions
+    BRACE: it has an unquoted { followed by a }, perhaps {a,b} or {1..9}
+    TILDE: it has an unquoted ~ at its start or after = or :
+    GLOB: it has an unquoted *, ? or [...] and may expand to paths
+    a word with none of these is used as it is
+*/
+struct noosh_word {
+  char * s;
+  size_t len;
+  int flags;
+};
+
+/*
+  redirection: operator such as "2>>" and its target word
+*/
+struct noosh_redir {
+  char * op;
+  struct noosh_word target;
+};
+
+/*
+  one `pattern | pattern) body ;;' of a case
+*/
+struct noosh_case {
+  struct noosh_word * pats;
+  int npats;
+  struct noosh_node * body;
+};
+
+/*
+  tests of a [[ ... ]]: the unary ones of a word, then from MATCH on the
+  binary ones of two
+*/
+enum noosh_test {
+  NOOSH_TEST_STRING,   // a lone word: not empty
+  NOOSH_TEST_EMPTY,    // -z
+  NOOSH_TEST_NONEMPTY, // -n
+  NOOSH_TEST_EXISTS,   // -e, -a
+  NOOSH_TEST_FILE,     // -f
+  NOOSH_TEST_DIR,      // -d
+  NOOSH_TEST_READ,     // -r
+  NOOSH_TEST_WRITE,    // -w
+  NOOSH_TEST_EXEC,     // -x
+  NOOSH_TEST_SIZE,     // -s
+  NOOSH_TEST_LINK,     // -L, -h
+  NOOSH_TEST_FIFO,     // -p
+  NOOSH_TEST_SOCKET,   // -S
+  NOOSH_TEST_BLOCK,    // -b
+  NOOSH_TEST_CHAR,     // -c
+  NOOSH_TEST_STICKY,   // -k
+  NOOSH_TEST_SETUID,   // -u
+  NOOSH_TEST_SETGID,   // -g
+  NOOSH_TEST_OWNER,    // -O
+  NOOSH_TEST_GROUP,    // -G
+  NOOSH_TEST_MODIFIED, // -N
+  NOOSH_TEST_TTY,      // -t
+  NOOSH_TEST_VAR,      // -v
+  NOOSH_TEST_OPTION,   // -o
+  NOOSH_TEST_MATCH,    // ==, =: the right side is a pattern
+  NOOSH_TEST_NOMATCH,  // !=
+  NOOSH_TEST_REGEX,    // =~: the right side is an extended regex
+  NOOSH_TEST_BEFORE,   // <
+  NOOSH_TEST_AFTER,    // >
+  NOOSH_TEST_EQ,       // -eq and the others: arithmetic comparisons
+  NOOSH_TEST_NE,
+  NOOSH_TEST_LT,
+  NOOSH_TEST_LE,
+  NOOSH_TEST_GT,
+  NOOSH_TEST_GE,
+  NOOSH_TEST_NEWER,    // -nt
+  NOOSH_TEST_OLDER,    // -ot
+  NOOSH_TEST_SAME      // -ef
+};
+
+/*
+  operators of [[ ... ]], followed by their tests
+*/
+char * noosh_test_op[] = {
+  "-z", "-n", "-e", "-a", "-f", "-d", "-r", "-w", "-x", "-s", "-L", "-h",
+  "-p", "-S", "-b", "-c", "-k", "-u", "-g", "-O", "-G", "-N", "-t", "-v",
+  "-o", "==", "=", "!=", "=~", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt",
+  "-ge", "-nt", "-ot", "-ef"
+};
+
+int noosh_test_code[] = {
+  NOOSH_TEST_EMPTY, NOOSH_TEST_NONEMPTY, NOOSH_TEST_EXISTS, NOOSH_TEST_EXISTS,
+  NOOSH_TEST_FILE, NOOSH_TEST_DIR, NOOSH_TEST_READ, NOOSH_TEST_WRITE,
+  NOOSH_TEST_EXEC, NOOSH_TEST_SIZE, NOOSH_TEST_LINK, NOOSH_TEST_LINK,
+  NOOSH_TEST_FIFO, NOOSH_TEST_SOCKET, NOOSH_TEST_BLOCK, NOOSH_TEST_CHAR,
+  NOOSH_TEST_STICKY, NOOSH_TEST_SETUID, NOOSH_TEST_SETGID, NOOSH_TEST_OWNER,
+  NOOSH_TEST_GROUP, NOOSH_TEST_MODIFIED, NOOSH_TEST_TTY, NOOSH_TEST_VAR,
+  NOOSH_TEST_OPTION, NOOSH_TEST_MATCH, NOOSH_TEST_MATCH, NOOSH_TEST_NOMATCH,
+  NOOSH_TEST_REGEX, NOOSH_TEST_BEFORE, NOOSH_TEST_AFTER, NOOSH_TEST_EQ,
+  NOOSH_TEST_NE, NOOSH_TEST_LT, NOOSH_TEST_LE, NOOSH_TEST_GT, NOOSH_TEST_GE,
+  NOOSH_TEST_NEWER, NOOSH_TEST_OLDER, NOOSH_TEST_SAME
+};
+
+enum noosh_cond_type {
+  NOOSH_C_TEST,
+  NOOSH_C_AND,
+  NOOSH_C_OR,
+  NOOSH_C_NOT
+};
+
+/*
+  expression of a [[ ... ]]
+    TEST: test of a, or of a and b when it is a binary one
+    AND, OR: l then r
+    NOT: l
+*/
+struct noosh_cond {
+  int type;
+  int test;
+  struct noosh_word a;
+  struct noosh_word b;
+  struct noosh_cond * l;
+  struct noosh_cond * r;
+};
+
+/*
+  syntax tree node
+    CMD: words, assigns (NAME=value words before the command) and redirs
+    PIPE: kids are the stages, bang for `!'
+    AND, OR: cond then body
+    LIST: kids run in order
+    IF: cond, body, alt (an elif is an IF in alt)
+    WHILE, UNTIL: cond and body
+    FOR: name, words (all positional parameters without `in') and body
+    CASE: words[0] is the subject, cases the items
+    GROUP, SUBSHELL: body
+    FUNC: name, words[0] the text of the body, which the function parses
+        again into a tree of its own
+    ARITH: words[0] the text of the expression of a ((...))
+    COND: test, the expression of a [[ ... ]]
+  compound commands may have redirs too; start and end delimit the source
+  text of commands and pipelines
+*/
+struct noosh_node {
+  int type;
+  struct noosh_word * words;
+  int nwords;
+  struct noosh_word * assigns;
+  int nassigns;
+  struct noosh_redir * redirs;
+  int nredirs;
+  struct noosh_node ** kids;
+  int nkids;
+  struct noosh_node * cond;
+  struct noosh_node * body;
+  struct noosh_node * alt;
+  struct noosh_case * cases;
+  int ncases;
+  struct noosh_cond * test;
+  char * name;
+  int has_in;
+  int bang;
+  size_t start;
+  size_t end;
+};
+
+/*
+  parser state
+    tok and word describe the current token, valid while peeked is set;
+    tok_pos is where it starts and last_end where the last consumed one ends
+    more is set when input ended inside a construct
+*/
+struct noosh_parser {
+  const char * src;
+  size_t len;
+  size_t pos;
+  size_t tok_pos;
+  size_t last_end;
+  struct noosh_arena * arena;
+  int tok;
+  struct noosh_word word;
+  char redir[4];
+  int peeked;
+  int more;
+  char * error;
+};
+
+# define NOOSH_PARSE_OK 1
+# define NOOSH_PARSE_END 0
+# define NOOSH_PARSE_ERROR -1
+# define NOOSH_PARSE_MORE -2
+
+/*
+    @brief record the first syntax error
+    @param ps: parser
+    @param msg: description
+    @return NULL, for the convenience of the parse functions
+*/
+void * noosh_syntax(struct noosh_parser * ps, char * msg) {
+  if (ps->error == NULL) {
+    ps->error = msg;
+  }
+  return NULL;
+}
+
+/*
+    @brief note that input ended inside a construct
+    @return NULL
+*/
+void * noosh_need_more(struct noosh_parser * ps) {
+  ps->more = 1;
+  return noosh_syntax(ps, "unexpected end of file");
+}
+
+/*
+    @brief skip a $(...), ${...} or `...` whose opening character is at i
+    @param s: text
+    @param len: its length
+    @param i: index of the `(' or `{' after `$', or of the backquote
+    @return index just past the closing character, 0 if the text ends first
+*/
+size_t noosh_skip_nested(const char * s, size_t len, size_t i) {
+  char open = s[i], close = open == '(' ? ')' : open == '{' ? '}' : '`';
+  int depth = 1;
+
+  for (i++; i < len; i++) {
+    if (s[i] == '\\') {
+      i++;
+    } else if (s[i] == '\'' && open != '`') {
+      while (++i < len && s[i] != '\'');
+    } else if (s[i] == '"' && open != '`') {
+      while (++i < len && s[i] != '"') {
+        i += s[i] == '\\';
+      }
+    } else if (s[i] == close && --depth == 0) {
+      return i + 1;
+    } else if (s[i] == open && open != '`') {
+      depth++;
+    }
+  }
+  return 0;
+}
+
+/*
+    @brief check for a character that ends a word
+*/
+int noosh_is_meta(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == ';' || c == '&' ||
+         c == '|' || c == '(' || c == ')' || c == '<' || c == '>';
+}
+
+/*
+    @brief length of a variable name at s
+*/
+size_t noosh_name_len(const char * s, size_t len) {
+  size_t i = 0;
+
+  if (len > 0 && (isalpha((unsigned char) s[0]) || s[0] == '_')) {
+    for (i = 1; i < len && (isalnum((unsigned char) s[i]) || s[i] == '_'); i++);
+  }
+  return i;
+}
+
+/*
+    @brief check whether the text of a word so far is name= or name+=,
+        which a `(' continues as an array assignment
+*/
+int noosh_compound_start(const char * s, size_t len) {
+  size_t n = noosh_name_len(s, len);
+
+  if (n == 0 || n == len || s[len - 1] != '=') {
+    return 0;
+  }
+  return n == len - 1 || (n == len - 2 && s[n] == '+');
+}
+
+/*
+    @brief scan a word starting at the current position
+    @param ps: parser
+    @return NOOSH_T_WORD, or NOOSH_T_EOF with more set if a quote is open
+*/
+int noosh_lex_word(struct noosh_parser * ps) {
+  const char * s = ps->src;
+  size_t i = ps->pos, j;
+  int flags = 0, brace = 0, bracket = 0;
+
+  while (i < ps->len && (!noosh_is_meta(s[i]) || (s[i] == '(' && noosh_compound_start(s + ps->pos, i - ps->pos)))) {
+    switch (s[i]) {
+    case '(':
+      // name=(...): the list is part of the word.
+      flags |= NOOSH_W_QUOTED | NOOSH_W_EXPAND;
+      j = noosh_skip_nested(s, ps->len, i);
+      i = j ? j : ps->len + 1;
+      break;
+    case '\\':
+      flags |= NOOSH_W_QUOTED;
+      i += 2;
+      break;
+    case '\'':
+      flags |= NOOSH_W_QUOTED;
+      while (++i < ps->len && s[i] != '\'');
+      i++;
+      break;
+    case '"':
+      flags |= NOOSH_W_QUOTED;
+      for (i++; i < ps->len && s[i] != '"'; i++) {
+        if (s[i] == '\\') {
+          i++;
+        } else if (s[i] == '`' || (s[i] == '$' && i + 1 < ps->len &&
+                                   (s[i + 1] == '(' || s[i + 1] == '{'))) {
+          flags |= NOOSH_W_EXPAND;
+          j = noosh_skip_nested(s, ps->len, s[i] == '`' ? i : i + 1);
+          if (j == 0) {
+            i = ps->len;
+            break;
+          }
+          i = j - 1;
+        } else if (s[i] == '$') {
+          flags |= NOOSH_W_EXPAND;
+        }
+      }
+      i++;
+      break;
+    case '$':
+    case '`':
+      flags |= NOOSH_W_EXPAND;
+      if (s[i] == '`' || (i + 1 < ps->len && (s[i + 1] == '(' || s[i + 1] == '{'))) {
+        j = noosh_skip_nested(s, ps->len, s[i] == '`' ? i : i + 1);
+        i = j ? j : ps->len + 1;
+      } else {
+        // The ? of $? and the * of $* are not wildcards.
+        i += i + 1 < ps->len && (s[i + 1] == '?' || s[i + 1] == '*') ? 2 : 1;
+      }
+      break;
+    case '*':
+    case '?':
+      flags |= NOOSH_W_GLOB;
+      i++;
+      break;
+    case '[':
+      bracket = 1;
+      i++;
+      break;
+    case ']':
+      flags |= bracket ? NOOSH_W_GLOB : 0;
+      i++;
+      break;
+    case '{':
+      brace = 1;
+      i++;
+      break;
+    case '}':
+      flags |= brace ? NOOSH_W_BRACE : 0;
+      i++;
+      break;
+    case '~':
+      if (i == ps->pos || s[i - 1] == '=' || s[i - 1] == ':') {
+        flags |= NOOSH_W_TILDE;
+      }
+      i++;
+      break;
+    default:
+      i++;
+    }
+  }
+  if (i > ps->len) {
+    // An unterminated quote or substitution.
+    noosh_need_more(ps);
+    ps->pos = ps->len;
+    return NOOSH_T_EOF;
+  }
+  ps->word.s = (char *) s + ps->pos;
+  ps->word.len = i - ps->pos;
+  ps->word.flags = flags;
+  ps->pos = i;
+  return NOOSH_T_WORD;
+}
+
+/*
+    @brief scan the next token
+    @param ps: parser
+    @return the token type, also left in ps->tok
+*/
+int noosh_lex(struct noosh_parser * ps) {
+  const char * s = ps->src;
+  size_t i;
+  char c, d;
+
+  while (1) {
+    while (ps->pos < ps->len && (s[ps->pos] == ' ' || s[ps->pos] == '\t')) {
+      ps->pos++;
+    }
+    if (ps->pos + 1 < ps->len && s[ps->pos] == '\\' && s[ps->pos + 1] == '\n') {
+      ps->pos += 2;
+      continue;
+    }
+    if (ps->pos < ps->len && s[ps->pos] == '#') {
+      while (ps->pos < ps->len && s[ps->pos] != '\n') {
+        ps->pos++;
+      }
+    }
+    break;
+  }
+  ps->tok_pos = ps->pos;
+  if (ps->pos >= ps->len) {
+    return ps->tok = NOOSH_T_EOF;
+  }
+
+  i = ps->pos;
+  c = s[i];
+  d = i + 1 < ps->len ? s[i + 1] : '\0';
+  if (isdigit((unsigned char) c) && (d == '<' || d == '>')) {
+    // n>word: the descriptor belongs to the operator.
+    i++;
+    c = d;
+    d = i + 1 < ps->len ? s[i + 1] : '\0';
+  }
+  if (c == '<' || c == '>') {
+    if (c == '<' && d == '<') {
+      ps->pos = i + 2;
+      noosh_syntax(ps, "here-documents are not supported");
+      return ps->tok = NOOSH_T_EOF;
+    }
+    i += (d == '>' || d == '&' || (c == '>' && d == '|')) ? 2 : 1;
+    memcpy(ps->redir, s + ps->pos, i - ps->pos);
+    ps->redir[i - ps->pos] = '\0';
+    if (c == '>' && d == '|') {
+      // >| is > here: there is no noclobber to override.
+      ps->redir[i - ps->pos - 1] = '\0';
+    }
+    ps->pos = i;
+    return ps->tok = NOOSH_T_REDIR;
+  }
+
+  ps->pos++;
+  switch (c) {
+  case '\n':
+    return ps->tok = NOOSH_T_NEWLINE;
+  case ';':
+    if (d == ';') {
+      ps->pos++;
+      return ps->tok = NOOSH_T_DSEMI;
+    }
+    return ps->tok = NOOSH_T_SEMI;
+  case '&':
+    if (d == '&') {
+      ps->pos++;
+      return ps->tok = NOOSH_T_AND;
+    }
+    return ps->tok = NOOSH_T_AMP;
+  case '|':
+    if (d == '|') {
+      ps->pos++;
+      return ps->tok = NOOSH_T_OR;
+    }
+    return ps->tok = NOOSH_T_PIPE;
+  case '(':
+    return ps->tok = NOOSH_T_LPAREN;
+  case ')':
+    return ps->tok = NOOSH_T_RPAREN;
+  }
+  ps->pos--;
+  return ps->tok = noosh_lex_word(ps);
+}
+
+/*
+    @brief look at the current token without consuming it
+*/
+int noosh_lookahead(struct noosh_parser * ps) {
+  if (!ps->peeked) {
+    noosh_lex(ps);
+    ps->peeked = 1;
+  }
+  return ps->tok;
+}
+
+/*
+    @brief consume the current token
+*/
+void noosh_advance(struct noosh_parser * ps) {
+  noosh_lookahead(ps);
+  ps->last_end = ps->pos;
+  ps->peeked = 0;
+}
+
+/*
+    @brief check whether the current token is the reserved word kw
+*/
+int noosh_at_keyword(struct noosh_parser * ps, const char * kw) {
+  return noosh_lookahead(ps) == NOOSH_T_WORD && (ps->word.flags & ~NOOSH_W_GLOB) == 0 &&
+         ps->word.len == strlen(kw) && memcmp(ps->word.s, kw, ps->word.len) == 0;
+}
+
+/*
+    @brief consume the reserved word kw, or fail
+    @return 1 if it was there, 0 after recording an error
+*/
+int noosh_expect_keyword(struct noosh_parser * ps, const char * kw) {
+  if (noosh_at_keyword(ps, kw)) {
+    noosh_advance(ps);
+    return 1;
+  }
+  if (ps->tok == NOOSH_T_EOF) {
+    noosh_need_more(ps);
+  } else {
+    noosh_syntax(ps, "unexpected token");
+  }
+  return 0;
+}
+
+/*
+    @brief skip newlines
+*/
+void noosh_linebreak(struct noosh_parser * ps) {
+  while (noosh_lookahead(ps) == NOOSH_T_NEWLINE) {
+    noosh_advance(ps);
+  }
+}
+
+/*
+    @brief copy the current word into the arena
+*/
+struct noosh_word noosh_take_word(struct noosh_parser * ps) {
+  struct noosh_word w = ps->word;
+
+  w.s = noosh_arena_strndup(ps->arena, w.s, w.len);
+  return w;
+}
+
+/*
+    @brief check whether the current token ends a compound list
+*/
+int noosh_at_list_end(struct noosh_parser * ps) {
+  static const char * ends[] = {"then", "elif", "else", "fi", "do", "done", "esac", "}"};
+  size_t i;
+
+  switch (noosh_lookahead(ps)) {
+  case NOOSH_T_EOF:
+  case NOOSH_T_RPAREN:
+  case NOOSH_T_DSEMI:
+    return 1;
+  case NOOSH_T_WORD:
+    for (i = 0; i < sizeof(ends) / sizeof(*ends); i++) {
+      if (noosh_at_keyword(ps, ends[i])) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+  growable array of pointers or structs used while a node is built, then
+  copied into the arena
+*/
+struct noosh_vec {
+  void * data;
+  int n;
+  int cap;
+};
+
+/*
+    @brief append an element to a vector
+    @param v: the vector
+    @param elem: element to copy in
+    @param size: element size
+*/
+void noosh_vec_push(struct noosh_vec * v, const void * elem, size_t size) {
+  if (v->n == v->cap) {
+    v->cap = v->cap ? v->cap * 2 : 8;
+    v->data = noosh_realloc(v->data, v->cap * size);
+  }
+  memcpy((char *) v->data + v->n++ * size, elem, size);
+}
+
+/*
+    @brief move a vector into the arena
+    @return the arena copy, NULL if empty
+*/
+void * noosh_vec_finish(struct noosh_parser * ps, struct noosh_vec * v, size_t size) {
+  void * p = NULL;
+
+  if (v->n > 0) {
+    p = noosh_arena_alloc(ps->arena, v->n * size);
+    memcpy(p, v->data, v->n * size);
+  }
+  free(v->data);
+  v->data = NULL;
+  return p;
+}
+
+/*
+    @brief allocate a node
+*/
+struct noosh_node * noosh_node_new(struct noosh_parser * ps, int type) {
+  struct noosh_node * n = noosh_arena_alloc(ps->arena, sizeof(*n));
+
+  n->type = type;
+  return n;
+}
+
+struct noosh_node * noosh_parse_list(struct noosh_parser * ps);
+struct noosh_node * noosh_parse_and_or(struct noosh_parser * ps);
+
+/*
+    @brief parse one redirection, the operator being the current token
+    @return 1 on success, 0 on error
+*/
+int noosh_parse_redir(struct noosh_parser * ps, struct noosh_vec * redirs) {
+  struct noosh_redir r;
+
+  r.op = noosh_arena_strndup(ps->arena, ps->redir, strlen(ps->redir));
+  noosh_advance(ps);
+  if (noosh_lookahead(ps) != NOOSH_T_WORD) {
+    if (ps->tok == NOOSH_T_EOF && !ps->error) {
+      noosh_need_more(ps);
+    }
+    noosh_syntax(ps, "expected word after redirection");
+    return 0;
+  }
+  r.target = noosh_take_word(ps);
+  noosh_advance(ps);
+  noosh_vec_push(redirs, &r, sizeof(r));
+  return 1;
+}
+
+/*
+    @brief parse redirections following a compound command
+    @return n, or NULL on error
+*/
+struct noosh_node * noosh_parse_redirs(struct noosh_parser * ps, struct noosh_node * n) {
+  struct noosh_vec redirs = {0};
+
+  while (n && noosh_lookahead(ps) == NOOSH_T_REDIR) {
+    if (!noosh_parse_redir(ps, &redirs)) {
+      n = NULL;
+    }
+  }
+  if (n) {
+    n->nredirs = redirs.n;
+    n->redirs = noosh_vec_finish(ps, &redirs, sizeof(struct noosh_redir));
+  } else {
+    free(redirs.data);
+  }
+  return n;
+}
+
+/*
+  parts of an assignment word, name[key]+=value
+    key is NULL without a subscript; compound is set when the value is
+    an array list, (...), in which case value is the text inside the
+    parentheses
+*/
+struct noosh_assign_parts {
+  size_t name_len;
+  const char * key;
+  size_t key_len;
+  int append;
+  const char * value;
+  size_t value_len;
+  int compound;
+};
+
+/*
+    @brief split an assignment word into its parts
+    @param s: the word
+    @param len: its length
+    @param p: receives the parts
+    @return 1 if the word is an assignment, 0 if not
+*/
+int noosh_split_assignment(const char * s, size_t len, struct noosh_assign_parts * p) {
+  size_t i = noosh_name_len(s, len), depth = 0;
+
+  memset(p, 0, sizeof(*p));
+  if (i == 0) {
+    return 0;
+  }
+  p->name_len = i;
+  if (i < len && s[i] == '[') {
+    p->key = s + i + 1;
+    for (i++; i < len; i++) {
+      if (s[i] == '[') {
+        depth++;
+      } else if (s[i] == ']' && depth-- == 0) {
+        break;
+      }
+    }
+    if (i == len) {
+      return 0;
+    }
+    p->key_len = s + i++ - p->key;
+  }
+  if (i + 1 < len && s[i] == '+' && s[i + 1] == '=') {
+    p->append = 1;
+    i++;
+  }
+  if (i >= len || s[i] != '=') {
+    return 0;
+  }
+  p->value = s + i + 1;
+  p->value_len = len - i - 1;
+  if (p->key == NULL && p->value_len >= 2 && p->value[0] == '(' && p->value[p->value_len - 1] == ')') {
+    p->compound = 1;
+    p->value++;
+    p->value_len -= 2;
+  }
+  return 1;
+}
+
+/*
+    @brief check whether a word is an assignment, NAME=value, NAME+=value,
+        NAME[key]=value or NAME=(list)
+*/
+int noosh_is_assignment(const struct noosh_word * w) {
+  struct noosh_assign_parts p;
+
+  return noosh_split_assignment(w->s, w->len, &p);
+}
+
+/*
+    @brief check whether an expanded operand of declare is an assignment
+*/
+int noosh_is_assignment_text(const char * s) {
+  struct noosh_assign_parts p;
+
+  return noosh_split_assignment(s, strlen(s), &p);
+}
+
+/*
+    @brief check whether an assignment word sets a plain NAME=value
+*/
+int noosh_is_plain_assignment(const struct noosh_word * w) {
+  struct noosh_assign_parts p;
+
+  return noosh_split_assignment(w->s, w->len, &p) && !p.key && !p.append && !p.compound;
+}
+
+/*
+    @brief parse a simple command: assignments, words and redirections
+*/
+struct noosh_node * noosh_parse_simple(struct noosh_parser * ps) {
+  struct noosh_vec words = {0}, assigns = {0}, redirs = {0};
+  struct noosh_node * n = noosh_node_new(ps, NOOSH_N_CMD);
+  struct noosh_word w;
+
+  while (1) {
+    if (noosh_lookahead(ps) == NOOSH_T_REDIR) {
+      if (!noosh_parse_redir(ps, &redirs)) {
+        break;
+      }
+    } else if (ps->tok == NOOSH_T_WORD) {
+      w = ps->word;
+      if (words.n == 0 && noosh_is_assignment(&w)) {
+        w = noosh_take_word(ps);
+        w.flags |= NOOSH_W_ASSIGN;
+        noosh_vec_push(&assigns, &w, sizeof(w));
+      } else {
+        w = noosh_take_word(ps);
+        noosh_vec_push(&words, &w, sizeof(w));
+      }
+      noosh_advance(ps);
+    } else {
+      break;
+    }
+  }
+  if (words.n + assigns.n + redirs.n == 0 && !ps->error) {
+    if (ps->tok == NOOSH_T_EOF) {
+      noosh_need_more(ps);
+    } else {
+      noosh_syntax(ps, "unexpected token");
+    }
+  }
+  n->nwords = words.n;
+  n->words = noosh_vec_finish(ps, &words, sizeof(struct noosh_word));
+  n->nassigns = assigns.n;
+  n->assigns = noosh_vec_finish(ps, &assigns, sizeof(struct noosh_word));
+  n->nredirs = redirs.n;
+  n->redirs = noosh_vec_finish(ps, &redirs, sizeof(struct noosh_redir));
+  return ps->error ? NULL : n;
+}
+
+/*
+    @brief parse a compound list that must not be empty
+*/
+struct noosh_node * noosh_parse_body(struct noosh_parser * ps) {
+  struct noosh_node * n = noosh_parse_list(ps);
+
+  if (n == NULL && !ps->error) {
+    if (ps->tok == NOOSH_T_EOF) {
+      noosh_need_more(ps);
+    } else {
+      noosh_syntax(ps, "unexpected token");
+    }
+  }
+  return n;
+}
+
+/*
+    @brief parse if ... then ... [elif ... then ...] [else ...] fi, the
+        `if' or `elif' having been consumed
+*/
+struct noosh_node * noosh_parse_if(struct noosh_parser * ps) {
+  struct noosh_node * n = noosh_node_new(ps, NOOSH_N_IF);
+
+  if (!(n->cond = noosh_parse_body(ps)) || !noosh_expect_keyword(ps, "then") ||
+      !(n->body = noosh_parse_body(ps))) {
+    return NULL;
+  }
+  if (noosh_at_keyword(ps, "elif")) {
+    noosh_advance(ps);
+    n->alt = noosh_parse_if(ps);
+    return n->alt ? n : NULL;
+  }
+  if (noosh_at_keyword(ps, "else")) {
+    noosh_advance(ps);
+    if (!(n->alt = noosh_parse_body(ps))) {
+      return NULL;
+    }
+  }
+  return noosh_expect_keyword(ps, "fi") ? n : NULL;
+}
+
+/*
+    @brief parse do ... done
+*/
+struct noosh_node * noosh_parse_do(struct noosh_parser * ps) {
+  struct noosh_node * body;
+
+  if (!noosh_expect_keyword(ps, "do") || !(body = noosh_parse_body(ps)) ||
+      !noosh_expect_keyword(ps, "done")) {
+    return NULL;
+  }
+  return body;
+}
+
+/*
+    @brief parse for name [in word ...]; do ... done, after `for'
+*/
+struct noosh_node * noosh_parse_for(struct noosh_parser * ps) {
+  struct noosh_node * n = noosh_node_new(ps, NOOSH_N_FOR);
+  struct noosh_vec words = {0};
+  struct noosh_word w;
+
+  if (noosh_lookahead(ps) != NOOSH_T_WORD || ps->word.flags != 0) {
+    return ps->tok == NOOSH_T_EOF ? noosh_need_more(ps) : noosh_syntax(ps, "bad for variable");
+  }
+  n->name = noosh_take_word(ps).s;
+  noosh_advance(ps);
+  if (!noosh_valid_name(n->name)) {
+    return noosh_syntax(ps, "bad for variable");
+  }
+  noosh_linebreak(ps);
+  if (noosh_at_keyword(ps, "in")) {
+    noosh_advance(ps);
+    n->has_in = 1;
+    while (noosh_lookahead(ps) == NOOSH_T_WORD) {
+      w = noosh_take_word(ps);
+      noosh_vec_push(&words, &w, sizeof(w));
+      noosh_advance(ps);
+    }
+    n->nwords = words.n;
+    n->words = noosh_vec_finish(ps, &words, sizeof(struct noosh_word));
+    if (ps->tok == NOOSH_T_SEMI) {
+      noosh_advance(ps);
+    } else if (ps->tok != NOOSH_T_NEWLINE) {
+      return ps->tok == NOOSH_T_EOF ? noosh_need_more(ps) : noosh_syntax(ps, "unexpected token");
+    }
+  } else if (noosh_lookahead(ps) == NOOSH_T_SEMI) {
+    noosh_advance(ps);
+  }
+  noosh_linebreak(ps);
+  return (n->body = noosh_parse_do(ps)) ? n : NULL;
+}
+
+/*
+    @brief parse case word in [(]pattern [| pattern]) list ;; ... esac,
+        after `case'
+*/
+struct noosh_node * noosh_parse_case(struct noosh_parser * ps) {
+  struct noosh_node * n = noosh_node_new(ps, NOOSH_N_CASE);
+  struct noosh_vec items = {0}, pats;
+  struct noosh_case item;
+  struct noosh_word w;
+
+  if (noosh_lookahead(ps) != NOOSH_T_WORD) {
+    return ps->tok == NOOSH_T_EOF ? noosh_need_more(ps) : noosh_syntax(ps, "unexpected token");
+  }
+  n->words = noosh_arena_alloc(ps->arena, sizeof(*n->words));
+  n->words[0] = noosh_take_word(ps);
+  n->nwords = 1;
+  noosh_advance(ps);
+  noosh_linebreak(ps);
+  if (!noosh_expect_keyword(ps, "in")) {
+    return NULL;
+  }
+  noosh_linebreak(ps);
+
+  while (!noosh_at_keyword(ps, "esac")) {
+    memset(&pats, 0, sizeof(pats));
+    if (noosh_lookahead(ps) == NOOSH_T_LPAREN) {
+      noosh_advance(ps);
+    }
+    while (noosh_lookahead(ps) == NOOSH_T_WORD) {
+      w = noosh_take_word(ps);
+      noosh_vec_push(&pats, &w, sizeof(w));
+      noosh_advance(ps);
+      if (noosh_lookahead(ps) != NOOSH_T_PIPE) {
+        break;
+      }
+      noosh_advance(ps);
+    }
+    if (pats.n == 0 || noosh_lookahead(ps) != NOOSH_T_RPAREN) {
+      free(pats.data);
+      free(items.data);
+      return ps->tok == NOOSH_T_EOF ? noosh_need_more(ps) : noosh_syntax(ps, "bad case pattern");
+    }
+    noosh_advance(ps);
+    item.npats = pats.n;
+    item.pats = noosh_vec_finish(ps, &pats, sizeof(struct noosh_word));
+    item.body = noosh_parse_list(ps);
+    if (ps->error) {
+      free(items.data);
+      return NULL;
+    }
+    noosh_vec_push(&items, &item, sizeof(item));
+    if (noosh_lookahead(ps) == NOOSH_T_DSEMI) {
+      noosh_advance(ps);
+      noosh_linebreak(ps);
+    } else if (!noosh_at_keyword(ps, "esac")) {
+      free(items.data);
+      return ps->tok == NOOSH_T_EOF ? noosh_need_more(ps) : noosh_syntax(ps, "expected `;;'");
+    }
+  }
+  noosh_advance(ps);
+  n->ncases = items.n;
+  n->cases = noosh_vec_finish(ps, &items, sizeof(struct noosh_case));
+  return n;
+}
+
+/*
+    @brief check for `()' at the current position, as after a function name
+    @return the position past it, 0 if it is not there
+*/
+size_t noosh_at_parens(struct noosh_parser * ps) {
+  size_t i = ps->pos;
+
+  while (i < ps->len && (ps->src[i] == ' ' || ps->src[i] == '\t')) {
+    i++;
+  }
+  if (i >= ps->len || ps->src[i++] != '(') {
+    return 0;
+  }
+  while (i < ps->len && (ps->src[i] == ' ' || ps->src[i] == '\t')) {
+    i++;
+  }
+  return i < ps->len && ps->src[i] == ')' ? i + 1 : 0;
+}
+
+struct noosh_node * noosh_parse_command(struct noosh_parser * ps);
+
+/*
+    @brief parse the body of a function definition, the name and any
+        `()' having been consumed
+    @param ps: parser
+    @param name: the function name
+*/
+struct noosh_node * noosh_parse_function(struct noosh_parser * ps, char * name) {
+  struct noosh_node * n = noosh_node_new(ps, NOOSH_N_FUNC), * body;
+
+  n->name = name;
+  noosh_linebreak(ps);
+  if ((body = noosh_parse_command(ps)) == NULL) {
+    return NULL;
+  }
+  if (body->type == NOOSH_N_CMD || body->type == NOOSH_N_FUNC) {
+    return noosh_syntax(ps, "function body must be a compound command");
+  }
+  n->words = noosh_arena_alloc(ps->arena, sizeof(*n->words));
+  n->words[0].len = body->end - body->start;
+  n->words[0].s = noosh_arena_strndup(ps->arena, ps->src + body->start, n->words[0].len);
+  n->nwords = 1;
+  return n;
+}
+
+/*
+    @brief find the end of a ((...)) command at the current `(' token
+    @param ps: parser
+    @return index just past the closing `))', 0 if it is not one (but
+        nested subshells), or if the text ends first (more is then set)
+*/
+size_t noosh_at_arith(struct noosh_parser * ps) {
+  const char * s = ps->src;
+  size_t i = ps->tok_pos + 2;
+  int depth = 0;
+
+  if (ps->tok_pos + 1 >= ps->len || s[ps->tok_pos + 1] != '(') {
+    return 0;
+  }
+  for (; i < ps->len; i++) {
+    if (s[i] == '\\') {
+      i++;
+    } else if (s[i] == '\'') {
+      while (++i < ps->len && s[i] != '\'');
+    } else if (s[i] == '"') {
+      while (++i < ps->len && s[i] != '"') {
+        i += s[i] == '\\';
+      }
+    } else if (s[i] == '(') {
+      depth++;
+    } else if (s[i] == ')' && depth > 0) {
+      depth--;
+    } else if (s[i] == ')') {
+      return i + 1 < ps->len && s[i + 1] == ')' ? i + 2 : 0;
+    }
+  }
+  noosh_need_more(ps);
+  return 0;
+}
+
+/*
+    @brief find the test an operator of [[ ... ]] stands for
+    @param w: the word, which must be unquoted
+    @param binary: look for a binary operator, otherwise a unary one
+    @return the test, -1 if the word is not such an operator
+*/
+int noosh_test_find(const struct noosh_word * w, int binary) {
+  size_t i;
+
+  if ((w->flags & ~(NOOSH_W_TILDE | NOOSH_W_GLOB)) != 0) {
+    // Only quotes and substitutions matter: the ~ of =~ looks like a tilde.
+    return -1;
+  }
+  for (i = 0; i < sizeof(noosh_test_op) / sizeof(*noosh_test_op); i++) {
+    if (strlen(noosh_test_op[i]) == w->len && memcmp(noosh_test_op[i], w->s, w->len) == 0 &&
+        (noosh_test_code[i] >= NOOSH_TEST_MATCH) == binary) {
+      return noosh_test_code[i];
+    }
+  }
+  return -1;
+}
+
+/*
+    @brief the operator of a test, for --disasm
+*/
+const char * noosh_test_name(int test) {
+  size_t i;
+
+  for (i = 0; i < sizeof(noosh_test_op) / sizeof(*noosh_test_op); i++) {
+    if (noosh_test_code[i] == test) {
+      return noosh_test_op[i];
+    }
+  }
+  return "word";
+}
+
+/*
+    @brief take the regex after =~ as it is written, up to a blank outside
+        parentheses: unlike other words it may hold (, ), | and <
+    @return the word, with len 0 after recording an error
+*/
+struct noosh_word noosh_parse_regex(struct noosh_parser * ps) {
+  const char * s = ps->src;
+  struct noosh_word w = {NULL, 0, 0};
+  size_t i = ps->pos, start, j;
+  int depth = 0;
+
+  while (i < ps->len && (s[i] == ' ' || s[i] == '\t')) {
+    i++;
+  }
+  start = i;
+  while (i < ps->len && ((s[i] != ' ' && s[i] != '\t' && s[i] != '\n') || depth > 0)) {
+    if (s[i] == ')' && depth == 0) {
+      break;
+    }
+    switch (s[i]) {
+    case '\\':
+      w.flags |= NOOSH_W_QUOTED;
+      i += 2;
+      break;
+    case '\'':
+      w.flags |= NOOSH_W_QUOTED;
+      while (++i < ps->len && s[i] != '\'');
+      i++;
+      break;
+    case '"':
+      w.flags |= NOOSH_W_QUOTED;
+      for (i++; i < ps->len && s[i] != '"'; i++) {
+        if (s[i] == '\\') {
+          i++;
+        } else if (s[i] == '$') {
+          w.flags |= NOOSH_W_EXPAND;
+        }
+      }
+      i++;
+      break;
+    case '$':
+    case '`':
+      w.flags |= NOOSH_W_EXPAND;
+      if (s[i] == '`' || (i + 1 < ps->len && (s[i + 1] == '(' || s[i + 1] == '{'))) {
+        j = noosh_skip_nested(s, ps->len, s[i] == '`' ? i : i + 1);
+        i = j ? j : ps->len + 1;
+      } else {
+        i++;
+      }
+      break;
+    case '~':
+      w.flags |= i == start ? NOOSH_W_TILDE : 0;
+      i++;
+      break;
+    case '(':
+      depth++;
+      i++;
+      break;
+    case ')':
+      depth--;
+      i++;
+      break;
+    default:
+      i++;
+    }
+  }
+  if (i > ps->len || depth > 0) {
+    noosh_need_more(ps);
+    return w;
+  }
+  if (i == start) {
+    noosh_syntax(ps, "expected regular expression after `=~'");
+    return w;
+  }
+  w.s = noosh_arena_strndup(ps->arena, s + start, i - start);
+  w.len = i - start;
+  ps->pos = ps->last_end = i;
+  ps->peeked = 0;
+  return w;
+}
+
+/*
+    @brief allocate a node of a conditional expression
+*/
+struct noosh_cond * noosh_cond_new(struct noosh_parser * ps, int type, struct noosh_cond * l) {
+  struct noosh_cond * c = noosh_arena_alloc(ps->arena, sizeof(*c));
+
+  c->type = type;
+  c->l = l;
+  return c;
+}
+
+struct noosh_cond * noosh_parse_cond_or(struct noosh_parser * ps);
+
+/*
+    @brief parse ( expr ), ! expr, a unary test, a binary test or a lone
+        word of a [[ ... ]]
+*/
+struct noosh_cond * noosh_parse_cond_not(struct noosh_parser * ps) {
+  struct noosh_cond * c;
+  struct noosh_word a;
+  int test, tok;
+
+  noosh_linebreak(ps);
+  if (ps->tok == NOOSH_T_LPAREN) {
+    noosh_advance(ps);
+    if ((c = noosh_parse_cond_or(ps)) == NULL) {
+      return NULL;
+    }
+    noosh_linebreak(ps);
+    if (ps->tok != NOOSH_T_RPAREN) {
+      return ps->tok == NOOSH_T_EOF ? noosh_need_more(ps) : noosh_syntax(ps, "expected `)' in conditional");
+    }
+    noosh_advance(ps);
+    return c;
+  }
+  if (noosh_at_keyword(ps, "!")) {
+    noosh_advance(ps);
+    return (c = noosh_parse_cond_not(ps)) ? noosh_cond_new(ps, NOOSH_C_NOT, c) : NULL;
+  }
+  if (ps->tok != NOOSH_T_WORD || noosh_at_keyword(ps, "]]")) {
+    return ps->tok == NOOSH_T_EOF ? noosh_need_more(ps) : noosh_syntax(ps, "unexpected token in conditional");
+  }
+  c = noosh_cond_new(ps, NOOSH_C_TEST, NULL);
+  a = noosh_take_word(ps);
+  noosh_advance(ps);
+  tok = noosh_lookahead(ps);
+  test = noosh_test_find(&a, 0);
+  if (test >= 0 && tok == NOOSH_T_WORD && !noosh_at_keyword(ps, "]]") && noosh_test_find(&ps->word, 1) < 0) {
+    // -f file; a lone -f is a string
+    c->test = test;
+    c->a = noosh_take_word(ps);
+    noosh_advance(ps);
+    return c;
+  }
+  c->a = a;
+  if (tok == NOOSH_T_REDIR && (strcmp(ps->redir, "<") == 0 || strcmp(ps->redir, ">") == 0)) {
+    test = ps->redir[0] == '<' ? NOOSH_TEST_BEFORE : NOOSH_TEST_AFTER;
+  } else if (tok != NOOSH_T_WORD || (test = noosh_test_find(&ps->word, 1)) < 0) {
+    c->test = NOOSH_TEST_STRING;
+    return c;
+  }
+  c->test = test;
+  noosh_advance(ps);
+  if (test == NOOSH_TEST_REGEX) {
+    c->b = noosh_parse_regex(ps);
+    return c->b.len ? c : NULL;
+  }
+  if (noosh_lookahead(ps) != NOOSH_T_WORD || noosh_at_keyword(ps, "]]")) {
+    return ps->tok == NOOSH_T_EOF ? noosh_need_more(ps) : noosh_syntax(ps, "expected operand in conditional");
+  }
+  c->b = noosh_take_word(ps);
+  noosh_advance(ps);
+  return c;
+}
+
+/*
+    @brief parse expr && expr ... of a [[ ... ]]
+*/
+struct noosh_cond * noosh_parse_cond_and(struct noosh_parser * ps) {
+  struct noosh_cond * c = noosh_parse_cond_not(ps), * r;
+
+  while (c && (noosh_linebreak(ps), ps->tok == NOOSH_T_AND)) {
+    noosh_advance(ps);
+    if ((r = noosh_parse_cond_not(ps)) == NULL) {
+      return NULL;
+    }
+    c = noosh_cond_new(ps, NOOSH_C_AND, c);
+    c->r = r;
+  }
+  return c;
+}
+
+/*
+    @brief parse expr || expr ... of a [[ ... ]]
+*/
+struct noosh_cond * noosh_parse_cond_or(struct noosh_parser * ps) {
+  struct noosh_cond * c = noosh_parse_cond_and(ps), * r;
+
+  while (c && (noosh_linebreak(ps), ps->tok == NOOSH_T_OR)) {
+    noosh_advance(ps);
+    if ((r = noosh_parse_cond_and(ps)) == NULL) {
+      return NULL;
+    }
+    c = noosh_cond_new(ps, NOOSH_C_OR, c);
+    c->r = r;
+  }
+  return c;
+}
+
+/*
+    @brief parse the command at the current token, for noosh_parse_command
+*/
+struct noosh_node * noosh_parse_command_at(struct noosh_parser * ps) {
+  struct noosh_node * n;
+  char * name;
+  size_t i;
+
+  if (noosh_lookahead(ps) == NOOSH_T_LPAREN && (i = noosh_at_arith(ps)) != 0) {
+    n = noosh_node_new(ps, NOOSH_N_ARITH);
+    n->words = noosh_arena_alloc(ps->arena, sizeof(*n->words));
+    n->words[0].len = i - ps->tok_pos - 4;
+    n->words[0].s = noosh_arena_strndup(ps->arena, ps->src + ps->tok_pos + 2, n->words[0].len);
+    n->nwords = 1;
+    ps->pos = i;
+    ps->last_end = i;
+    ps->peeked = 0;
+    return noosh_parse_redirs(ps, n);
+  }
+  if (ps->more) {
+    return NULL;
+  }
+  if (noosh_lookahead(ps) == NOOSH_T_LPAREN) {
+    noosh_advance(ps);
+    n = noosh_node_new(ps, NOOSH_N_SUBSHELL);
+    if (!(n->body = noosh_parse_body(ps))) {
+      return NULL;
+    }
+    if (noosh_lookahead(ps) != NOOSH_T_RPAREN) {
+      return ps->tok == NOOSH_T_EOF ? noosh_need_more(ps) : noosh_syntax(ps, "expected `)'");
+    }
+    noosh_advance(ps);
+    return noosh_parse_redirs(ps, n);
+  }
+  if (ps->tok != NOOSH_T_WORD || (ps->word.flags & ~NOOSH_W_GLOB) != 0) {
+    return noosh_parse_simple(ps);
+  }
+
+  if (noosh_at_keyword(ps, "function")) {
+    noosh_advance(ps);
+    if (noosh_lookahead(ps) != NOOSH_T_WORD || ps->word.flags != 0) {
+      return ps->tok == NOOSH_T_EOF ? noosh_need_more(ps) : noosh_syntax(ps, "bad function name");
+    }
+    name = noosh_take_word(ps).s;
+    if (!noosh_valid_name(name)) {
+      return noosh_syntax(ps, "bad function name");
+    }
+    if ((i = noosh_at_parens(ps)) != 0) {
+      ps->pos = i;
+    }
+    noosh_advance(ps);
+    return noosh_parse_function(ps, name);
+  }
+  if ((i = noosh_at_parens(ps)) != 0) {
+    // name () compound-command
+    name = noosh_take_word(ps).s;
+    if (!noosh_valid_name(name)) {
+      return noosh_syntax(ps, "bad function name");
+    }
+    ps->pos = i;
+    noosh_advance(ps);
+    return noosh_parse_function(ps, name);
+  }
+  if (noosh_at_keyword(ps, "if")) {
+    noosh_advance(ps);
+    n = noosh_parse_if(ps);
+  } else if (noosh_at_keyword(ps, "while") || noosh_at_keyword(ps, "until")) {
+    n = noosh_node_new(ps, ps->word.s[0] == 'w' ? NOOSH_N_WHILE : NOOSH_N_UNTIL);
+    noosh_advance(ps);
+    if ((n->cond = noosh_parse_body(ps)) == NULL || (n->body = noosh_parse_do(ps)) == NULL) {
+      return NULL;
+    }
+  } else if (noosh_at_keyword(ps, "for")) {
+    noosh_advance(ps);
+    n = noosh_parse_for(ps);
+  } else if (noosh_at_keyword(ps, "case")) {
+    noosh_advance(ps);
+    n = noosh_parse_case(ps);
+  } else if (noosh_at_keyword(ps, "{")) {
+    noosh_advance(ps);
+    n = noosh_node_new(ps, NOOSH_N_GROUP);
+    if (!(n->body = noosh_parse_body(ps)) || !noosh_expect_keyword(ps, "}")) {
+      return NULL;
+    }
+  } else if (noosh_at_keyword(ps, "[[")) {
+    noosh_advance(ps);
+    n = noosh_node_new(ps, NOOSH_N_COND);
+    if (!(n->test = noosh_parse_cond_or(ps))) {
+      return NULL;
+    }
+    noosh_linebreak(ps);
+    if (!noosh_expect_keyword(ps, "]]")) {
+      return NULL;
+    }
+  } else if (noosh_at_list_end(ps) || noosh_at_keyword(ps, "in")) {
+    return noosh_syntax(ps, "unexpected reserved word");
+  } else {
+    return noosh_parse_simple(ps);
+  }
+  return n ? noosh_parse_redirs(ps, n) : NULL;
+}
+
+/*
+    @brief parse a command: a compound command with its redirections, a
+        function definition, or a simple command
+*/
+struct noosh_node * noosh_parse_command(struct noosh_parser * ps) {
+  struct noosh_node * n;
+  size_t start;
+
+  noosh_lookahead(ps);
+  start = ps->tok_pos;
+  n = noosh_parse_command_at(ps);
+  if (n) {
+    n->start = start;
+    n->end = ps->last_end;
+  }
+  return n;
+}
+
+/*
+    @brief parse [!] command [| command ...]
+*/
+struct noosh_node * noosh_parse_pipeline(struct noosh_parser * ps) {
+  struct noosh_vec kids = {0};
+  struct noosh_node * n, * cmd;
+  size_t start;
+  int bang = 0;
+
+  noosh_lookahead(ps);
+  start = ps->tok_pos;
+  if (noosh_at_keyword(ps, "!")) {
+    noosh_advance(ps);
+    bang = 1;
+  }
+  while (1) {
+    if ((cmd = noosh_parse_command(ps)) == NULL) {
+      free(kids.data);
+      return NULL;
+    }
+    noosh_vec_push(&kids, &cmd, sizeof(cmd));
+    if (noosh_lookahead(ps) != NOOSH_T_PIPE) {
+      break;
+    }
+    noosh_advance(ps);
+    noosh_linebreak(ps);
+  }
+  if (kids.n == 1 && !bang) {
+    free(kids.data);
+    return cmd;
+  }
+  n = noosh_node_new(ps, NOOSH_N_PIPE);
+  n->bang = bang;
+  n->start = start;
+  n->end = ps->last_end;
+  n->nkids = kids.n;
+  n->kids = noosh_vec_finish(ps, &kids, sizeof(cmd));
+  return n;
+}
+
+/*
+    @brief parse pipeline [&& or || pipeline ...], left associative
+*/
+struct noosh_node * noosh_parse_and_or(struct noosh_parser * ps) {
+  struct noosh_node * n = noosh_parse_pipeline(ps), * op;
+
+  while (n && (noosh_lookahead(ps) == NOOSH_T_AND || ps->tok == NOOSH_T_OR)) {
+    op = noosh_node_new(ps, ps->tok == NOOSH_T_AND ? NOOSH_N_AND : NOOSH_N_OR);
+    noosh_advance(ps);
+    noosh_linebreak(ps);
+    op->cond = n;
+    if ((op->body = noosh_parse_pipeline(ps)) == NULL) {
+      return NULL;
+    }
+    n = op;
+  }
+  if (n && noosh_lookahead(ps) == NOOSH_T_AMP) {
+    return noosh_syntax(ps, "background jobs are not supported");
+  }
+  return n;
+}
+
+/*
+    @brief parse a compound list: and-or lists separated by `;' or
+        newlines, up to a reserved word or operator that ends it
+    @return the list, NULL if it is empty or on error
+*/
+struct noosh_node * noosh_parse_list(struct noosh_parser * ps) {
+  struct noosh_vec kids = {0};
+  struct noosh_node * n;
+
+  while (1) {
+    noosh_linebreak(ps);
+    if (noosh_at_list_end(ps)) {
+      break;
+    }
+    if ((n = noosh_parse_and_or(ps)) == NULL) {
+      free(kids.data);
+      return NULL;
+    }
+    noosh_vec_push(&kids, &n, sizeof(n));
+    if (noosh_lookahead(ps) == NOOSH_T_SEMI) {
+      noosh_advance(ps);
+    } else if (ps->tok != NOOSH_T_NEWLINE) {
+      break;
+    }
+  }
+  if (kids.n <= 1) {
+    n = kids.n ? ((struct noosh_node **) kids.data)[0] : NULL;
+    free(kids.data);
+    return n;
+  }
+  n = noosh_node_new(ps, NOOSH_N_LIST);
+  n->nkids = kids.n;
+  n->kids = noosh_vec_finish(ps, &kids, sizeof(n));
+  return n;
+}
+
+/*
+    @brief start parsing text
+    @param ps: parser to initialize
+    @param src: the text
+    @param len: its length
+    @param pos: where to start
+    @param arena: where the tree is allocated
+*/
+void noosh_parser_init(struct noosh_parser * ps, const char * src, size_t len,
+                       size_t pos, struct noosh_arena * arena) {
+  memset(ps, 0, sizeof(*ps));
+  ps->src = src;
+  ps->len = len;
+  ps->pos = pos;
+  ps->arena = arena;
+}
+
+/*
+    @brief parse the next complete command: and-or lists up to the end of
+        the line, plus any following lines a construct spans
+    @param ps: parser, left just past the command
+    @param out: receives the command, NULL for a blank line
+    @return NOOSH_PARSE_OK, NOOSH_PARSE_END at end of input,
+        NOOSH_PARSE_MORE if input ended inside the command, or
+        NOOSH_PARSE_ERROR with ps->error set
+*/
+int noosh_parse(struct noosh_parser * ps, struct noosh_node ** out) {
+  struct noosh_vec kids = {0};
+  struct noosh_node * n;
+
+  *out = NULL;
+  if (noosh_lookahead(ps) == NOOSH_T_EOF && !ps->error) {
+    return ps->more ? NOOSH_PARSE_MORE : NOOSH_PARSE_END;
+  }
+  while (noosh_lookahead(ps) != NOOSH_T_NEWLINE && ps->tok != NOOSH_T_EOF) {
+    if ((n = noosh_parse_and_or(ps)) == NULL) {
+      break;
+    }
+    noosh_vec_push(&kids, &n, sizeof(n));
+    if (noosh_lookahead(ps) == NOOSH_T_SEMI) {
+      noosh_advance(ps);
+    } else if (ps->tok != NOOSH_T_NEWLINE && ps->tok != NOOSH_T_EOF) {
+      noosh_syntax(ps, "unexpected token");
+      break;
+    }
+  }
+  if (ps->more) {
+    free(kids.data);
+    return NOOSH_PARSE_MORE;
+  }
+  if (ps->error) {
+    free(kids.data);
+    return NOOSH_PARSE_ERROR;
+  }
+  if (ps->tok == NOOSH_T_NEWLINE) {
+    noosh_advance(ps);
+  }
+  if (kids.n <= 1) {
+    *out = kids.n ? ((struct noosh_node **) kids.data)[0] : NULL;
+    free(kids.data);
+  } else {
+    n = noosh_node_new(ps, NOOSH_N_LIST);
+    n->nkids = kids.n;
+    n->kids = noosh_vec_finish(ps, &kids, sizeof(n));
+    *out = n;
+  }
+  return NOOSH_PARSE_OK;
+}
+
+/*
+  Patterns
+
+  Glob patterns of parameter operators are compiled once into a list of
+  steps: literal runs, ?, * and bracket sets as bitmaps of the bytes they
+  accept. Matching is byte by byte, without locale, and backtracks only
+  to the last * it passed, so it is linear for the common cases. A
+  pattern with no wildcard is a plain string, searched with memchr.
+*/
+
+enum noosh_pat_type {
+  NOOSH_P_LIT,
+  NOOSH_P_ANY,
+  NOOSH_P_STAR,
+  NOOSH_P_SET
+};
+
+/*
+  step of a pattern
+    LIT: s and len; SET: the bitmap of bytes in set
+*/
+struct noosh_pat_step {
+  int type;
+  const char * s;
+  size_t len;
+  unsigned char set[32];
+};
+
+/*
+  compiled pattern
+    text holds the literal bytes that steps point to; fixed is the length
+    every match has, -1 when a * makes it vary; literal is set when the
+    pattern is just text, steps[0] if there is any
+*/
+struct noosh_pattern {
+  char * text;
+  struct noosh_pat_step * steps;
+  int nsteps;
+  long fixed;
+  int literal;
+};
+
+/*
+  character classes of bracket expressions
+*/
+struct noosh_pat_class {
+  char * name;
+  int (* test)(int);
+};
+
+struct noosh_pat_class noosh_pat_classes[] = {
+  {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+  {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+  {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit}
+};
+
+/*
+    @brief compile a bracket expression
+    @param p: the pattern text
+    @param len: its length
+    @param i: index of the [
+    @param set: receives the bitmap
+    @return index past the ], 0 if there is none and the [ is literal
+*/
+size_t noosh_pat_bracket(const char * p, size_t len, size_t i, unsigned char * set) {
+  size_t j = i + 1, k, n;
+  int negate = 0, c, lo;
+
+  memset(set, 0, 32);
+  if (j < len && (p[j] == '!' || p[j] == '^')) {
+    negate = 1;
+    j++;
+  }
+  for (k = j; k < len && (p[k] != ']' || k == j); k++) {
+    if (p[k] == '[' && k + 1 < len && p[k + 1] == ':') {
+      for (n = k + 2; n + 1 < len && !(p[n] == ':' && p[n + 1] == ']'); n++);
+      if (n + 1 >= len) {
+        return 0;
+      }
+      for (c = 0; c < (int) (sizeof(noosh_pat_classes) / sizeof(noosh_pat_classes[0])); c++) {
+        if (strlen(noosh_pat_classes[c].name) == n - k - 2 &&
+            memcmp(noosh_pat_classes[c].name, p + k + 2, n - k - 2) == 0) {
+          for (lo = 0; lo < 256; lo++) {
+            if (noosh_pat_classes[c].test(lo)) {
+              set[lo >> 3] |= 1 << (lo & 7);
+            }
+          }
+        }
+      }
+      k = n + 1;
+      continue;
+    }
+    k += p[k] == '\\' && k + 1 < len;
+    lo = (unsigned char) p[k];
+    if (k + 2 < len && p[k + 1] == '-' && p[k + 2] != ']') {
+      k += 2;
+      k += p[k] == '\\' && k + 1 < len;
+    }
+    for (c = lo; c <= (unsigned char) p[k]; c++) {
+      set[c >> 3] |= 1 << (c & 7);
+    }
+  }
+  if (k >= len) {
+    return 0;
+  }
+  if (negate) {
+    for (c = 0; c < 32; c++) {
+      set[c] = ~set[c];
+    }
+  }
+  return k + 1;
+}
+
+/*
+    @brief compile a glob pattern, in which a backslash makes the next
+        character literal
+    @param p: the pattern
+    @return the compiled pattern, allocated
+*/
+struct noosh_pattern * noosh_pat_compile(const char * p) {
+  struct noosh_pattern * pat = noosh_malloc(sizeof(*pat));
+  size_t len = strlen(p), i, j, t = 0;
+  struct noosh_pat_step * st;
+
+  pat->text = noosh_malloc(len + 1);
+  pat->steps = noosh_malloc((len + 1) * sizeof(*pat->steps));
+  pat->nsteps = 0;
+  pat->fixed = 0;
+  for (i = 0; i < len;) {
+    st = &pat->steps[pat->nsteps];
+    if (p[i] == '*') {
+      while (i < len && p[i] == '*') {
+        i++;
+      }
+      st->type = NOOSH_P_STAR;
+      pat->fixed = -1;
+    } else if (p[i] == '?') {
+      st->type = NOOSH_P_ANY;
+      pat->fixed += pat->fixed >= 0;
+      i++;
+    } else if (p[i] == '[' && (j = noosh_pat_bracket(p, len, i, st->set)) > 0) {
+      st->type = NOOSH_P_SET;
+      pat->fixed += pat->fixed >= 0;
+      i = j;
+    } else {
+      // A run of literal characters, backslashes removed; a [ that
+      // starts no bracket expression is one of them.
+      st->type = NOOSH_P_LIT;
+      st->s = pat->text + t;
+      do {
+        i += p[i] == '\\' && i + 1 < len;
+        pat->text[t++] = p[i++];
+      } while (i < len && p[i] != '*' && p[i] != '?' && p[i] != '[');
+      st->len = pat->text + t - st->s;
+      pat->fixed += pat->fixed >= 0 ? (long) st->len : 0;
+      if (pat->nsteps > 0 && st[-1].type == NOOSH_P_LIT) {
+        st[-1].len += st->len;
+        continue;
+      }
+    }
+    pat->nsteps++;
+  }
+  pat->literal = pat->nsteps == 0 || (pat->nsteps == 1 && pat->steps[0].type == NOOSH_P_LIT);
+  return pat;
+}
+
+/*
+    @brief free a compiled pattern
+*/
+void noosh_pat_free(struct noosh_pattern * pat) {
+  free(pat->text);
+  free(pat->steps);
+  free(pat);
+}
+
+/*
+    @brief match one step other than * at the start of a string
+    @return the number of bytes it takes, -1 if it does not match
+*/
+long noosh_pat_step(const struct noosh_pat_step * st, const char * s, size_t len) {
+  unsigned char c = len ? (unsigned char) s[0] : 0;
+
+  switch (st->type) {
+  case NOOSH_P_LIT:
+    return len >= st->len && memcmp(s, st->s, st->len) == 0 ? (long) st->len : -1;
+  case NOOSH_P_ANY:
+    return len ? 1 : -1;
+  case NOOSH_P_SET:
+    return len && (st->set[c >> 3] >> (c & 7) & 1) ? 1 : -1;
+  }
+  return -1;
+}
+
+/*
+    @brief match a whole string against a compiled pattern
+    @param pat: the pattern
+    @param s: the string
+    @param len: its length
+    @return 1 if it matches
+*/
+int noosh_pat_match(const struct noosh_pattern * pat, const char * s, size_t len) {
+  const struct noosh_pat_step * first = pat->steps, * last = pat->steps + pat->nsteps - 1;
+  size_t i = 0, mark = 0;
+  int k = 0, star = -1;
+  long n;
+
+  if (pat->fixed >= 0 && (size_t) pat->fixed != len) {
+    return 0;
+  }
+  // Literal text at either end must be right there: the prefix and
+  // suffix searches try many lengths, and most fail here.
+  if (pat->nsteps > 0 && ((first->type == NOOSH_P_LIT && (len < first->len || memcmp(s, first->s, first->len) != 0)) ||
+      (last->type == NOOSH_P_LIT && (len < last->len || memcmp(s + len - last->len, last->s, last->len) != 0)))) {
+    return 0;
+  }
+  while (i < len || k < pat->nsteps) {
+    if (k < pat->nsteps && pat->steps[k].type == NOOSH_P_STAR) {
+      star = ++k;
+      mark = i;
+      continue;
+    }
+    if (k < pat->nsteps && (n = noosh_pat_step(&pat->steps[k], s + i, len - i)) >= 0) {
+      i += n;
+      k++;
+      continue;
+    }
+    // Let the last * take one more byte and try again from there.
+    if (star < 0 || mark >= len) {
+      return 0;
+    }
+    k = star;
+    i = ++mark;
+  }
+  return 1;
+}
+
+/*
+    @brief find the shortest or longest prefix of a string that matches
+    @return its length, -1 if none does
+*/
+long noosh_pat_prefix(const struct noosh_pattern * pat, const char * s, size_t len, int longest) {
+  size_t k;
+
+  if (pat->fixed >= 0) {
+    return (size_t) pat->fixed <= len && noosh_pat_match(pat, s, pat->fixed) ? pat->fixed : -1;
+  }
+  for (k = 0; k <= len; k++) {
+    if (noosh_pat_match(pat, s, longest ? len - k : k)) {
+      return longest ? len - k : k;
+    }
+  }
+  return -1;
+}
+
+/*
+    @brief find the shortest or longest suffix of a string that matches
+    @return the index where it starts, -1 if none does
+*/
+long noosh_pat_suffix(const struct noosh_pattern * pat, const char * s, size_t len, int longest) {
+  size_t k;
+
+  if (pat->fixed >= 0) {
+    return (size_t) pat->fixed <= len && noosh_pat_match(pat, s + len - pat->fixed, pat->fixed) ?
+           (long) (len - pat->fixed) : -1;
+  }
+  for (k = 0; k <= len; k++) {
+    if (noosh_pat_match(pat, s + (longest ? k : len - k), longest ? len - k : k)) {
+      return longest ? k : len - k;
+    }
+  }
+  return -1;
+}
+
+/*
+    @brief find the leftmost non-empty match in a string, the longest one
+        there
+    @param pat: the pattern
+    @param s: the string
+    @param len: its length
+    @param mlen: receives the length of the match
+    @return the index where it starts, -1 if there is none
+*/
+long noosh_pat_find(const struct noosh_pattern * pat, const char * s, size_t len, size_t * mlen) {
+  const struct noosh_pat_step * st = pat->steps;
+  const char * p;
+  size_t i, k;
+
+  if (pat->literal) {
+    if (pat->nsteps == 0) {
+      return -1;
+    }
+    // memchr runs on the first byte, a word at a time.
+    for (p = s; (p = memchr(p, st->s[0], len - (p - s))) != NULL; p++) {
+      if ((size_t) (s + len - p) < st->len) {
+        return -1;
+      }
+      if (memcmp(p, st->s, st->len) == 0) {
+        *mlen = st->len;
+        return p - s;
+      }
+    }
+    return -1;
+  }
+  for (i = 0; i < len; i++) {
+    if (st->type == NOOSH_P_LIT && s[i] != st->s[0]) {
+      continue;
+    }
+    if (pat->fixed >= 0) {
+      if ((size_t) pat->fixed > 0 && (size_t) pat->fixed <= len - i && noosh_pat_match(pat, s + i, pat->fixed)) {
+        *mlen = pat->fixed;
+        return i;
+      }
+      continue;
+    }
+    for (k = len - i; k > 0; k--) {
+      if (noosh_pat_match(pat, s + i, k)) {
+        *mlen = k;
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+/*
+  compiled patterns of parameter operators, by the text of the
+  substitution they come from (its place in the syntax tree or bytecode
+  strings) and the pattern: a loop running ${f%.*} compiles it once
+*/
+struct noosh_pat_slot {
+  const char * site;
+  char * text;
+  struct noosh_pattern * pat;
+};
+
+# define NOOSH_PAT_SLOTS 64
+
+struct noosh_pat_slot noosh_pat_cache[NOOSH_PAT_SLOTS];
+
+/*
+    @brief get the compiled form of a pattern
+    @param site: the substitution it comes from
+    @param text: the pattern
+    @return the pattern, to give back with noosh_pat_release
+*/
+struct noosh_pattern * noosh_pat_get(const char * site, const char * text) {
+  struct noosh_pat_slot * slot = &noosh_pat_cache[((uintptr_t) site >> 2) % NOOSH_PAT_SLOTS];
+
+  if (noosh_stage_isolated) {
+    // Pipeline stage threads keep out of the shell's cache.
+    return noosh_pat_compile(text);
+  }
+  if (slot->site != site || strcmp(slot->text, text) != 0) {
+    if (slot->site) {
+      free(slot->text);
+      noosh_pat_free(slot->pat);
+    }
+    slot->site = site;
+    slot->text = noosh_strdup(text);
+    slot->pat = noosh_pat_compile(text);
+  }
+  return slot->pat;
+}
+
+/*
+    @brief give back a pattern from noosh_pat_get
+*/
+void noosh_pat_release(struct noosh_pattern * pat) {
+  if (noosh_stage_isolated) {
+    noosh_pat_free(pat);
+  }
+}
+
+/*
+  Expansion
+
+  A word is expanded in one scan of its text: quotes are removed as they
+  are met, ~ and $parameters and $(commands) are substituted, and unquoted
+  substitution results are split on IFS into separate fields. A {a,b} or
+  {1..9} brace does not make copies of the word: the scan goes on into
+  each alternative and then on into the rest of the word, so the text
+  before the brace is expanded once and only its result is repeated.
+*/
+
+/*
+  growable argument vector of allocated strings, null terminated
+*/
+struct noosh_args {
+  char ** v;
+  int n;
+  int cap;
+};
+
+/*
+    @brief append a string to an argument vector, taking ownership
+*/
+void noosh_args_push(struct noosh_args * a, char * s) {
+  if (a->n + 1 >= a->cap) {
+    a->cap = a->cap ? a->cap * 2 : 8;
+    a->v = noosh_realloc(a->v, a->cap * sizeof(*a->v));
+  }
+  a->v[a->n++] = s;
+  a->v[a->n] = NULL;
+}
+
+/*
+    @brief free an argument vector and its strings
+*/
+void noosh_args_free(struct noosh_args * a) {
+  int i;
+
+  for (i = 0; i < a->n; i++) {
+    free(a->v[i]);
+  }
+  free(a->v);
+  memset(a, 0, sizeof(*a));
+}
+
+# define NOOSH_X_SPLIT 1
+# define NOOSH_X_PATTERN 2
+# define NOOSH_X_ASSIGN 4
+# define NOOSH_X_REGEX 8
+# define NOOSH_X_GLOB 16
+
+/*
+  state of the expansion of one word
+    field collects the current field; started is set once it exists even
+    if empty, as it does after ""; first is the index in out of the
+    word's first field, or of the current brace alternative's; fields
+    are allocated in arena when there is one; brace is set when the
+    word may have {a,b} braces
+    with GLOB the field is collected as a pattern: glob is set once it
+    has an unquoted wildcard, escaped once a quoted character in it was
+    escaped
+*/
+struct noosh_expander {
+  int mode;
+  const char * ifs;
+  struct noosh_args * out;
+  struct noosh_buf field;
+  int started;
+  int first;
+  struct noosh_arena * arena;
+  int brace;
+  int glob;
+  int escaped;
+};
+
+int noosh_glob_expand(const char * pat, struct noosh_args * out, struct noosh_arena * arena);
+
+/*
+    @brief remove the backslashes escaping characters of a pattern
+    @param s: the pattern, changed in place
+    @param len: its length
+    @return the new length
+*/
+size_t noosh_unescape(char * s, size_t len) {
+  size_t i, j;
+
+  for (i = j = 0; i < len; i++) {
+    if (s[i] == '\\' && i + 1 < len) {
+      i++;
+    }
+    s[j++] = s[i];
+  }
+  s[j] = '\0';
+  return j;
+}
+
+/*
+    @brief copy a string for the output vector
+*/
+char * noosh_x_copy(struct noosh_expander * x, const char * s, size_t len) {
+  return x->arena ? noosh_arena_strndup(x->arena, s, len) : noosh_strndup(s, len);
+}
+
+/*
+    @brief end the current field
+    @param force: emit it even if empty and not started
+*/
+void noosh_x_field(struct noosh_expander * x, int force) {
+  if (x->glob && x->field.len > 0 && noosh_glob_expand(x->field.data, x->out, x->arena) > 0) {
+    // The matching paths replace the field.
+  } else if (x->field.len > 0 || x->started || force) {
+    if (x->glob || x->escaped) {
+      x->field.len = noosh_unescape(x->field.data, x->field.len);
+    }
+    noosh_args_push(x->out, noosh_x_copy(x, x->field.data ? x->field.data : "", x->field.len));
+  }
+  x->glob = x->escaped = 0;
+  x->field.len = 0;
+  if (x->field.data) {
+    x->field.data[0] = '\0';
+  }
+  x->started = 0;
+}
+
+/*
+    @brief add a literal character; in a pattern or regex, quoted special
+        characters are escaped so that they match themselves, and when
+        globbing so are all backslashes
+*/
+void noosh_x_char(struct noosh_expander * x, char c, int quoted) {
+  if ((x->mode & NOOSH_X_GLOB) && (c == '\\' || (quoted && (c == '*' || c == '?' || c == '[')))) {
+    noosh_buf_append(&x->field, "\\", 1);
+    x->escaped = 1;
+  } else if ((x->mode & NOOSH_X_GLOB) && (c == '*' || c == '?' || c == '[')) {
+    x->glob = 1;
+  } else if (quoted && (((x->mode & NOOSH_X_PATTERN) && strchr("*?[]\\", c)) ||
+                        ((x->mode & NOOSH_X_REGEX) && strchr("\\^$.|?*+()[]{}", c)))) {
+    noosh_buf_append(&x->field, "\\", 1);
+  }
+  noosh_buf_append(&x->field, &c, 1);
+  x->started = 1;
+}
+
+/*
+    @brief check text for characters that matter to a glob pattern
+*/
+int noosh_has_glob_char(const char * s, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+    @brief add literal text, in one piece unless it needs escaping
+*/
+void noosh_x_text(struct noosh_expander * x, const char * s, size_t len, int quoted) {
+  size_t i;
+
+  if ((quoted && (x->mode & (NOOSH_X_PATTERN | NOOSH_X_REGEX))) ||
+      ((x->mode & NOOSH_X_GLOB) && noosh_has_glob_char(s, len))) {
+    for (i = 0; i < len; i++) {
+      noosh_x_char(x, s[i], quoted);
+    }
+  } else if (len > 0) {
+    noosh_buf_append(&x->field, s, len);
+    x->started = 1;
+  }
+}
+
+/*
+    @brief add the result of a substitution, split on IFS unless quoted
+*/
+void noosh_x_value(struct noosh_expander * x, const char * v, size_t len, int quoted) {
+  size_t i, j;
+
+  if (quoted || !(x->mode & NOOSH_X_SPLIT)) {
+    noosh_x_text(x, v, len, quoted);
+    x->started |= quoted;
+    return;
+  }
+  for (i = 0; i < len; i = j + 1) {
+    for (j = i; j < len && (strchr(x->ifs, v[j]) == NULL || v[j] == '\0'); j++);
+    noosh_x_text(x, v + i, j - i, 0);
+    if (j == len) {
+      break;
+    }
+    if (noosh_ifs_space(v[j], x->ifs)) {
+      noosh_x_field(x, 0);
+    } else {
+      noosh_x_field(x, 1);
+    }
+  }
+}
+
+char * noosh_command_subst(const char * src, size_t len);
+char * noosh_expand_string(const struct noosh_word * w, int mode);
+int noosh_arith_expand(const char * s, size_t len, long long * out);
+int noosh_arith_needs_expansion(const char * s, size_t len);
+
+/*
+    @brief look up a special or positional parameter
+    @param name: parameter name, not null terminated
+    @param len: its length
+    @param tmp: scratch space for numbers, at least 24 bytes
+    @return the value, NULL if unset
+*/
+const char * noosh_special_param(const char * name, size_t len, char * tmp) {
+  int i;
+
+  if (len == 1 && name[0] == '?') {
+    sprintf(tmp, "%d", noosh_last_status);
+    return tmp;
+  }
+  if (len == 1 && name[0] == '$') {
+    sprintf(tmp, "%d", (int) getpid());
+    return tmp;
+  }
+  if (len == 1 && name[0] == '#') {
+    sprintf(tmp, "%d", noosh_nparams);
+    return tmp;
+  }
+  if (isdigit((unsigned char) name[0])) {
+    i = atoi(name);
+    if (i == 0) {
+      return noosh_arg0;
+    }
+    return i <= noosh_nparams ? noosh_params[i - 1] : NULL;
+  }
+  return NULL;
+}
+
+/*
+    @brief the next element of a variable, in index or insertion order
+    @param v: the cell; a set scalar is a single element
+    @param pos: position, 0 to start, advanced past the element
+    @param keys: give the key rather than the value
+    @param tmp: scratch space for an index, at least 24 bytes
+    @return the element, NULL after the last
+*/
+const char * noosh_var_next(struct noosh_var * v, size_t * pos, int keys, char * tmp) {
+  struct noosh_assoc * m = v->assoc;
+
+  if (v->array) {
+    if (*pos >= v->array->n) {
+      return NULL;
+    }
+    if (keys) {
+      sprintf(tmp, "%lld", noosh_array_key(v->array, *pos));
+      return (*pos)++, tmp;
+    }
+    return v->array->items[(*pos)++];
+  }
+  if (m) {
+    while (*pos < m->n && m->entries[*pos].key == NULL) {
+      (*pos)++;
+    }
+    if (*pos >= m->n) {
+      return NULL;
+    }
+    (*pos)++;
+    return keys ? m->entries[*pos - 1].key : m->entries[*pos - 1].value;
+  }
+  if (*pos > 0 || noosh_var_value(v) == NULL) {
+    return NULL;
+  }
+  (*pos)++;
+  return keys ? "0" : noosh_var_value(v);
+}
+
+/*
+    @brief the number of elements of a variable
+*/
+size_t noosh_var_count(struct noosh_var * v) {
+  if (v->array) {
+    return v->array->n;
+  }
+  if (v->assoc) {
+    return v->assoc->count;
+  }
+  return noosh_var_value(v) != NULL;
+}
+
+/*
+    @brief add one item of a list substitution, $@, $* or ${name[@]}
+    @param x: expander
+    @param first: this is the first item
+    @param v: the item
+    @param at: "$@"-style, each item its own field when quoted; otherwise
+        quoted items are joined by the first character of IFS
+    @param quoted: inside double quotes
+*/
+void noosh_x_item(struct noosh_expander * x, int first, const char * v, int at, int quoted) {
+  if (!first) {
+    if (quoted && at) {
+      noosh_x_field(x, 1);
+    } else if (quoted) {
+      if (x->ifs[0]) {
+        noosh_x_char(x, x->ifs[0], 1);
+      }
+    } else {
+      noosh_x_field(x, 0);
+    }
+  }
+  noosh_x_value(x, v, strlen(v), quoted);
+}
+
+/*
+    @brief find the subscript of name[sub] in ${...}
+    @param s: text after the name
+    @param len: its length
+    @param sub: receives the subscript
+    @param sublen: receives its length
+    @return length of [sub], 0 if s does not start with one
+*/
+size_t noosh_subscript(const char * s, size_t len, const char ** sub, size_t * sublen) {
+  size_t i, depth = 0;
+
+  if (len == 0 || s[0] != '[') {
+    return 0;
+  }
+  for (i = 1; i < len; i++) {
+    if (s[i] == '[') {
+      depth++;
+    } else if (s[i] == ']' && depth-- == 0) {
+      *sub = s + 1;
+      *sublen = i - 1;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+/*
+    @brief substitute ${name[sub]}, ${#name[sub]} and ${!name[@]}
+    @param x: expander
+    @param v: the cell
+    @param sub: the subscript, not yet expanded
+    @param sublen: its length
+    @param length: ${#...}: the length of the element, or the number of
+        elements for @ and *
+    @param keys: ${!...}: the keys, for @ and *
+    @param quoted: inside double quotes
+    @return 0, -1 after printing an error
+*/
+int noosh_x_element(struct noosh_expander * x, struct noosh_var * v, const char * sub,
+                    size_t sublen, int length, int keys, int quoted) {
+  struct noosh_word w = {(char *) sub, sublen, NOOSH_W_QUOTED | NOOSH_W_EXPAND};
+  char tmp[24], * key;
+  const char * e;
+  size_t pos = 0;
+  int first = 1;
+
+  if (sublen == 1 && (sub[0] == '@' || sub[0] == '*')) {
+    if (length) {
+      sprintf(tmp, "%zu", noosh_var_count(v));
+      noosh_x_value(x, tmp, strlen(tmp), quoted);
+      return 0;
+    }
+    // Straight from the array into the fields, one per element when
+    // quoted: nothing is joined.
+    while ((e = noosh_var_next(v, &pos, keys, tmp)) != NULL) {
+      noosh_x_item(x, first, e, sub[0] == '@', quoted);
+      first = 0;
+    }
+    return 0;
+  }
+  if (keys) {
+    dprintf(NOOSH_FD(2), "noosh: %s[%.*s]: bad substitution\n", v->name, (int) sublen, sub);
+    return -1;
+  }
+  if ((key = noosh_expand_string(&w, 0)) == NULL) {
+    return -1;
+  }
+  if (noosh_var_get_elem(v, key, strlen(key), &e) < 0) {
+    free(key);
+    return -1;
+  }
+  free(key);
+  if (length) {
+    sprintf(tmp, "%zu", e ? strlen(e) : 0);
+    noosh_x_value(x, tmp, strlen(tmp), quoted);
+  } else if (e) {
+    noosh_x_value(x, e, strlen(e), quoted);
+  }
+  return 0;
+}
+
+/*
+  rest of a word after a brace, and what follows that in enclosing ones
+*/
+struct noosh_x_rest {
+  const char * s;
+  size_t len;
+  const struct noosh_x_rest * next;
+};
+
+/*
+  parameter operator other than a test, parsed once for all the values
+  it applies to
+    type: '#', '%', '/', '^' or ','; all: ##, %%, //, ^^ or ,,; anchor:
+    '#' or '%' for /#pattern and /%pattern; pat: NULL for ^ and , that
+    convert any character; repl: the replacement of /
+*/
+struct noosh_x_op {
+  int type;
+  int all;
+  int anchor;
+  struct noosh_pattern * pat;
+  char * repl;
+};
+
+/*
+    @brief apply a parameter operator to a value
+    @param o: the operator
+    @param v: the value
+    @return the result, allocated
+*/
+char * noosh_x_apply(const struct noosh_x_op * o, const char * v) {
+  struct noosh_buf b = {0};
+  size_t len = strlen(v), at = 0, mlen, i;
+  long k;
+
+  switch (o->type) {
+  case '#':
+    k = noosh_pat_prefix(o->pat, v, len, o->all);
+    return noosh_strdup(v + (k < 0 ? 0 : k));
+  case '%':
+    k = noosh_pat_suffix(o->pat, v, len, o->all);
+    return noosh_strndup(v, k < 0 ? len : (size_t) k);
+  case '/':
+    if (o->anchor == '#') {
+      k = noosh_pat_prefix(o->pat, v, len, 1);
+      noosh_buf_append(&b, o->repl, k < 0 ? 0 : strlen(o->repl));
+      noosh_buf_append(&b, v + (k < 0 ? 0 : k), len - (k < 0 ? 0 : k));
+    } else if (o->anchor == '%') {
+      k = noosh_pat_suffix(o->pat, v, len, 1);
+      noosh_buf_append(&b, v, k < 0 ? len : (size_t) k);
+      noosh_buf_append(&b, o->repl, k < 0 ? 0 : strlen(o->repl));
+    } else {
+      while (at < len && (k = noosh_pat_find(o->pat, v + at, len - at, &mlen)) >= 0) {
+        noosh_buf_append(&b, v + at, k);
+        noosh_buf_append(&b, o->repl, strlen(o->repl));
+        at += k + mlen;
+        if (!o->all) {
+          break;
+        }
+      }
+      noosh_buf_append(&b, v + at, len - at);
+    }
+    return b.data;
+  }
+  // ^ and , convert the first character, or all of them, that match.
+  b.data = noosh_strdup(v);
+  for (i = 0; i < (o->all ? len : len > 0); i++) {
+    if (o->pat == NULL || noosh_pat_match(o->pat, v + i, 1)) {
+      b.data[i] = o->type == '^' ? toupper((unsigned char) v[i]) : tolower((unsigned char) v[i]);
+    }
+  }
+  return b.data;
+}
+
+/*
+    @brief find a character outside quotes and nested substitutions, the
+        / of ${name/pattern/string} or the : of ${name:offset:length}
+    @return its index, len if there is none
+*/
+size_t noosh_x_find(const char * s, size_t len, char c) {
+  size_t i, j;
+  int depth = 0;
+
+  for (i = 0; i < len; i++) {
+    if (s[i] == c && depth == 0) {
+      return i;
+    }
+    switch (s[i]) {
+    case '\\':
+      i++;
+      break;
+    case '\'':
+      while (++i < len && s[i] != '\'');
+      break;
+    case '"':
+      while (++i < len && s[i] != '"') {
+        i += s[i] == '\\';
+      }
+      break;
+    case '$':
+    case '`':
+      if ((s[i] == '`' || (i + 1 < len && (s[i + 1] == '(' || s[i + 1] == '{'))) &&
+          (j = noosh_skip_nested(s, len, s[i] == '`' ? i : i + 1)) > 0) {
+        i = j - 1;
+      }
+      break;
+    case '(':
+      depth++;
+      break;
+    case ')':
+      depth--;
+    }
+  }
+  return len;
+}
+
+/*
+    @brief expand a piece of an operator, the pattern or the string
+    @param s: its text
+    @param len: its length
+    @param mode: 0, or NOOSH_X_PATTERN
+    @return allocated string, NULL after printing an error
+*/
+char * noosh_x_op_word(const char * s, size_t len, int mode) {
+  struct noosh_word w = {(char *) s, len, NOOSH_W_QUOTED | NOOSH_W_EXPAND};
+
+  if (!noosh_arith_needs_expansion(s, len)) {
+    return noosh_strndup(s, len);
+  }
+  return noosh_expand_string(&w, mode);
+}
+
+/*
+    @brief take the ${name:offset:length} part of a string or a list
+    @param op: the text after the first :
+    @param len: its length
+    @param n: the length of the string, or the number of items
+    @param from: receives where the part starts
+    @param to: receives where it ends
+    @return 0, -1 after printing an error
+*/
+int noosh_x_substring(const char * op, size_t len, size_t n, size_t * from, size_t * to) {
+  size_t colon = noosh_x_find(op, len, ':');
+  long long off, count;
+
+  if (noosh_arith_expand(op, colon, &off) < 0) {
+    return -1;
+  }
+  if (off < 0) {
+    off += n;
+  }
+  if (off < 0 || (size_t) off > n) {
+    *from = *to = 0;
+    return 0;
+  }
+  *from = off;
+  *to = n;
+  if (colon < len) {
+    if (noosh_arith_expand(op + colon + 1, len - colon - 1, &count) < 0) {
+      return -1;
+    }
+    if (count < 0 && (count += n - off) < 0) {
+      dprintf(NOOSH_FD(2), "noosh: %.*s: substring expression < 0\n", (int) (len - colon - 1), op + colon + 1);
+      return -1;
+    }
+    if ((size_t) count < n - off) {
+      *to = off + count;
+    }
+  }
+  return 0;
+}
+
+int noosh_x_part(struct noosh_expander * x, const char * s, size_t len, int dq,
+                 const struct noosh_x_rest * rest, int start);
+
+/*
+    @brief substitute a parameter with an operator: the tests
+        ${name-word}, ${name=word}, ${name+word} and ${name?word} (each
+        also with a : that makes an empty value count as unset), the
+        pattern removals ${name#pattern} and ${name%pattern}, the
+        replacements ${name/pattern/string}, ${name:offset:length} and
+        the case conversions ${name^pattern} and ${name,pattern}; on
+        $@, $* and ${name[@]} they apply to each item
+    @param x: expander
+    @param site: the text of the substitution, which its compiled pattern
+        is kept by
+    @param name: the parameter name
+    @param nlen: its length
+    @param sub: the subscript of name[sub], NULL if there is none
+    @param sublen: its length
+    @param op: the operator and its words
+    @param oplen: their length
+    @param quoted: inside double quotes
+    @return 0, -1 after printing an error
+*/
+int noosh_x_op(struct noosh_expander * x, const char * site, const char * name, size_t nlen,
+               const char * sub, size_t sublen, const char * op, size_t oplen, int quoted) {
+  struct noosh_x_op o = {op[0], 0, 0, NULL, NULL};
+  const char ** items = NULL, * value = NULL, * e;
+  char tmp[24], * nm = noosh_strndup(name, nlen), * key, * text, * p, ** results;
+  size_t n = 0, pos = 0, skip = 0, i, from, to, slash;
+  int list = 0, at = 0, r = -1, colon, use, saved;
+  struct noosh_var * v = NULL;
+
+  // The value, or the items of a list.
+  if (sub && sublen == 1 && (sub[0] == '@' || sub[0] == '*')) {
+    list = 1;
+    at = sub[0] == '@';
+    v = noosh_var_cell(nm);
+    items = noosh_malloc((noosh_var_count(v) + 1) * sizeof(*items));
+    while ((e = noosh_var_next(v, &pos, 0, tmp)) != NULL) {
+      items[n++] = e;
+    }
+  } else if (sub) {
+    if ((key = noosh_x_op_word(sub, sublen, 0)) == NULL) {
+      goto out;
+    }
+    v = noosh_var_cell(nm);
+    if (noosh_var_get_elem(v, key, strlen(key), &value) < 0) {
+      free(key);
+      goto out;
+    }
+    free(key);
+  } else if (nlen == 1 && (name[0] == '@' || name[0] == '*')) {
+    // $0 is item 0, which only an offset of 0 reaches.
+    list = 1;
+    at = name[0] == '@';
+    items = noosh_malloc((noosh_nparams + 2) * sizeof(*items));
+    items[n++] = noosh_arg0;
+    for (i = 0; i < (size_t) noosh_nparams; i++) {
+      items[n++] = noosh_params[i];
+    }
+    skip = 1;
+  } else if (noosh_valid_name(nm)) {
+    value = noosh_getvar(nm);
+  } else {
+    value = noosh_special_param(name, nlen, tmp);
+  }
+  if (list && !(o.type == ':' && !(oplen > 1 && strchr("-=+?", op[1])))) {
+    // Only ${@:offset} sees $0.
+    items += skip;
+    n -= skip;
+  } else {
+    skip = 0;
+  }
+
+  colon = o.type == ':' && oplen > 1 && strchr("-=+?", op[1]);
+  if (colon || strchr("-=+?", o.type)) {
+    op += colon + 1;
+    oplen -= colon + 1;
+    o.type = op[-1];
+    if (list) {
+      use = colon ? n == 0 || (n == 1 && items[0][0] == '\0') : n == 0;
+    } else {
+      use = colon ? value == NULL || value[0] == '\0' : value == NULL;
+    }
+    if (o.type == '+') {
+      use = !use;
+    }
+    if (use && (o.type == '-' || o.type == '+')) {
+      // The word is expanded in place, split like the rest of the word.
+      saved = x->brace;
+      x->brace = 0;
+      r = noosh_x_part(x, op, oplen, quoted, NULL, 1);
+      x->brace = saved;
+      goto out;
+    }
+    if (use && o.type == '?') {
+      text = oplen ? noosh_x_op_word(op, oplen, 0) : noosh_strdup("parameter null or not set");
+      if (text) {
+        dprintf(NOOSH_FD(2), "noosh: %s: %s\n", nm, text);
+        free(text);
+      }
+      if (!noosh_interactive) {
+        noosh_exit_code = 1;
+        noosh_exit_pending = 1;
+      }
+      goto out;
+    }
+    if (use && o.type == '=') {
+      if (list || sub || !noosh_valid_name(nm)) {
+        dprintf(NOOSH_FD(2), "noosh: $%s: cannot assign in this way\n", nm);
+        goto out;
+      }
+      if ((text = noosh_x_op_word(op, oplen, 0)) == NULL) {
+        goto out;
+      }
+      if (noosh_setvar(nm, text) < 0) {
+        free(text);
+        goto out;
+      }
+      noosh_x_value(x, text, strlen(text), quoted);
+      free(text);
+      r = 0;
+      goto out;
+    }
+    if (o.type == '+') {
+      r = 0;
+      goto out;
+    }
+    for (i = 0; list && i < n; i++) {
+      noosh_x_item(x, i == 0, items[i], at, quoted);
+    }
+    if (!list && value) {
+      noosh_x_value(x, value, strlen(value), quoted);
+    }
+    r = 0;
+    goto out;
+  }
+
+  if (o.type == ':') {
+    if (noosh_x_substring(op + 1, oplen - 1, list ? n : value ? strlen(value) : 0, &from, &to) < 0) {
+      goto out;
+    }
+    for (i = from; list && i < to; i++) {
+      noosh_x_item(x, i == from, items[i], at, quoted);
+    }
+    if (!list && value) {
+      noosh_x_value(x, value + from, to - from, quoted);
+    }
+    r = 0;
+    goto out;
+  }
+
+  if (!strchr("#%/^,", o.type)) {
+    dprintf(NOOSH_FD(2), "noosh: ${%.*s%.*s}: bad substitution\n", (int) nlen, name, (int) oplen, op);
+    goto out;
+  }
+  op++;
+  oplen--;
+  if (oplen > 0 && op[0] == o.type && o.type != '/') {
+    o.all = 1;
+    op++;
+    oplen--;
+  } else if (o.type == '/' && oplen > 0 && strchr("/#%", op[0])) {
+    o.all = op[0] == '/';
+    o.anchor = op[0] == '/' ? 0 : op[0];
+    op++;
+    oplen--;
+  }
+  slash = o.type == '/' ? noosh_x_find(op, oplen, '/') : oplen;
+  if (o.type == '/' && (o.repl = slash < oplen ? noosh_x_op_word(op + slash + 1, oplen - slash - 1, 0) :
+                                                 noosh_strdup("")) == NULL) {
+    goto out;
+  }
+  if (slash > 0 || (o.type != '^' && o.type != ',')) {
+    if ((p = noosh_x_op_word(op, slash, NOOSH_X_PATTERN)) == NULL) {
+      goto out;
+    }
+    o.pat = noosh_pat_get(site, p);
+    free(p);
+  }
+  if (list) {
+    results = noosh_malloc((n + 1) * sizeof(*results));
+    for (i = 0; i < n; i++) {
+      results[i] = noosh_x_apply(&o, items[i]);
+    }
+    for (i = 0; i < n; i++) {
+      noosh_x_item(x, i == 0, results[i], at, quoted);
+      free(results[i]);
+    }
+    free(results);
+  } else if (value) {
+    text = noosh_x_apply(&o, value);
+    noosh_x_value(x, text, strlen(text), quoted);
+    free(text);
+  }
+  if (o.pat) {
+    noosh_pat_release(o.pat);
+  }
+  r = 0;
+
+out:
+  free(o.repl);
+  free(items ? items - skip : NULL);
+  free(nm);
+  return r;
+}
+
+/*
+    @brief substitute the parameter of a $ at s[i]
+    @param x: expander
+    @param s: word text
+    @param len: its length
+    @param i: index of the `$'
+    @param quoted: inside double quotes
+    @return index past the substitution, 0 after printing an error
+*/
+size_t noosh_x_dollar(struct noosh_expander * x, const char * s, size_t len,
+                      size_t i, int quoted) {
+  char tmp[24], * name, * sub, * ref;
+  const char * v, * sub2;
+  size_t j, k, m, nlen, sublen;
+  long long num;
+  int length = 0, indirect = 0, p;
+
+  if (i + 1 >= len) {
+    noosh_x_char(x, '$', quoted);
+    return i + 1;
+  }
+  if (s[i + 1] == '(' || s[i + 1] == '{') {
+    if ((j = noosh_skip_nested(s, len, i + 1)) == 0) {
+      dprintf(NOOSH_FD(2), "noosh: %.*s: bad substitution\n", (int) (len - i), s + i);
+      return 0;
+    }
+  }
+  if (s[i + 1] == '(') {
+    if (s[i + 2] == '(' && s[j - 2] == ')') {
+      if (noosh_arith_expand(s + i + 3, j - i - 5, &num) < 0) {
+        return 0;
+      }
+      sprintf(tmp, "%lld", num);
+      noosh_x_value(x, tmp, strlen(tmp), quoted);
+      return j;
+    }
+    sub = noosh_command_subst(s + i + 2, j - i - 3);
+    noosh_x_value(x, sub, strlen(sub), quoted);
+    free(sub);
+    return j;
+  }
+
+  if (s[i + 1] == '{') {
+    k = i + 2;
+    // ${#:-word} is $# with an operator, not a length.
+    if (s[k] == '#' && j - k > 2 && !strchr(":-=+?%/^,", s[k + 1])) {
+      length = 1;
+      k++;
+    } else if (s[k] == '!' && j - k > 2) {
+      indirect = 1;
+      k++;
+    }
+    nlen = noosh_name_len(s + k, j - 1 - k);
+    sublen = 0;
+    m = nlen > 0 ? noosh_subscript(s + k + nlen, j - 1 - k - nlen, &sub2, &sublen) : 0;
+    if (nlen == 0 && k < j - 1) {
+      for (; k + nlen < j - 1 && isdigit((unsigned char) s[k + nlen]); nlen++);
+      nlen += nlen == 0 && strchr("?$#@*", s[k]);
+    }
+    if (nlen > 0 && k + nlen + m < j - 1 && !length && !indirect) {
+      return noosh_x_op(x, s + i, s + k, nlen, m ? sub2 : NULL, sublen, s + k + nlen + m,
+                        j - 1 - k - nlen - m, quoted) < 0 ? 0 : j;
+    }
+    if (m > 0 && k + nlen + m == j - 1) {
+      name = noosh_strndup(s + k, nlen);
+      if (indirect && !(sublen == 1 && (sub2[0] == '@' || sub2[0] == '*'))) {
+        free(name);
+        dprintf(NOOSH_FD(2), "noosh: %.*s: bad substitution\n", (int) (j - i), s + i);
+        return 0;
+      }
+      p = noosh_x_element(x, noosh_var_cell(name), sub2, sublen, length, indirect, quoted);
+      free(name);
+      return p < 0 ? 0 : j;
+    }
+    nlen = j - 1 - k;
+  } else {
+    k = i + 1;
+    if (isalpha((unsigned char) s[k]) || s[k] == '_') {
+      for (nlen = 1; k + nlen < len && (isalnum((unsigned char) s[k + nlen]) || s[k + nlen] == '_'); nlen++);
+    } else if (strchr("?$#@*0123456789", s[k])) {
+      nlen = 1;
+    } else {
+      noosh_x_char(x, '$', quoted);
+      return i + 1;
+    }
+    j = k + nlen;
+  }
+
+  name = noosh_malloc(nlen + 1);
+  memcpy(name, s + k, nlen);
+  name[nlen] = '\0';
+  if (nlen == 1 && (name[0] == '@' || name[0] == '*') && !length && !indirect) {
+    // "$@" gives one field per parameter, "$*" one field joined by the
+    // first character of IFS; unquoted, both are split.
+    for (p = 0; p < noosh_nparams; p++) {
+      noosh_x_item(x, p == 0, noosh_params[p], name[0] == '@', quoted);
+    }
+    free(name);
+    return j;
+  }
+  if (!(noosh_valid_name(name) || strchr("?$#", name[0]) ||
+        strspn(name, "0123456789") == nlen) || nlen == 0) {
+    dprintf(NOOSH_FD(2), "noosh: %.*s: bad substitution\n", (int) (j - i), s + i);
+    free(name);
+    return 0;
+  }
+  v = noosh_valid_name(name) ? noosh_getvar(name) : noosh_special_param(name, nlen, tmp);
+  free(name);
+  if (indirect) {
+    // ${!ref}: the value of ref names the parameter, or an element.
+    nlen = v ? noosh_name_len(v, strlen(v)) : 0;
+    if (v && v[0] && strspn(v, "0123456789") == strlen(v)) {
+      nlen = strlen(v);
+    }
+    if (nlen == 0 || (v[nlen] && (noosh_subscript(v + nlen, strlen(v + nlen), &sub2, &sublen) != strlen(v + nlen)))) {
+      dprintf(NOOSH_FD(2), "noosh: %s: invalid indirect expansion\n", v ? v : "");
+      return 0;
+    }
+    ref = noosh_malloc(strlen(v) + 4);
+    sprintf(ref, "${%s}", v);
+    m = noosh_x_dollar(x, ref, strlen(ref), 0, quoted);
+    free(ref);
+    return m ? j : 0;
+  }
+  if (length) {
+    sprintf(tmp, "%zu", v ? strlen(v) : 0);
+    noosh_x_value(x, tmp, strlen(tmp), quoted);
+  } else if (v) {
+    noosh_x_value(x, v, strlen(v), quoted);
+  }
+  return j;
+}
+
+/*
+    @brief substitute a `command` at s[i]
+    @return index past it
+*/
+size_t noosh_x_backquote(struct noosh_expander * x, const char * s, size_t len,
+                         size_t i, int quoted) {
+  struct noosh_buf src = {0};
+  size_t j;
+  char * sub;
+
+  for (j = i + 1; j < len && s[j] != '`'; j++) {
+    // Inside backquotes, a backslash only escapes $, ` and itself.
+    if (s[j] == '\\' && j + 1 < len && strchr("$`\\", s[j + 1])) {
+      j++;
+    }
+    noosh_buf_append(&src, s + j, 1);
+  }
+  sub = noosh_command_subst(src.data ? src.data : "", src.len);
+  noosh_x_value(x, sub, strlen(sub), quoted);
+  free(sub);
+  free(src.data);
+  return j + 1;
+}
+
+int noosh_x_compound(const struct noosh_word * w, const struct noosh_assign_parts * p,
+                     struct noosh_args * out);
+
+/*
+    @brief substitute the ~ or ~user that starts at s[i], ending at a /
+        or the end of the word, or at a : in an assignment
+    @return index past it, 0 if it is to stay as it is: it is quoted or
+        names no user
+*/
+size_t noosh_x_tilde(struct noosh_expander * x, const char * s, size_t len, size_t i) {
+  char cwd[PATH_MAX], * name;
+  const char * dir = NULL;
+  struct passwd * pw;
+  size_t j;
+
+  for (j = i + 1; j < len && s[j] != '/' && !(s[j] == ':' && (x->mode & NOOSH_X_ASSIGN)); j++) {
+    if (strchr("'\"\\$`{}", s[j])) {
+      return 0;
+    }
+  }
+  name = noosh_strndup(s + i + 1, j - i - 1);
+  if (name[0] == '\0') {
+    if ((dir = noosh_getvar("HOME")) == NULL && (pw = getpwuid(getuid())) != NULL) {
+      dir = pw->pw_dir;
+    }
+  } else if (strcmp(name, "+") == 0) {
+    dir = getcwd(cwd, sizeof(cwd));
+  } else if (strcmp(name, "-") == 0) {
+    dir = noosh_getvar("OLDPWD");
+  } else if ((pw = getpwnam(name)) != NULL) {
+    dir = pw->pw_dir;
+  }
+  free(name);
+  if (dir == NULL) {
+    return 0;
+  }
+  noosh_x_value(x, dir, strlen(dir), 1);
+  return j;
+}
+
+/*
+    @brief find the end of the next alternative of a brace
+    @param s: text
+    @param len: its length
+    @param i: where the alternative starts, after the { or a ,
+    @return index of the , or } that ends it, len if there is none
+*/
+size_t noosh_brace_next(const char * s, size_t len, size_t i) {
+  size_t j;
+  int depth = 0;
+
+  for (; i < len; i++) {
+    switch (s[i]) {
+    case '\\':
+      i++;
+      break;
+    case '\'':
+      while (++i < len && s[i] != '\'');
+      break;
+    case '"':
+      while (++i < len && s[i] != '"') {
+        i += s[i] == '\\';
+      }
+      break;
+    case '$':
+    case '`':
+      if ((s[i] == '`' || (i + 1 < len && (s[i + 1] == '(' || s[i + 1] == '{'))) &&
+          (j = noosh_skip_nested(s, len, s[i] == '`' ? i : i + 1)) > 0) {
+        i = j - 1;
+      }
+      break;
+    case '{':
+      depth++;
+      break;
+    case '}':
+      if (depth-- == 0) {
+        return i;
+      }
+      break;
+    case ',':
+      if (depth == 0) {
+        return i;
+      }
+    }
+  }
+  return len;
+}
+
+/*
+  what the expansion of a word gave before a brace, repeated in front of
+  each alternative: the fields it finished and the current one
+*/
+struct noosh_x_prefix {
+  int first;
+  int nfields;
+  char * field;
+  size_t len;
+  int started;
+  int glob;
+  int escaped;
+  int count;
+};
+
+int noosh_x_scan(struct noosh_expander * x, const char * s, size_t len,
+                 const struct noosh_x_rest * rest, int start);
+
+/*
+    @brief note what came before a brace
+*/
+void noosh_x_prefix_save(struct noosh_expander * x, struct noosh_x_prefix * p) {
+  p->first = x->first;
+  p->nfields = x->out->n - x->first;
+  p->field = noosh_strndup(x->field.data ? x->field.data : "", x->field.len);
+  p->len = x->field.len;
+  p->started = x->started;
+  p->glob = x->glob;
+  p->escaped = x->escaped;
+  p->count = 0;
+}
+
+/*
+    @brief expand one alternative of a brace and the rest of the word
+    @param x: expander
+    @param p: what came before the brace, put back from the second
+        alternative on
+    @param s: text of the alternative
+    @param len: its length
+    @param rest: the rest of the word
+    @param start: the brace starts the word, so a ~ may start the
+        alternative
+    @return 0, -1 after printing an error
+*/
+int noosh_x_alt(struct noosh_expander * x, struct noosh_x_prefix * p, const char * s, size_t len,
+                const struct noosh_x_rest * rest, int start) {
+  int i;
+
+  if (p->count++ > 0) {
+    x->first = x->out->n;
+    for (i = 0; i < p->nfields; i++) {
+      noosh_args_push(x->out, noosh_x_copy(x, x->out->v[p->first + i], strlen(x->out->v[p->first + i])));
+    }
+    x->field.len = 0;
+    noosh_buf_append(&x->field, p->field, p->len);
+    x->started = p->started;
+    x->glob = p->glob;
+    x->escaped = p->escaped;
+  }
+  return noosh_x_scan(x, s, len, rest, start);
+}
+
+/*
+  range of integers or of characters, counted one value at a time
+    n is the next value, to the last one and step the signed increment;
+    width pads numbers with zeros, chars makes values single characters
+*/
+struct noosh_range {
+  long long n;
+  long long to;
+  long long step;
+  int width;
+  int chars;
+  int done;
+};
+
+/*
+    @brief parse the inside of a {from..to} or {from..to..step} brace
+    @param s: text between the braces
+    @param len: its length
+    @param r: the range, counting from from to to
+    @return 1 if it is a range, 0 if not
+*/
+int noosh_range_parse(const char * s, size_t len, struct noosh_range * r) {
+  long long from, to, step = 1;
+  char * text, * end, * dots;
+  int width = 0, chars;
+
+  text = noosh_strndup(s, len);
+  if ((dots = strstr(text, "..")) == NULL || dots == text) {
+    free(text);
+    return 0;
+  }
+  *dots = '\0';
+  dots += 2;
+  chars = strlen(text) == 1 && strlen(dots) >= 1 && !isdigit((unsigned char) text[0]) &&
+          text[0] != '-' && (dots[1] == '\0' || strncmp(dots + 1, "..", 2) == 0);
+  if (chars) {
+    from = (unsigned char) text[0];
+    to = (unsigned char) dots[0];
+    end = dots + 1;
+  } else {
+    from = strtoll(text, &end, 10);
+    if (*end || !isdigit((unsigned char) text[text[0] == '-'])) {
+      free(text);
+      return 0;
+    }
+    to = strtoll(dots, &end, 10);
+    if (end == dots || !isdigit((unsigned char) dots[dots[0] == '-'])) {
+      free(text);
+      return 0;
+    }
+    // A leading 0 on either end pads all values to the longer one.
+    if (text[text[0] == '-'] == '0' || dots[dots[0] == '-'] == '0') {
+      width = strlen(text) > (size_t) (end - dots) ? strlen(text) : (size_t) (end - dots);
+    }
+  }
+  if (*end) {
+    if (strncmp(end, "..", 2) != 0 || !isdigit((unsigned char) end[2 + (end[2] == '-')])) {
+      free(text);
+      return 0;
+    }
+    step = strtoll(end + 2, &end, 10);
+    if (*end) {
+      free(text);
+      return 0;
+    }
+  }
+  free(text);
+  step = step < 0 ? -step : step ? step : 1;
+  *r = (struct noosh_range) {from, to, from <= to ? step : -step, width, chars, 0};
+  return 1;
+}
+
+/*
+    @brief take the next value of a range
+    @param r: the range
+    @param tmp: gets the value as text
+    @return 1, 0 when the range is over
+*/
+int noosh_range_next(struct noosh_range * r, char tmp[24]) {
+  if (r->done || (r->step > 0 ? r->n > r->to : r->n < r->to)) {
+    r->done = 1;
+    return 0;
+  }
+  if (r->chars) {
+    tmp[0] = r->n;
+    tmp[1] = '\0';
+  } else {
+    snprintf(tmp, 24, "%0*lld", r->width, r->n);
+  }
+  // Stop rather than wrap around at the end of long long.
+  if (__builtin_add_overflow(r->n, r->step, &r->n)) {
+    r->done = 1;
+  }
+  return 1;
+}
+
+/*
+    @brief expand a {from..to} or {from..to..step} range of integers, or
+        of single characters, as a brace with one alternative per value
+    @param x: expander
+    @param s: text between the braces
+    @param len: its length
+    @param rest: the rest of the word
+    @return 1 if expanded, 0 if it is not a range, -1 after an error
+*/
+int noosh_x_range(struct noosh_expander * x, const char * s, size_t len,
+                  const struct noosh_x_rest * rest) {
+  struct noosh_x_prefix p;
+  struct noosh_range range;
+  char tmp[25];
+  int r = 0;
+
+  if (!noosh_range_parse(s, len, &range)) {
+    return 0;
+  }
+  noosh_x_prefix_save(x, &p);
+  while (r == 0 && noosh_range_next(&range, tmp + 1)) {
+    if (range.chars) {
+      // Escaped, a character that is a quote or $ stays as it is.
+      tmp[0] = '\\';
+      r = noosh_x_alt(x, &p, tmp, 2, rest, 0);
+    } else {
+      r = noosh_x_alt(x, &p, tmp + 1, strlen(tmp + 1), rest, 0);
+    }
+  }
+  free(p.field);
+  return r < 0 ? -1 : 1;
+}
+
+/*
+    @brief expand the brace that starts at s[i], if it is one: {a,b,...}
+        or a range
+    @param x: expander
+    @param s: text
+    @param len: its length
+    @param i: index of the {
+    @param rest: what follows s
+    @param start: s starts the word
+    @return 1 if expanded, with the rest of the word, 0 if it is not a
+        brace, -1 after an error
+*/
+int noosh_x_brace(struct noosh_expander * x, const char * s, size_t len, size_t i,
+                  const struct noosh_x_rest * rest, int start) {
+  struct noosh_x_rest after;
+  struct noosh_x_prefix p;
+  size_t j, end;
+  int r = 0;
+
+  for (end = noosh_brace_next(s, len, i + 1); end < len && s[end] == ','; end = noosh_brace_next(s, len, end + 1));
+  if (end == len) {
+    return 0;
+  }
+  after = (struct noosh_x_rest) {s + end + 1, len - end - 1, rest};
+  j = noosh_brace_next(s, len, i + 1);
+  if (j == end) {
+    return noosh_x_range(x, s + i + 1, end - i - 1, &after);
+  }
+  noosh_x_prefix_save(x, &p);
+  for (j = i; r == 0 && j < end; j = noosh_brace_next(s, len, j + 1)) {
+    r = noosh_x_alt(x, &p, s + j + 1, noosh_brace_next(s, len, j + 1) - j - 1, &after, start && i == 0);
+  }
+  free(p.field);
+  return r < 0 ? -1 : 1;
+}
+
+/*
+    @brief check for a character that starts a quote or an expansion
+*/
+int noosh_x_special(char c) {
+  return c == '\'' || c == '"' || c == '\\' || c == '$' || c == '`' || c == '{' || c == '~';
+}
+
+/*
+    @brief expand a piece of text into the current fields
+    @param x: expander
+    @param s: the text
+    @param len: its length
+    @param dq: it starts inside double quotes
+    @param rest: what follows it after a brace, NULL at the end
+    @param start: s starts the word
+    @return 0 at the end of s, 1 if a brace went on to the end of the
+        word, -1 after printing an error
+*/
+int noosh_x_part(struct noosh_expander * x, const char * s, size_t len, int dq,
+                 const struct noosh_x_rest * rest, int start) {
+  size_t i = 0, j;
+  int r;
+
+  while (i < len) {
+    switch (s[i]) {
+    case '\'':
+      if (dq) {
+        noosh_x_char(x, s[i++], 1);
+        break;
+      }
+      for (j = ++i; j < len && s[j] != '\''; j++);
+      noosh_x_text(x, s + i, j - i, 1);
+      x->started = 1;
+      i = j + 1;
+      break;
+    case '"':
+      dq = !dq;
+      x->started = 1;
+      i++;
+      break;
+    case '\\':
+      if (i + 1 >= len) {
+        noosh_x_char(x, s[i++], dq);
+      } else if (s[i + 1] == '\n') {
+        i += 2;
+      } else if (dq && !strchr("$`\"\\", s[i + 1])) {
+        noosh_x_char(x, s[i++], 1);
+      } else {
+        noosh_x_char(x, s[i + 1], 1);
+        i += 2;
+      }
+      break;
+    case '$':
+      if ((i = noosh_x_dollar(x, s, len, i, dq)) == 0) {
+        return -1;
+      }
+      break;
+    case '`':
+      i = noosh_x_backquote(x, s, len, i, dq);
+      break;
+    case '~':
+      if (dq || !((start && i == 0) || ((x->mode & NOOSH_X_ASSIGN) && i > 0 && s[i - 1] == ':')) ||
+          (j = noosh_x_tilde(x, s, len, i)) == 0) {
+        noosh_x_char(x, s[i++], dq);
+      } else {
+        i = j;
+      }
+      break;
+    case '{':
+      if (!dq && x->brace && (x->mode & NOOSH_X_SPLIT) && (r = noosh_x_brace(x, s, len, i, rest, start)) != 0) {
+        // The alternatives went on to the end of the word.
+        return r;
+      }
+      noosh_x_char(x, s[i++], dq);
+      break;
+    default:
+      for (j = i + 1; j < len && !noosh_x_special(s[j]); j++);
+      noosh_x_text(x, s + i, j - i, dq);
+      i = j;
+    }
+  }
+  return 0;
+}
+
+/*
+    @brief expand the text of a word, or a piece of it, then the rest
+        after it, and end the word
+    @param x: expander
+    @param s: the text
+    @param len: its length
+    @param rest: what follows it after a brace, NULL at the end
+    @param start: s starts the word
+    @return 0, -1 after printing an error
+*/
+int noosh_x_scan(struct noosh_expander * x, const char * s, size_t len,
+                 const struct noosh_x_rest * rest, int start) {
+  int r = noosh_x_part(x, s, len, 0, rest, start);
+
+  if (r != 0) {
+    return r < 0 ? -1 : 0;
+  }
+  if (rest) {
+    return noosh_x_scan(x, rest->s, rest->len, rest->next, 0);
+  }
+  noosh_x_field(x, !(x->mode & NOOSH_X_SPLIT));
+  return 0;
+}
+
+/*
+    @brief expand a word into fields
+    @param w: the word
+    @param mode: NOOSH_X_SPLIT to split unquoted substitutions into
+        several fields, expand braces and (unless noglob is set) expand
+        unquoted wildcards to paths, NOOSH_X_PATTERN to keep quoted
+        glob characters literal, NOOSH_X_REGEX to keep quoted regex
+        characters literal, NOOSH_X_ASSIGN for the value of an
+        assignment, where a ~ may also follow a :; without SPLIT the word
+        gives exactly one field
+    @param out: fields are appended here
+    @param arena: where the fields are allocated, NULL to malloc them
+    @return 0 on success, -1 after printing an error
+*/
+int noosh_expand_word_in(const struct noosh_word * w, int mode, struct noosh_args * out,
+                         struct noosh_arena * arena) {
+  struct noosh_expander x = {mode, NULL, out, {0}, 0, out->n, arena, (w->flags & NOOSH_W_BRACE) != 0, 0, 0};
+  struct noosh_args tmp = {0};
+  struct noosh_assign_parts p;
+  const char * s = w->s;
+  size_t len = w->len, n;
+  int first = out->n, i, r;
+  char * name;
+
+  if ((mode & NOOSH_X_SPLIT) && !noosh_opt_noglob) {
+    x.mode |= NOOSH_X_GLOB;
+  }
+  if (w->flags == 0 || (w->flags == NOOSH_W_GLOB && !(x.mode & NOOSH_X_GLOB))) {
+    noosh_args_push(out, noosh_x_copy(&x, s, len));
+    return 0;
+  }
+  if (len == 4 && memcmp(s, "\"$@\"", 4) == 0 && noosh_nparams == 0) {
+    return 0;
+  }
+  if (len > 8 && memcmp(s, "\"${", 3) == 0 && memcmp(s + len - 5, "[@]}\"", 5) == 0 &&
+      noosh_name_len(s + 3, len - 8) == len - 8) {
+    // "${name[@]}" of an empty array gives no field at all.
+    name = noosh_strndup(s + 3, len - 8);
+    n = noosh_var_count(noosh_var_cell(name));
+    free(name);
+    if (n == 0) {
+      return 0;
+    }
+  }
+  if ((w->flags & NOOSH_W_EXPAND) && noosh_split_assignment(s, len, &p) && p.compound) {
+    if (arena == NULL) {
+      return noosh_x_compound(w, &p, out);
+    }
+    if ((r = noosh_x_compound(w, &p, &tmp)) == 0) {
+      for (i = 0; i < tmp.n; i++) {
+        noosh_args_push(out, noosh_x_copy(&x, tmp.v[i], strlen(tmp.v[i])));
+      }
+    }
+    noosh_args_free(&tmp);
+    return r;
+  }
+  x.ifs = noosh_getvar("IFS");
+  if (x.ifs == NULL) {
+    x.ifs = " \t\n";
+  }
+  r = noosh_x_scan(&x, s, len, NULL, 1);
+  free(x.field.data);
+  if (r < 0) {
+    while (out->n > first) {
+      out->n--;
+      if (arena == NULL) {
+        free(out->v[out->n]);
+      }
+    }
+    if (out->v) {
+      out->v[out->n] = NULL;
+    }
+  }
+  return r;
+}
+
+/*
+    @brief expand a word into allocated fields, see noosh_expand_word_in
+*/
+int noosh_expand_word(const struct noosh_word * w, int mode, struct noosh_args * out) {
+  return noosh_expand_word_in(w, mode, out, NULL);
+}
+
+/*
+    @brief expand the words of a command into fields
+    @param words: the words
+    @param n: how many
+    @param out: receives the fields
+    @return 0 on success, -1 after printing an error
+*/
+int noosh_expand_words(const struct noosh_word * words, int n, struct noosh_args * out) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (noosh_expand_word(&words[i], NOOSH_X_SPLIT, out) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+    @brief expand a word into a single string, without splitting
+    @param w: the word
+    @param mode: 0, NOOSH_X_PATTERN for case patterns or NOOSH_X_ASSIGN
+        for assignment values
+    @return allocated string, NULL after printing an error
+*/
+char * noosh_expand_string(const struct noosh_word * w, int mode) {
+  struct noosh_args a = {0};
+  char * s;
+
+  if (noosh_expand_word(w, mode, &a) < 0) {
+    noosh_args_free(&a);
+    return NULL;
+  }
+  // "$@" without parameters gives no field at all.
+  s = a.n > 0 ? a.v[0] : noosh_strdup("");
+  free(a.v);
+  return s;
+}
+
+/*
+    @brief expand the elements of an array list, the text inside
+        name=(...): a [key]=value element gives one key and value, any
+        other word gives its fields as values without keys
+    @param s: the text
+    @param len: its length
+    @param keys: receives the key of each value, NULL where it has none
+    @param values: receives the values
+    @return 0 on success, -1 after printing an error
+*/
+int noosh_compound_elems(const char * s, size_t len, struct noosh_args * keys, struct noosh_args * values) {
+  struct noosh_word key, value;
+  struct noosh_parser ps;
+  const char * sub;
+  size_t m, sublen;
+  char * k, * v;
+
+  noosh_parser_init(&ps, s, len, 0, NULL);
+  while (noosh_lex(&ps) != NOOSH_T_EOF || ps.more) {
+    if (ps.tok == NOOSH_T_NEWLINE) {
+      continue;
+    }
+    if (ps.tok != NOOSH_T_WORD || ps.more) {
+      dprintf(NOOSH_FD(2), "noosh: syntax error in array list: %.*s\n", (int) len, s);
+      return -1;
+    }
+    m = noosh_subscript(ps.word.s, ps.word.len, &sub, &sublen);
+    if (m == 0 || m >= ps.word.len || ps.word.s[m] != '=') {
+      while (keys->n < values->n) {
+        noosh_args_push(keys, NULL);
+      }
+      if (noosh_expand_word(&ps.word, NOOSH_X_SPLIT, values) < 0) {
+        return -1;
+      }
+      continue;
+    }
+    key = (struct noosh_word) {(char *) sub, sublen, NOOSH_W_QUOTED | NOOSH_W_EXPAND};
+    value = (struct noosh_word) {ps.word.s + m + 1, ps.word.len - m - 1, ps.word.flags};
+    if ((k = noosh_expand_string(&key, 0)) == NULL) {
+      return -1;
+    }
+    if ((v = noosh_expand_string(&value, NOOSH_X_ASSIGN)) == NULL) {
+      free(k);
+      return -1;
+    }
+    while (keys->n < values->n) {
+      noosh_args_push(keys, NULL);
+    }
+    noosh_args_push(keys, k);
+    noosh_args_push(values, v);
+  }
+  while (keys->n < values->n) {
+    noosh_args_push(keys, NULL);
+  }
+  return 0;
+}
+
+/*
+    @brief add a string to a buffer in single quotes
+*/
+void noosh_buf_quote(struct noosh_buf * b, const char * s) {
+  noosh_buf_append(b, "'", 1);
+  for (; *s; s++) {
+    if (*s == '\'') {
+      noosh_buf_append(b, "'\\''", 4);
+    } else {
+      noosh_buf_append(b, s, 1);
+    }
+  }
+  noosh_buf_append(b, "'", 1);
+}
+
+/*
+    @brief expand a name=(...) word that is an argument, for declare and
+        local, into a single field in which each element is expanded and
+        quoted again, name=('a' ['k']='b'), so the builtin can take the
+        list apart without expanding anything twice
+    @param w: the word
+    @param p: its parts
+    @param out: receives the field
+    @return 0 on success, -1 after printing an error
+*/
+int noosh_x_compound(const struct noosh_word * w, const struct noosh_assign_parts * p,
+                     struct noosh_args * out) {
+  struct noosh_args keys = {0}, values = {0};
+  struct noosh_buf b = {0};
+  int i;
+
+  if (noosh_compound_elems(p->value, p->value_len, &keys, &values) < 0) {
+    noosh_args_free(&keys);
+    noosh_args_free(&values);
+    return -1;
+  }
+  noosh_buf_append(&b, w->s, p->value - 1 - w->s);
+  noosh_buf_append(&b, "(", 1);
+  for (i = 0; i < values.n; i++) {
+    if (keys.v[i]) {
+      noosh_buf_append(&b, "[", 1);
+      noosh_buf_quote(&b, keys.v[i]);
+      noosh_buf_append(&b, "]=", 2);
+    }
+    noosh_buf_quote(&b, values.v[i]);
+    if (i + 1 < values.n) {
+      noosh_buf_append(&b, " ", 1);
+    }
+  }
+  noosh_buf_append(&b, ")", 1);
+  noosh_args_push(out, b.data);
+  noosh_args_free(&keys);
+  noosh_args_free(&values);
+  return 0;
+}
+
+/*
+  Stat cache
+
+  With `set -o statcache', the metadata that [[ ]] file tests, globs,
+  source, the command search and Tab completion ask for is kept in a
+  table of recent paths, filled with statx, failures included. Each entry depends on an
+  inotify watch on its directory, and on itself when it is a directory:
+  any change there (a name created, removed or renamed, a file written or
+  its mode changed) drops the entries of that directory before the next
+  lookup. A lookup that follows a final symlink also watches the
+  directory of its target, and of each link on the way to it. Where a watch cannot be had, on filesystems without inotify,
+  the entry lasts NOOSH_STAT_TTL_MS instead. Like bash's command hash,
+  it does not notice a directory further up the path being renamed.
+*/
+
+# define NOOSH_STAT_SLOTS 1024
+# define NOOSH_STAT_TTL_MS 1000
+
+/*
+  watches past this many start the cache over, to stay within the
+  system's limit
+*/
+# define NOOSH_STAT_WATCHES 512
+
+/*
+  watches an entry may depend on: its directory, those of the links a
+  followed path goes through, and the directory it is
+*/
+# define NOOSH_STAT_DEPS 4
+
+/*
+  cached metadata of a path
+    err is the errno statx failed with, 0 if it did not; wd are the
+    watches the entry depends on, -1 for none, and gen their generations
+    when it was made; expires is when an entry without watches goes, in
+    ms; cwd is the working directory epoch of a relative path
+*/
+struct noosh_stat_entry {
+  char * path;
+  unsigned long hash;
+  int follow;
+  int err;
+  struct statx stx;
+  int wd[NOOSH_STAT_DEPS];
+  unsigned long gen[NOOSH_STAT_DEPS];
+  long long expires;
+  unsigned long cwd;
+};
+
+struct noosh_stat_entry * noosh_stat_cache[NOOSH_STAT_SLOTS];
+
+/*
+  inotify descriptor, -1 until first needed and -2 if there is none, the
+  generation of each watch, bumped by its events, and one past the
+  highest watch yet
+*/
+int noosh_stat_fd = -1;
+unsigned long * noosh_stat_gens = NULL;
+int noosh_stat_ngens = 0;
+int noosh_stat_top = 0;
+
+/*
+  working directory epoch, bumped by cd and subshells that go back
+*/
+unsigned long noosh_stat_cwd = 0;
+
+/*
+  stat cache counters for stats: drops are entries a change invalidated
+*/
+unsigned long noosh_stat_hits = 0;
+unsigned long noosh_stat_misses = 0;
+unsigned long noosh_stat_drops = 0;
+
+/*
+    @brief current time of the monotonic clock, in milliseconds
+*/
+long long noosh_stat_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+    @brief empty the cache and drop its watches
+*/
+void noosh_stat_flush(void) {
+  int i;
+
+  for (i = 0; i < NOOSH_STAT_SLOTS; i++) {
+    if (noosh_stat_cache[i]) {
+      free(noosh_stat_cache[i]->path);
+      free(noosh_stat_cache[i]);
+      noosh_stat_cache[i] = NULL;
+    }
+  }
+  if (noosh_stat_fd >= 0) {
+    close(noosh_stat_fd);
+    noosh_stat_fd = -1;
+  }
+  free(noosh_stat_gens);
+  noosh_stat_gens = NULL;
+  noosh_stat_ngens = 0;
+  noosh_stat_top = 0;
+}
+
+/*
+    @brief read the pending inotify events, bumping the generations of
+        the watches they came from
+*/
+void noosh_stat_drain(void) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event * ev;
+  ssize_t n, off;
+
+  if (noosh_stat_fd < 0) {
+    return;
+  }
+  while ((n = read(noosh_stat_fd, buf, sizeof(buf))) > 0) {
+    for (off = 0; off < n; off += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *) (buf + off);
+      if (ev->mask & IN_Q_OVERFLOW) {
+        // Events were lost: nothing can be trusted.
+        noosh_stat_flush();
+        return;
+      }
+      if (ev->wd >= 0 && ev->wd < noosh_stat_ngens) {
+        noosh_stat_gens[ev->wd]++;
+      }
+    }
+  }
+}
+
+/*
+    @brief watch a directory for changes
+    @param dir: its path
+    @return the watch, -1 if it cannot be watched
+*/
+int noosh_stat_watch(const char * dir) {
+  int wd, n;
+
+  if (noosh_stat_fd == -1 && (noosh_stat_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    noosh_stat_fd = -2;
+  }
+  if (noosh_stat_fd < 0) {
+    return -1;
+  }
+  wd = inotify_add_watch(noosh_stat_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                         IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+  if (wd < 0) {
+    return -1;
+  }
+  if (wd >= noosh_stat_top) {
+    noosh_stat_top = wd + 1;
+  }
+  if (wd >= noosh_stat_ngens) {
+    n = noosh_stat_ngens ? noosh_stat_ngens : 16;
+    while (n <= wd) {
+      n *= 2;
+    }
+    noosh_stat_gens = noosh_realloc(noosh_stat_gens, n * sizeof(*noosh_stat_gens));
+    memset(noosh_stat_gens + noosh_stat_ngens, 0, (n - noosh_stat_ngens) * sizeof(*noosh_stat_gens));
+    noosh_stat_ngens = n;
+  }
+  return wd;
+}
+
+/*
+    @brief the directory a path is in
+    @return allocated path, "." for a bare name
+*/
+char * noosh_stat_dir(const char * path) {
+  char * dir = noosh_malloc(strlen(path) + 2), * end;
+
+  strcpy(dir, path);
+  for (end = dir + strlen(dir); end > dir + 1 && end[-1] == '/'; *--end = '\0');
+  end = strrchr(dir, '/');
+  if (end == NULL) {
+    strcpy(dir, ".");
+  } else {
+    end[end == dir] = '\0';
+  }
+  return dir;
+}
+
+/*
+    @brief make a cache entry depend on a watch
+    @param e: the entry
+    @param wd: the watch, -1 for none
+    @return 0, or -1 if there is no watch or no room for it
+*/
+int noosh_stat_depend(struct noosh_stat_entry * e, int wd) {
+  int i;
+
+  if (wd < 0) {
+    return -1;
+  }
+  for (i = 0; i < NOOSH_STAT_DEPS && e->wd[i] >= 0; i++) {
+    if (e->wd[i] == wd) {
+      return 0;
+    }
+  }
+  if (i == NOOSH_STAT_DEPS) {
+    return -1;
+  }
+  e->wd[i] = wd;
+  return 0;
+}
+
+/*
+    @brief check whether a cache entry is still good
+*/
+int noosh_stat_valid(const struct noosh_stat_entry * e) {
+  int i;
+
+  if (e->path[0] != '/' && e->cwd != noosh_stat_cwd) {
+    return 0;
+  }
+  if (e->expires) {
+    return noosh_stat_now() < e->expires;
+  }
+  for (i = 0; i < NOOSH_STAT_DEPS; i++) {
+    if (e->wd[i] >= 0 && noosh_stat_gens[e->wd[i]] != e->gen[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+    @brief fill a struct stat from statx results
+*/
+void noosh_stat_from_statx(struct stat * st, const struct statx * stx) {
+  memset(st, 0, sizeof(*st));
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+  st->st_size = stx->stx_size;
+  st->st_blksize = stx->stx_blksize;
+  st->st_blocks = stx->stx_blocks;
+  st->st_atim = (struct timespec) {stx->stx_atime.tv_sec, stx->stx_atime.tv_nsec};
+  st->st_mtim = (struct timespec) {stx->stx_mtime.tv_sec, stx->stx_mtime.tv_nsec};
+  st->st_ctim = (struct timespec) {stx->stx_ctime.tv_sec, stx->stx_ctime.tv_nsec};
+}
+
+/*
+    @brief stat or lstat a path, through the cache when statcache is on
+    @param path: the path
+    @param st: gets its metadata
+    @param follow: follow a final symlink, as stat does
+    @return 0, or -1 with errno set
+*/
+int noosh_stat(const char * path, struct stat * st, int follow) {
+  unsigned long h = noosh_hash(path, strlen(path)) * 2 + !!follow;
+  struct noosh_stat_entry ** slot = &noosh_stat_cache[h % NOOSH_STAT_SLOTS], * e = *slot;
+  char link[PATH_MAX], * dir, * cur;
+  int i, hops, watched = 1;
+  ssize_t n;
+
+  if (!noosh_opt_statcache || noosh_stage_isolated) {
+    // Pipeline stage threads keep out of the shell's cache.
+    return follow ? stat(path, st) : lstat(path, st);
+  }
+  noosh_stat_drain();
+  if (noosh_stat_top + NOOSH_STAT_DEPS + 1 > NOOSH_STAT_WATCHES) {
+    // A miss adds a watch per dependency and one it may not keep. Start
+    // over now, before an entry is taken: that frees them all.
+    noosh_stat_flush();
+  }
+  e = *slot;
+  if (e && e->hash == h && strcmp(e->path, path) == 0) {
+    if (noosh_stat_valid(e)) {
+      __atomic_add_fetch(&noosh_stat_hits, 1, __ATOMIC_RELAXED);
+      if (e->err) {
+        errno = e->err;
+        return -1;
+      }
+      noosh_stat_from_statx(st, &e->stx);
+      return 0;
+    }
+    __atomic_add_fetch(&noosh_stat_drops, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&noosh_stat_misses, 1, __ATOMIC_RELAXED);
+  if (e == NULL) {
+    e = *slot = noosh_malloc(sizeof(*e));
+  } else {
+    free(e->path);
+  }
+  memset(e, 0, sizeof(*e));
+  e->path = noosh_strdup(path);
+  e->hash = h;
+  e->follow = follow;
+  e->cwd = noosh_stat_cwd;
+  for (i = 0; i < NOOSH_STAT_DEPS; i++) {
+    e->wd[i] = -1;
+  }
+
+  // The watches come first, so that no change slips in before them.
+  // A followed symlink depends on the directory of each link it goes
+  // through as well, where its target may be replaced or removed.
+  cur = noosh_strdup(path);
+  for (hops = 0; ; hops++) {
+    dir = noosh_stat_dir(cur);
+    if (hops == NOOSH_STAT_DEPS || noosh_stat_depend(e, noosh_stat_watch(dir)) < 0) {
+      watched = 0;
+      free(dir);
+      break;
+    }
+    if (!follow || (n = readlink(cur, link, sizeof(link) - 1)) < 0) {
+      free(dir);
+      break;
+    }
+    link[n] = '\0';
+    free(cur);
+    cur = noosh_malloc(strlen(dir) + n + 2);
+    if (link[0] == '/') {
+      strcpy(cur, link);
+    } else {
+      sprintf(cur, "%s/%s", dir, link);
+    }
+    free(dir);
+  }
+  if (statx(AT_FDCWD, path, follow ? 0 : AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &e->stx) < 0) {
+    e->err = errno;
+  } else if (S_ISDIR(e->stx.stx_mode) && watched) {
+    // And on the directory itself, as for any directory.
+    if (noosh_stat_depend(e, noosh_stat_watch(cur)) < 0) {
+      watched = 0;
+    } else if (statx(AT_FDCWD, path, follow ? 0 : AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &e->stx) < 0) {
+      e->err = errno;
+    }
+  }
+  free(cur);
+  if (!watched) {
+    for (i = 0; i < NOOSH_STAT_DEPS; i++) {
+      e->wd[i] = -1;
+    }
+    e->expires = noosh_stat_now() + NOOSH_STAT_TTL_MS;
+  }
+  for (i = 0; i < NOOSH_STAT_DEPS; i++) {
+    e->gen[i] = e->wd[i] >= 0 ? noosh_stat_gens[e->wd[i]] : 0;
+  }
+  if (e->err) {
+    errno = e->err;
+    return -1;
+  }
+  noosh_stat_from_statx(st, &e->stx);
+  return 0;
+}
+
+/*
+    @brief look a path up in the stat cache alone, making no system call
+        beyond reading inotify events, for callers that must not block
+    @param path: the path
+    @param st: gets its metadata, a final symlink followed
+    @return 0 if it is there, -1 if the cache knows it is not, -2 if the
+        cache does not know
+*/
+int noosh_stat_peek(const char * path, struct stat * st) {
+  unsigned long h = noosh_hash(path, strlen(path)) * 2 + 1;
+  struct noosh_stat_entry * e;
+
+  if (!noosh_opt_statcache || noosh_stage_isolated) {
+    return -2;
+  }
+  noosh_stat_drain();
+  e = noosh_stat_cache[h % NOOSH_STAT_SLOTS];
+  if (e == NULL || e->hash != h || strcmp(e->path, path) != 0 || !noosh_stat_valid(e)) {
+    return -2;
+  }
+  __atomic_add_fetch(&noosh_stat_hits, 1, __ATOMIC_RELAXED);
+  if (e->err) {
+    return -1;
+  }
+  noosh_stat_from_statx(st, &e->stx);
+  return 0;
+}
+
+/*
+    @brief find an executable in PATH, through the stat cache
+    @param name: the command name, without a slash
+    @return allocated path, NULL if none was found
+*/
+char * noosh_path_find(const char * name) {
+  const char * dirs = noosh_getvar("PATH"), * end;
+  struct stat st;
+  char * path;
+  size_t len;
+
+  for (; dirs && *dirs; dirs = *end ? end + 1 : end) {
+    end = strchrnul(dirs, ':');
+    len = end - dirs;
+    path = noosh_malloc(len + strlen(name) + 3);
+    sprintf(path, "%.*s/%s", len ? (int) len : 1, len ? dirs : ".", name);
+    if (noosh_stat(path, &st, 1) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+      return path;
+    }
+    free(path);
+  }
+  return NULL;
+}
+
+/*
+    @brief print the stat cache counters, for stats
+    @param out: descriptor to print to
+    @param reset: zero them after
+*/
+void noosh_stat_stats(int out, int reset) {
+  dprintf(out, "stat cache hits %lu misses %lu invalidated %lu\n",
+          __atomic_load_n(&noosh_stat_hits, __ATOMIC_RELAXED),
+          __atomic_load_n(&noosh_stat_misses, __ATOMIC_RELAXED),
+          __atomic_load_n(&noosh_stat_drops, __ATOMIC_RELAXED));
+  if (reset) {
+    __atomic_store_n(&noosh_stat_hits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&noosh_stat_misses, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&noosh_stat_drops, 0, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+  Globbing
+
+  A word with unquoted wildcards is a pattern of path segments. It is
+  compiled once into a small cache keyed by its text: a segment without
+  wildcards is a plain name that needs no directory read, the others are
+  compiled patterns matched against the names getdents64 returns into a
+  large buffer, and d_type tells directories apart without a stat except
+  on filesystems that leave it unknown. A ** segment matches any number
+  of directories. When the tree below one proves big, its walk goes to a
+  pool of threads, each taking directories from its own queue and
+  stealing from the others' when it runs dry. Matches go straight into
+  the argument vector and are sorted there by byte value, the same in
+  any locale, unless globsort is off.
+*/
+
+/*
+  segment of a compiled glob
+    a literal one has its name, a pattern one pat, and any is set for
+    **; dot is set when the pattern starts with a literal `.', which
+    lets it match hidden names
+*/
+struct noosh_glob_seg {
+  char * name;
+  struct noosh_pattern * pat;
+  int any;
+  int dot;
+};
+
+/*
+  compiled glob
+    segs are the parts between slashes; absolute when it starts with
+    /, dirs when it ends with one and so matches directories only
+*/
+struct noosh_glob {
+  char * text;
+  unsigned long hash;
+  struct noosh_glob_seg * segs;
+  int nsegs;
+  int absolute;
+  int dirs;
+};
+
+/*
+    @brief check a segment for an unescaped wildcard
+*/
+int noosh_glob_wild(const char * s) {
+  for (; *s; s++) {
+    if (*s == '\\' && s[1]) {
+      s++;
+    } else if (*s == '*' || *s == '?' || *s == '[') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+    @brief compile a glob pattern
+    @param text: the pattern, with quoted characters escaped
+    @return the glob, to free with noosh_glob_free
+*/
+struct noosh_glob * noosh_glob_compile(const char * text) {
+  struct noosh_glob * g = noosh_malloc(sizeof(*g));
+  struct noosh_glob_seg * seg;
+  size_t i = 0, start, len = strlen(text);
+  char * part;
+
+  memset(g, 0, sizeof(*g));
+  g->text = noosh_strdup(text);
+  g->hash = noosh_hash(text, len);
+  g->absolute = text[0] == '/';
+  g->dirs = len > 1 && text[len - 1] == '/';
+  g->segs = noosh_malloc((len / 2 + 1) * sizeof(*g->segs));
+  while (i < len) {
+    for (start = i; i < len && text[i] != '/'; i++) {
+      i += text[i] == '\\' && i + 1 < len;
+    }
+    if (i > start) {
+      part = noosh_strndup(text + start, i - start);
+      seg = &g->segs[g->nsegs++];
+      memset(seg, 0, sizeof(*seg));
+      if (strcmp(part, "**") == 0) {
+        seg->any = 1;
+        free(part);
+      } else if (!noosh_glob_wild(part)) {
+        noosh_unescape(part, strlen(part));
+        seg->name = part;
+      } else {
+        seg->pat = noosh_pat_compile(part);
+        seg->dot = part[0] == '.' || (part[0] == '\\' && part[1] == '.');
+        free(part);
+      }
+    }
+    i++;
+  }
+  return g;
+}
+
+/*
+    @brief free a glob from noosh_glob_compile
+*/
+void noosh_glob_free(struct noosh_glob * g) {
+  int i;
+
+  for (i = 0; i < g->nsegs; i++) {
+    free(g->segs[i].name);
+    if (g->segs[i].pat) {
+      noosh_pat_free(g->segs[i].pat);
+    }
+  }
+  free(g->segs);
+  free(g->text);
+  free(g);
+}
+
+# define NOOSH_GLOB_SLOTS 32
+
+struct noosh_glob * noosh_glob_cache[NOOSH_GLOB_SLOTS];
+
+/*
+    @brief get the compiled form of a glob pattern
+    @param text: the pattern
+    @return the glob, to give back with noosh_glob_release
+*/
+struct noosh_glob * noosh_glob_get(const char * text) {
+  unsigned long h = noosh_hash(text, strlen(text));
+  struct noosh_glob ** slot = &noosh_glob_cache[h % NOOSH_GLOB_SLOTS];
+
+  if (noosh_stage_isolated) {
+    // Pipeline stage threads keep out of the shell's cache.
+    return noosh_glob_compile(text);
+  }
+  if (*slot == NULL || (*slot)->hash != h || strcmp((*slot)->text, text) != 0) {
+    if (*slot) {
+      noosh_glob_free(*slot);
+    }
+    *slot = noosh_glob_compile(text);
+  }
+  return *slot;
+}
+
+/*
+    @brief give back a glob from noosh_glob_get
+*/
+void noosh_glob_release(struct noosh_glob * g) {
+  if (noosh_stage_isolated) {
+    noosh_glob_free(g);
+  }
+}
+
+/*
+  record of getdents64
+*/
+struct noosh_dirent64 {
+  unsigned long long ino;
+  long long off;
+  unsigned short reclen;
+  unsigned char type;
+  char name[];
+};
+
+# define NOOSH_GLOB_BUFSIZE (64 * 1024)
+
+/*
+  state of one glob expansion, or of one thread of a ** walk
+    path is the directory being read, empty or ending with a /; buf
+    receives its entries; matches go to found, made in arena unless it
+    is NULL; dirs gets the subdirectories a ** walk still has to read
+*/
+struct noosh_glob_walk {
+  const struct noosh_glob * g;
+  struct noosh_args * found;
+  struct noosh_arena * arena;
+  struct noosh_buf path;
+  char * buf;
+  struct noosh_args dirs;
+};
+
+/*
+  k of noosh_glob_scan for every name, and for none
+*/
+# define NOOSH_GLOB_ALL -1
+# define NOOSH_GLOB_NONE -2
+
+/*
+    @brief add a match: the path being read followed by name
+*/
+void noosh_glob_found(struct noosh_glob_walk * w, const char * name) {
+  size_t len = w->path.len;
+
+  noosh_buf_append(&w->path, name, strlen(name));
+  if (w->g->dirs) {
+    noosh_buf_append(&w->path, "/", 1);
+  }
+  noosh_args_push(w->found, w->arena ? noosh_arena_strndup(w->arena, w->path.data, w->path.len) :
+                                       noosh_strndup(w->path.data, w->path.len));
+  w->path.len = len;
+  w->path.data[len] = '\0';
+}
+
+/*
+    @brief check whether an entry is a directory, from d_type when the
+        filesystem gives it
+    @param fd: the directory it is in
+    @param d: the entry
+    @param follow: count a symlink to a directory as one
+*/
+int noosh_glob_isdir(int fd, const struct noosh_dirent64 * d, int follow) {
+  struct stat st;
+
+  if (d->type == DT_DIR) {
+    return 1;
+  }
+  if (d->type != DT_UNKNOWN && !(d->type == DT_LNK && follow)) {
+    return 0;
+  }
+  return fstatat(fd, d->name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+void noosh_glob_walk_from(struct noosh_glob_walk * w, int k);
+
+/*
+    @brief read the directory at path, matching its names against one
+        segment
+    @param w: the walk
+    @param k: index of the segment, NOOSH_GLOB_ALL to take every name
+        that is not hidden, NOOSH_GLOB_NONE to take none
+    @param recurse: add the subdirectories to w->dirs (not those that
+        are hidden or symlinks)
+*/
+void noosh_glob_scan(struct noosh_glob_walk * w, int k, int recurse) {
+  const struct noosh_glob * g = w->g;
+  const struct noosh_glob_seg * seg = k >= 0 ? &g->segs[k] : NULL;
+  struct noosh_args next = {0};
+  struct noosh_dirent64 * d;
+  size_t len = w->path.len;
+  long n, off;
+  int fd, i, last = k < 0 || k == g->nsegs - 1, matched;
+  char * name;
+
+  fd = open(len ? w->path.data : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  while ((n = syscall(SYS_getdents64, fd, w->buf, NOOSH_GLOB_BUFSIZE)) > 0) {
+    for (off = 0; off < n; off += d->reclen) {
+      d = (struct noosh_dirent64 *) (w->buf + off);
+      name = d->name;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      if (k == NOOSH_GLOB_NONE) {
+        matched = 0;
+      } else if (seg == NULL || seg->name) {
+        matched = seg ? strcmp(name, seg->name) == 0 : name[0] != '.';
+      } else {
+        matched = (name[0] != '.' || seg->dot) && noosh_pat_match(seg->pat, name, strlen(name));
+      }
+      if (matched && last) {
+        if (!g->dirs || noosh_glob_isdir(fd, d, 1)) {
+          noosh_glob_found(w, name);
+        }
+      } else if (matched && noosh_glob_isdir(fd, d, 1)) {
+        // Read after this directory, whose entries are in buf.
+        noosh_args_push(&next, noosh_strdup(name));
+      }
+      if (recurse && name[0] != '.' && noosh_glob_isdir(fd, d, 0)) {
+        noosh_buf_append(&w->path, name, strlen(name));
+        noosh_buf_append(&w->path, "/", 1);
+        noosh_args_push(&w->dirs, noosh_strndup(w->path.data, w->path.len));
+        w->path.len = len;
+        w->path.data[len] = '\0';
+      }
+    }
+  }
+  close(fd);
+  for (i = 0; i < next.n; i++) {
+    noosh_buf_append(&w->path, next.v[i], strlen(next.v[i]));
+    noosh_buf_append(&w->path, "/", 1);
+    noosh_glob_walk_from(w, k + 1);
+    w->path.len = len;
+    w->path.data[len] = '\0';
+  }
+  noosh_args_free(&next);
+}
+
+/*
+  work-stealing pool of a ** walk
+    each worker reads directories from the end of its own queue and
+    steals from the start of the others'; pending counts directories
+    queued or being read, and the walk is over when it drops to 0
+*/
+struct noosh_glob_worker {
+  pthread_mutex_t lock;
+  struct noosh_args queue;
+  int head;
+  struct noosh_args found;
+  struct noosh_glob_walk w;
+  struct noosh_glob_pool * pool;
+  int index;
+  pthread_t thread;
+};
+
+struct noosh_glob_pool {
+  struct noosh_glob_worker * workers;
+  int n;
+  int k;
+  int pending;
+};
+
+# define NOOSH_GLOB_MAX_THREADS 8
+
+/*
+  directories a ** walk reads by itself before it hands the rest of the
+  tree to a pool
+*/
+# define NOOSH_GLOB_SERIAL 64
+
+/*
+    @brief number of ** walk threads: one per CPU, at most 8
+*/
+int noosh_glob_nthreads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n < 1) {
+    return 1;
+  }
+  return n > NOOSH_GLOB_MAX_THREADS ? NOOSH_GLOB_MAX_THREADS : (int) n;
+}
+
+/*
+    @brief take a directory for a worker: its own last, or another's first
+    @return the path, allocated, NULL if every queue is empty
+*/
+char * noosh_glob_take(struct noosh_glob_worker * me) {
+  struct noosh_glob_pool * pool = me->pool;
+  struct noosh_glob_worker * o;
+  char * d = NULL;
+  int i;
+
+  for (i = 0; i < pool->n && d == NULL; i++) {
+    o = &pool->workers[(me->index + i) % pool->n];
+    pthread_mutex_lock(&o->lock);
+    if (o->queue.n > o->head) {
+      d = o == me ? o->queue.v[--o->queue.n] : o->queue.v[o->head++];
+    }
+    if (o->queue.n == o->head) {
+      o->queue.n = o->head = 0;
+    }
+    pthread_mutex_unlock(&o->lock);
+  }
+  return d;
+}
+
+/*
+    @brief ** walk worker: read directories until none are left anywhere
+    @param arg: the worker
+    @return NULL
+*/
+void * noosh_glob_worker(void * arg) {
+  struct noosh_glob_worker * me = arg;
+  struct noosh_glob_pool * pool = me->pool;
+  char * d;
+  int i;
+
+  while (1) {
+    if ((d = noosh_glob_take(me)) == NULL) {
+      if (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0) {
+        return NULL;
+      }
+      sched_yield();
+      continue;
+    }
+    me->w.path.len = 0;
+    noosh_buf_append(&me->w.path, d, strlen(d));
+    free(d);
+    noosh_glob_scan(&me->w, pool->k, 1);
+    __atomic_add_fetch(&pool->pending, me->w.dirs.n, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&me->lock);
+    for (i = 0; i < me->w.dirs.n; i++) {
+      noosh_args_push(&me->queue, me->w.dirs.v[i]);
+    }
+    pthread_mutex_unlock(&me->lock);
+    me->w.dirs.n = 0;
+    __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+    @brief finish a ** walk with a pool of threads
+    @param w: the walk, whose dirs from first on are left to read
+    @param k: the segment to match in them
+    @param first: index in w->dirs of the first directory to read
+*/
+void noosh_glob_parallel(struct noosh_glob_walk * w, int k, int first) {
+  struct noosh_glob_pool pool = {NULL, noosh_glob_nthreads(), k, w->dirs.n - first};
+  struct noosh_glob_worker * o;
+  int i, j;
+
+  pool.workers = noosh_malloc(pool.n * sizeof(*pool.workers));
+  memset(pool.workers, 0, pool.n * sizeof(*pool.workers));
+  for (i = 0; i < pool.n; i++) {
+    o = &pool.workers[i];
+    pthread_mutex_init(&o->lock, NULL);
+    o->pool = &pool;
+    o->index = i;
+    o->w.g = w->g;
+    o->w.found = &o->found;
+    o->w.buf = noosh_malloc(NOOSH_GLOB_BUFSIZE);
+  }
+  for (i = first; i < w->dirs.n; i++) {
+    noosh_args_push(&pool.workers[i % pool.n].queue, w->dirs.v[i]);
+  }
+  w->dirs.n = first;
+  for (i = 1; i < pool.n; i++) {
+    if (pthread_create(&pool.workers[i].thread, NULL, noosh_glob_worker, &pool.workers[i]) != 0) {
+      // Fewer threads: the others steal what it was given.
+      pool.workers[i].thread = 0;
+    }
+  }
+  noosh_glob_worker(&pool.workers[0]);
+  for (i = 1; i < pool.n; i++) {
+    if (pool.workers[i].thread) {
+      pthread_join(pool.workers[i].thread, NULL);
+    }
+  }
+  for (i = 0; i < pool.n; i++) {
+    o = &pool.workers[i];
+    for (j = 0; j < o->found.n; j++) {
+      if (w->arena) {
+        noosh_args_push(w->found, noosh_arena_strndup(w->arena, o->found.v[j], strlen(o->found.v[j])));
+        free(o->found.v[j]);
+      } else {
+        noosh_args_push(w->found, o->found.v[j]);
+      }
+    }
+    free(o->found.v);
+    free(o->queue.v);
+    free(o->w.dirs.v);
+    free(o->w.path.data);
+    free(o->w.buf);
+    pthread_mutex_destroy(&o->lock);
+  }
+  free(pool.workers);
+}
+
+/*
+    @brief read the tree below path for a **, matching segment k (or
+        every name) in each directory
+*/
+void noosh_glob_tree(struct noosh_glob_walk * w, int k) {
+  char * base = noosh_strndup(w->path.data ? w->path.data : "", w->path.len), * d;
+  int first = w->dirs.n, read = 0;
+
+  noosh_glob_scan(w, k, 1);
+  while (w->dirs.n > first) {
+    if (++read >= NOOSH_GLOB_SERIAL && w->dirs.n - first > 1 && noosh_glob_nthreads() > 1) {
+      noosh_glob_parallel(w, k, first);
+      break;
+    }
+    d = w->dirs.v[--w->dirs.n];
+    w->path.len = 0;
+    noosh_buf_append(&w->path, d, strlen(d));
+    free(d);
+    noosh_glob_scan(w, k, 1);
+  }
+  w->path.len = 0;
+  noosh_buf_append(&w->path, base, strlen(base));
+  free(base);
+}
+
+/*
+    @brief match the segments from k on below the directory at path
+*/
+void noosh_glob_walk_from(struct noosh_glob_walk * w, int k) {
+  const struct noosh_glob * g = w->g;
+  const struct noosh_glob_seg * seg = &g->segs[k];
+  size_t len = w->path.len;
+  struct stat st;
+  int first, i;
+
+  if (seg->name) {
+    noosh_buf_append(&w->path, seg->name, strlen(seg->name));
+    if (k < g->nsegs - 1) {
+      noosh_buf_append(&w->path, "/", 1);
+      noosh_glob_walk_from(w, k + 1);
+    } else if (noosh_stat(w->path.data, &st, 0) == 0 &&
+               (!g->dirs || (noosh_stat(w->path.data, &st, 1) == 0 && S_ISDIR(st.st_mode)))) {
+      w->path.len = len;
+      noosh_glob_found(w, seg->name);
+    }
+  } else if (!seg->any) {
+    noosh_glob_scan(w, k, 0);
+  } else if (k >= g->nsegs - 2) {
+    // **, or **/last: one read per directory of the tree.
+    noosh_glob_tree(w, k == g->nsegs - 1 ? NOOSH_GLOB_ALL : k + 1);
+  } else {
+    // **/more/segments: try them here and in every subdirectory.
+    noosh_glob_walk_from(w, k + 1);
+    first = w->dirs.n;
+    noosh_glob_scan(w, NOOSH_GLOB_NONE, 1);
+    for (i = first; i < w->dirs.n; i++) {
+      w->path.len = 0;
+      noosh_buf_append(&w->path, w->dirs.v[i], strlen(w->dirs.v[i]));
+      free(w->dirs.v[i]);
+      noosh_glob_walk_from(w, k);
+    }
+    w->dirs.n = first;
+  }
+  w->path.len = len;
+  if (w->path.data) {
+    w->path.data[len] = '\0';
+  }
+}
+
+/*
+    @brief compare paths for qsort, byte by byte
+*/
+int noosh_glob_cmp(const void * a, const void * b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+    @brief expand a glob pattern into the paths it matches
+    @param pat: the pattern, with quoted characters escaped
+    @param out: the matches are appended here, sorted unless globsort is
+        off
+    @param arena: where they are allocated, NULL to malloc them
+    @return the number of matches
+*/
+int noosh_glob_expand(const char * pat, struct noosh_args * out, struct noosh_arena * arena) {
+  struct noosh_glob * g = noosh_glob_get(pat);
+  struct noosh_glob_walk w = {g, out, arena, {0}, NULL, {0}};
+  int first = out->n;
+
+  if (g->nsegs > 0) {
+    w.buf = noosh_malloc(NOOSH_GLOB_BUFSIZE);
+    if (g->absolute) {
+      noosh_buf_append(&w.path, "/", 1);
+    }
+    noosh_glob_walk_from(&w, 0);
+    free(w.buf);
+  }
+  free(w.path.data);
+  free(w.dirs.v);
+  noosh_glob_release(g);
+  if (noosh_opt_globsort && out->n - first > 1) {
+    qsort(out->v + first, out->n - first, sizeof(*out->v), noosh_glob_cmp);
+  }
+  return out->n - first;
+}
+
+/*
+  directory being read by a glob iterator
+    items are what is left to do in it, in order: a path to give (k <
+    0) or a subdirectory to read for segment k; len is the length of its
+    path
+*/
+struct noosh_glob_item {
+  char * key;
+  int k;
+};
+
+struct noosh_glob_frame {
+  size_t len;
+  struct noosh_glob_item * items;
+  int n;
+  int next;
+};
+
+/*
+  glob read one directory at a time, for a loop to take its matches as
+  they are found: memory grows with the depth of the tree and the size
+  of its directories, not with the number of matches
+*/
+struct noosh_glob_iter {
+  struct noosh_glob * g;
+  struct noosh_buf path;
+  char * buf;
+  struct noosh_glob_frame * frames;
+  int nframes;
+  int found;
+};
+
+/*
+    @brief compare the items of a directory for qsort: by name, a
+        subdirectory as its name followed by a /, so that paths come
+        in the order a sorted glob gives them
+*/
+int noosh_glob_item_cmp(const void * a, const void * b) {
+  const struct noosh_glob_item * x = a, * y = b;
+  int r = strcmp(x->key, y->key);
+
+  return r ? r : (x->k > y->k) - (x->k < y->k);
+}
+
+/*
+    @brief add an item to a frame
+*/
+void noosh_glob_item_add(struct noosh_glob_frame * f, const char * name, int slash, int k) {
+  size_t len = strlen(name);
+
+  if ((f->n & (f->n - 1)) == 0) {
+    f->items = noosh_realloc(f->items, (f->n ? 2 * f->n : 1) * sizeof(*f->items));
+  }
+  f->items[f->n].key = noosh_malloc(len + 2);
+  memcpy(f->items[f->n].key, name, len);
+  strcpy(f->items[f->n].key + len, slash ? "/" : "");
+  f->items[f->n++].k = k;
+}
+
+/*
+    @brief match segment k of the iterator's glob in the directory at
+        its path, pushing a frame with what it found
+*/
+void noosh_glob_iter_enter(struct noosh_glob_iter * it, int k) {
+  const struct noosh_glob * g = it->g;
+  const struct noosh_glob_seg * seg = &g->segs[k], * next;
+  struct noosh_glob_frame * f;
+  struct noosh_dirent64 * d;
+  struct stat st;
+  long n, off;
+  int fd, last = k == g->nsegs - 1, match;
+  char * name;
+
+  if ((it->nframes & (it->nframes - 1)) == 0) {
+    it->frames = noosh_realloc(it->frames, (it->nframes ? 2 * it->nframes : 1) * sizeof(*it->frames));
+  }
+  f = &it->frames[it->nframes++];
+  memset(f, 0, sizeof(*f));
+  f->len = it->path.len;
+  if (seg->name) {
+    if (!last) {
+      noosh_glob_item_add(f, seg->name, 1, k + 1);
+      return;
+    }
+    noosh_buf_append(&it->path, seg->name, strlen(seg->name));
+    if (noosh_stat(it->path.data, &st, 0) == 0 &&
+        (!g->dirs || (noosh_stat(it->path.data, &st, 1) == 0 && S_ISDIR(st.st_mode)))) {
+      noosh_glob_item_add(f, seg->name, g->dirs, -1);
+    }
+    it->path.len = f->len;
+    it->path.data[f->len] = '\0';
+    return;
+  }
+  // After **, the segment that follows is tried in each directory.
+  next = seg->any && !last ? &g->segs[k + 1] : seg;
+  fd = open(f->len ? it->path.data : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  while ((n = syscall(SYS_getdents64, fd, it->buf, NOOSH_GLOB_BUFSIZE)) > 0) {
+    for (off = 0; off < n; off += d->reclen) {
+      d = (struct noosh_dirent64 *) (it->buf + off);
+      name = d->name;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      if (next->name) {
+        match = strcmp(name, next->name) == 0;
+      } else if (next->pat) {
+        match = (name[0] != '.' || next->dot) && noosh_pat_match(next->pat, name, strlen(name));
+      } else {
+        match = name[0] != '.';
+      }
+      if (match && (next == seg ? last : k + 1 == g->nsegs - 1)) {
+        if (!g->dirs || noosh_glob_isdir(fd, d, 1)) {
+          noosh_glob_item_add(f, name, g->dirs, -1);
+        }
+      } else if (match && noosh_glob_isdir(fd, d, 1)) {
+        noosh_glob_item_add(f, name, 1, next == seg ? k + 1 : k + 2);
+      }
+      if (seg->any && name[0] != '.' && noosh_glob_isdir(fd, d, 0)) {
+        noosh_glob_item_add(f, name, 1, k);
+      }
+    }
+  }
+  close(fd);
+  if (noosh_opt_globsort && f->n > 1) {
+    qsort(f->items, f->n, sizeof(*f->items), noosh_glob_item_cmp);
+  }
+}
+
+/*
+    @brief start reading a glob lazily
+    @param pat: the pattern, with quoted characters escaped
+    @return the iterator, to free with noosh_glob_iter_free
+*/
+struct noosh_glob_iter * noosh_glob_iter_new(const char * pat) {
+  struct noosh_glob_iter * it = noosh_malloc(sizeof(*it));
+
+  memset(it, 0, sizeof(*it));
+  it->g = noosh_glob_compile(pat);
+  it->buf = noosh_malloc(NOOSH_GLOB_BUFSIZE);
+  noosh_buf_append(&it->path, "/", it->g->absolute);
+  if (it->g->nsegs > 0) {
+    noosh_glob_iter_enter(it, 0);
+  }
+  return it;
+}
+
+/*
+    @brief take the next match of a glob iterator
+    @return the path, valid until the next call, NULL when there are no
+        more
+*/
+const char * noosh_glob_iter_next(struct noosh_glob_iter * it) {
+  struct noosh_glob_frame * f;
+  struct noosh_glob_item * item;
+
+  while (it->nframes > 0) {
+    f = &it->frames[it->nframes - 1];
+    if (f->next == f->n) {
+      free(f->items);
+      it->nframes--;
+      continue;
+    }
+    item = &f->items[f->next++];
+    it->path.len = f->len;
+    noosh_buf_append(&it->path, item->key, strlen(item->key));
+    free(item->key);
+    if (item->k < 0) {
+      it->found++;
+      return it->path.data;
+    }
+    noosh_glob_iter_enter(it, item->k);
+  }
+  return NULL;
+}
+
+/*
+    @brief free a glob iterator
+*/
+void noosh_glob_iter_free(struct noosh_glob_iter * it) {
+  struct noosh_glob_frame * f;
+
+  for (; it->nframes > 0; it->nframes--) {
+    f = &it->frames[it->nframes - 1];
+    for (; f->next < f->n; f->next++) {
+      free(f->items[f->next].key);
+    }
+    free(f->items);
+  }
+  free(it->frames);
+  free(it->buf);
+  free(it->path.data);
+  noosh_glob_free(it->g);
+  free(it);
+}
+
+/*
+  Arithmetic
+
+  $((...)), ((...)), let and assignments to declare -i variables evaluate
+  C-like expressions on 64-bit integers. An expression is parsed into a
+  small tree whose constant parts are folded as it is built; the tree is
+  then evaluated directly, or compiled to VM ops working on a stack of
+  numbers. Variables are read and written as numbers (see struct
+  noosh_var), so a counter never goes through a decimal string unless
+  it is expanded into a word.
+*/
+
+enum noosh_arith_op {
+  NOOSH_A_NUM,
+  NOOSH_A_VAR,
+  // binary operators, which the ARITH op takes as operand
+  NOOSH_A_MUL,
+  NOOSH_A_DIV,
+  NOOSH_A_MOD,
+  NOOSH_A_ADD,
+  NOOSH_A_SUB,
+  NOOSH_A_SHL,
+  NOOSH_A_SHR,
+  NOOSH_A_LT,
+  NOOSH_A_LE,
+  NOOSH_A_GT,
+  NOOSH_A_GE,
+  NOOSH_A_EQ,
+  NOOSH_A_NE,
+  NOOSH_A_BAND,
+  NOOSH_A_BXOR,
+  NOOSH_A_BOR,
+  NOOSH_A_POW,
+  // unary operators, which it takes too
+  NOOSH_A_NEG,
+  NOOSH_A_NOT,
+  NOOSH_A_BNOT,
+  NOOSH_A_AND,
+  NOOSH_A_OR,
+  NOOSH_A_COND,
+  NOOSH_A_ASSIGN,
+  NOOSH_A_PREINC,
+  NOOSH_A_POSTINC,
+  NOOSH_A_COMMA
+};
+
+/*
+  operator names, for --disasm
+*/
+char * noosh_arith_str[] = {
+  "num", "var", "*", "/", "%", "+", "-", "<<", ">>", "<", "<=", ">", ">=",
+  "==", "!=", "&", "^", "|", "**", "neg", "!", "~", "&&", "||", "?:", "=",
+  "++x", "x++", ","
+};
+
+/*
+  expression tree
+    NUM: num
+    VAR: name
+    binary and unary operators, AND, OR: a and b
+    COND: a ? b : c
+    ASSIGN: name = b, or name sub= b for a compound assignment (sub is
+        -1 for a plain one)
+    PREINC, POSTINC: name, num is the step, 1 or -1
+    COMMA: a, b
+  the variable of VAR, ASSIGN and the increments is element key of name
+  when key is not NULL (name[key])
+*/
+struct noosh_arith {
+  int op;
+  int sub;
+  long long num;
+  char * name;
+  char * key;
+  struct noosh_arith * a;
+  struct noosh_arith * b;
+  struct noosh_arith * c;
+};
+
+/*
+  expression parser state
+    key is the subscript of the last name read, if any; subscripts is
+    set once any name had one
+*/
+struct noosh_arith_parser {
+  const char * s;
+  size_t len;
+  size_t pos;
+  struct noosh_arena * arena;
+  char * error;
+  char * key;
+  int subscripts;
+};
+
+/*
+  binary operators by precedence level, lowest first: the text, the
+  characters that must not follow it (they would make another operator)
+  and the operator
+*/
+struct noosh_arith_binop {
+  char * text;
+  char * not_before;
+  int op;
+};
+
+struct noosh_arith_binop noosh_arith_levels[][4] = {
+  {{"||", "", NOOSH_A_OR}},
+  {{"&&", "", NOOSH_A_AND}},
+  {{"|", "|=", NOOSH_A_BOR}},
+  {{"^", "=", NOOSH_A_BXOR}},
+  {{"&", "&=", NOOSH_A_BAND}},
+  {{"==", "", NOOSH_A_EQ}, {"!=", "", NOOSH_A_NE}},
+  {{"<=", "", NOOSH_A_LE}, {">=", "", NOOSH_A_GE}, {"<", "<=", NOOSH_A_LT}, {">", ">=", NOOSH_A_GT}},
+  {{"<<", "=", NOOSH_A_SHL}, {">>", "=", NOOSH_A_SHR}},
+  {{"+", "+=", NOOSH_A_ADD}, {"-", "-=", NOOSH_A_SUB}},
+  {{"*", "*=", NOOSH_A_MUL}, {"/", "=", NOOSH_A_DIV}, {"%", "=", NOOSH_A_MOD}}
+};
+
+# define NOOSH_ARITH_LEVELS (sizeof(noosh_arith_levels) / sizeof(noosh_arith_levels[0]))
+
+/*
+  compound assignment operators, with the binary operator they apply
+*/
+struct noosh_arith_binop noosh_arith_assigns[] = {
+  {"=", "=", -1}, {"+=", "", NOOSH_A_ADD}, {"-=", "", NOOSH_A_SUB},
+  {"*=", "", NOOSH_A_MUL}, {"/=", "", NOOSH_A_DIV}, {"%=", "", NOOSH_A_MOD},
+  {"<<=", "", NOOSH_A_SHL}, {">>=", "", NOOSH_A_SHR}, {"&=", "", NOOSH_A_BAND},
+  {"^=", "", NOOSH_A_BXOR}, {"|=", "", NOOSH_A_BOR}
+};
+
+/*
+  nesting of variables evaluated as expressions, which may refer to
+  each other
+*/
+__thread int noosh_arith_depth = 0;
+
+# define NOOSH_ARITH_MAX_DEPTH 64
+
+/*
+    @brief apply an operator to numbers
+    @param op: binary or unary operator
+    @param a: left (or only) operand
+    @param b: right operand
+    @param r: receives the result
+    @return 0, -1 after printing an error
+*/
+int noosh_arith_apply(int op, long long a, long long b, long long * r) {
+  unsigned long long base, p;
+
+  switch (op) {
+  // Wrap around on overflow, in unsigned arithmetic that defines it.
+  case NOOSH_A_MUL: *r = (long long) ((unsigned long long) a * b); break;
+  case NOOSH_A_ADD: *r = (long long) ((unsigned long long) a + b); break;
+  case NOOSH_A_SUB: *r = (long long) ((unsigned long long) a - b); break;
+  case NOOSH_A_SHL: *r = (long long) ((unsigned long long) a << (b & 63)); break;
+  case NOOSH_A_SHR: *r = a >> (b & 63); break;
+  case NOOSH_A_LT: *r = a < b; break;
+  case NOOSH_A_LE: *r = a <= b; break;
+  case NOOSH_A_GT: *r = a > b; break;
+  case NOOSH_A_GE: *r = a >= b; break;
+  case NOOSH_A_EQ: *r = a == b; break;
+  case NOOSH_A_NE: *r = a != b; break;
+  case NOOSH_A_BAND: *r = a & b; break;
+  case NOOSH_A_BXOR: *r = a ^ b; break;
+  case NOOSH_A_BOR: *r = a | b; break;
+  case NOOSH_A_NEG: *r = (long long) -(unsigned long long) a; break;
+  case NOOSH_A_NOT: *r = !a; break;
+  case NOOSH_A_BNOT: *r = ~a; break;
+  case NOOSH_A_DIV:
+  case NOOSH_A_MOD:
+    if (b == 0) {
+      dprintf(NOOSH_FD(2), "noosh: division by 0\n");
+      return -1;
+    }
+    if (b == -1) {
+      // LLONG_MIN / -1 overflows.
+      *r = op == NOOSH_A_DIV ? (long long) -(unsigned long long) a : 0;
+    } else {
+      *r = op == NOOSH_A_DIV ? a / b : a % b;
+    }
+    break;
+  case NOOSH_A_POW:
+    if (b < 0) {
+      dprintf(NOOSH_FD(2), "noosh: exponent less than 0\n");
+      return -1;
+    }
+    for (base = a, p = 1; b; b >>= 1, base *= base) {
+      if (b & 1) {
+        p *= base;
+      }
+    }
+    *r = (long long) p;
+    break;
+  }
+  return 0;
+}
+
+/*
+    @brief make a tree node
+*/
+struct noosh_arith * noosh_arith_new(struct noosh_arith_parser * ap, int op,
+                                     struct noosh_arith * a, struct noosh_arith * b) {
+  struct noosh_arith * n = noosh_arena_alloc(ap->arena, sizeof(*n));
+
+  memset(n, 0, sizeof(*n));
+  n->op = op;
+  n->sub = -1;
+  n->a = a;
+  n->b = b;
+  return n;
+}
+
+/*
+    @brief fold an operator node whose operands are constants
+    @param n: the node, turned into a NUM if it can be
+    @return n
+*/
+struct noosh_arith * noosh_arith_fold(struct noosh_arith * n) {
+  long long r;
+
+  if (n->a == NULL || n->a->op != NOOSH_A_NUM) {
+    return n;
+  }
+  if (n->op == NOOSH_A_AND || n->op == NOOSH_A_OR) {
+    // The right side only runs when the left one does not decide.
+    if ((n->a->num != 0) == (n->op == NOOSH_A_OR)) {
+      n->op = NOOSH_A_NUM;
+      n->num = n->a->num != 0;
+    } else if (n->b->op == NOOSH_A_NUM) {
+      n->op = NOOSH_A_NUM;
+      n->num = n->b->num != 0;
+    }
+    return n;
+  }
+  if (n->op == NOOSH_A_COND) {
+    return n->a->num ? n->b : n->c;
+  }
+  if (n->op >= NOOSH_A_NEG && n->op <= NOOSH_A_BNOT) {
+    noosh_arith_apply(n->op, n->a->num, 0, &n->num);
+    n->op = NOOSH_A_NUM;
+  } else if (n->op >= NOOSH_A_MUL && n->op <= NOOSH_A_POW && n->b->op == NOOSH_A_NUM &&
+             !((n->op == NOOSH_A_DIV || n->op == NOOSH_A_MOD) && n->b->num == 0) &&
+             !(n->op == NOOSH_A_POW && n->b->num < 0)) {
+    // Errors are left for run time, where they are reported.
+    noosh_arith_apply(n->op, n->a->num, n->b->num, &r);
+    n->op = NOOSH_A_NUM;
+    n->num = r;
+  }
+  return n;
+}
+
+/*
+    @brief skip blanks and newlines
+*/
+void noosh_arith_blank(struct noosh_arith_parser * ap) {
+  while (ap->pos < ap->len && isspace((unsigned char) ap->s[ap->pos])) {
+    ap->pos++;
+  }
+}
+
+/*
+    @brief consume an operator if it is next
+    @param ap: parser
+    @param text: the operator
+    @param not_before: characters that would make it a longer operator
+    @return 1 if it was there
+*/
+int noosh_arith_accept(struct noosh_arith_parser * ap, const char * text, const char * not_before) {
+  size_t n = strlen(text);
+
+  noosh_arith_blank(ap);
+  if (ap->pos + n > ap->len || memcmp(ap->s + ap->pos, text, n) != 0 ||
+      (ap->pos + n < ap->len && strchr(not_before, ap->s[ap->pos + n]) && not_before[0])) {
+    return 0;
+  }
+  ap->pos += n;
+  return 1;
+}
+
+/*
+    @brief read a variable name, if one is next
+    @return the name in the arena, NULL if there is none
+*/
+char * noosh_arith_name(struct noosh_arith_parser * ap) {
+  size_t n, start, depth = 0;
+  char * name;
+
+  noosh_arith_blank(ap);
+  n = noosh_name_len(ap->s + ap->pos, ap->len - ap->pos);
+  if (n == 0) {
+    return NULL;
+  }
+  ap->pos += n;
+  name = noosh_arena_strndup(ap->arena, ap->s + ap->pos - n, n);
+  ap->key = NULL;
+  if (ap->pos < ap->len && ap->s[ap->pos] == '[') {
+    // name[subscript], the subscript running to the matching `]'
+    for (start = ++ap->pos; ap->pos < ap->len; ap->pos++) {
+      if (ap->s[ap->pos] == '[') {
+        depth++;
+      } else if (ap->s[ap->pos] == ']' && depth-- == 0) {
+        break;
+      }
+    }
+    if (ap->pos == ap->len) {
+      ap->error = "`]' expected";
+      return NULL;
+    }
+    ap->key = noosh_arena_strndup(ap->arena, ap->s + start, ap->pos++ - start);
+    ap->subscripts = 1;
+  }
+  return name;
+}
+
+/*
+    @brief convert an integer constant: decimal, 0x hexadecimal, 0 octal
+        or base#digits with a base from 2 to 64
+    @param s: the text
+    @param len: its length
+    @param out: receives the value
+    @return 0, -1 if it is not a valid constant
+*/
+int noosh_arith_const(const char * s, size_t len, long long * out) {
+  unsigned long long v = 0;
+  const char * hash = memchr(s, '#', len);
+  size_t i = 0;
+  int base = 10, d;
+
+  if (hash) {
+    for (base = 0; s + i < hash; i++) {
+      if (!isdigit((unsigned char) s[i]) || (base = base * 10 + s[i] - '0') > 64) {
+        return -1;
+      }
+    }
+    i++;
+    if (base < 2 || i == len) {
+      return -1;
+    }
+  } else if (len > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+    base = 16;
+    i = 2;
+  } else if (len > 1 && s[0] == '0') {
+    base = 8;
+    i = 1;
+  }
+  for (; i < len; i++) {
+    if (isdigit((unsigned char) s[i])) {
+      d = s[i] - '0';
+    } else if (islower((unsigned char) s[i])) {
+      d = s[i] - 'a' + 10;
+    } else if (isupper((unsigned char) s[i])) {
+      d = s[i] - 'A' + (base <= 36 ? 10 : 36);
+    } else if (s[i] == '@' || s[i] == '_') {
+      d = s[i] == '@' ? 62 : 63;
+    } else {
+      return -1;
+    }
+    if (d >= base) {
+      return -1;
+    }
+    v = v * base + d;
+  }
+  *out = (long long) v;
+  return 0;
+}
+
+struct noosh_arith * noosh_arith_comma(struct noosh_arith_parser * ap);
+struct noosh_arith * noosh_arith_assign(struct noosh_arith_parser * ap);
+
+/*
+    @brief parse a unary expression: a prefix operator, a constant, a
+        variable with an optional ++ or --, or a parenthesized expression
+*/
+struct noosh_arith * noosh_arith_unary(struct noosh_arith_parser * ap) {
+  struct noosh_arith * n;
+  size_t start;
+  char * name;
+  int op;
+
+  if (noosh_arith_accept(ap, "++", "") || noosh_arith_accept(ap, "--", "")) {
+    op = ap->s[ap->pos - 1] == '+' ? 1 : -1;
+    if ((name = noosh_arith_name(ap)) == NULL) {
+      ap->error = "variable expected";
+      return NULL;
+    }
+    n = noosh_arith_new(ap, NOOSH_A_PREINC, NULL, NULL);
+    n->name = name;
+    n->key = ap->key;
+    n->num = op;
+    return n;
+  }
+  op = noosh_arith_accept(ap, "!", "=") ? NOOSH_A_NOT :
+       noosh_arith_accept(ap, "~", "") ? NOOSH_A_BNOT :
+       noosh_arith_accept(ap, "-", "=") ? NOOSH_A_NEG :
+       noosh_arith_accept(ap, "+", "=") ? NOOSH_A_ADD : -1;
+  if (op >= 0) {
+    if ((n = noosh_arith_unary(ap)) == NULL || op == NOOSH_A_ADD) {
+      return n;
+    }
+    return noosh_arith_fold(noosh_arith_new(ap, op, n, NULL));
+  }
+  if (noosh_arith_accept(ap, "(", "")) {
+    if ((n = noosh_arith_comma(ap)) == NULL) {
+      return NULL;
+    }
+    if (!noosh_arith_accept(ap, ")", "")) {
+      ap->error = "`)' expected";
+      return NULL;
+    }
+    return n;
+  }
+  if (ap->pos < ap->len && isdigit((unsigned char) ap->s[ap->pos])) {
+    for (start = ap->pos; ap->pos < ap->len && (isalnum((unsigned char) ap->s[ap->pos]) ||
+         strchr("#@_", ap->s[ap->pos])); ap->pos++);
+    n = noosh_arith_new(ap, NOOSH_A_NUM, NULL, NULL);
+    if (noosh_arith_const(ap->s + start, ap->pos - start, &n->num) < 0) {
+      ap->error = "bad number";
+      return NULL;
+    }
+    return n;
+  }
+  if ((name = noosh_arith_name(ap)) == NULL) {
+    ap->error = ap->pos < ap->len ? "syntax error" : "operand expected";
+    return NULL;
+  }
+  if (noosh_arith_accept(ap, "++", "") || noosh_arith_accept(ap, "--", "")) {
+    n = noosh_arith_new(ap, NOOSH_A_POSTINC, NULL, NULL);
+    n->num = ap->s[ap->pos - 1] == '+' ? 1 : -1;
+  } else {
+    n = noosh_arith_new(ap, NOOSH_A_VAR, NULL, NULL);
+  }
+  n->name = name;
+  n->key = ap->key;
+  return n;
+}
+
+/*
+    @brief parse the binary operators of a precedence level and above
+*/
+struct noosh_arith * noosh_arith_binary(struct noosh_arith_parser * ap, size_t level) {
+  struct noosh_arith_binop * b;
+  struct noosh_arith * n, * r;
+  int i, found;
+
+  if (level == NOOSH_ARITH_LEVELS) {
+    // ** binds tightest and to the right.
+    if ((n = noosh_arith_unary(ap)) == NULL || !noosh_arith_accept(ap, "**", "=")) {
+      return n;
+    }
+    if ((r = noosh_arith_binary(ap, level)) == NULL) {
+      return NULL;
+    }
+    return noosh_arith_fold(noosh_arith_new(ap, NOOSH_A_POW, n, r));
+  }
+  if ((n = noosh_arith_binary(ap, level + 1)) == NULL) {
+    return NULL;
+  }
+  do {
+    found = 0;
+    for (i = 0; i < 4 && (b = &noosh_arith_levels[level][i])->text; i++) {
+      if (noosh_arith_accept(ap, b->text, b->not_before)) {
+        if ((r = noosh_arith_binary(ap, level + 1)) == NULL) {
+          return NULL;
+        }
+        n = noosh_arith_fold(noosh_arith_new(ap, b->op, n, r));
+        found = 1;
+        break;
+      }
+    }
+  } while (found);
+  return n;
+}
+
+/*
+    @brief parse a conditional expression, a ? b : c
+*/
+struct noosh_arith * noosh_arith_cond(struct noosh_arith_parser * ap) {
+  struct noosh_arith * n, * c;
+
+  if ((c = noosh_arith_binary(ap, 0)) == NULL || !noosh_arith_accept(ap, "?", "")) {
+    return c;
+  }
+  n = noosh_arith_new(ap, NOOSH_A_COND, c, NULL);
+  if ((n->b = noosh_arith_comma(ap)) == NULL) {
+    return NULL;
+  }
+  if (!noosh_arith_accept(ap, ":", "")) {
+    ap->error = "`:' expected for conditional expression";
+    return NULL;
+  }
+  if ((n->c = noosh_arith_assign(ap)) == NULL) {
+    return NULL;
+  }
+  return noosh_arith_fold(n);
+}
+
+/*
+    @brief parse an assignment, or a conditional expression
+*/
+struct noosh_arith * noosh_arith_assign(struct noosh_arith_parser * ap) {
+  struct noosh_arith * n;
+  size_t start = ap->pos, i;
+  char * name;
+
+  if ((name = noosh_arith_name(ap)) != NULL) {
+    for (i = 0; i < sizeof(noosh_arith_assigns) / sizeof(noosh_arith_assigns[0]); i++) {
+      if (noosh_arith_accept(ap, noosh_arith_assigns[i].text, noosh_arith_assigns[i].not_before)) {
+        n = noosh_arith_new(ap, NOOSH_A_ASSIGN, NULL, NULL);
+        n->name = name;
+        n->key = ap->key;
+        n->sub = noosh_arith_assigns[i].op;
+        return (n->b = noosh_arith_assign(ap)) ? n : NULL;
+      }
+    }
+    ap->pos = start;
+  }
+  return noosh_arith_cond(ap);
+}
+
+/*
+    @brief parse expressions separated by commas
+*/
+struct noosh_arith * noosh_arith_comma(struct noosh_arith_parser * ap) {
+  struct noosh_arith * n, * r;
+
+  if ((n = noosh_arith_assign(ap)) == NULL) {
+    return NULL;
+  }
+  while (noosh_arith_accept(ap, ",", "")) {
+    if ((r = noosh_arith_assign(ap)) == NULL) {
+      return NULL;
+    }
+    n = noosh_arith_new(ap, NOOSH_A_COMMA, n, r);
+  }
+  return n;
+}
+
+/*
+    @brief parse a whole expression
+    @return the tree, NULL with ap->error set; an empty expression is 0
+*/
+struct noosh_arith * noosh_arith_top(struct noosh_arith_parser * ap) {
+  struct noosh_arith * n;
+
+  noosh_arith_blank(ap);
+  if (ap->pos == ap->len) {
+    return noosh_arith_new(ap, NOOSH_A_NUM, NULL, NULL);
+  }
+  if ((n = noosh_arith_comma(ap)) != NULL) {
+    noosh_arith_blank(ap);
+    if (ap->pos < ap->len) {
+      ap->error = "syntax error";
+      n = NULL;
+    }
+  }
+  return n;
+}
+
+/*
+    @brief parse an expression
+    @param s: its text
+    @param len: its length
+    @param arena: where the tree is allocated
+    @return the tree, NULL after printing an error
+*/
+struct noosh_arith * noosh_arith_parse(const char * s, size_t len, struct noosh_arena * arena) {
+  struct noosh_arith_parser ap = {s, len, 0, arena, NULL, NULL, 0};
+  struct noosh_arith * n;
+
+  if ((n = noosh_arith_top(&ap)) == NULL) {
+    dprintf(NOOSH_FD(2), "noosh: %.*s: %s (error token is \"%.*s\")\n", (int) len, s,
+            ap.error, (int) (len - ap.pos), s + ap.pos);
+  }
+  return n;
+}
+
+/*
+    @brief read the variable of a VAR, ASSIGN or increment node
+    @param n: the node
+    @param out: receives its value as a number
+    @return 0, -1 after printing an error
+*/
+int noosh_arith_load(struct noosh_arith * n, long long * out) {
+  struct noosh_var * v = noosh_var_cell(n->name);
+  const char * s;
+
+  if (n->key == NULL) {
+    return noosh_var_num(v, out);
+  }
+  if (noosh_var_get_elem(v, n->key, strlen(n->key), &s) < 0) {
+    return -1;
+  }
+  if (s == NULL || *s == '\0') {
+    *out = 0;
+    return 0;
+  }
+  return noosh_arith_string(s, out);
+}
+
+/*
+    @brief assign the variable of an ASSIGN or increment node
+    @return 0, -1 after printing an error
+*/
+int noosh_arith_store(struct noosh_arith * n, long long value) {
+  struct noosh_var * v = noosh_var_cell(n->name);
+  char tmp[24];
+
+  if (n->key == NULL) {
+    return noosh_var_set_num(v, value);
+  }
+  sprintf(tmp, "%lld", value);
+  return noosh_var_set_elem(v, n->key, strlen(n->key), tmp);
+}
+
+/*
+    @brief evaluate an expression tree
+    @param n: the tree
+    @param out: receives the value
+    @return 0, -1 after printing an error
+*/
+int noosh_arith_eval(struct noosh_arith * n, long long * out) {
+  long long a, b;
+
+  switch (n->op) {
+  case NOOSH_A_NUM:
+    *out = n->num;
+    return 0;
+  case NOOSH_A_VAR:
+    return noosh_arith_load(n, out);
+  case NOOSH_A_AND:
+  case NOOSH_A_OR:
+    if (noosh_arith_eval(n->a, &a) < 0) {
+      return -1;
+    }
+    if ((a != 0) == (n->op == NOOSH_A_OR)) {
+      *out = a != 0;
+      return 0;
+    }
+    if (noosh_arith_eval(n->b, &b) < 0) {
+      return -1;
+    }
+    *out = b != 0;
+    return 0;
+  case NOOSH_A_COND:
+    if (noosh_arith_eval(n->a, &a) < 0) {
+      return -1;
+    }
+    return noosh_arith_eval(a ? n->b : n->c, out);
+  case NOOSH_A_ASSIGN:
+    if (noosh_arith_eval(n->b, &b) < 0) {
+      return -1;
+    }
+    if (n->sub >= 0 && (noosh_arith_load(n, &a) < 0 || noosh_arith_apply(n->sub, a, b, &b) < 0)) {
+      return -1;
+    }
+    if (noosh_arith_store(n, b) < 0) {
+      return -1;
+    }
+    *out = b;
+    return 0;
+  case NOOSH_A_PREINC:
+  case NOOSH_A_POSTINC:
+    if (noosh_arith_load(n, &a) < 0) {
+      return -1;
+    }
+    b = (long long) ((unsigned long long) a + n->num);
+    if (noosh_arith_store(n, b) < 0) {
+      return -1;
+    }
+    *out = n->op == NOOSH_A_PREINC ? b : a;
+    return 0;
+  case NOOSH_A_COMMA:
+    if (noosh_arith_eval(n->a, &a) < 0) {
+      return -1;
+    }
+    return noosh_arith_eval(n->b, out);
+  }
+  if (noosh_arith_eval(n->a, &a) < 0 || (n->b && noosh_arith_eval(n->b, &b) < 0)) {
+    return -1;
+  }
+  return noosh_arith_apply(n->op, a, n->b ? b : 0, out);
+}
+
+/*
+    @brief evaluate an expression given as text, already expanded
+    @param s: the text
+    @param len: its length
+    @param out: receives the value
+    @return 0, -1 after printing an error
+*/
+int noosh_arith_text(const char * s, size_t len, long long * out) {
+  struct noosh_arena arena = {0};
+  struct noosh_arith * n;
+  int r = -1;
+
+  if (noosh_arith_depth >= NOOSH_ARITH_MAX_DEPTH) {
+    dprintf(NOOSH_FD(2), "noosh: %.*s: expression recursion level exceeded\n", (int) len, s);
+    return -1;
+  }
+  noosh_arith_depth++;
+  if ((n = noosh_arith_parse(s, len, &arena)) != NULL) {
+    r = noosh_arith_eval(n, out);
+  }
+  noosh_arith_depth--;
+  noosh_arena_free(&arena);
+  return r;
+}
+
+/*
+    @brief evaluate a string as an expression, for variable values
+*/
+int noosh_arith_string(const char * s, long long * out) {
+  return noosh_arith_text(s, strlen(s), out);
+}
+
+/*
+    @brief check whether the text of an expression has expansions or
+        quotes to process before it is parsed
+*/
+int noosh_arith_needs_expansion(const char * s, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (strchr("$`'\"\\", s[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+    @brief evaluate the text of a $((...)) or ((...)), expanding its
+        parameters and command substitutions first
+    @param s: the text
+    @param len: its length
+    @param out: receives the value
+    @return 0, -1 after printing an error
+*/
+int noosh_arith_expand(const char * s, size_t len, long long * out) {
+  struct noosh_word w = {(char *) s, len, NOOSH_W_QUOTED | NOOSH_W_EXPAND};
+  char * text;
+  int r;
+
+  if (!noosh_arith_needs_expansion(s, len)) {
+    return noosh_arith_text(s, len, out);
+  }
+  if ((text = noosh_expand_string(&w, 0)) == NULL) {
+    return -1;
+  }
+  r = noosh_arith_text(text, strlen(text), out);
+  free(text);
+  return r;
+}
+
+/*
+  Conditional expressions
+
+  A [[ ... ]] is parsed into a tree of tests joined by &&, || and !. Its
+  words are expanded without field splitting, the right side of == and
+  != as a pattern and that of =~ as an extended regex, with quoted
+  characters matching themselves. The status of a test is 0 when true,
+  1 when false and 2 for a bad regex or arithmetic operand.
+
+  Regexes are compiled once per distinct text into a small cache that
+  drops the least recently used one. When compiled, a literal that every
+  match must contain is taken from the regex (a prefix after ^ if it has
+  one, otherwise its longest plain run outside groups): a subject without
+  it is a miss found by strncmp or strstr, without running the matcher.
+  The whole match and the groups of a successful =~ go into the MATCH
+  array, ${MATCH[1]} being the first group.
+*/
+
+/*
+  compiled regex
+    text is its source and hash the hash of that; used is the clock
+    value of its last use; lit, llen bytes long, is the literal every
+    match contains, at its start when anchored; error is set when the
+    text does not compile
+*/
+struct noosh_regex {
+  char * text;
+  unsigned long hash;
+  unsigned long used;
+  regex_t re;
+  int error;
+  char * lit;
+  size_t llen;
+  int anchored;
+};
+
+# define NOOSH_REGEX_SLOTS 32
+
+struct noosh_regex * noosh_regex_cache[NOOSH_REGEX_SLOTS];
+unsigned long noosh_regex_clock = 0;
+
+/*
+  regex cache counters for stats: skips are subjects the literal ruled out
+*/
+unsigned long noosh_regex_hits = 0;
+unsigned long noosh_regex_misses = 0;
+unsigned long noosh_regex_skips = 0;
+
+/*
+    @brief skip a bracket expression of a regex
+    @param re: the regex
+    @param i: index of the `['
+    @return index of its closing `]', or of the terminating null
+*/
+size_t noosh_regex_bracket(const char * re, size_t i) {
+  const char * end;
+
+  i++;
+  i += re[i] == '^';
+  i += re[i] == ']';
+  for (; re[i] && re[i] != ']'; i++) {
+    if (re[i] == '[' && (re[i + 1] == ':' || re[i + 1] == '.' || re[i + 1] == '=')) {
+      // [:alpha:] and the like may hold a ]
+      char close[3] = {re[i + 1], ']', '\0'};
+
+      if ((end = strstr(re + i + 2, close)) == NULL) {
+        return strlen(re);
+      }
+      i = end + 1 - re;
+    }
+  }
+  return i;
+}
+
+/*
+    @brief end a plain run of a regex, keeping it if it is the longest
+*/
+void noosh_regex_run_end(struct noosh_buf * run, struct noosh_buf * best) {
+  if (run->len > best->len) {
+    best->len = 0;
+    noosh_buf_append(best, run->data, run->len);
+  }
+  run->len = 0;
+}
+
+/*
+    @brief find a literal every match of an extended regex contains
+    @param re: the regex
+    @param llen: receives the length of the literal
+    @param anchored: set when the literal must start the subject
+    @return the literal, allocated, NULL if there is none
+*/
+char * noosh_regex_literal(const char * re, size_t * llen, int * anchored) {
+  struct noosh_buf run = {0}, best = {0}, prefix = {0};
+  int lead = re[0] == '^', depth = 0;
+  size_t i;
+  char c;
+
+  for (i = lead; re[i]; i++) {
+    c = re[i];
+    if (c == '\\' && re[i + 1] && !isalnum((unsigned char) re[i + 1]) && !strchr("<>`'", re[i + 1])) {
+      // An escaped character is literal; \w, \1, \< and the like are not.
+      if (depth == 0) {
+        noosh_buf_append(&run, re + ++i, 1);
+        continue;
+      }
+      i++;
+    } else if (c == '|' && depth == 0) {
+      // Any of the alternatives may match: no text is certain.
+      free(run.data);
+      free(best.data);
+      free(prefix.data);
+      return NULL;
+    } else if (c == '*' || c == '?' || c == '{') {
+      // The character before may be left out, all of a multibyte one.
+      while (run.len > 0 && ((unsigned char) run.data[run.len - 1] & 0xc0) == 0x80) {
+        run.len--;
+      }
+      run.len -= run.len > 0;
+      while (c == '{' && re[i] && re[i] != '}') {
+        i++;
+      }
+    } else if (c == '[') {
+      i = noosh_regex_bracket(re, i);
+    } else if (c == '(' || c == ')') {
+      depth += c == '(' ? 1 : -1;
+    } else if (c == '\\' && re[i + 1]) {
+      i++;
+    } else if (c != '+' && c != '.' && c != '^' && c != '$' && depth == 0) {
+      noosh_buf_append(&run, &c, 1);
+      continue;
+    }
+    if (lead) {
+      // The run right after a leading ^ must start the subject.
+      noosh_buf_append(&prefix, run.data ? run.data : "", run.len);
+      lead = 0;
+    }
+    noosh_regex_run_end(&run, &best);
+    if (re[i] == '\0') {
+      break;
+    }
+  }
+  if (lead) {
+    noosh_buf_append(&prefix, run.data ? run.data : "", run.len);
+  }
+  noosh_regex_run_end(&run, &best);
+  free(run.data);
+  *anchored = prefix.len > 0;
+  if (*anchored) {
+    free(best.data);
+    best = prefix;
+  } else {
+    free(prefix.data);
+  }
+  *llen = best.len;
+  if (best.len == 0) {
+    free(best.data);
+    return NULL;
+  }
+  return best.data;
+}
+
+/*
+    @brief compile a regex
+    @param text: its source
+    @return the regex, to free with noosh_regex_free; error is set in it
+        when the text is not a valid regex
+*/
+struct noosh_regex * noosh_regex_compile(const char * text) {
+  struct noosh_regex * r = noosh_malloc(sizeof(*r));
+
+  memset(r, 0, sizeof(*r));
+  r->text = noosh_strdup(text);
+  r->hash = noosh_hash(text, strlen(text));
+  r->error = regcomp(&r->re, text, REG_EXTENDED) != 0;
+  if (!r->error) {
+    r->lit = noosh_regex_literal(text, &r->llen, &r->anchored);
+  }
+  return r;
+}
+
+/*
+    @brief free a regex from noosh_regex_compile
+*/
+void noosh_regex_free(struct noosh_regex * r) {
+  if (!r->error) {
+    regfree(&r->re);
+  }
+  free(r->lit);
+  free(r->text);
+  free(r);
+}
+
+/*
+    @brief get the compiled form of a regex from the cache, compiling it
+        into the least recently used slot if it is not there
+    @param text: the regex
+    @return the regex, to give back with noosh_regex_release
+*/
+struct noosh_regex * noosh_regex_get(const char * text) {
+  unsigned long h = noosh_hash(text, strlen(text));
+  int i, old = 0;
+
+  if (noosh_stage_isolated) {
+    // Pipeline stage threads keep out of the shell's cache.
+    return noosh_regex_compile(text);
+  }
+  for (i = 0; i < NOOSH_REGEX_SLOTS && noosh_regex_cache[i]; i++) {
+    if (noosh_regex_cache[i]->hash == h && strcmp(noosh_regex_cache[i]->text, text) == 0) {
+      __atomic_add_fetch(&noosh_regex_hits, 1, __ATOMIC_RELAXED);
+      noosh_regex_cache[i]->used = ++noosh_regex_clock;
+      return noosh_regex_cache[i];
+    }
+    if (noosh_regex_cache[i]->used < noosh_regex_cache[old]->used) {
+      old = i;
+    }
+  }
+  __atomic_add_fetch(&noosh_regex_misses, 1, __ATOMIC_RELAXED);
+  if (i < NOOSH_REGEX_SLOTS) {
+    old = i;
+  } else {
+    noosh_regex_free(noosh_regex_cache[old]);
+  }
+  noosh_regex_cache[old] = noosh_regex_compile(text);
+  noosh_regex_cache[old]->used = ++noosh_regex_clock;
+  return noosh_regex_cache[old];
+}
+
+/*
+    @brief give back a regex from noosh_regex_get
+*/
+void noosh_regex_release(struct noosh_regex * r) {
+  if (noosh_stage_isolated) {
+    noosh_regex_free(r);
+  }
+}
+
+/*
+    @brief set the MATCH array to the match and groups of a regex, or
+        empty it after a miss
+    @param s: the subject
+    @param m: the match and its groups, NULL after a miss
+    @param n: their number
+*/
+void noosh_regex_set_match(const char * s, const regmatch_t * m, size_t n) {
+  struct noosh_var * v = noosh_var_cell("MATCH");
+  size_t i;
+
+  if (m == NULL && noosh_var_count(v) == 0) {
+    // Misses in a loop leave an empty MATCH as it is.
+    return;
+  }
+  if (noosh_var_reset_array(v, 0, 1) < 0 || noosh_stage_isolated) {
+    return;
+  }
+  pthread_mutex_lock(&noosh_var_lock);
+  for (i = 0; i < n; i++) {
+    if (m[i].rm_so < 0) {
+      noosh_array_set(v->array, i, "", 0);
+    } else {
+      noosh_array_set(v->array, i, s + m[i].rm_so, m[i].rm_eo - m[i].rm_so);
+    }
+  }
+  pthread_mutex_unlock(&noosh_var_lock);
+}
+
+# define NOOSH_REGEX_GROUPS 16
+
+/*
+    @brief match a subject against a regex, for =~
+    @param s: the subject
+    @param text: the regex
+    @return 0 if it matches, 1 if not, 2 if the regex is not valid
+*/
+int noosh_regex_test(const char * s, const char * text) {
+  struct noosh_regex * r = noosh_regex_get(text);
+  regmatch_t local[NOOSH_REGEX_GROUPS], * m = local;
+  size_t n;
+  int status = 1;
+
+  if (r->error) {
+    noosh_regex_release(r);
+    return 2;
+  }
+  if (r->lit && (r->anchored ? strncmp(s, r->lit, r->llen) != 0 : strstr(s, r->lit) == NULL)) {
+    __atomic_add_fetch(&noosh_regex_skips, 1, __ATOMIC_RELAXED);
+    noosh_regex_release(r);
+    noosh_regex_set_match(s, NULL, 0);
+    return 1;
+  }
+  n = r->re.re_nsub + 1;
+  if (n > NOOSH_REGEX_GROUPS) {
+    m = noosh_malloc(n * sizeof(*m));
+  }
+  if (regexec(&r->re, s, n, m, 0) == 0) {
+    noosh_regex_set_match(s, m, n);
+    status = 0;
+  } else {
+    noosh_regex_set_match(s, NULL, 0);
+  }
+  if (m != local) {
+    free(m);
+  }
+  noosh_regex_release(r);
+  return status;
+}
+
+/*
+    @brief show the regex cache counters
+    @param out: descriptor to write to
+    @param reset: nonzero to reset them afterwards
+*/
+void noosh_regex_stats(int out, int reset) {
+  dprintf(out, "regex cache hits %lu misses %lu prefilter skips %lu\n",
+          __atomic_load_n(&noosh_regex_hits, __ATOMIC_RELAXED),
+          __atomic_load_n(&noosh_regex_misses, __ATOMIC_RELAXED),
+          __atomic_load_n(&noosh_regex_skips, __ATOMIC_RELAXED));
+  if (reset) {
+    __atomic_store_n(&noosh_regex_hits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&noosh_regex_misses, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&noosh_regex_skips, 0, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+    @brief compare the modification times of two files
+    @return <0, 0 or >0 as a is older, as old or newer than b
+*/
+int noosh_mtime_cmp(const struct stat * a, const struct stat * b) {
+  if (a->st_mtim.tv_sec != b->st_mtim.tv_sec) {
+    return a->st_mtim.tv_sec < b->st_mtim.tv_sec ? -1 : 1;
+  }
+  return (a->st_mtim.tv_nsec > b->st_mtim.tv_nsec) - (a->st_mtim.tv_nsec < b->st_mtim.tv_nsec);
+}
+
+/*
+    @brief check whether a variable or element named by -v is set
+    @param name: name or name[subscript]
+    @return 0 if it is set, 1 if not
+*/
+int noosh_test_var(const char * name) {
+  const char * sub = strchr(name, '['), * value = NULL;
+  size_t len = strlen(name);
+  char * base;
+  int r;
+
+  if (sub == NULL || name[len - 1] != ']') {
+    return !noosh_valid_name(name) || noosh_getvar(name) == NULL;
+  }
+  base = noosh_strndup(name, sub - name);
+  r = noosh_valid_name(base) &&
+      noosh_var_get_elem(noosh_var_cell(base), sub + 1, name + len - 1 - (sub + 1), &value) == 0 && value;
+  free(base);
+  return !r;
+}
+
+/*
+    @brief the expansion mode of the right side of a binary test
+*/
+int noosh_test_mode(int test) {
+  if (test == NOOSH_TEST_REGEX) {
+    return NOOSH_X_REGEX;
+  }
+  return test == NOOSH_TEST_MATCH || test == NOOSH_TEST_NOMATCH ? NOOSH_X_PATTERN : 0;
+}
+
+/*
+    @brief run one test of a [[ ... ]] on expanded words
+    @param test: the test
+    @param a: its operand, the left one of a binary test
+    @param b: the right operand of a binary test
+    @param site: where the right side of == and != comes from, for the
+        pattern cache
+    @return 0 if true, 1 if false, 2 after an error
+*/
+int noosh_cond_test(int test, const char * a, const char * b, const char * site) {
+  struct noosh_pattern * pat;
+  struct stat st, st2;
+  long long x, y;
+  int r, i;
+
+  switch (test) {
+  case NOOSH_TEST_STRING:
+  case NOOSH_TEST_NONEMPTY:
+    return a[0] == '\0';
+  case NOOSH_TEST_EMPTY:
+    return a[0] != '\0';
+  case NOOSH_TEST_TTY:
+    if (noosh_arith_text(a, strlen(a), &x) < 0) {
+      return 2;
+    }
+    return !isatty(x >= 0 && x < NOOSH_IO_FDS ? NOOSH_FD(x) : x);
+  case NOOSH_TEST_VAR:
+    return noosh_test_var(a);
+  case NOOSH_TEST_OPTION:
+    for (i = 0; i < noosh_num_options(); i++) {
+      if (strcmp(a, option_str[i]) == 0) {
+        return !*option_flag[i];
+      }
+    }
+    return 1;
+  case NOOSH_TEST_MATCH:
+  case NOOSH_TEST_NOMATCH:
+    pat = noosh_pat_get(site, b);
+    r = noosh_pat_match(pat, a, strlen(a));
+    noosh_pat_release(pat);
+    return r == (test == NOOSH_TEST_NOMATCH);
+  case NOOSH_TEST_REGEX:
+    return noosh_regex_test(a, b);
+  case NOOSH_TEST_BEFORE:
+    return strcmp(a, b) >= 0;
+  case NOOSH_TEST_AFTER:
+    return strcmp(a, b) <= 0;
+  case NOOSH_TEST_EQ:
+  case NOOSH_TEST_NE:
+  case NOOSH_TEST_LT:
+  case NOOSH_TEST_LE:
+  case NOOSH_TEST_GT:
+  case NOOSH_TEST_GE:
+    if (noosh_arith_text(a, strlen(a), &x) < 0 || noosh_arith_text(b, strlen(b), &y) < 0) {
+      return 2;
+    }
+    switch (test) {
+    case NOOSH_TEST_EQ:
+      return x != y;
+    case NOOSH_TEST_NE:
+      return x == y;
+    case NOOSH_TEST_LT:
+      return x >= y;
+    case NOOSH_TEST_LE:
+      return x > y;
+    case NOOSH_TEST_GT:
+      return x <= y;
+    }
+    return x < y;
+  case NOOSH_TEST_NEWER:
+    return noosh_stat(a, &st, 1) < 0 || (noosh_stat(b, &st2, 1) == 0 && noosh_mtime_cmp(&st, &st2) <= 0);
+  case NOOSH_TEST_OLDER:
+    return noosh_stat(b, &st2, 1) < 0 || (noosh_stat(a, &st, 1) == 0 && noosh_mtime_cmp(&st, &st2) >= 0);
+  case NOOSH_TEST_SAME:
+    return noosh_stat(a, &st, 1) < 0 || noosh_stat(b, &st2, 1) < 0 || st.st_dev != st2.st_dev ||
+           st.st_ino != st2.st_ino;
+  case NOOSH_TEST_READ:
+    return faccessat(AT_FDCWD, a, R_OK, AT_EACCESS) != 0;
+  case NOOSH_TEST_WRITE:
+    return faccessat(AT_FDCWD, a, W_OK, AT_EACCESS) != 0;
+  case NOOSH_TEST_EXEC:
+    return faccessat(AT_FDCWD, a, X_OK, AT_EACCESS) != 0;
+  }
+
+  // The rest look at the file's metadata.
+  if (noosh_stat(a, &st, test != NOOSH_TEST_LINK) < 0) {
+    return 1;
+  }
+  switch (test) {
+  case NOOSH_TEST_FILE:
+    return !S_ISREG(st.st_mode);
+  case NOOSH_TEST_DIR:
+    return !S_ISDIR(st.st_mode);
+  case NOOSH_TEST_SIZE:
+    return st.st_size == 0;
+  case NOOSH_TEST_LINK:
+    return !S_ISLNK(st.st_mode);
+  case NOOSH_TEST_FIFO:
+    return !S_ISFIFO(st.st_mode);
+  case NOOSH_TEST_SOCKET:
+    return !S_ISSOCK(st.st_mode);
+  case NOOSH_TEST_BLOCK:
+    return !S_ISBLK(st.st_mode);
+  case NOOSH_TEST_CHAR:
+    return !S_ISCHR(st.st_mode);
+  case NOOSH_TEST_STICKY:
+    return !(st.st_mode & S_ISVTX);
+  case NOOSH_TEST_SETUID:
+    return !(st.st_mode & S_ISUID);
+  case NOOSH_TEST_SETGID:
+    return !(st.st_mode & S_ISGID);
+  case NOOSH_TEST_OWNER:
+    return st.st_uid != geteuid();
+  case NOOSH_TEST_GROUP:
+    return st.st_gid != getegid();
+  case NOOSH_TEST_MODIFIED:
+    return st.st_mtim.tv_sec < st.st_atim.tv_sec ||
+           (st.st_mtim.tv_sec == st.st_atim.tv_sec && st.st_mtim.tv_nsec <= st.st_atim.tv_nsec);
+  }
+  return 0;
+}
+
+/*
+    @brief evaluate the expression of a [[ ... ]] with the tree walker
+    @param c: the expression
+    @return its status
+*/
+int noosh_cond_eval(struct noosh_cond * c) {
+  char * a, * b = NULL;
+  int status;
+
+  switch (c->type) {
+  case NOOSH_C_AND:
+    status = noosh_cond_eval(c->l);
+    return status == 0 ? noosh_cond_eval(c->r) : status;
+  case NOOSH_C_OR:
+    status = noosh_cond_eval(c->l);
+    return status != 0 ? noosh_cond_eval(c->r) : 0;
+  case NOOSH_C_NOT:
+    return !noosh_cond_eval(c->l);
+  }
+  if ((a = noosh_expand_string(&c->a, 0)) == NULL) {
+    return 1;
+  }
+  if (c->test >= NOOSH_TEST_MATCH && (b = noosh_expand_string(&c->b, noosh_test_mode(c->test))) == NULL) {
+    free(a);
+    return 1;
+  }
+  status = noosh_cond_test(c->test, a, b, c->b.s);
+  free(a);
+  free(b);
+  return status;
+}
+
+/*
+  Pipelines
+*/
+
+/*
+    execution helpers the pipeline shares with the tree walker below
+*/
+int noosh_apply_redirs(struct noosh_node * n, struct noosh_io * io);
+int noosh_expand_assigns(struct noosh_node * n, struct noosh_args * out);
+int noosh_run_compound(struct noosh_node * n);
+struct noosh_func * noosh_find_func(const char * name);
+int noosh_call_func(struct noosh_func * f, char ** argv);
+int noosh_assign(struct noosh_args * assigns, struct noosh_args * saved);
+
+
+/*
+  one stage of a pipeline
+    builtin stages run on a thread of the shell (or, with lastpipe, on the
+    shell's own thread when last) instead of a forked copy of the shell;
+    in and out are the stage's pipe ends, which a thread closes itself
+    when its builtin returns so the next stage sees end of input
+    argv and assigns are the expanded words of a simple command; a
+    function, and a builtin that runs commands (eval, source), runs like
+    a compound command
+*/
+struct noosh_stage {
+  struct noosh_node * node;
+  struct noosh_args argv;
+  struct noosh_args assigns;
+  struct noosh_func * func;
+  int builtin;
+  int status;
+  struct noosh_io io;
+  int in;
+  int out;
+  pid_t pid;
+  pthread_t thread;
+  int started;
+  sem_t * ready;
+  unsigned long long end;
+};
+
+/*
+  pipestats relay between two stages
+    the producer writes into one pipe and the consumer reads from another;
+    a thread splices between them, counting bytes and the time spent
+    waiting for the producer (the consumer starves) or for the consumer
+    (the producer is held back)
+*/
+struct noosh_relay {
+  int in;
+  int out;
+  pthread_t thread;
+  int started;
+  unsigned long long bytes;
+  unsigned long long in_ns;
+  unsigned long long out_ns;
+  unsigned long long end;
+};
+
+/*
+    @brief wait for one end of a relay, timing the wait if it blocks
+    @param fd: descriptor to poll
+    @param events: POLLIN or POLLOUT
+    @param ns: accumulates the time blocked
+    @return 1 when ready (or hung up), 0 on error
+*/
+int noosh_relay_poll(int fd, short events, unsigned long long * ns) {
+  struct pollfd pfd = {fd, events, 0};
+  unsigned long long t;
+  int r;
+
+  if (poll(&pfd, 1, 0) > 0) {
+    return 1;
+  }
+  t = noosh_now_ns();
+  while ((r = poll(&pfd, 1, -1)) < 0 && errno == EINTR) {
+  }
+  *ns += noosh_now_ns() - t;
+  return r > 0;
+}
+
+/*
+    @brief thread body of a pipestats relay
+    @param arg: the struct noosh_relay
+    @return NULL
+*/
+void * noosh_relay_thread(void * arg) {
+  struct noosh_relay * r = arg;
+  ssize_t n;
+
+  while (noosh_relay_poll(r->in, POLLIN, &r->in_ns) &&
+         noosh_relay_poll(r->out, POLLOUT, &r->out_ns)) {
+    n = splice(r->in, NULL, r->out, NULL, NOOSH_BUFFER_IO,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      r->bytes += n;
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+      // End of input, or the consumer is gone (EPIPE).
+      break;
+    }
+  }
+  r->end = noosh_now_ns();
+  // Pass end of input downstream and EPIPE upstream.
+  close(r->in);
+  close(r->out);
+  return NULL;
+}
+
+/*
+    @brief print the pipestats report of a finished pipeline
+    @param stages: the stages
+    @param relays: n - 1 relays, relays[k] follows stages[k]
+    @param names: command name of each stage
+    @param n: number of stages
+    @param start: when the pipeline started
+*/
+void noosh_pipestats_report(struct noosh_stage * stages, struct noosh_relay * relays,
+                            char ** names, int n, unsigned long long start) {
+  unsigned long long elapsed, rd, wr, busy, most = 0, io;
+  int k, worst = -1;
+
+  fprintf(stderr, "noosh: pipestats: %.3fs\n",
+          (stages[n - 1].end - start) / 1e9);
+  fprintf(stderr, "  %-5s %-12s %12s %12s %10s %10s %10s\n",
+          "stage", "command", "bytes in", "bytes out", "MB/s", "read wait", "write wait");
+  for (k = 0; k < n; k++) {
+    elapsed = stages[k].end - start;
+    rd = k > 0 ? relays[k - 1].in_ns : 0;
+    wr = k < n - 1 ? relays[k].out_ns : 0;
+    io = k < n - 1 ? relays[k].bytes : relays[k - 1].bytes;
+    fprintf(stderr, "  %-5d %-12.12s ", k + 1, names[k] ? names[k] : "-");
+    if (k > 0) {
+      fprintf(stderr, "%12llu ", relays[k - 1].bytes);
+    } else {
+      fprintf(stderr, "%12s ", "-");
+    }
+    if (k < n - 1) {
+      fprintf(stderr, "%12llu ", relays[k].bytes);
+    } else {
+      fprintf(stderr, "%12s ", "-");
+    }
+    fprintf(stderr, "%10.1f %9.3fs %9.3fs\n",
+            elapsed ? io / 1e6 / (elapsed / 1e9) : 0.0, rd / 1e9, wr / 1e9);
+    // The stage that spent the most time neither starved nor held back
+    // is the one the others are waiting on.
+    busy = elapsed > rd + wr ? elapsed - rd - wr : 0;
+    if (busy >= most) {
+      most = busy;
+      worst = k;
+    }
+  }
+  if (worst >= 0) {
+    fprintf(stderr, "  bottleneck: stage %d (%s), busy %.3fs\n",
+            worst + 1, names[worst] ? names[worst] : "-", most / 1e9);
+  }
+}
+
+/*
+    @brief close everything a stage holds once it is finished
+*/
+void noosh_stage_finish(struct noosh_stage * st) {
+  noosh_io_close(&st->io);
+  if (st->in >= 0) {
+    close(st->in);
+  }
+  if (st->out >= 0) {
+    close(st->out);
+  }
+}
+
+/*
+    @brief tell the builtins that run commands or expressions, which
+        read back what they assign, from those a stage thread can run
+    @param builtin: index in builtin_func
+    @return 1 for eval, source, `.' and let
+*/
+int noosh_builtin_runs_code(int builtin) {
+  return builtin_func[builtin] == noosh_eval || builtin_func[builtin] == noosh_source ||
+         builtin_func[builtin] == noosh_let;
+}
+
+/*
+    @brief thread body of a builtin pipeline stage
+    @param arg: the struct noosh_stage
+    @return NULL
+*/
+void * noosh_stage_thread(void * arg) {
+  struct noosh_stage * st = arg;
+
+  noosh_cur_io = &st->io;
+  noosh_stage_isolated = 1;
+  // A private cwd keeps relative paths of this stage immune to a `cd' in
+  // the shell (a lastpipe stage) and lets its own `cd' stay local.
+  noosh_stage_own_cwd = unshare(CLONE_FS) == 0;
+  sem_post(st->ready);
+  st->status = ( * builtin_func[st->builtin])(st->argv.v);
+  noosh_stage_finish(st);
+  noosh_peek_close();
+  return NULL;
+}
+
+/*
+    @brief run a pipeline
+        external stages are forked; builtin stages run as threads of the
+        shell connected by the same pipes, so they cost no fork; other
+        compound stages, and builtins that run commands, run in a forked
+        subshell; with lastpipe set a final builtin or compound command
+        runs on the shell's own thread
+        with pipestats set every pipe is relayed and measured
+    @param pipe: the pipeline node
+    @return exit status of the last stage, inverted by `!'
+*/
+int noosh_run_pipeline(struct noosh_node * pipe) {
+  int n = pipe->nkids;
+  struct noosh_stage * stages = noosh_malloc(n * sizeof(*stages));
+  struct noosh_relay * relays = NULL;
+  struct noosh_stage * st;
+  char ** names = NULL;
+  int k, in = -1, p[2], q[2], threads = 0, stats = noosh_opt_pipestats, status;
+  unsigned long long start = 0;
+  sem_t ready;
+
+  memset(stages, 0, n * sizeof(*stages));
+  if (stats) {
+    relays = noosh_malloc(n * sizeof(*relays));
+    memset(relays, 0, n * sizeof(*relays));
+    names = noosh_malloc(n * sizeof(*names));
+    start = noosh_now_ns();
+  }
+
+  sem_init(&ready, 0, 0);
+  for (k = 0; k < n; k++) {
+    st = &stages[k];
+    st->node = pipe->kids[k];
+    st->ready = &ready;
+    st->builtin = -1;
+    noosh_io_init(&st->io);
+    p[0] = p[1] = -1;
+    if (k < n - 1 && noosh_pipe(p) < 0) {
+      perror("noosh");
+      n = k;
+      break;
+    }
+    st->in = in;
+    st->out = p[1];
+    in = p[0];
+    if (stats && k < n - 1) {
+      // The next stage reads from a second pipe the relay feeds.
+      if (noosh_pipe(q) == 0) {
+        relays[k].in = p[0];
+        relays[k].out = q[1];
+        in = q[0];
+        if (pthread_create(&relays[k].thread, NULL, noosh_relay_thread, &relays[k]) == 0) {
+          relays[k].started = 1;
+        } else {
+          close(p[0]);
+          close(q[1]);
+        }
+      } else {
+        perror("noosh");
+      }
+    }
+    if (st->in >= 0) {
+      st->io.fd[0] = st->in;
+    }
+    if (st->out >= 0) {
+      // The pipe counts as an output, so `a > file | b' feeds both.
+      st->io.fd[1] = st->out;
+      st->io.outs[1][0] = st->out;
+      st->io.nouts[1] = 1;
+    }
+    if (stats) {
+      names[k] = noosh_node_str[st->node->type];
+    }
+
+    st->status = 1;
+    if (noosh_apply_redirs(st->node, &st->io) < 0) {
+      noosh_stage_finish(st);
+      continue;
+    }
+    if (st->node->type == NOOSH_N_CMD) {
+      if (noosh_expand_words(st->node->words, st->node->nwords, &st->argv) < 0 ||
+          noosh_expand_assigns(st->node, &st->assigns) < 0) {
+        // Expanded here, but a stage is a subshell: an error that ends
+        // the script ends only the stage, unless lastpipe runs it here.
+        if (n > 1 && !(k == n - 1 && noosh_opt_lastpipe)) {
+          noosh_exit_pending = 0;
+        }
+        noosh_stage_finish(st);
+        continue;
+      }
+      if (st->argv.n == 0) {
+        st->status = 0;
+        noosh_stage_finish(st);
+        continue;
+      }
+      if (stats) {
+        names[k] = st->argv.v[0];
+      }
+      if ((st->func = noosh_find_func(st->argv.v[0])) == NULL) {
+        st->builtin = noosh_find_builtin(st->argv.v[0]);
+      }
+    }
+
+    if (st->node->type == NOOSH_N_CMD && st->builtin < 0 && st->func == NULL) {
+      st->pid = noosh_spawn(st->argv.v, st->assigns.v, &st->io);
+      st->started = st->pid > 0;
+      noosh_stage_finish(st);
+    } else if (k == n - 1 && noosh_opt_lastpipe) {
+      struct noosh_io * saved = noosh_cur_io;
+      // Stage threads must have left the shell's cwd before it may change.
+      for (; threads > 0; threads--) {
+        sem_wait(&ready);
+      }
+      noosh_cur_io = &st->io;
+      if (st->builtin >= 0) {
+        st->status = ( * builtin_func[st->builtin])(st->argv.v);
+      } else if (st->func) {
+        st->status = noosh_call_func(st->func, st->argv.v);
+      } else {
+        st->status = noosh_run_compound(st->node);
+      }
+      noosh_cur_io = saved;
+      noosh_stage_finish(st);
+      st->end = noosh_now_ns();
+    } else if (st->builtin < 0 || noosh_builtin_runs_code(st->builtin)) {
+      // A compound command, or a builtin running commands, may assign,
+      // define functions and cd, and read them back: give it its own
+      // process.
+      st->pid = noosh_fork();
+      if (st->pid == 0) {
+        noosh_child_setup(&st->io);
+        if (noosh_assign(&st->assigns, NULL) < 0) {
+          status = 1;
+        } else if (st->builtin >= 0) {
+          status = ( * builtin_func[st->builtin])(st->argv.v);
+        } else {
+          status = st->func ? noosh_call_func(st->func, st->argv.v) : noosh_run_compound(st->node);
+        }
+        exit(noosh_exit_pending ? noosh_exit_code : status);
+      }
+      if (st->pid < 0) {
+        perror("noosh");
+      }
+      st->started = st->pid > 0;
+      noosh_stage_finish(st);
+    } else if (pthread_create(&st->thread, NULL, noosh_stage_thread, st) == 0) {
+      st->started = 2;
+      threads++;
+      __atomic_add_fetch(&noosh_stage_threads, 1, __ATOMIC_RELAXED);
+    } else {
+      fprintf(stderr, "noosh: cannot start pipeline stage\n");
+      noosh_stage_finish(st);
+    }
+  }
+  if (in >= 0) {
+    close(in);
+  }
+
+  for (k = 0; k < n; k++) {
+    st = &stages[k];
+    if (st->started == 1) {
+      st->status = noosh_wait(st->pid);
+    } else if (st->started == 2) {
+      pthread_join(st->thread, NULL);
+      __atomic_sub_fetch(&noosh_stage_threads, 1, __ATOMIC_RELAXED);
+    }
+    noosh_io_wait(&st->io);
+    if (st->end == 0) {
+      st->end = noosh_now_ns();
+    }
+  }
+  if (stats) {
+    for (k = 0; k < n - 1; k++) {
+      if (relays[k].started) {
+        pthread_join(relays[k].thread, NULL);
+        // A stage is done when its output ends, whatever order it is
+        // reaped in.
+        stages[k].end = relays[k].end;
+      }
+    }
+    if (n > 1) {
+      noosh_pipestats_report(stages, relays, names, n, start);
+    }
+    free(relays);
+    free(names);
+  }
+  noosh_var_reclaim();
+  status = n > 0 ? stages[n - 1].status : 1;
+  for (k = 0; k < pipe->nkids; k++) {
+    noosh_args_free(&stages[k].argv);
+    noosh_args_free(&stages[k].assigns);
+  }
+  sem_destroy(&ready);
+  free(stages);
+  return pipe->bang ? !status : status;
+}
+
+/*
+  Edit buffer
+
+  The line being edited is kept in a rope, so that a paste of megabytes,
+  and every key typed after it, costs O(log n) instead of a copy of the
+  whole text. The rope is a treap of chunks of up to NOOSH_ROPE_CHUNK
+  bytes, in text order. An edit splits the tree where it falls and joins
+  it back; the chunks that meet where it is joined are merged when they
+  fit in one, so typing fills the chunk at the cursor instead of adding
+  nodes.
+
+  Each node counts, for its chunk and for its whole subtree, the bytes,
+  newlines, characters one cell wide and other characters (tabs,
+  controls, wide characters, marks, broken UTF-8) it holds. These are
+  the editor's line and width indexes: a line or character is found from
+  its number, or a number from a position, going down the tree once.
+  Each chunk also keeps the counts of the pieces between its newlines,
+  so the lines of the text are listed with their widths without reading
+  them, a run of chunks with no newline being taken whole from its sum.
+*/
+
+# define NOOSH_ROPE_CHUNK 1024
+
+/*
+  what a rope counts
+*/
+enum noosh_rope_unit {
+  NOOSH_ROPE_BYTES,
+  NOOSH_ROPE_LINES,
+  NOOSH_ROPE_CHARS,
+  NOOSH_ROPE_ODD,
+  NOOSH_ROPE_UNITS
+};
+
+/*
+  piece of a chunk up to a newline or its end
+    bytes, characters one cell wide and other characters in it
+*/
+struct noosh_rope_seg {
+  unsigned short bytes;
+  unsigned short chars;
+  unsigned short odd;
+};
+
+/*
+  node of a rope
+    holds a chunk of len bytes; own counts what is in it and sum what is
+    in its subtree, by noosh_rope_unit; segs are its pieces, one more
+    than its newlines; prio keeps the treap balanced
+*/
+struct noosh_rope_node {
+  struct noosh_rope_node * left;
+  struct noosh_rope_node * right;
+  unsigned int prio;
+  size_t own[NOOSH_ROPE_UNITS];
+  size_t sum[NOOSH_ROPE_UNITS];
+  struct noosh_rope_seg * segs;
+  size_t len;
+  char data[NOOSH_ROPE_CHUNK];
+};
+
+/*
+  rope
+    seed gives the priorities of new nodes
+*/
+struct noosh_rope {
+  struct noosh_rope_node * root;
+  unsigned int seed;
+};
+
+/*
+  line of a rope's text
+    start and bytes say where it is, its newline left out; chars and odd
+    count its characters as the nodes do; before is the number of
+    characters one cell wide before it
+*/
+struct noosh_rope_line {
+  size_t start;
+  size_t bytes;
+  size_t chars;
+  size_t odd;
+  size_t before;
+};
+
+/*
+  lines of a rope's text
+*/
+struct noosh_rope_lines {
+  struct noosh_rope_line * v;
+  size_t n;
+  size_t cap;
+};
+
+/*
+    @brief tell what the character at the start of some text counts as
+    @param s: text
+    @param len: bytes left in it, at least 1
+    @param n: gets the character's length
+    @return NOOSH_ROPE_LINES for a newline, NOOSH_ROPE_CHARS for a
+        character one cell wide, NOOSH_ROPE_ODD for any other
+*/
+int noosh_rope_class(const char * s, size_t len, size_t * n) {
+  unsigned char b = *s;
+  unsigned int c;
+
+  *n = 1;
+  if (b == '\n') {
+    return NOOSH_ROPE_LINES;
+  }
+  if (b >= 0x20 && b < 0x7f) {
+    return NOOSH_ROPE_CHARS;
+  }
+  if (b < 0x80) {
+    return NOOSH_ROPE_ODD;
+  }
+  *n = noosh_utf8_decode(s, len, &c);
+  return *n > 1 && noosh_wcwidth(c) == 1 ? NOOSH_ROPE_CHARS : NOOSH_ROPE_ODD;
+}
+
+/*
+    @brief add up the counts of a node and its subtrees
+*/
+void noosh_rope_update(struct noosh_rope_node * t) {
+  int u;
+
+  for (u = 0; u < NOOSH_ROPE_UNITS; u++) {
+    t->sum[u] = t->own[u] + (t->left ? t->left->sum[u] : 0) + (t->right ? t->right->sum[u] : 0);
+  }
+}
+
+/*
+    @brief count what a node's chunk holds, after it changed
+*/
+void noosh_rope_count(struct noosh_rope_node * t) {
+  struct noosh_rope_seg * seg;
+  const char * nl;
+  size_t i, n, lines = 0;
+  int u;
+
+  for (nl = t->data; (nl = memchr(nl, '\n', t->data + t->len - nl)) != NULL; nl++) {
+    lines++;
+  }
+  t->segs = noosh_realloc(t->segs, (lines + 1) * sizeof(*t->segs));
+  memset(t->own, 0, sizeof(t->own));
+  t->own[NOOSH_ROPE_BYTES] = t->len;
+  t->own[NOOSH_ROPE_LINES] = lines;
+  seg = t->segs;
+  memset(seg, 0, sizeof(*seg));
+  for (i = 0; i < t->len; i += n) {
+    u = noosh_rope_class(t->data + i, t->len - i, &n);
+    if (u == NOOSH_ROPE_LINES) {
+      memset(++seg, 0, sizeof(*seg));
+      continue;
+    }
+    t->own[u]++;
+    seg->bytes += n;
+    if (u == NOOSH_ROPE_CHARS) {
+      seg->chars++;
+    } else {
+      seg->odd++;
+    }
+  }
+  noosh_rope_update(t);
+}
+
+/*
+    @brief make a node for a chunk of text
+*/
+struct noosh_rope_node * noosh_rope_node(struct noosh_rope * r, const char * s, size_t len) {
+  struct noosh_rope_node * t = noosh_malloc(sizeof(*t));
+
+  if (r->seed == 0) {
+    r->seed = 2463534242u;
+  }
+  r->seed ^= r->seed << 13;
+  r->seed ^= r->seed >> 17;
+  r->seed ^= r->seed << 5;
+  t->left = t->right = NULL;
+  t->prio = r->seed;
+  t->segs = NULL;
+  t->len = len;
+  memcpy(t->data, s, len);
+  noosh_rope_count(t);
+  return t;
+}
+
+/*
+    @brief free a tree
+*/
+void noosh_rope_free_tree(struct noosh_rope_node * t) {
+  if (t != NULL) {
+    noosh_rope_free_tree(t->left);
+    noosh_rope_free_tree(t->right);
+    free(t->segs);
+    free(t);
+  }
+}
+
+/*
+    @brief empty a rope
+*/
+void noosh_rope_free(struct noosh_rope * r) {
+  noosh_rope_free_tree(r->root);
+  r->root = NULL;
+}
+
+/*
+    @brief number of bytes in a rope
+*/
+size_t noosh_rope_len(const struct noosh_rope * r) {
+  return r->root ? r->root->sum[NOOSH_ROPE_BYTES] : 0;
+}
+
+/*
+    @brief put the text of a tree before that of another
+    @return the tree of both
+*/
+struct noosh_rope_node * noosh_rope_merge(struct noosh_rope_node * a, struct noosh_rope_node * b) {
+  if (a == NULL || b == NULL) {
+    return a ? a : b;
+  }
+  if (a->prio > b->prio) {
+    a->right = noosh_rope_merge(a->right, b);
+    noosh_rope_update(a);
+    return a;
+  }
+  b->left = noosh_rope_merge(a, b->left);
+  noosh_rope_update(b);
+  return b;
+}
+
+/*
+    @brief split a tree at a position
+    @param r: rope, for the node made when it falls inside a chunk
+    @param t: the tree
+    @param pos: the position
+    @param left: gets the tree of the text before it
+    @param right: gets the tree of the text from it on
+*/
+void noosh_rope_split(struct noosh_rope * r, struct noosh_rope_node * t, size_t pos,
+                      struct noosh_rope_node ** left, struct noosh_rope_node ** right) {
+  struct noosh_rope_node * tail;
+  size_t lsize;
+
+  if (t == NULL) {
+    *left = *right = NULL;
+    return;
+  }
+  lsize = t->left ? t->left->sum[NOOSH_ROPE_BYTES] : 0;
+  if (pos <= lsize) {
+    noosh_rope_split(r, t->left, pos, left, &t->left);
+    noosh_rope_update(t);
+    *right = t;
+  } else if (pos >= lsize + t->len) {
+    noosh_rope_split(r, t->right, pos - lsize - t->len, &t->right, right);
+    noosh_rope_update(t);
+    *left = t;
+  } else {
+    // The end of the chunk becomes a node of its own.
+    tail = noosh_rope_node(r, t->data + pos - lsize, lsize + t->len - pos);
+    *right = noosh_rope_merge(tail, t->right);
+    t->right = NULL;
+    t->len = pos - lsize;
+    noosh_rope_count(t);
+    *left = t;
+  }
+}
+
+/*
+    @brief find how much of some text goes in a chunk with room for
+        some bytes, without splitting a character if it can help it
+*/
+size_t noosh_rope_cut(const char * s, size_t len, size_t room) {
+  size_t n = len < room ? len : room, i;
+
+  for (i = n; i < len && i > 0 && n - i < 3 && (s[i] & 0xc0) == 0x80; i--);
+  return i < len && (s[i] & 0xc0) == 0x80 ? n : i;
+}
+
+/*
+    @brief add text to the last chunk of a tree, as much as fits in it
+    @return the bytes added
+*/
+size_t noosh_rope_append(struct noosh_rope_node * t, const char * s, size_t len) {
+  size_t n;
+
+  if (t->right) {
+    n = noosh_rope_append(t->right, s, len);
+    noosh_rope_update(t);
+  } else if ((n = noosh_rope_cut(s, len, NOOSH_ROPE_CHUNK - t->len)) > 0) {
+    memcpy(t->data + t->len, s, n);
+    t->len += n;
+    noosh_rope_count(t);
+  }
+  return n;
+}
+
+/*
+    @brief put the text of a tree before that of another, merging the
+        chunks that meet if they fit in one
+    @return the tree of both
+*/
+struct noosh_rope_node * noosh_rope_join(struct noosh_rope * r, struct noosh_rope_node * a, struct noosh_rope_node * b) {
+  struct noosh_rope_node * last, * first;
+
+  if (a != NULL && b != NULL) {
+    for (last = a; last->right; last = last->right);
+    for (first = b; first->left; first = first->left);
+    if (last->len + first->len <= NOOSH_ROPE_CHUNK) {
+      noosh_rope_split(r, b, first->len, &first, &b);
+      noosh_rope_append(a, first->data, first->len);
+      noosh_rope_free_tree(first);
+    }
+  }
+  return noosh_rope_merge(a, b);
+}
+
+/*
+    @brief insert text in a rope
+*/
+void noosh_rope_insert(struct noosh_rope * r, size_t pos, const char * s, size_t len) {
+  struct noosh_rope_node * a, * b, * m = NULL;
+  size_t done, n;
+
+  noosh_rope_split(r, r->root, pos, &a, &b);
+  done = a ? noosh_rope_append(a, s, len) : 0;
+  for (; done < len; done += n) {
+    n = noosh_rope_cut(s + done, len - done, NOOSH_ROPE_CHUNK);
+    m = noosh_rope_merge(m, noosh_rope_node(r, s + done, n));
+  }
+  r->root = noosh_rope_join(r, noosh_rope_merge(a, m), b);
+}
+
+/*
+    @brief delete the text between two positions of a rope
+*/
+void noosh_rope_delete(struct noosh_rope * r, size_t from, size_t to) {
+  struct noosh_rope_node * a, * m, * b;
+
+  if (to <= from) {
+    return;
+  }
+  noosh_rope_split(r, r->root, from, &a, &b);
+  noosh_rope_split(r, b, to - from, &m, &b);
+  noosh_rope_free_tree(m);
+  r->root = noosh_rope_join(r, a, b);
+}
+
+/*
+    @brief copy bytes of a tree's text
+    @return how many were copied
+*/
+size_t noosh_rope_copy(const struct noosh_rope_node * t, size_t pos, char * buf, size_t n) {
+  size_t lsize, done = 0, off, k;
+
+  if (t == NULL || n == 0) {
+    return 0;
+  }
+  lsize = t->left ? t->left->sum[NOOSH_ROPE_BYTES] : 0;
+  if (pos < lsize) {
+    done = noosh_rope_copy(t->left, pos, buf, n);
+  }
+  off = pos + done - lsize;
+  if (done < n && pos + done >= lsize && off < t->len) {
+    k = t->len - off < n - done ? t->len - off : n - done;
+    memcpy(buf + done, t->data + off, k);
+    done += k;
+  }
+  if (done < n && pos + done >= lsize + t->len) {
+    done += noosh_rope_copy(t->right, pos + done - lsize - t->len, buf + done, n - done);
+  }
+  return done;
+}
+
+/*
+    @brief copy bytes of a rope's text
+    @return how many were copied, fewer than n at its end
+*/
+size_t noosh_rope_read(const struct noosh_rope * r, size_t pos, char * buf, size_t n) {
+  return noosh_rope_copy(r->root, pos, buf, n);
+}
+
+/*
+    @brief get a byte of a rope's text
+    @return the byte, -1 past its end
+*/
+int noosh_rope_byte(const struct noosh_rope * r, size_t pos) {
+  char c;
+
+  return noosh_rope_read(r, pos, &c, 1) ? (unsigned char) c : -1;
+}
+
+/*
+    @brief copy a rope's text to a string
+    @return the string, allocated
+*/
+char * noosh_rope_string(const struct noosh_rope * r) {
+  size_t len = noosh_rope_len(r);
+  char * s = noosh_malloc(len + 1);
+
+  s[noosh_rope_read(r, 0, s, len)] = '\0';
+  return s;
+}
+
+/*
+    @brief count the newlines or characters one cell wide before a
+        position of a rope
+    @param unit: NOOSH_ROPE_LINES or NOOSH_ROPE_CHARS
+*/
+size_t noosh_rope_rank(const struct noosh_rope * r, size_t pos, int unit) {
+  const struct noosh_rope_node * t = r->root;
+  size_t count = 0, lsize, i, n;
+
+  while (t != NULL) {
+    lsize = t->left ? t->left->sum[NOOSH_ROPE_BYTES] : 0;
+    if (pos < lsize) {
+      t = t->left;
+      continue;
+    }
+    count += t->left ? t->left->sum[unit] : 0;
+    pos -= lsize;
+    if (pos < t->len) {
+      for (i = 0; i < pos; i += n) {
+        count += noosh_rope_class(t->data + i, t->len - i, &n) == unit;
+      }
+      break;
+    }
+    count += t->own[unit];
+    pos -= t->len;
+    t = t->right;
+  }
+  return count;
+}
+
+/*
+    @brief find a newline or a character one cell wide of a rope by its
+        number
+    @param unit: NOOSH_ROPE_LINES or NOOSH_ROPE_CHARS
+    @param k: its number, from 0
+    @return where it starts, the length of the text when there are not
+        that many
+*/
+size_t noosh_rope_find(const struct noosh_rope * r, int unit, size_t k) {
+  const struct noosh_rope_node * t = r->root;
+  size_t pos = 0, lsum, i, n;
+
+  while (t != NULL) {
+    lsum = t->left ? t->left->sum[unit] : 0;
+    if (k < lsum) {
+      t = t->left;
+      continue;
+    }
+    k -= lsum;
+    pos += t->left ? t->left->sum[NOOSH_ROPE_BYTES] : 0;
+    if (k < t->own[unit]) {
+      for (i = 0; i < t->len; i += n) {
+        if (noosh_rope_class(t->data + i, t->len - i, &n) == unit && k-- == 0) {
+          break;
+        }
+      }
+      return pos + i;
+    }
+    k -= t->own[unit];
+    pos += t->len;
+    t = t->right;
+  }
+  return pos;
+}
+
+/*
+    @brief start a line in a list of lines
+*/
+void noosh_rope_line_add(struct noosh_rope_lines * lines, size_t start, size_t before) {
+  struct noosh_rope_line * line;
+
+  if (lines->n == lines->cap) {
+    lines->cap = lines->cap ? 2 * lines->cap : 64;
+    lines->v = noosh_realloc(lines->v, lines->cap * sizeof(*lines->v));
+  }
+  line = &lines->v[lines->n++];
+  memset(line, 0, sizeof(*line));
+  line->start = start;
+  line->before = before;
+}
+
+/*
+    @brief add the text of a tree to a list of lines, its last line going
+        on with it
+    @param t: the tree
+    @param base: where its text starts
+    @param lines: the list
+*/
+void noosh_rope_walk(const struct noosh_rope_node * t, size_t base, struct noosh_rope_lines * lines) {
+  struct noosh_rope_line * line;
+  size_t i, off = 0;
+
+  if (t == NULL) {
+    return;
+  }
+  if (t->sum[NOOSH_ROPE_LINES] == 0) {
+    line = &lines->v[lines->n - 1];
+    line->bytes += t->sum[NOOSH_ROPE_BYTES];
+    line->chars += t->sum[NOOSH_ROPE_CHARS];
+    line->odd += t->sum[NOOSH_ROPE_ODD];
+    return;
+  }
+  noosh_rope_walk(t->left, base, lines);
+  base += t->left ? t->left->sum[NOOSH_ROPE_BYTES] : 0;
+  for (i = 0; i <= t->own[NOOSH_ROPE_LINES]; i++) {
+    if (i > 0) {
+      line = &lines->v[lines->n - 1];
+      noosh_rope_line_add(lines, base + off, line->before + line->chars);
+    }
+    line = &lines->v[lines->n - 1];
+    line->bytes += t->segs[i].bytes;
+    line->chars += t->segs[i].chars;
+    line->odd += t->segs[i].odd;
+    off += t->segs[i].bytes + 1;
+  }
+  noosh_rope_walk(t->right, base + t->len, lines);
+}
+
+/*
+    @brief list the lines of a rope's text
+    @param r: the rope
+    @param lines: gets them, one more than the newlines
+*/
+void noosh_rope_lines(const struct noosh_rope * r, struct noosh_rope_lines * lines) {
+  lines->n = 0;
+  noosh_rope_line_add(lines, 0, 0);
+  noosh_rope_walk(r->root, 0, lines);
+}
+
+/*
+  Highlighting
+
+  With `set -o highlight', the line being edited is drawn in colors by
+  what its parts are: command names by whether they are found, keywords,
+  strings, variables and expansions, operators and comments, and errors
+  such as an operator where a command should start. A small lexer cuts
+  the line into tokens, kept in a gap buffer: those before the gap hold
+  their offsets from the start of the line and those after it their
+  offsets from its end, so an edit costs only moving the gap to it. The
+  tokens an edit touches go. Lexing starts again from the last token
+  before them that begins a word or operator, with the lexer state saved
+  there, and stops as soon as it comes to an old token at the same place
+  with the same state past the edit: the rest lexes as it did. It is also
+  lazy, going no further than the rows drawn. A long word or string is
+  cut into tokens of NOOSH_HL_CHUNK bytes or so, each knowing the quote
+  it starts in, so that typing at the end of one lexes only its last
+  piece again.
+
+  A command name is looked for among builtins and functions, then in the
+  stat cache, without a system call. Names the cache does not know go to
+  a thread that stats the PATH directories itself, so a slow directory
+  never holds up the keys: the name keeps the color it had before the
+  edit, or is drawn plain if it had none, until the answer comes, and
+  the thread then wakes the editor through a pipe to draw it again. The
+  redraw only writes the cells that changed, so an answer that leaves
+  the color as it was costs nothing. Answers last NOOSH_STAT_TTL_MS, and one past it is still used
+  while the thread checks it again.
+*/
+
+# define NOOSH_HL_LOOKUPS 64
+
+/*
+  bytes lexed past the last one drawn, so that a few rows more need no
+  lexing of their own
+*/
+# define NOOSH_HL_AHEAD 4096
+
+/*
+  bytes of a word or string past which it is cut into tokens that
+  lexing can start again from; more than the words looked at whole, such
+  as keywords, are long
+*/
+# define NOOSH_HL_CHUNK 4096
+
+/*
+  what a token is, which gives its color
+    word is a command name, until it is looked up
+*/
+enum noosh_hl_type {
+  NOOSH_HL_PLAIN,
+  NOOSH_HL_COMMAND,
+  NOOSH_HL_MISSING,
+  NOOSH_HL_KEYWORD,
+  NOOSH_HL_STRING,
+  NOOSH_HL_VARIABLE,
+  NOOSH_HL_OPERATOR,
+  NOOSH_HL_COMMENT,
+  NOOSH_HL_ERROR,
+  NOOSH_HL_WORD
+};
+
+/*
+  what the lexer expects of the next word: anything, a word that is not
+  a command (a redirection's target), the word of case and the in after
+  it, the variable of for and the in or do after it, a function's name
+*/
+enum noosh_hl_want {
+  NOOSH_HL_ANY,
+  NOOSH_HL_ARG,
+  NOOSH_HL_CASE,
+  NOOSH_HL_CASE_IN,
+  NOOSH_HL_FOR,
+  NOOSH_HL_FOR_IN,
+  NOOSH_HL_NAME
+};
+
+/*
+  state of the lexer between words and operators
+    cmd is set where a command may start; pattern in the patterns of a
+    case item, test between [[ and ]]; cases counts the cases open and
+    depth the subshells; here is how far back the word after the first
+    << of the line is, 0 for none, and tabs is set for <<-
+*/
+struct noosh_hl_state {
+  unsigned char cmd;
+  unsigned char want;
+  unsigned char pattern;
+  unsigned char test;
+  unsigned char cases;
+  unsigned char tabs;
+  unsigned short depth;
+  unsigned int here;
+};
+
+/*
+  token of the line
+    start and end are offsets from the line's start before the gap and
+    from its end after it; stable is set on the first token of a word or
+    operator, where lexing can start again with state; quote is set on
+    one that starts inside a long word, where it can start again too:
+    to the quote it is in, a space outside quotes, with rest the type of
+    the word's unquoted parts and state what follows the word
+*/
+struct noosh_hl_token {
+  size_t start;
+  size_t end;
+  unsigned char type;
+  unsigned char stable;
+  unsigned char quote;
+  unsigned char rest;
+  struct noosh_hl_state state;
+};
+
+/*
+  tokens of a line, in a gap buffer
+    v[0..gap) come before the gap and v[after..cap) after it; when dirty,
+    those from hole on are to be checked: the line was lexed again as far
+    as lexed, and edited as far as dirty_end bytes from its end; at is
+    the token looked up last, word the start of the command name looked
+    up last this redraw and found what it was found to be; known is the
+    start of the last name with an answer and known_found that answer,
+    kept for the name while it is looked up again after an edit
+*/
+struct noosh_hl {
+  struct noosh_hl_token * v;
+  size_t gap;
+  size_t after;
+  size_t cap;
+  size_t hole;
+  int dirty;
+  size_t dirty_end;
+  size_t lexed;
+  size_t at;
+  size_t word;
+  int found;
+  size_t known;
+  int known_found;
+};
+
+/*
+  lexer at work on a line
+    pos is where it is and st its state, in which here is a position
+    plus 1; mark is the state at the start of the word or operator being
+    lexed, and first is set until its first token is out; cut is set
+    while lexing a word that may be cut, one whose start alone tells
+    what it is: resume is the quote the next token starts in when it
+    was, and rest the type of its unquoted parts; buf holds bytes of the
+    line from base
+*/
+struct noosh_hl_lexer {
+  struct noosh_hl * hl;
+  const struct noosh_rope * text;
+  size_t len;
+  size_t pos;
+  struct noosh_hl_state st;
+  struct noosh_hl_state mark;
+  int first;
+  int cut;
+  int resume;
+  int rest;
+  size_t base;
+  size_t n;
+  char buf[4096];
+};
+
+/*
+  command name looked for by the lookup thread
+    path is the PATH it was looked for in and cwd the working directory
+    epoch then; found is NOOSH_HL_COMMAND or NOOSH_HL_MISSING once known,
+    as of when; queued is set while it waits for the thread and busy
+    while the thread has it; used is when it was last asked for
+*/
+struct noosh_hl_lookup {
+  char * name;
+  char * path;
+  unsigned long cwd;
+  int found;
+  long long when;
+  int queued;
+  int busy;
+  unsigned long used;
+};
+
+struct noosh_hl_lookup noosh_hl_lookups[NOOSH_HL_LOOKUPS];
+unsigned long noosh_hl_used = 0;
+pthread_mutex_t noosh_hl_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t noosh_hl_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+  pipe the lookup thread writes to when it has an answer, -1 until the
+  thread is started
+*/
+int noosh_hl_wake[2] = {-1, -1};
+
+/*
+  highlighting counters for stats: bytes lexed, tokens made, names the
+  lookup thread looked for
+*/
+unsigned long noosh_hl_bytes = 0;
+unsigned long noosh_hl_tokens = 0;
+unsigned long noosh_hl_searches = 0;
+
+/*
+    @brief look for a command in the directories of a PATH, asking the
+        system; safe off the main thread
+    @param name: the command name
+    @param dirs: the PATH
+    @return NOOSH_HL_COMMAND or NOOSH_HL_MISSING
+*/
+int noosh_hl_search(const char * name, const char * dirs) {
+  const char * end;
+  struct stat st;
+  char * path;
+  int found;
+
+  if (strchr(name, '/')) {
+    return stat(name, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111) ? NOOSH_HL_COMMAND : NOOSH_HL_MISSING;
+  }
+  for (; *dirs; dirs = *end ? end + 1 : end) {
+    end = strchrnul(dirs, ':');
+    path = malloc((end - dirs) + strlen(name) + 3);
+    if (path == NULL) {
+      break;
+    }
+    sprintf(path, "%.*s/%s", end > dirs ? (int) (end - dirs) : 1, end > dirs ? dirs : ".", name);
+    found = stat(path, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111);
+    free(path);
+    if (found) {
+      return NOOSH_HL_COMMAND;
+    }
+  }
+  return NOOSH_HL_MISSING;
+}
+
+/*
+    @brief the lookup thread: take queued names and look for them
+*/
+void * noosh_hl_thread(void * arg) {
+  struct noosh_hl_lookup * l;
+  int i, found;
+
+  pthread_mutex_lock(&noosh_hl_lock);
+  while (1) {
+    for (i = 0; i < NOOSH_HL_LOOKUPS && !noosh_hl_lookups[i].queued; i++);
+    if (i == NOOSH_HL_LOOKUPS) {
+      pthread_cond_wait(&noosh_hl_cond, &noosh_hl_lock);
+      continue;
+    }
+    // A busy entry is not reused, so its strings stay put unlocked.
+    l = &noosh_hl_lookups[i];
+    l->queued = 0;
+    l->busy = 1;
+    pthread_mutex_unlock(&noosh_hl_lock);
+    found = noosh_hl_search(l->name, l->path);
+    __atomic_add_fetch(&noosh_hl_searches, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&noosh_hl_lock);
+    l->found = found;
+    l->when = noosh_stat_now();
+    l->busy = 0;
+    if (write(noosh_hl_wake[1], "", 1) < 0) {
+      // The pipe is full: the editor has a wake-up waiting already.
+    }
+  }
+  return NULL;
+}
+
+/*
+    @brief start the lookup thread, with its pipe, if it is not running
+    @return 0, or -1 if it cannot be started
+*/
+int noosh_hl_start(void) {
+  sigset_t all, saved;
+  pthread_t thread;
+  int err;
+
+  if (noosh_hl_wake[0] >= 0) {
+    return 0;
+  }
+  if (pipe2(noosh_hl_wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+    noosh_hl_wake[0] = noosh_hl_wake[1] = -1;
+    return -1;
+  }
+  // Signals are the shell's: the thread takes none.
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &saved);
+  err = pthread_create(&thread, NULL, noosh_hl_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  if (err != 0) {
+    close(noosh_hl_wake[0]);
+    close(noosh_hl_wake[1]);
+    noosh_hl_wake[0] = noosh_hl_wake[1] = -1;
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/*
+    @brief empty the lookup thread's pipe, after it woke the editor
+*/
+void noosh_hl_woken(void) {
+  char buf[64];
+
+  while (read(noosh_hl_wake[0], buf, sizeof(buf)) > 0);
+}
+
+/*
+    @brief ask the lookup thread about a command name
+    @param name: the name
+    @param path: the PATH to look in
+    @return what it found, NOOSH_HL_WORD while it does not know yet
+*/
+int noosh_hl_ask(const char * name, const char * path) {
+  struct noosh_hl_lookup * l = NULL, * free_one = NULL;
+  int i, found = NOOSH_HL_WORD;
+
+  pthread_mutex_lock(&noosh_hl_lock);
+  for (i = 0; i < NOOSH_HL_LOOKUPS; i++) {
+    if (noosh_hl_lookups[i].name && strcmp(noosh_hl_lookups[i].name, name) == 0 &&
+        strcmp(noosh_hl_lookups[i].path, path) == 0 && noosh_hl_lookups[i].cwd == noosh_stat_cwd) {
+      l = &noosh_hl_lookups[i];
+      break;
+    }
+    if (!noosh_hl_lookups[i].queued && !noosh_hl_lookups[i].busy &&
+        (free_one == NULL || noosh_hl_lookups[i].used < free_one->used)) {
+      free_one = &noosh_hl_lookups[i];
+    }
+  }
+  if (l == NULL && free_one && noosh_hl_start() == 0) {
+    // The entry asked for longest ago makes room.
+    l = free_one;
+    free(l->name);
+    free(l->path);
+    l->name = noosh_strdup(name);
+    l->path = noosh_strdup(path);
+    l->cwd = noosh_stat_cwd;
+    l->found = 0;
+  }
+  if (l) {
+    l->used = ++noosh_hl_used;
+    if (!l->queued && !l->busy && (l->found == 0 || noosh_stat_now() - l->when >= NOOSH_STAT_TTL_MS)) {
+      l->queued = 1;
+      pthread_cond_signal(&noosh_hl_cond);
+    }
+    found = l->found ? l->found : NOOSH_HL_WORD;
+  }
+  pthread_mutex_unlock(&noosh_hl_lock);
+  return found;
+}
+
+/*
+    @brief find whether a command name is found: a builtin, a function or
+        a program in PATH, without waiting on the system
+    @param name: the name
+    @return NOOSH_HL_COMMAND, NOOSH_HL_MISSING, or NOOSH_HL_WORD while it
+        is being looked for
+*/
+int noosh_hl_resolve(const char * name) {
+  const char * var = noosh_getvar("PATH"), * dirs, * end;
+  struct stat st;
+  char * path;
+  int i, r, unknown = 0;
+
+  for (i = 0; i < noosh_num_builtins(); i++) {
+    if (strcmp(name, builtin_str[i]) == 0) {
+      return NOOSH_HL_COMMAND;
+    }
+  }
+  if (noosh_find_func(name)) {
+    return NOOSH_HL_COMMAND;
+  }
+  var = var ? var : "";
+  if (strchr(name, '/')) {
+    if ((r = noosh_stat_peek(name, &st)) != -2) {
+      return r == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111) ? NOOSH_HL_COMMAND : NOOSH_HL_MISSING;
+    }
+  } else {
+    for (dirs = var; *dirs; dirs = *end ? end + 1 : end) {
+      end = strchrnul(dirs, ':');
+      path = noosh_malloc((end - dirs) + strlen(name) + 3);
+      sprintf(path, "%.*s/%s", end > dirs ? (int) (end - dirs) : 1, end > dirs ? dirs : ".", name);
+      r = noosh_stat_peek(path, &st);
+      free(path);
+      if (r == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+        return NOOSH_HL_COMMAND;
+      }
+      unknown |= r == -2;
+    }
+    if (!unknown) {
+      return NOOSH_HL_MISSING;
+    }
+  }
+  return noosh_hl_ask(name, var);
+}
+
+/*
+    @brief start the tokens over, for a line replaced whole
+*/
+void noosh_hl_reset(struct noosh_hl * hl) {
+  hl->gap = 0;
+  hl->after = hl->cap;
+  hl->hole = 0;
+  hl->dirty = 1;
+  hl->dirty_end = 0;
+  hl->lexed = 0;
+  hl->at = 0;
+  hl->word = (size_t) -1;
+  hl->known = (size_t) -1;
+}
+
+/*
+    @brief move the gap of the tokens to before the ith
+    @param len: length of the line, to turn offsets from one end into
+        offsets from the other
+*/
+void noosh_hl_move(struct noosh_hl * hl, size_t i, size_t len) {
+  struct noosh_hl_token * t;
+
+  while (hl->gap > i) {
+    t = &hl->v[--hl->after];
+    *t = hl->v[--hl->gap];
+    t->start = len - t->start;
+    t->end = len - t->end;
+  }
+  while (hl->gap < i && hl->after < hl->cap) {
+    t = &hl->v[hl->gap++];
+    *t = hl->v[hl->after++];
+    t->start = len - t->start;
+    t->end = len - t->end;
+  }
+}
+
+/*
+    @brief note an edit of the line: the tokens it touches go, and those
+        after it are to be checked by the next lexing
+    @param hl: the tokens
+    @param pos: where the edit was
+    @param removed: bytes removed there
+    @param added: bytes put there
+    @param len: length of the line after it
+*/
+void noosh_hl_edit(struct noosh_hl * hl, size_t pos, size_t removed, size_t added, size_t len) {
+  size_t old = len + removed - added;
+
+  while (hl->gap > 0 && hl->v[hl->gap - 1].end >= pos) {
+    noosh_hl_move(hl, hl->gap - 1, old);
+  }
+  while (hl->after < hl->cap && old - hl->v[hl->after].end < pos) {
+    noosh_hl_move(hl, hl->gap + 1, old);
+  }
+  // A token that touches it may join another or split.
+  while (hl->after < hl->cap && old - hl->v[hl->after].start <= pos + removed) {
+    hl->after++;
+  }
+  if (!hl->dirty || hl->hole > hl->gap) {
+    hl->hole = hl->gap;
+  }
+  if (!hl->dirty || hl->dirty_end > len - pos - added) {
+    hl->dirty_end = len - pos - added;
+  }
+  hl->dirty = 1;
+  hl->lexed = hl->hole > 0 ? hl->v[hl->hole - 1].end : 0;
+  hl->word = (size_t) -1;
+}
+
+/*
+    @brief the byte of the line at a position, -1 past its end
+*/
+int noosh_hl_char(struct noosh_hl_lexer * lx, size_t pos) {
+  if (pos >= lx->len) {
+    return -1;
+  }
+  if (pos < lx->base || pos >= lx->base + lx->n) {
+    lx->base = pos;
+    lx->n = noosh_rope_read(lx->text, pos, lx->buf, sizeof(lx->buf));
+  }
+  return (unsigned char) lx->buf[pos - lx->base];
+}
+
+/*
+    @brief check whether two lexer states are the same
+*/
+int noosh_hl_same(const struct noosh_hl_state * a, const struct noosh_hl_state * b) {
+  return a->cmd == b->cmd && a->want == b->want && a->pattern == b->pattern && a->test == b->test &&
+         a->cases == b->cases && a->tabs == b->tabs && a->depth == b->depth && a->here == b->here;
+}
+
+/*
+    @brief the lexer state as a token at a position keeps it: with here
+        counted back from there plus 1, so that it does not change when
+        text before it does
+*/
+struct noosh_hl_state noosh_hl_saved(const struct noosh_hl_state * st, size_t pos) {
+  struct noosh_hl_state s = *st;
+
+  s.here = s.here ? pos + 2 - s.here : 0;
+  return s;
+}
+
+/*
+    @brief add a token before the gap, in place of the old tokens it
+        overlaps
+    @param lx: lexer
+    @param start: where it starts
+    @param end: where it ends
+    @param type: what it is
+    @param stable: set for the first token of a word or operator
+*/
+void noosh_hl_emit(struct noosh_hl_lexer * lx, size_t start, size_t end, int type, int stable) {
+  struct noosh_hl * hl = lx->hl;
+  size_t n;
+
+  end = end < lx->len ? end : lx->len;
+  if (end <= start) {
+    return;
+  }
+  while (hl->after < hl->cap && lx->len - hl->v[hl->after].start < end) {
+    hl->after++;
+  }
+  if (hl->gap == hl->after) {
+    n = hl->cap ? 2 * hl->cap : 256;
+    hl->v = noosh_realloc(hl->v, n * sizeof(*hl->v));
+    memmove(hl->v + n - (hl->cap - hl->after), hl->v + hl->after, (hl->cap - hl->after) * sizeof(*hl->v));
+    hl->after += n - hl->cap;
+    hl->cap = n;
+  }
+  hl->v[hl->gap].start = start;
+  hl->v[hl->gap].end = end;
+  hl->v[hl->gap].type = type;
+  hl->v[hl->gap].stable = stable;
+  hl->v[hl->gap].quote = lx->resume;
+  hl->v[hl->gap].rest = lx->rest;
+  // Lexing that starts again inside the word goes on with what follows it.
+  hl->v[hl->gap].state = noosh_hl_saved(lx->resume ? &lx->st : &lx->mark, start);
+  hl->gap++;
+  lx->resume = 0;
+  __atomic_add_fetch(&noosh_hl_tokens, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    @brief add a token of the word being lexed
+*/
+void noosh_hl_put(struct noosh_hl_lexer * lx, size_t start, size_t end, int type) {
+  if (end > start && start < lx->len) {
+    noosh_hl_emit(lx, start, end, type, lx->first);
+    lx->first = 0;
+  }
+}
+
+/*
+    @brief find the end of a bracketed piece: what $( or ${ opens, up to
+        the matching bracket
+    @param lx: lexer
+    @param p: where the opening bracket is
+    @return where the piece ends, the end of the line if it does not
+*/
+size_t noosh_hl_match(struct noosh_hl_lexer * lx, size_t p) {
+  int open = noosh_hl_char(lx, p), close = open == '(' ? ')' : '}', depth = 0, quote = 0, c;
+
+  for (; (c = noosh_hl_char(lx, p)) >= 0; p++) {
+    if (quote) {
+      if (c == '\\' && quote == '"') {
+        p++;
+      } else if (c == quote) {
+        quote = 0;
+      }
+    } else if (c == '\\') {
+      p++;
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+    } else if (c == open) {
+      depth++;
+    } else if (c == close && --depth == 0) {
+      return p + 1;
+    }
+  }
+  return lx->len;
+}
+
+size_t noosh_hl_quote(struct noosh_hl_lexer * lx, size_t p, int emit);
+
+/*
+    @brief lex a single or double quoted string, from its start or from
+        inside it
+    @param lx: lexer
+    @param s: where its token starts
+    @param p: where to go on from, past the opening quote
+    @param quote: the quote
+    @param emit: add its tokens
+    @return where it ends
+*/
+size_t noosh_hl_string(struct noosh_hl_lexer * lx, size_t s, size_t p, int quote, int emit) {
+  int c;
+
+  while ((c = noosh_hl_char(lx, p)) >= 0 && c != quote) {
+    if (quote == '"' && (c == '$' || c == '`')) {
+      // Expansions in the string have their own color.
+      if (emit) {
+        noosh_hl_put(lx, s, p, NOOSH_HL_STRING);
+      }
+      s = p = noosh_hl_quote(lx, p, emit);
+    } else if (quote == '"' && c == '\\') {
+      p += 2;
+    } else {
+      if (emit && lx->cut && p - s >= NOOSH_HL_CHUNK) {
+        noosh_hl_put(lx, s, p, NOOSH_HL_STRING);
+        lx->resume = quote;
+        s = p;
+      }
+      p++;
+    }
+  }
+  p++;
+  p = p < lx->len ? p : lx->len;
+  if (emit) {
+    noosh_hl_put(lx, s, p, NOOSH_HL_STRING);
+  }
+  return p;
+}
+
+/*
+    @brief lex a quoted string or an expansion
+    @param lx: lexer
+    @param p: where it starts
+    @param emit: add its tokens
+    @return where it ends
+*/
+size_t noosh_hl_quote(struct noosh_hl_lexer * lx, size_t p, int emit) {
+  size_t s = p;
+  int c = noosh_hl_char(lx, p), d = noosh_hl_char(lx, p + 1), type = NOOSH_HL_STRING;
+
+  if (c == '\'' || c == '"') {
+    return noosh_hl_string(lx, s, p + 1, c, emit);
+  }
+  if (c == '`') {
+    for (p++; (c = noosh_hl_char(lx, p)) >= 0 && c != '`'; p += c == '\\' ? 2 : 1);
+    p++;
+    type = NOOSH_HL_VARIABLE;
+  } else if (d == '\'') {
+    for (p += 2; (c = noosh_hl_char(lx, p)) >= 0 && c != '\''; p += c == '\\' ? 2 : 1);
+    p++;
+  } else if (d == '(' || d == '{') {
+    p = noosh_hl_match(lx, p + 1);
+    type = NOOSH_HL_VARIABLE;
+  } else if (d == '_' || isalpha(d)) {
+    for (p += 2; (c = noosh_hl_char(lx, p)) == '_' || isalnum(c); p++);
+    type = NOOSH_HL_VARIABLE;
+  } else if (d > 0 && (isdigit(d) || strchr("@*#?$!-", d))) {
+    p += 2;
+    type = NOOSH_HL_VARIABLE;
+  } else {
+    // A $ that expands nothing.
+    p++;
+    type = NOOSH_HL_PLAIN;
+  }
+  p = p < lx->len ? p : lx->len;
+  if (emit) {
+    noosh_hl_put(lx, s, p, type);
+  }
+  return p;
+}
+
+/*
+    @brief go over a word, from its start or from inside it
+    @param lx: lexer
+    @param p: where to start
+    @param type: what its unquoted parts are
+    @param emit: add its tokens
+    @param simple: set if it is one unquoted part with nothing to expand
+    @return where it ends
+*/
+size_t noosh_hl_scan(struct noosh_hl_lexer * lx, size_t p, int type, int emit, int * simple) {
+  size_t start = p, run = p;
+  int c;
+
+  *simple = 1;
+  while ((c = noosh_hl_char(lx, p)) >= 0) {
+    if (c == '(' && p > start && noosh_hl_char(lx, p - 1) == '=') {
+      // The values of an array.
+      *simple = 0;
+      p = noosh_hl_match(lx, p);
+    } else if (c == ' ' || c == '\t' || c == '\n' || (c && strchr("|&;<>()", c))) {
+      break;
+    } else if (c == '\\') {
+      *simple = 0;
+      p += 2;
+    } else if (c == '\'' || c == '"' || c == '$' || c == '`') {
+      *simple = 0;
+      if (emit) {
+        noosh_hl_put(lx, run, p, type);
+      }
+      run = p = noosh_hl_quote(lx, p, emit);
+    } else {
+      if (emit && lx->cut && p - run >= NOOSH_HL_CHUNK) {
+        noosh_hl_put(lx, run, p, type);
+        lx->resume = ' ';
+        run = p;
+      }
+      p++;
+    }
+  }
+  p = p < lx->len ? p : lx->len;
+  if (emit) {
+    noosh_hl_put(lx, run, p, type);
+  }
+  return p;
+}
+
+/*
+    @brief length of the NAME= or NAME[index]= an assignment starts with
+    @return it, 0 if the word is not an assignment
+*/
+size_t noosh_hl_assign(struct noosh_hl_lexer * lx, size_t start, size_t end) {
+  size_t p = start;
+  int c = noosh_hl_char(lx, p);
+
+  if (c != '_' && !isalpha(c)) {
+    return 0;
+  }
+  while ((c = noosh_hl_char(lx, ++p)) == '_' || isalnum(c));
+  if (c == '[') {
+    // The index is gone over as the word is, to the same ].
+    for (p++; p < end && (c = noosh_hl_char(lx, p)) != ']'; ) {
+      if (c == '(' && noosh_hl_char(lx, p - 1) == '=') {
+        p = noosh_hl_match(lx, p);
+      } else if (c == '\'' || c == '"' || c == '$' || c == '`') {
+        p = noosh_hl_quote(lx, p, 0);
+      } else {
+        p += 1 + (c == '\\');
+      }
+    }
+    c = noosh_hl_char(lx, ++p);
+  }
+  if (c == '+') {
+    c = noosh_hl_char(lx, ++p);
+  }
+  return c == '=' && p < end ? p + 1 - start : 0;
+}
+
+/*
+    @brief check for a keyword where a command may start, and apply what
+        it does to the lexer state
+    @return 1 if the word is one
+*/
+int noosh_hl_keyword(const char * word, struct noosh_hl_state * st) {
+  static const char * const opens[] = {"if", "then", "else", "elif", "do", "while", "until", "!", "{", "time", "in"};
+  static const char * const closes[] = {"fi", "done", "}", "esac"};
+  size_t i;
+
+  for (i = 0; i < sizeof(opens) / sizeof(*opens); i++) {
+    if (strcmp(word, opens[i]) == 0) {
+      return 1;
+    }
+  }
+  for (i = 0; i < sizeof(closes) / sizeof(*closes); i++) {
+    if (strcmp(word, closes[i]) == 0) {
+      st->cases -= word[0] == 'e' && st->cases > 0;
+      st->cmd = 0;
+      return 1;
+    }
+  }
+  if (strcmp(word, "case") == 0) {
+    st->want = NOOSH_HL_CASE;
+    st->cases += st->cases < 255;
+    st->cmd = 0;
+  } else if (strcmp(word, "for") == 0 || strcmp(word, "select") == 0) {
+    st->want = NOOSH_HL_FOR;
+    st->cmd = 0;
+  } else if (strcmp(word, "function") == 0) {
+    st->want = NOOSH_HL_NAME;
+  } else if (strcmp(word, "[[") == 0) {
+    st->test = 1;
+    st->cmd = 0;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+/*
+    @brief lex a word
+*/
+void noosh_hl_word(struct noosh_hl_lexer * lx) {
+  struct noosh_hl_state * st = &lx->st;
+  size_t start = lx->pos, end, n, p;
+  int simple, type = NOOSH_HL_PLAIN, want = st->want, c, cut = 1;
+  char word[16];
+
+  lx->mark = *st;
+  lx->first = 1;
+  end = noosh_hl_scan(lx, start, type, 0, &simple);
+  for (n = 0; simple && end - start < sizeof(word) && n < end - start; n++) {
+    word[n] = noosh_hl_char(lx, start + n);
+  }
+  word[n] = '\0';
+  st->want = NOOSH_HL_ANY;
+  if (want == NOOSH_HL_ARG) {
+    // A redirection's target.
+  } else if (want == NOOSH_HL_CASE) {
+    st->want = NOOSH_HL_CASE_IN;
+  } else if (want == NOOSH_HL_CASE_IN && strcmp(word, "in") == 0) {
+    type = NOOSH_HL_KEYWORD;
+    st->pattern = 1;
+  } else if (want == NOOSH_HL_FOR) {
+    st->want = NOOSH_HL_FOR_IN;
+  } else if (want == NOOSH_HL_FOR_IN && (strcmp(word, "in") == 0 || strcmp(word, "do") == 0)) {
+    type = NOOSH_HL_KEYWORD;
+    st->cmd = word[0] == 'd';
+  } else if (want == NOOSH_HL_NAME) {
+    // The body comes next, unless () does.
+    for (p = end; (c = noosh_hl_char(lx, p)) == ' ' || c == '\t'; p++);
+    st->cmd = c != '(';
+    cut = 0;
+  } else if (st->test) {
+    if (strcmp(word, "]]") == 0) {
+      type = NOOSH_HL_KEYWORD;
+      st->test = 0;
+    }
+  } else if (st->pattern) {
+    if (strcmp(word, "esac") == 0) {
+      type = NOOSH_HL_KEYWORD;
+      st->pattern = 0;
+      st->cases -= st->cases > 0;
+      st->cmd = 0;
+    }
+  } else if (st->cmd && (n = noosh_hl_assign(lx, start, end)) > 0) {
+    noosh_hl_put(lx, start, start + n, NOOSH_HL_VARIABLE);
+    lx->cut = 1;
+    lx->rest = type;
+    noosh_hl_scan(lx, start + n, type, 1, &simple);
+    lx->cut = 0;
+    lx->pos = end;
+    return;
+  } else if (st->cmd && noosh_hl_keyword(word, st)) {
+    type = NOOSH_HL_KEYWORD;
+  } else if (st->cmd) {
+    // Whether it is a command name, or an assignment, can change with
+    // any of it.
+    type = simple ? NOOSH_HL_WORD : NOOSH_HL_PLAIN;
+    st->cmd = 0;
+    cut = 0;
+  }
+  lx->cut = cut;
+  lx->rest = type;
+  noosh_hl_scan(lx, start, type, 1, &simple);
+  lx->cut = 0;
+  lx->pos = end;
+}
+
+/*
+    @brief lex the rest of a long word, from a token cut from it
+    @param lx: lexer, where the token starts and with the state after the
+        word
+    @param quote: the quote the token starts in, a space for none
+    @param type: what the word's unquoted parts are
+*/
+void noosh_hl_rest(struct noosh_hl_lexer * lx, int quote, int type) {
+  size_t p = lx->pos;
+  int simple;
+
+  lx->mark = lx->st;
+  lx->first = 0;
+  lx->cut = 1;
+  lx->rest = type;
+  if (quote != ' ') {
+    p = noosh_hl_string(lx, p, p, quote, 1);
+  }
+  lx->pos = noosh_hl_scan(lx, p, type, 1, &simple);
+  lx->cut = 0;
+}
+
+/*
+    @brief lex the body of a here-document, after the newline it starts
+        on, and the line that ends it
+*/
+void noosh_hl_heredoc(struct noosh_hl_lexer * lx) {
+  struct noosh_hl_state * st = &lx->st;
+  size_t n = 0, p, q, i;
+  char delim[256];
+  int c, quote = 0;
+
+  // The delimiter, with its quotes taken out.
+  for (p = st->here - 1; (c = noosh_hl_char(lx, p)) > 0 && (quote || !strchr(" \t\n|&;<>()", c)); p++) {
+    if (c == quote) {
+      quote = 0;
+    } else if (!quote && (c == '\'' || c == '"')) {
+      quote = c;
+    } else if (n < sizeof(delim) - 1 && (quote || c != '\\' || (c = noosh_hl_char(lx, ++p)) >= 0)) {
+      delim[n++] = c;
+    }
+  }
+  for (p = lx->pos; noosh_hl_char(lx, p) >= 0; ) {
+    for (q = p; st->tabs && noosh_hl_char(lx, q) == '\t'; q++);
+    for (i = 0; i < n && noosh_hl_char(lx, q + i) == (unsigned char) delim[i]; i++);
+    if (i == n && ((c = noosh_hl_char(lx, q + n)) == '\n' || c < 0)) {
+      p = q + n;
+      break;
+    }
+    for (; (c = noosh_hl_char(lx, p)) >= 0 && c != '\n'; p++);
+    p += c >= 0;
+  }
+  lx->mark = *st;
+  noosh_hl_emit(lx, lx->pos, p, NOOSH_HL_STRING, 0);
+  lx->pos = p;
+  st->here = 0;
+  st->tabs = 0;
+}
+
+/*
+    @brief lex an operator or a redirection
+*/
+void noosh_hl_operator(struct noosh_hl_lexer * lx) {
+  struct noosh_hl_state * st = &lx->st;
+  size_t p = lx->pos, q;
+  int c, d, e, type = NOOSH_HL_OPERATOR, control = 0;
+
+  lx->mark = *st;
+  for (; (c = noosh_hl_char(lx, p)) >= '0' && c <= '9'; p++);
+  d = noosh_hl_char(lx, p + 1);
+  if (c == '\n') {
+    p++;
+    st->cmd |= !st->pattern;
+    st->want = st->want == NOOSH_HL_CASE_IN || st->want == NOOSH_HL_FOR_IN ? st->want : NOOSH_HL_ANY;
+  } else if (st->test) {
+    // Between [[ and ]], these are the tests'.
+    p += 1 + ((c == '&' || c == '|') && d == c);
+  } else if ((c == '<' || c == '>') && d == '(') {
+    // A process substitution is a word.
+    p = noosh_hl_match(lx, p + 1);
+    type = NOOSH_HL_VARIABLE;
+  } else if (c == '<' || c == '>' || (c == '&' && d == '>')) {
+    e = noosh_hl_char(lx, p + 2);
+    if (c == '<' && d == '<' && e != '<' && !st->here) {
+      // The here-document is read after the newline.
+      for (q = p + 2 + (e == '-'); (e = noosh_hl_char(lx, q)) == ' ' || e == '\t'; q++);
+      st->here = q + 1;
+      st->tabs = noosh_hl_char(lx, p + 2) == '-';
+    }
+    p += 1 + (d == c || d == '&' || (c == '<' && d == '>') || (c == '>' && d == '|') || c == '&');
+    e = noosh_hl_char(lx, p);
+    p += (c == '<' && d == '<' && (e == '-' || e == '<')) || (c == '&' && e == '>');
+    st->want = NOOSH_HL_ARG;
+  } else if (c == '(') {
+    if (st->pattern) {
+      p++;
+    } else if (st->cmd && d == '(') {
+      // Arithmetic, as one piece.
+      p = noosh_hl_match(lx, p);
+      st->cmd = 0;
+    } else if (st->cmd) {
+      p++;
+      st->depth++;
+    } else {
+      // A function's (), its body next.
+      for (q = p + 1; (e = noosh_hl_char(lx, q)) == ' ' || e == '\t'; q++);
+      if (e == ')') {
+        p = q + 1;
+        st->cmd = 1;
+      } else {
+        p++;
+        type = NOOSH_HL_ERROR;
+      }
+    }
+  } else if (c == ')') {
+    p++;
+    if (st->pattern) {
+      st->pattern = 0;
+      st->cmd = 1;
+    } else if (st->depth > 0) {
+      st->depth--;
+      st->cmd = 0;
+    } else {
+      type = NOOSH_HL_ERROR;
+    }
+  } else if (c == ';' && (d == ';' || d == '&')) {
+    p += 2 + (d == ';' && noosh_hl_char(lx, p + 2) == '&');
+    if (st->cases > 0 && !st->pattern) {
+      st->pattern = 1;
+      st->cmd = 0;
+    } else {
+      type = NOOSH_HL_ERROR;
+    }
+  } else if (c == ';') {
+    p++;
+    control = 1;
+  } else {
+    p += 1 + (d == c || (c == '|' && d == '&'));
+    // In patterns, a single | parts them.
+    control = !st->pattern || c != '|' || p > lx->pos + 1;
+  }
+  if (control) {
+    type = st->cmd ? NOOSH_HL_ERROR : type;
+    st->cmd = 1;
+    st->want = NOOSH_HL_ANY;
+  }
+  noosh_hl_emit(lx, lx->pos, p, type, 1);
+  lx->pos = p < lx->len ? p : lx->len;
+  if (c == '\n' && st->here) {
+    noosh_hl_heredoc(lx);
+  }
+}
+
+/*
+    @brief lex a word, an operator or a comment
+*/
+void noosh_hl_unit(struct noosh_hl_lexer * lx) {
+  size_t p, start = lx->pos;
+  int c = noosh_hl_char(lx, start);
+
+  if (c == '#') {
+    for (p = start; (c = noosh_hl_char(lx, p)) >= 0 && c != '\n'; p++);
+    lx->mark = lx->st;
+    noosh_hl_emit(lx, start, p, NOOSH_HL_COMMENT, 1);
+    lx->pos = p;
+    return;
+  }
+  for (p = start; (c = noosh_hl_char(lx, p)) >= '0' && c <= '9'; p++);
+  if (c == '<' || c == '>' || (p == start && c > 0 && strchr("|&;()\n", c))) {
+    noosh_hl_operator(lx);
+  } else {
+    noosh_hl_word(lx);
+  }
+}
+
+/*
+    @brief bring the tokens up to date, as far as a position of the line
+        at least
+    @param hl: the tokens
+    @param text: the line
+    @param upto: the position
+*/
+void noosh_hl_lex(struct noosh_hl * hl, const struct noosh_rope * text, size_t upto) {
+  struct noosh_hl_state saved;
+  struct noosh_hl_lexer lx;
+  size_t k, from;
+  int c, quote = 0, rest = 0;
+
+  if (!hl->dirty || hl->lexed > upto) {
+    return;
+  }
+  memset(&lx, 0, sizeof(lx));
+  lx.hl = hl;
+  lx.text = text;
+  lx.len = noosh_rope_len(text);
+  lx.st.cmd = 1;
+  // Back to the last token the edits left that lexing can start from.
+  for (k = hl->hole; k > 0 && !hl->v[k - 1].stable && !hl->v[k - 1].quote; k--);
+  if (k > 0) {
+    k--;
+    lx.pos = hl->v[k].start;
+    lx.st = hl->v[k].state;
+    lx.st.here = lx.st.here ? lx.pos + 2 - lx.st.here : 0;
+    quote = hl->v[k].quote;
+    rest = hl->v[k].rest;
+  }
+  // The tokens from there on to the hole are made again; those after it
+  // are old ones, which lexing may come back into step with.
+  noosh_hl_move(hl, hl->hole, lx.len);
+  hl->gap = k;
+  from = lx.pos;
+  if (quote) {
+    noosh_hl_rest(&lx, quote, rest);
+  }
+  while (1) {
+    while ((c = noosh_hl_char(&lx, lx.pos)) == ' ' || c == '\t' ||
+           (c == '\\' && noosh_hl_char(&lx, lx.pos + 1) == '\n')) {
+      lx.pos += c == '\\' ? 2 : 1;
+    }
+    while (hl->after < hl->cap && lx.len - hl->v[hl->after].start < lx.pos) {
+      hl->after++;
+    }
+    if (c < 0) {
+      hl->dirty = 0;
+      break;
+    }
+    // From here on, the line lexes as it did, unless a here-document
+    // is to come: where it ends depends on the text before.
+    saved = noosh_hl_saved(&lx.st, lx.pos);
+    if (hl->after < hl->cap && lx.len - hl->v[hl->after].start == lx.pos && hl->v[hl->after].stable &&
+        lx.pos >= lx.len - hl->dirty_end && saved.here == 0 && noosh_hl_same(&hl->v[hl->after].state, &saved)) {
+      hl->dirty = 0;
+      break;
+    }
+    if (lx.pos > upto) {
+      // Nothing is known of what follows: lexing must get past it.
+      hl->lexed = lx.pos;
+      hl->dirty_end = hl->dirty_end < lx.len - lx.pos ? hl->dirty_end : lx.len - lx.pos;
+      break;
+    }
+    noosh_hl_unit(&lx);
+  }
+  hl->hole = hl->gap;
+  __atomic_add_fetch(&noosh_hl_bytes, lx.pos - from, __ATOMIC_RELAXED);
+}
+
+/*
+    @brief start or end of the ith token, as an offset from the line's
+        start
+*/
+size_t noosh_hl_pos(const struct noosh_hl * hl, size_t i, size_t len, int end) {
+  const struct noosh_hl_token * t = i < hl->gap ? &hl->v[i] : &hl->v[hl->after + i - hl->gap];
+
+  if (i < hl->gap) {
+    return end ? t->end : t->start;
+  }
+  return len - (end ? t->end : t->start);
+}
+
+/*
+    @brief what the byte at a position of the line is, lexing and
+        looking up command names as needed
+    @param hl: the tokens
+    @param text: the line
+    @param pos: the position
+    @return its NOOSH_HL_* type, a command name in its last color until
+        it is found or not
+*/
+int noosh_hl_type(struct noosh_hl * hl, const struct noosh_rope * text, size_t pos) {
+  size_t len = noosh_rope_len(text), n, i, lo, hi, start, end;
+  struct noosh_hl_token * t;
+  char * name;
+
+  noosh_hl_lex(hl, text, pos + NOOSH_HL_AHEAD);
+  n = hl->gap + hl->cap - hl->after;
+  // The last token that starts at pos or before: mostly the one looked
+  // up last or the one after it, cells being drawn in order.
+  i = hl->at;
+  if (i + 1 < n && noosh_hl_pos(hl, i, len, 0) <= pos && noosh_hl_pos(hl, i + 1, len, 0) <= pos) {
+    i++;
+  }
+  if (i >= n || noosh_hl_pos(hl, i, len, 0) > pos || (i + 1 < n && noosh_hl_pos(hl, i + 1, len, 0) <= pos)) {
+    for (lo = 0, hi = n; lo < hi; ) {
+      i = lo + (hi - lo) / 2;
+      if (noosh_hl_pos(hl, i, len, 0) <= pos) {
+        lo = i + 1;
+      } else {
+        hi = i;
+      }
+    }
+    if (lo == 0) {
+      return NOOSH_HL_PLAIN;
+    }
+    i = lo - 1;
+  }
+  hl->at = i;
+  start = noosh_hl_pos(hl, i, len, 0);
+  end = noosh_hl_pos(hl, i, len, 1);
+  t = i < hl->gap ? &hl->v[i] : &hl->v[hl->after + i - hl->gap];
+  if (pos >= end) {
+    return NOOSH_HL_PLAIN;
+  }
+  if (t->type != NOOSH_HL_WORD) {
+    return t->type;
+  }
+  if (hl->word != start) {
+    name = noosh_malloc(end - start + 1);
+    name[noosh_rope_read(text, start, name, end - start)] = '\0';
+    hl->word = start;
+    hl->found = noosh_hl_resolve(name);
+    free(name);
+    if (hl->found != NOOSH_HL_WORD) {
+      hl->known = start;
+      hl->known_found = hl->found;
+    }
+  }
+  if (hl->found == NOOSH_HL_WORD) {
+    // Not drawn plain in between, which would flicker on every key.
+    return hl->known == start ? hl->known_found : NOOSH_HL_PLAIN;
+  }
+  return hl->found;
+}
+
+/*
+    @brief print the highlighting counters, for stats
+    @param out: descriptor to print to
+    @param reset: zero them after
+*/
+void noosh_hl_stats(int out, int reset) {
+  dprintf(out, "highlight lexed %lu tokens %lu lookups %lu\n", __atomic_load_n(&noosh_hl_bytes, __ATOMIC_RELAXED),
+          __atomic_load_n(&noosh_hl_tokens, __ATOMIC_RELAXED), __atomic_load_n(&noosh_hl_searches, __ATOMIC_RELAXED));
+  if (reset) {
+    __atomic_store_n(&noosh_hl_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&noosh_hl_tokens, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&noosh_hl_searches, 0, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+  Line editor
+
+  When standard input and output are a terminal, lines are read in raw
+  mode and edited in place, with cursor movement, history and completion.
+  The editor keeps a model of what it has drawn, row by row and cell by
+  cell. After each batch of keys, it lays out the rows the line should
+  show now and compares them with the model: a row that changed is
+  redrawn from its first changed cell to its last, and everything, cursor
+  moves included, goes out in one write. Only as many rows as the
+  terminal has are drawn, following the cursor, so a long line costs no
+  more to redraw than a short one. Keys typed ahead are all applied
+  before the next redraw.
+
+  Cell widths come from a table of the ranges of Unicode 14 that are
+  wide (2 cells) or take no cell (combining marks and format
+  characters); a character with no width shares the cell of the one
+  before it.
+*/
+
+/*
+  range of characters of the same width, other than 1
+*/
+struct noosh_width_range {
+  unsigned int from;
+  unsigned int to;
+  unsigned char width;
+};
+
+const struct noosh_width_range noosh_widths[] = {
+  {0x00300, 0x0036f, 0}, {0x00483, 0x00489, 0}, {0x00591, 0x005bd, 0}, {0x005bf, 0x005bf, 0},
+  {0x005c1, 0x005c2, 0}, {0x005c4, 0x005c5, 0}, {0x005c7, 0x005c7, 0}, {0x00600, 0x00605, 0},
+  {0x00610, 0x0061a, 0}, {0x0061c, 0x0061c, 0}, {0x0064b, 0x0065f, 0}, {0x00670, 0x00670, 0},
+  {0x006d6, 0x006dd, 0}, {0x006df, 0x006e4, 0}, {0x006e7, 0x006e8, 0}, {0x006ea, 0x006ed, 0},
+  {0x0070f, 0x0070f, 0}, {0x00711, 0x00711, 0}, {0x00730, 0x0074a, 0}, {0x007a6, 0x007b0, 0},
+  {0x007eb, 0x007f3, 0}, {0x007fd, 0x007fd, 0}, {0x00816, 0x00819, 0}, {0x0081b, 0x00823, 0},
+  {0x00825, 0x00827, 0}, {0x00829, 0x0082d, 0}, {0x00859, 0x0085b, 0}, {0x00890, 0x00891, 0},
+  {0x00898, 0x0089f, 0}, {0x008ca, 0x00902, 0}, {0x0093a, 0x0093a, 0}, {0x0093c, 0x0093c, 0},
+  {0x00941, 0x00948, 0}, {0x0094d, 0x0094d, 0}, {0x00951, 0x00957, 0}, {0x00962, 0x00963, 0},
+  {0x00981, 0x00981, 0}, {0x009bc, 0x009bc, 0}, {0x009c1, 0x009c4, 0}, {0x009cd, 0x009cd, 0},
+  {0x009e2, 0x009e3, 0}, {0x009fe, 0x009fe, 0}, {0x00a01, 0x00a02, 0}, {0x00a3c, 0x00a3c, 0},
+  {0x00a41, 0x00a42, 0}, {0x00a47, 0x00a48, 0}, {0x00a4b, 0x00a4d, 0}, {0x00a51, 0x00a51, 0},
+  {0x00a70, 0x00a71, 0}, {0x00a75, 0x00a75, 0}, {0x00a81, 0x00a82, 0}, {0x00abc, 0x00abc, 0},
+  {0x00ac1, 0x00ac5, 0}, {0x00ac7, 0x00ac8, 0}, {0x00acd, 0x00acd, 0}, {0x00ae2, 0x00ae3, 0},
+  {0x00afa, 0x00aff, 0}, {0x00b01, 0x00b01, 0}, {0x00b3c, 0x00b3c, 0}, {0x00b3f, 0x00b3f, 0},
+  {0x00b41, 0x00b44, 0}, {0x00b4d, 0x00b4d, 0}, {0x00b55, 0x00b56, 0}, {0x00b62, 0x00b63, 0},
+  {0x00b82, 0x00b82, 0}, {0x00bc0, 0x00bc0, 0}, {0x00bcd, 0x00bcd, 0}, {0x00c00, 0x00c00, 0},
+  {0x00c04, 0x00c04, 0}, {0x00c3c, 0x00c3c, 0}, {0x00c3e, 0x00c40, 0}, {0x00c46, 0x00c48, 0},
+  {0x00c4a, 0x00c4d, 0}, {0x00c55, 0x00c56, 0}, {0x00c62, 0x00c63, 0}, {0x00c81, 0x00c81, 0},
+  {0x00cbc, 0x00cbc, 0}, {0x00cbf, 0x00cbf, 0}, {0x00cc6, 0x00cc6, 0}, {0x00ccc, 0x00ccd, 0},
+  {0x00ce2, 0x00ce3, 0}, {0x00d00, 0x00d01, 0}, {0x00d3b, 0x00d3c, 0}, {0x00d41, 0x00d44, 0},
+  {0x00d4d, 0x00d4d, 0}, {0x00d62, 0x00d63, 0}, {0x00d81, 0x00d81, 0}, {0x00dca, 0x00dca, 0},
+  {0x00dd2, 0x00dd4, 0}, {0x00dd6, 0x00dd6, 0}, {0x00e31, 0x00e31, 0}, {0x00e34, 0x00e3a, 0},
+  {0x00e47, 0x00e4e, 0}, {0x00eb1, 0x00eb1, 0}, {0x00eb4, 0x00ebc, 0}, {0x00ec8, 0x00ecd, 0},
+  {0x00f18, 0x00f19, 0}, {0x00f35, 0x00f35, 0}, {0x00f37, 0x00f37, 0}, {0x00f39, 0x00f39, 0},
+  {0x00f71, 0x00f7e, 0}, {0x00f80, 0x00f84, 0}, {0x00f86, 0x00f87, 0}, {0x00f8d, 0x00f97, 0},
+  {0x00f99, 0x00fbc, 0}, {0x00fc6, 0x00fc6, 0}, {0x0102d, 0x01030, 0}, {0x01032, 0x01037, 0},
+  {0x01039, 0x0103a, 0}, {0x0103d, 0x0103e, 0}, {0x01058, 0x01059, 0}, {0x0105e, 0x01060, 0},
+  {0x01071, 0x01074, 0}, {0x01082, 0x01082, 0}, {0x01085, 0x01086, 0}, {0x0108d, 0x0108d, 0},
+  {0x0109d, 0x0109d, 0}, {0x01100, 0x0115f, 2}, {0x01160, 0x011ff, 0}, {0x0135d, 0x0135f, 0},
+  {0x01712, 0x01714, 0}, {0x01732, 0x01733, 0}, {0x01752, 0x01753, 0}, {0x01772, 0x01773, 0},
+  {0x017b4, 0x017b5, 0}, {0x017b7, 0x017bd, 0}, {0x017c6, 0x017c6, 0}, {0x017c9, 0x017d3, 0},
+  {0x017dd, 0x017dd, 0}, {0x0180b, 0x0180f, 0}, {0x01885, 0x01886, 0}, {0x018a9, 0x018a9, 0},
+  {0x01920, 0x01922, 0}, {0x01927, 0x01928, 0}, {0x01932, 0x01932, 0}, {0x01939, 0x0193b, 0},
+  {0x01a17, 0x01a18, 0}, {0x01a1b, 0x01a1b, 0}, {0x01a56, 0x01a56, 0}, {0x01a58, 0x01a5e, 0},
+  {0x01a60, 0x01a60, 0}, {0x01a62, 0x01a62, 0}, {0x01a65, 0x01a6c, 0}, {0x01a73, 0x01a7c, 0},
+  {0x01a7f, 0x01a7f, 0}, {0x01ab0, 0x01ace, 0}, {0x01b00, 0x01b03, 0}, {0x01b34, 0x01b34, 0},
+  {0x01b36, 0x01b3a, 0}, {0x01b3c, 0x01b3c, 0}, {0x01b42, 0x01b42, 0}, {0x01b6b, 0x01b73, 0},
+  {0x01b80, 0x01b81, 0}, {0x01ba2, 0x01ba5, 0}, {0x01ba8, 0x01ba9, 0}, {0x01bab, 0x01bad, 0},
+  {0x01be6, 0x01be6, 0}, {0x01be8, 0x01be9, 0}, {0x01bed, 0x01bed, 0}, {0x01bef, 0x01bf1, 0},
+  {0x01c2c, 0x01c33, 0}, {0x01c36, 0x01c37, 0}, {0x01cd0, 0x01cd2, 0}, {0x01cd4, 0x01ce0, 0},
+  {0x01ce2, 0x01ce8, 0}, {0x01ced, 0x01ced, 0}, {0x01cf4, 0x01cf4, 0}, {0x01cf8, 0x01cf9, 0},
+  {0x01dc0, 0x01dff, 0}, {0x0200b, 0x0200f, 0}, {0x0202a, 0x0202e, 0}, {0x02060, 0x02064, 0},
+  {0x02066, 0x0206f, 0}, {0x020d0, 0x020f0, 0}, {0x0231a, 0x0231b, 2}, {0x02329, 0x0232a, 2},
+  {0x023e9, 0x023ec, 2}, {0x023f0, 0x023f0, 2}, {0x023f3, 0x023f3, 2}, {0x025fd, 0x025fe, 2},
+  {0x02614, 0x02615, 2}, {0x02648, 0x02653, 2}, {0x0267f, 0x0267f, 2}, {0x02693, 0x02693, 2},
+  {0x026a1, 0x026a1, 2}, {0x026aa, 0x026ab, 2}, {0x026bd, 0x026be, 2}, {0x026c4, 0x026c5, 2},
+  {0x026ce, 0x026ce, 2}, {0x026d4, 0x026d4, 2}, {0x026ea, 0x026ea, 2}, {0x026f2, 0x026f3, 2},
+  {0x026f5, 0x026f5, 2}, {0x026fa, 0x026fa, 2}, {0x026fd, 0x026fd, 2}, {0x02705, 0x02705, 2},
+  {0x0270a, 0x0270b, 2}, {0x02728, 0x02728, 2}, {0x0274c, 0x0274c, 2}, {0x0274e, 0x0274e, 2},
+  {0x02753, 0x02755, 2}, {0x02757, 0x02757, 2}, {0x02795, 0x02797, 2}, {0x027b0, 0x027b0, 2},
+  {0x027bf, 0x027bf, 2}, {0x02b1b, 0x02b1c, 2}, {0x02b50, 0x02b50, 2}, {0x02b55, 0x02b55, 2},
+  {0x02cef, 0x02cf1, 0}, {0x02d7f, 0x02d7f, 0}, {0x02de0, 0x02dff, 0}, {0x02e80, 0x02e99, 2},
+  {0x02e9b, 0x02ef3, 2}, {0x02f00, 0x02fd5, 2}, {0x02ff0, 0x02ffb, 2}, {0x03000, 0x03029, 2},
+  {0x0302a, 0x0302d, 0}, {0x0302e, 0x0303e, 2}, {0x03041, 0x03096, 2}, {0x03099, 0x0309a, 0},
+  {0x0309b, 0x030ff, 2}, {0x03105, 0x0312f, 2}, {0x03131, 0x0318e, 2}, {0x03190, 0x031e3, 2},
+  {0x031f0, 0x0321e, 2}, {0x03220, 0x03247, 2}, {0x03250, 0x04dbf, 2}, {0x04e00, 0x0a48c, 2},
+  {0x0a490, 0x0a4c6, 2}, {0x0a66f, 0x0a672, 0}, {0x0a674, 0x0a67d, 0}, {0x0a69e, 0x0a69f, 0},
+  {0x0a6f0, 0x0a6f1, 0}, {0x0a802, 0x0a802, 0}, {0x0a806, 0x0a806, 0}, {0x0a80b, 0x0a80b, 0},
+  {0x0a825, 0x0a826, 0}, {0x0a82c, 0x0a82c, 0}, {0x0a8c4, 0x0a8c5, 0}, {0x0a8e0, 0x0a8f1, 0},
+  {0x0a8ff, 0x0a8ff, 0}, {0x0a926, 0x0a92d, 0}, {0x0a947, 0x0a951, 0}, {0x0a960, 0x0a97c, 2},
+  {0x0a980, 0x0a982, 0}, {0x0a9b3, 0x0a9b3, 0}, {0x0a9b6, 0x0a9b9, 0}, {0x0a9bc, 0x0a9bd, 0},
+  {0x0a9e5, 0x0a9e5, 0}, {0x0aa29, 0x0aa2e, 0}, {0x0aa31, 0x0aa32, 0}, {0x0aa35, 0x0aa36, 0},
+  {0x0aa43, 0x0aa43, 0}, {0x0aa4c, 0x0aa4c, 0}, {0x0aa7c, 0x0aa7c, 0}, {0x0aab0, 0x0aab0, 0},
+  {0x0aab2, 0x0aab4, 0}, {0x0aab7, 0x0aab8, 0}, {0x0aabe, 0x0aabf, 0}, {0x0aac1, 0x0aac1, 0},
+  {0x0aaec, 0x0aaed, 0}, {0x0aaf6, 0x0aaf6, 0}, {0x0abe5, 0x0abe5, 0}, {0x0abe8, 0x0abe8, 0},
+  {0x0abed, 0x0abed, 0}, {0x0ac00, 0x0d7a3, 2}, {0x0f900, 0x0fa6d, 2}, {0x0fa70, 0x0fad9, 2},
+  {0x0fb1e, 0x0fb1e, 0}, {0x0fe00, 0x0fe0f, 0}, {0x0fe10, 0x0fe19, 2}, {0x0fe20, 0x0fe2f, 0},
+  {0x0fe30, 0x0fe52, 2}, {0x0fe54, 0x0fe66, 2}, {0x0fe68, 0x0fe6b, 2}, {0x0feff, 0x0feff, 0},
+  {0x0ff01, 0x0ff60, 2}, {0x0ffe0, 0x0ffe6, 2}, {0x0fff9, 0x0fffb, 0}, {0x101fd, 0x101fd, 0},
+  {0x102e0, 0x102e0, 0}, {0x10376, 0x1037a, 0}, {0x10a01, 0x10a03, 0}, {0x10a05, 0x10a06, 0},
+  {0x10a0c, 0x10a0f, 0}, {0x10a38, 0x10a3a, 0}, {0x10a3f, 0x10a3f, 0}, {0x10ae5, 0x10ae6, 0},
+  {0x10d24, 0x10d27, 0}, {0x10eab, 0x10eac, 0}, {0x10f46, 0x10f50, 0}, {0x10f82, 0x10f85, 0},
+  {0x11001, 0x11001, 0}, {0x11038, 0x11046, 0}, {0x11070, 0x11070, 0}, {0x11073, 0x11074, 0},
+  {0x1107f, 0x11081, 0}, {0x110b3, 0x110b6, 0}, {0x110b9, 0x110ba, 0}, {0x110bd, 0x110bd, 0},
+  {0x110c2, 0x110c2, 0}, {0x110cd, 0x110cd, 0}, {0x11100, 0x11102, 0}, {0x11127, 0x1112b, 0},
+  {0x1112d, 0x11134, 0}, {0x11173, 0x11173, 0}, {0x11180, 0x11181, 0}, {0x111b6, 0x111be, 0},
+  {0x111c9, 0x111cc, 0}, {0x111cf, 0x111cf, 0}, {0x1122f, 0x11231, 0}, {0x11234, 0x11234, 0},
+  {0x11236, 0x11237, 0}, {0x1123e, 0x1123e, 0}, {0x112df, 0x112df, 0}, {0x112e3, 0x112ea, 0},
+  {0x11300, 0x11301, 0}, {0x1133b, 0x1133c, 0}, {0x11340, 0x11340, 0}, {0x11366, 0x1136c, 0},
+  {0x11370, 0x11374, 0}, {0x11438, 0x1143f, 0}, {0x11442, 0x11444, 0}, {0x11446, 0x11446, 0},
+  {0x1145e, 0x1145e, 0}, {0x114b3, 0x114b8, 0}, {0x114ba, 0x114ba, 0}, {0x114bf, 0x114c0, 0},
+  {0x114c2, 0x114c3, 0}, {0x115b2, 0x115b5, 0}, {0x115bc, 0x115bd, 0}, {0x115bf, 0x115c0, 0},
+  {0x115dc, 0x115dd, 0}, {0x11633, 0x1163a, 0}, {0x1163d, 0x1163d, 0}, {0x1163f, 0x11640, 0},
+  {0x116ab, 0x116ab, 0}, {0x116ad, 0x116ad, 0}, {0x116b0, 0x116b5, 0}, {0x116b7, 0x116b7, 0},
+  {0x1171d, 0x1171f, 0}, {0x11722, 0x11725, 0}, {0x11727, 0x1172b, 0}, {0x1182f, 0x11837, 0},
+  {0x11839, 0x1183a, 0}, {0x1193b, 0x1193c, 0}, {0x1193e, 0x1193e, 0}, {0x11943, 0x11943, 0},
+  {0x119d4, 0x119d7, 0}, {0x119da, 0x119db, 0}, {0x119e0, 0x119e0, 0}, {0x11a01, 0x11a0a, 0},
+  {0x11a33, 0x11a38, 0}, {0x11a3b, 0x11a3e, 0}, {0x11a47, 0x11a47, 0}, {0x11a51, 0x11a56, 0},
+  {0x11a59, 0x11a5b, 0}, {0x11a8a, 0x11a96, 0}, {0x11a98, 0x11a99, 0}, {0x11c30, 0x11c36, 0},
+  {0x11c38, 0x11c3d, 0}, {0x11c3f, 0x11c3f, 0}, {0x11c92, 0x11ca7, 0}, {0x11caa, 0x11cb0, 0},
+  {0x11cb2, 0x11cb3, 0}, {0x11cb5, 0x11cb6, 0}, {0x11d31, 0x11d36, 0}, {0x11d3a, 0x11d3a, 0},
+  {0x11d3c, 0x11d3d, 0}, {0x11d3f, 0x11d45, 0}, {0x11d47, 0x11d47, 0}, {0x11d90, 0x11d91, 0},
+  {0x11d95, 0x11d95, 0}, {0x11d97, 0x11d97, 0}, {0x11ef3, 0x11ef4, 0}, {0x13430, 0x13438, 0},
+  {0x16af0, 0x16af4, 0}, {0x16b30, 0x16b36, 0}, {0x16f4f, 0x16f4f, 0}, {0x16f8f, 0x16f92, 0},
+  {0x16fe0, 0x16fe3, 2}, {0x16fe4, 0x16fe4, 0}, {0x16ff0, 0x16ff1, 2}, {0x17000, 0x187f7, 2},
+  {0x18800, 0x18cd5, 2}, {0x18d00, 0x18d08, 2}, {0x1aff0, 0x1aff3, 2}, {0x1aff5, 0x1affb, 2},
+  {0x1affd, 0x1affe, 2}, {0x1b000, 0x1b122, 2}, {0x1b150, 0x1b152, 2}, {0x1b164, 0x1b167, 2},
+  {0x1b170, 0x1b2fb, 2}, {0x1bc9d, 0x1bc9e, 0}, {0x1bca0, 0x1bca3, 0}, {0x1cf00, 0x1cf2d, 0},
+  {0x1cf30, 0x1cf46, 0}, {0x1d167, 0x1d169, 0}, {0x1d173, 0x1d182, 0}, {0x1d185, 0x1d18b, 0},
+  {0x1d1aa, 0x1d1ad, 0}, {0x1d242, 0x1d244, 0}, {0x1da00, 0x1da36, 0}, {0x1da3b, 0x1da6c, 0},
+  {0x1da75, 0x1da75, 0}, {0x1da84, 0x1da84, 0}, {0x1da9b, 0x1da9f, 0}, {0x1daa1, 0x1daaf, 0},
+  {0x1e000, 0x1e006, 0}, {0x1e008, 0x1e018, 0}, {0x1e01b, 0x1e021, 0}, {0x1e023, 0x1e024, 0},
+  {0x1e026, 0x1e02a, 0}, {0x1e130, 0x1e136, 0}, {0x1e2ae, 0x1e2ae, 0}, {0x1e2ec, 0x1e2ef, 0},
+  {0x1e8d0, 0x1e8d6, 0}, {0x1e944, 0x1e94a, 0}, {0x1f004, 0x1f004, 2}, {0x1f0cf, 0x1f0cf, 2},
+  {0x1f18e, 0x1f18e, 2}, {0x1f191, 0x1f19a, 2}, {0x1f200, 0x1f202, 2}, {0x1f210, 0x1f23b, 2},
+  {0x1f240, 0x1f248, 2}, {0x1f250, 0x1f251, 2}, {0x1f260, 0x1f265, 2}, {0x1f300, 0x1f320, 2},
+  {0x1f32d, 0x1f335, 2}, {0x1f337, 0x1f37c, 2}, {0x1f37e, 0x1f393, 2}, {0x1f3a0, 0x1f3ca, 2},
+  {0x1f3cf, 0x1f3d3, 2}, {0x1f3e0, 0x1f3f0, 2}, {0x1f3f4, 0x1f3f4, 2}, {0x1f3f8, 0x1f43e, 2},
+  {0x1f440, 0x1f440, 2}, {0x1f442, 0x1f4fc, 2}, {0x1f4ff, 0x1f53d, 2}, {0x1f54b, 0x1f54e, 2},
+  {0x1f550, 0x1f567, 2}, {0x1f57a, 0x1f57a, 2}, {0x1f595, 0x1f596, 2}, {0x1f5a4, 0x1f5a4, 2},
+  {0x1f5fb, 0x1f64f, 2}, {0x1f680, 0x1f6c5, 2}, {0x1f6cc, 0x1f6cc, 2}, {0x1f6d0, 0x1f6d2, 2},
+  {0x1f6d5, 0x1f6d7, 2}, {0x1f6dd, 0x1f6df, 2}, {0x1f6eb, 0x1f6ec, 2}, {0x1f6f4, 0x1f6fc, 2},
+  {0x1f7e0, 0x1f7eb, 2}, {0x1f7f0, 0x1f7f0, 2}, {0x1f90c, 0x1f93a, 2}, {0x1f93c, 0x1f945, 2},
+  {0x1f947, 0x1f9ff, 2}, {0x1fa70, 0x1fa74, 2}, {0x1fa78, 0x1fa7c, 2}, {0x1fa80, 0x1fa86, 2},
+  {0x1fa90, 0x1faac, 2}, {0x1fab0, 0x1faba, 2}, {0x1fac0, 0x1fac5, 2}, {0x1fad0, 0x1fad9, 2},
+  {0x1fae0, 0x1fae7, 2}, {0x1faf0, 0x1faf6, 2}, {0x20000, 0x3fffd, 2}, {0xe0001, 0xe0001, 0},
+  {0xe0020, 0xe007f, 0}, {0xe0100, 0xe01ef, 0}
+};
+
+/*
+    @brief number of terminal cells a character takes
+    @param c: the character
+    @return 0, 1 or 2, -1 for a control character
+*/
+int noosh_wcwidth(unsigned int c) {
+  int lo = 0, hi = sizeof(noosh_widths) / sizeof(*noosh_widths) - 1, mid;
+
+  if (c < 0x300) {
+    return c < 0x20 || (c >= 0x7f && c < 0xa0) ? -1 : 1;
+  }
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (c < noosh_widths[mid].from) {
+      hi = mid - 1;
+    } else if (c > noosh_widths[mid].to) {
+      lo = mid + 1;
+    } else {
+      return noosh_widths[mid].width;
+    }
+  }
+  return 1;
+}
+
+/*
+    @brief decode a UTF-8 character
+    @param s: text
+    @param len: bytes left in it, at least 1
+    @param c: gets the character, U+FFFD for a byte that does not start
+        a valid one
+    @return its length in bytes
+*/
+size_t noosh_utf8_decode(const char * s, size_t len, unsigned int * c) {
+  const unsigned char * u = (const unsigned char *) s;
+  size_t n, i;
+
+  if (u[0] < 0x80) {
+    *c = u[0];
+    return 1;
+  }
+  n = u[0] >= 0xf0 && u[0] < 0xf8 ? 4 : u[0] >= 0xe0 ? 3 : u[0] >= 0xc2 ? 2 : 0;
+  if (n == 0 || n > len) {
+    *c = 0xfffd;
+    return 1;
+  }
+  *c = u[0] & (0x7f >> n);
+  for (i = 1; i < n; i++) {
+    if ((u[i] & 0xc0) != 0x80) {
+      *c = 0xfffd;
+      return 1;
+    }
+    *c = *c << 6 | (u[i] & 0x3f);
+  }
+  return n;
+}
+
+/*
+  cell of the screen
+    s holds what is drawn in it: a character and its combining marks, or
+    ^X for a control character; width is 1 or 2 (a tab is up to 8
+    blanks); col is where it starts and attr its color, the NOOSH_HL_*
+    type of what it shows
+*/
+struct noosh_cell {
+  char s[16];
+  unsigned char len;
+  unsigned char width;
+  unsigned char attr;
+  unsigned short col;
+};
+
+/*
+  row of the screen, as drawn or as it should be
+    prompt is set on the first row, which starts with the prompt
+*/
+struct noosh_ed_row {
+  struct noosh_cell * cells;
+  int n;
+  int cap;
+  int prompt;
+};
+
+/*
+  line being edited
+    text and cursor, a byte offset in it; index lists the lines of the
+    text for layout and span holds the bytes of one; prompt and its
+    width pw
+    rows is the model of the screen: what the editor has drawn on the
+    rows from the prompt's down, nrows of them, of which alloc have
+    been reached; next is where the rows it should show are laid out; row and col are the terminal's cursor in those terms,
+    col -1 when it is unknown; top is the first row of the line shown
+    hist is the history entry being edited, saved the new line while
+    going through history; tabs counts Tabs pressed in a row
+    hl are the tokens of the text, for its colors, and attr the color
+    the terminal is drawing in
+*/
+struct noosh_editor {
+  struct noosh_rope text;
+  size_t cursor;
+  struct noosh_rope_lines index;
+  struct noosh_buf span;
+  const char * prompt;
+  int pw;
+  int cols;
+  int lines;
+  struct noosh_ed_row * rows;
+  int nrows;
+  int caprows;
+  struct noosh_ed_row * next;
+  int capnext;
+  int alloc;
+  int row;
+  int col;
+  int top;
+  struct noosh_buf out;
+  int hist;
+  char * saved;
+  int tabs;
+  struct noosh_hl hl;
+  int attr;
+};
+
+/*
+  lines entered, oldest first
+*/
+# define NOOSH_HISTORY_MAX 1000
+
+struct noosh_args noosh_history = {0};
+
+/*
+  keys read from the terminal and not used yet, and the state it had
+  before the editor made it raw; reads are large for pastes
+*/
+char noosh_ed_in[65536];
+size_t noosh_ed_inlen = 0;
+size_t noosh_ed_inpos = 0;
+struct termios noosh_ed_cooked;
+
+/*
+  set when the line was given up with ^C
+*/
+int noosh_ed_cancelled = 0;
+
+/*
+  editor counters for stats: keys handled, redraws and the bytes they
+  sent to the terminal, pastes
+*/
+unsigned long noosh_ed_keys = 0;
+unsigned long noosh_ed_redraws = 0;
+unsigned long noosh_ed_bytes = 0;
+unsigned long noosh_ed_pastes = 0;
+
+/*
+    @brief number of terminal cells a prompt takes: its characters, not
+        the escape sequences in it
+*/
+int noosh_prompt_width(const char * p) {
+  unsigned int c;
+  int w = 0, cw;
+
+  while (*p) {
+    if (*p == '\033') {
+      for (p++, p += *p == '['; *p && !isalpha((unsigned char) *p); p++);
+      p += *p != '\0';
+      continue;
+    }
+    p += noosh_utf8_decode(p, strlen(p), &c);
+    cw = noosh_wcwidth(c);
+    w += cw > 0 ? cw : 0;
+  }
+  return w;
+}
+
+/*
+    @brief find where the character after a position of some text ends,
+        with its combining marks
+*/
+size_t noosh_text_next(const char * s, size_t len, size_t pos) {
+  unsigned int c;
+  size_t n;
+
+  if (pos >= len) {
+    return len;
+  }
+  pos += noosh_utf8_decode(s + pos, len - pos, &c);
+  while (pos < len) {
+    n = noosh_utf8_decode(s + pos, len - pos, &c);
+    if (noosh_wcwidth(c) != 0) {
+      break;
+    }
+    pos += n;
+  }
+  return pos;
+}
+
+/*
+    @brief find where the character after a position of the line ends,
+        with its combining marks
+*/
+size_t noosh_ed_next(const struct noosh_editor * ed, size_t pos) {
+  char tmp[64];
+
+  return pos + noosh_text_next(tmp, noosh_rope_read(&ed->text, pos, tmp, sizeof(tmp)), 0);
+}
+
+/*
+    @brief find where the character before a position of the line starts,
+        with its combining marks
+*/
+size_t noosh_ed_prev(const struct noosh_editor * ed, size_t pos) {
+  unsigned int c;
+  char tmp[4];
+
+  while (pos > 0) {
+    for (pos--; pos > 0 && (noosh_rope_byte(&ed->text, pos) & 0xc0) == 0x80; pos--);
+    noosh_utf8_decode(tmp, noosh_rope_read(&ed->text, pos, tmp, sizeof(tmp)), &c);
+    if (noosh_wcwidth(c) != 0) {
+      break;
+    }
+  }
+  return pos;
+}
+
+/*
+    @brief make the cell of the character at a position of some text
+    @param s: the text
+    @param len: its length
+    @param pos: where the character starts
+    @param col: the column it would start at, for tabs
+    @param cell: gets the cell, its col left to the caller
+    @return where the next one starts
+*/
+size_t noosh_ed_cell(const char * s, size_t len, size_t pos, int col, struct noosh_cell * cell) {
+  size_t end = noosh_text_next(s, len, pos), n;
+  unsigned int c;
+  int w;
+
+  noosh_utf8_decode(s + pos, end - pos, &c);
+  w = noosh_wcwidth(c);
+  if (c == '\t') {
+    cell->width = 8 - col % 8;
+    memset(cell->s, ' ', cell->width);
+    cell->len = cell->width;
+  } else if (w < 0) {
+    cell->s[0] = '^';
+    cell->s[1] = c < 0x80 ? (char) (c ^ 0x40) : '?';
+    cell->len = cell->width = 2;
+  } else {
+    // A character and as many of its marks as the cell holds.
+    n = end - pos < sizeof(cell->s) ? end - pos : noosh_utf8_decode(s + pos, end - pos, &c);
+    memcpy(cell->s, s + pos, n);
+    cell->len = n;
+    cell->width = w == 0 ? 1 : w;
+  }
+  return end;
+}
+
+/*
+    @brief add a cell to a row
+*/
+void noosh_ed_row_add(struct noosh_ed_row * row, const struct noosh_cell * cell) {
+  if (row->n == row->cap) {
+    row->cap = row->cap ? 2 * row->cap : 64;
+    row->cells = noosh_realloc(row->cells, row->cap * sizeof(*row->cells));
+  }
+  row->cells[row->n++] = *cell;
+}
+
+/*
+    @brief lay out a piece of a line, from its start or that of a row
+    @param ed: editor
+    @param s: the piece
+    @param len: its length
+    @param base: where it starts in the line, for its colors
+    @param cursor: the cursor's offset in it, (size_t) -1 when it is not
+        in it
+    @param row: the row it starts on, gets the row it ends on
+    @param col: likewise for the column
+    @param first: first row to fill into ed->next
+    @param n: number of rows to fill, 0 for none
+    @param crow: gets the cursor's row
+    @param ccol: gets its column
+*/
+void noosh_ed_layout_span(struct noosh_editor * ed, const char * s, size_t len, size_t base, size_t cursor,
+                          int * row, int * col, int first, int n, int * crow, int * ccol) {
+  struct noosh_cell cell;
+  size_t pos = 0, next;
+
+  while (1) {
+    if (pos == cursor) {
+      if (*col == ed->cols) {
+        (*row)++;
+        *col = 0;
+      }
+      *crow = *row;
+      *ccol = *col;
+    }
+    if (pos >= len) {
+      break;
+    }
+    next = noosh_ed_cell(s, len, pos, *col, &cell);
+    if (*col + cell.width > ed->cols) {
+      // It does not fit: the rest of the row stays blank.
+      (*row)++;
+      *col = 0;
+      if (cell.s[0] == ' ' && s[pos] == '\t') {
+        noosh_ed_cell(s, len, pos, 0, &cell);
+      }
+    }
+    if (*row >= first && *row < first + n) {
+      cell.col = *col;
+      cell.attr = noosh_opt_highlight ? noosh_hl_type(&ed->hl, &ed->text, base + pos) : NOOSH_HL_PLAIN;
+      noosh_ed_row_add(&ed->next[*row - first], &cell);
+    }
+    *col += cell.width;
+    pos = next;
+  }
+}
+
+/*
+    @brief copy bytes of the line into ed->span
+*/
+void noosh_ed_span(struct noosh_editor * ed, size_t pos, size_t len) {
+  ed->span.len = 0;
+  noosh_buf_reserve(&ed->span, len);
+  ed->span.len = noosh_rope_read(&ed->text, pos, ed->span.data, len);
+}
+
+/*
+    @brief lay out the line: find the row and column of the cursor and
+        the number of rows, and fill the rows of the window from first
+        A line of characters one cell wide wraps where its counts say,
+        and only its rows in the window are read. Any other line is read
+        whole, unless it cannot wrap and is neither shown nor has the
+        cursor.
+    @param ed: editor
+    @param first: first row to fill
+    @param n: number of rows to fill into ed->next, 0 for none
+    @param crow: gets the cursor's row
+    @param ccol: gets its column
+    @return number of rows of the line
+*/
+int noosh_ed_layout(struct noosh_editor * ed, int first, int n, int * crow, int * ccol) {
+  struct noosh_rope_line * line;
+  size_t k, cline, w, j, from, len;
+  int row = 0, c0, erow, ecol, r, col;
+
+  noosh_rope_lines(&ed->text, &ed->index);
+  cline = noosh_rope_rank(&ed->text, ed->cursor, NOOSH_ROPE_LINES);
+  for (k = 0; ; k++) {
+    line = &ed->index.v[k];
+    c0 = k == 0 ? ed->pw : 0;
+    erow = row;
+    ecol = c0;
+    if (line->odd == 0) {
+      w = line->chars;
+      if (w > 0) {
+        erow = row + (c0 + w - 1) / ed->cols;
+        ecol = (c0 + w - 1) % ed->cols + 1;
+      }
+      if (k == cline) {
+        j = noosh_rope_rank(&ed->text, ed->cursor, NOOSH_ROPE_CHARS) - line->before;
+        *crow = row + (c0 + j) / ed->cols;
+        *ccol = (c0 + j) % ed->cols;
+        if (j == w && ecol == ed->cols) {
+          erow++;
+          ecol = 0;
+        }
+      }
+      r = first > row ? first - row : 0;
+      j = r == 0 ? 0 : (size_t) r * ed->cols - c0;
+      if (n > 0 && j < w && row + r < first + n) {
+        // Only the rows in the window, a character taking 4 bytes at most.
+        from = j == 0 ? line->start : noosh_rope_find(&ed->text, NOOSH_ROPE_CHARS, line->before + j);
+        len = (size_t) (first + n - row - r) * ed->cols * 4;
+        noosh_ed_span(ed, from, line->start + line->bytes - from < len ? line->start + line->bytes - from : len);
+        r += row;
+        col = r == row ? c0 : 0;
+        noosh_ed_layout_span(ed, ed->span.data, ed->span.len, from, (size_t) -1, &r, &col, first, n, crow, ccol);
+      }
+    } else if (k == cline || k + 1 == ed->index.n || c0 + line->chars + 8 * line->odd > (size_t) ed->cols ||
+               (n > 0 && row >= first && row < first + n)) {
+      noosh_ed_span(ed, line->start, line->bytes);
+      noosh_ed_layout_span(ed, ed->span.data, ed->span.len, line->start,
+                           k == cline ? ed->cursor - line->start : (size_t) -1, &erow, &ecol, first, n, crow, ccol);
+    }
+    if (k + 1 == ed->index.n) {
+      return (ecol == ed->cols ? erow + 1 : erow) + 1;
+    }
+    row = erow + 1;
+  }
+}
+
+/*
+    @brief queue an escape sequence with a count
+*/
+void noosh_ed_csi(struct noosh_editor * ed, int n, char final) {
+  char tmp[16];
+
+  if (n == 1) {
+    snprintf(tmp, sizeof(tmp), "\033[%c", final);
+  } else {
+    snprintf(tmp, sizeof(tmp), "\033[%d%c", n, final);
+  }
+  noosh_buf_append(&ed->out, tmp, strlen(tmp));
+}
+
+/*
+    @brief queue the moves that take the terminal's cursor to a row and
+        column of the editor's rows
+*/
+void noosh_ed_move(struct noosh_editor * ed, int row, int col) {
+  if (row >= ed->alloc) {
+    // New rows are reached by going down from the last one, scrolling.
+    if (ed->row < ed->alloc - 1) {
+      noosh_ed_csi(ed, ed->alloc - 1 - ed->row, 'B');
+    }
+    for (; ed->alloc <= row; ed->alloc++) {
+      noosh_buf_append(&ed->out, "\r\n", 2);
+    }
+    ed->row = row;
+    ed->col = 0;
+  } else if (row < ed->row) {
+    noosh_ed_csi(ed, ed->row - row, 'A');
+  } else if (row > ed->row) {
+    noosh_ed_csi(ed, row - ed->row, 'B');
+  }
+  if (ed->col >= ed->cols) {
+    // Past the last column, the terminal may be waiting to wrap.
+    ed->col = -1;
+  }
+  ed->row = row;
+  if (col == 0 && ed->col != 0) {
+    noosh_buf_append(&ed->out, "\r", 1);
+  } else if (ed->col < 0) {
+    noosh_buf_append(&ed->out, "\r", 1);
+    noosh_ed_csi(ed, col, 'C');
+  } else if (col > ed->col) {
+    noosh_ed_csi(ed, col - ed->col, 'C');
+  } else if (col < ed->col) {
+    noosh_ed_csi(ed, ed->col - col, 'D');
+  }
+  ed->col = col;
+}
+
+/*
+    @brief queue what makes the terminal draw in the color of a type of
+        token, if it does not already
+*/
+void noosh_ed_attr(struct noosh_editor * ed, int attr) {
+  const int colors[] = {0, noosh_colors.command_color, noosh_colors.missing_color, noosh_colors.keyword_color,
+                        noosh_colors.string_color, noosh_colors.variable_color, noosh_colors.operator_color,
+                        noosh_colors.comment_color, noosh_colors.error_color};
+  char tmp[32];
+
+  if (attr == ed->attr) {
+    return;
+  }
+  if (attr == NOOSH_HL_PLAIN) {
+    snprintf(tmp, sizeof(tmp), "\033[0m");
+  } else if (attr == NOOSH_HL_ERROR) {
+    // Underlined too, for errors in blanks to show.
+    snprintf(tmp, sizeof(tmp), "\033[0;4;%dm", colors[attr]);
+  } else {
+    snprintf(tmp, sizeof(tmp), "\033[0;%dm", colors[attr]);
+  }
+  noosh_buf_append(&ed->out, tmp, strlen(tmp));
+  ed->attr = attr;
+}
+
+/*
+    @brief compare two cells of the screen
+*/
+int noosh_cell_eq(const struct noosh_cell * a, const struct noosh_cell * b) {
+  return a->col == b->col && a->width == b->width && a->attr == b->attr && a->len == b->len &&
+         memcmp(a->s, b->s, a->len) == 0;
+}
+
+/*
+    @brief queue what turns a row of the screen into another
+    @param ed: editor
+    @param r: the row
+    @param old: what it shows
+    @param new: what it should show
+*/
+void noosh_ed_diff_row(struct noosh_editor * ed, int r, const struct noosh_ed_row * old, const struct noosh_ed_row * new) {
+  int p = 0, s = 0, i, oend, nend;
+
+  oend = old->n ? old->cells[old->n - 1].col + old->cells[old->n - 1].width : old->prompt ? ed->pw : 0;
+  nend = new->n ? new->cells[new->n - 1].col + new->cells[new->n - 1].width : new->prompt ? ed->pw : 0;
+  if (old->prompt != new->prompt) {
+    noosh_ed_move(ed, r, 0);
+    if (new->prompt) {
+      noosh_ed_attr(ed, NOOSH_HL_PLAIN);
+      noosh_buf_append(&ed->out, ed->prompt, strlen(ed->prompt));
+      ed->col = ed->pw;
+    }
+  } else {
+    for (; p < old->n && p < new->n && noosh_cell_eq(&old->cells[p], &new->cells[p]); p++);
+    if (p == old->n && p == new->n) {
+      return;
+    }
+    for (; s < old->n - p && s < new->n - p &&
+           noosh_cell_eq(&old->cells[old->n - 1 - s], &new->cells[new->n - 1 - s]); s++);
+    noosh_ed_move(ed, r, p < new->n ? new->cells[p].col : nend);
+  }
+  for (i = p; i < new->n - s; i++) {
+    noosh_ed_attr(ed, new->cells[i].attr);
+    noosh_buf_append(&ed->out, new->cells[i].s, new->cells[i].len);
+    ed->col = new->cells[i].col + new->cells[i].width;
+  }
+  if (s == 0 && oend > nend) {
+    if (ed->col >= ed->cols) {
+      noosh_ed_move(ed, r, nend);
+    }
+    noosh_buf_append(&ed->out, "\033[K", 3);
+  }
+}
+
+/*
+    @brief write out what was queued
+*/
+void noosh_ed_flush(struct noosh_editor * ed) {
+  size_t off = 0;
+  ssize_t n;
+
+  __atomic_add_fetch(&noosh_ed_bytes, ed->out.len, __ATOMIC_RELAXED);
+  while (off < ed->out.len) {
+    if ((n = write(STDOUT_FILENO, ed->out.data + off, ed->out.len - off)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    off += n;
+  }
+  ed->out.len = 0;
+}
+
+/*
+    @brief forget what the screen shows, for a redraw from the current row
+*/
+void noosh_ed_forget(struct noosh_editor * ed) {
+  int i;
+
+  for (i = 0; i < ed->nrows; i++) {
+    ed->rows[i].n = 0;
+    ed->rows[i].prompt = 0;
+  }
+  ed->nrows = 0;
+  ed->alloc = 1;
+  ed->row = 0;
+  ed->col = -1;
+}
+
+/*
+    @brief bring the screen up to date with the line
+*/
+void noosh_ed_refresh(struct noosh_editor * ed) {
+  struct noosh_ed_row * swap, empty = {0};
+  struct winsize ws;
+  int cols = 80, lines = 24, total, crow = 0, ccol = 0, n, i;
+
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+    cols = ws.ws_col;
+    lines = ws.ws_row > 0 ? ws.ws_row : lines;
+  }
+  if (cols != ed->cols && ed->cols != 0) {
+    // The terminal rewrapped what was drawn: start over on its first row.
+    if (ed->row > 0) {
+      noosh_ed_csi(ed, ed->row, 'A');
+    }
+    noosh_buf_append(&ed->out, "\r\033[J", 4);
+    noosh_ed_forget(ed);
+  }
+  __atomic_add_fetch(&noosh_ed_redraws, 1, __ATOMIC_RELAXED);
+  // Command names are looked up again, for answers that came since.
+  ed->hl.word = (size_t) -1;
+  ed->cols = cols;
+  ed->lines = lines;
+  ed->pw = noosh_prompt_width(ed->prompt);
+  if (ed->pw >= cols) {
+    ed->prompt = "> ";
+    ed->pw = 2;
+  }
+
+  // The window: as many rows as the terminal has, showing the cursor.
+  total = noosh_ed_layout(ed, -1, 0, &crow, &ccol);
+  if (crow < ed->top) {
+    ed->top = crow;
+  } else if (crow >= ed->top + lines) {
+    ed->top = crow - lines + 1;
+  }
+  if (ed->top > 0 && total - ed->top < lines) {
+    ed->top = total > lines ? total - lines : 0;
+  }
+  n = total - ed->top < lines ? total - ed->top : lines;
+  if (n > ed->capnext) {
+    ed->next = noosh_realloc(ed->next, n * sizeof(*ed->next));
+    memset(ed->next + ed->capnext, 0, (n - ed->capnext) * sizeof(*ed->next));
+    ed->capnext = n;
+  }
+  for (i = 0; i < n; i++) {
+    ed->next[i].n = 0;
+    ed->next[i].prompt = ed->top == 0 && i == 0;
+  }
+  noosh_ed_layout(ed, ed->top, n, &crow, &ccol);
+
+  for (i = 0; i < n || i < ed->nrows; i++) {
+    noosh_ed_diff_row(ed, i, i < ed->nrows ? &ed->rows[i] : &empty, i < n ? &ed->next[i] : &empty);
+  }
+  noosh_ed_move(ed, crow - ed->top, ccol);
+
+  // What was drawn becomes the model; the rows below it are blank.
+  swap = ed->rows;
+  ed->rows = ed->next;
+  ed->next = swap;
+  i = ed->caprows;
+  ed->caprows = ed->capnext;
+  ed->capnext = i;
+  ed->nrows = n;
+  noosh_ed_flush(ed);
+}
+
+/*
+    @brief insert text at the cursor
+*/
+void noosh_ed_insert(struct noosh_editor * ed, const char * s, size_t len) {
+  noosh_rope_insert(&ed->text, ed->cursor, s, len);
+  noosh_hl_edit(&ed->hl, ed->cursor, 0, len, noosh_rope_len(&ed->text));
+  ed->cursor += len;
+}
+
+/*
+    @brief delete the text between two positions, leaving the cursor at
+        the first
+*/
+void noosh_ed_delete(struct noosh_editor * ed, size_t from, size_t to) {
+  if (to <= from) {
+    return;
+  }
+  noosh_rope_delete(&ed->text, from, to);
+  noosh_hl_edit(&ed->hl, from, to - from, 0, noosh_rope_len(&ed->text));
+  ed->cursor = from;
+}
+
+/*
+    @brief replace the line with other text, the cursor at its end
+*/
+void noosh_ed_set(struct noosh_editor * ed, const char * s) {
+  noosh_rope_free(&ed->text);
+  noosh_rope_insert(&ed->text, 0, s, strlen(s));
+  noosh_hl_reset(&ed->hl);
+  ed->cursor = strlen(s);
+}
+
+/*
+    @brief go to an older (-1) or newer (1) history entry
+*/
+void noosh_ed_history(struct noosh_editor * ed, int dir) {
+  int to = ed->hist + dir;
+
+  if (to < 0 || to > noosh_history.n) {
+    return;
+  }
+  if (ed->hist == noosh_history.n) {
+    free(ed->saved);
+    ed->saved = noosh_rope_string(&ed->text);
+  }
+  ed->hist = to;
+  noosh_ed_set(ed, to == noosh_history.n ? ed->saved : noosh_history.v[to]);
+}
+
+/*
+    @brief add an entered line to the history
+*/
+void noosh_history_add(const char * line) {
+  if (line[0] == '\0' || (noosh_history.n > 0 && strcmp(noosh_history.v[noosh_history.n - 1], line) == 0)) {
+    return;
+  }
+  if (noosh_history.n == NOOSH_HISTORY_MAX) {
+    free(noosh_history.v[0]);
+    memmove(noosh_history.v, noosh_history.v + 1, --noosh_history.n * sizeof(*noosh_history.v));
+  }
+  noosh_args_push(&noosh_history, noosh_strdup(line));
+}
+
+/*
+    @brief check whether a character ends the word being completed
+*/
+int noosh_ed_word_break(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || strchr(";&|<>()", c) != NULL;
+}
+
+/*
+    @brief add the names in a directory that start with a prefix to the
+        completions, told apart through the stat cache
+    @param dir: the directory
+    @param base: the prefix
+    @param exec: keep only executable files, for commands
+    @param out: the names, a directory's followed by a /
+*/
+void noosh_ed_complete_dir(const char * dir, const char * base, int exec, struct noosh_args * out) {
+  struct noosh_buf path = {0};
+  size_t len = strlen(base);
+  struct dirent * d;
+  struct stat st;
+  char * name;
+  DIR * dp;
+
+  if ((dp = opendir(dir)) == NULL) {
+    return;
+  }
+  while ((d = readdir(dp)) != NULL) {
+    if (strncmp(d->d_name, base, len) != 0 || (d->d_name[0] == '.' && base[0] != '.') ||
+        strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+      continue;
+    }
+    // The path the command search and file tests ask the cache about.
+    path.len = 0;
+    noosh_buf_append(&path, dir, strlen(dir));
+    noosh_buf_append(&path, "/", 1);
+    noosh_buf_append(&path, d->d_name, strlen(d->d_name));
+    if (noosh_stat(path.data, &st, 1) < 0) {
+      continue;
+    }
+    if (exec && (!S_ISREG(st.st_mode) || !(st.st_mode & 0111))) {
+      continue;
+    }
+    name = noosh_malloc(strlen(d->d_name) + 2);
+    sprintf(name, "%s%s", d->d_name, S_ISDIR(st.st_mode) && !exec ? "/" : "");
+    noosh_args_push(out, name);
+  }
+  closedir(dp);
+  free(path.data);
+}
+
+/*
+    @brief compare completions for qsort
+*/
+int noosh_ed_cmp(const void * a, const void * b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+    @brief complete the word before the cursor: a command name in the
+        first word, else a path. A second Tab lists the choices.
+*/
+void noosh_ed_complete(struct noosh_editor * ed) {
+  struct noosh_args found = {0};
+  const char * path, * end;
+  size_t start = ed->cursor, len, common, i;
+  char * word, * slash, * dir;
+  int cmd, j, width = 0, per, k, c = 0;
+
+  for (; start > 0 && !noosh_ed_word_break(noosh_rope_byte(&ed->text, start - 1)); start--);
+  for (i = start; i > 0 && ((c = noosh_rope_byte(&ed->text, i - 1)) == ' ' || c == '\t'); i--);
+  word = noosh_malloc(ed->cursor - start + 1);
+  word[noosh_rope_read(&ed->text, start, word, ed->cursor - start)] = '\0';
+  cmd = (i == 0 || strchr(";&|(\n", c)) && !strchr(word, '/');
+  if (cmd) {
+    for (j = 0; j < noosh_num_builtins(); j++) {
+      if (strncmp(builtin_str[j], word, strlen(word)) == 0) {
+        noosh_args_push(&found, noosh_strdup(builtin_str[j]));
+      }
+    }
+    for (path = noosh_getvar("PATH"); path && *path; path = *end ? end + 1 : end) {
+      end = strchrnul(path, ':');
+      dir = end > path ? noosh_strndup(path, end - path) : noosh_strdup(".");
+      noosh_ed_complete_dir(dir, word, 1, &found);
+      free(dir);
+    }
+  } else {
+    slash = strrchr(word, '/');
+    dir = slash ? noosh_strndup(word, slash - word + (slash == word)) : noosh_strdup(".");
+    noosh_ed_complete_dir(dir, slash ? slash + 1 : word, 0, &found);
+    free(dir);
+  }
+  qsort(found.v, found.n, sizeof(*found.v), noosh_ed_cmp);
+  for (j = k = 0; j < found.n; j++) {
+    // Drop duplicates, from PATH directories that share names.
+    if (k == 0 || strcmp(found.v[k - 1], found.v[j]) != 0) {
+      found.v[k++] = found.v[j];
+    } else {
+      free(found.v[j]);
+    }
+  }
+  found.n = k;
+
+  len = strlen(slash = cmd ? word : strrchr(word, '/') ? strrchr(word, '/') + 1 : word);
+  if (found.n == 1) {
+    noosh_ed_insert(ed, found.v[0] + len, strlen(found.v[0] + len));
+    if (found.v[0][strlen(found.v[0]) - 1] != '/') {
+      noosh_ed_insert(ed, " ", 1);
+    }
+  } else if (found.n > 1) {
+    for (common = strlen(found.v[0]), j = 1; j < found.n; j++) {
+      for (i = 0; i < common && found.v[j][i] == found.v[0][i]; i++);
+      common = i;
+    }
+    if (common > len) {
+      noosh_ed_insert(ed, found.v[0] + len, common - len);
+    } else if (ed->tabs > 0) {
+      // List the choices under the line, then draw it again below them.
+      noosh_ed_attr(ed, NOOSH_HL_PLAIN);
+      noosh_ed_move(ed, ed->nrows > 0 ? ed->nrows - 1 : 0, 0);
+      noosh_buf_append(&ed->out, "\r\n", 2);
+      for (j = 0; j < found.n; j++) {
+        width = (int) strlen(found.v[j]) > width ? (int) strlen(found.v[j]) : width;
+      }
+      per = ed->cols / (width + 2) > 0 ? ed->cols / (width + 2) : 1;
+      for (j = 0; j < found.n; j++) {
+        noosh_buf_append(&ed->out, found.v[j], strlen(found.v[j]));
+        if (j % per == per - 1 || j == found.n - 1) {
+          noosh_buf_append(&ed->out, "\r\n", 2);
+        } else {
+          for (k = strlen(found.v[j]); k < width + 2; k++) {
+            noosh_buf_append(&ed->out, " ", 1);
+          }
+        }
+      }
+      noosh_ed_forget(ed);
+      ed->col = 0;
+    }
+  }
+  noosh_args_free(&found);
+  free(word);
+}
+
+/*
+    @brief get the next byte of input, reading more when there is none
+    @param ed: editor, refreshed before waiting for keys
+    @param wait: milliseconds to wait at most, -1 for ever
+    @return the byte, -1 at end of input or when wait ran out
+*/
+int noosh_ed_getc(struct noosh_editor * ed, int wait) {
+  struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {-1, POLLIN, 0}};
+  ssize_t n;
+
+  while (noosh_ed_inpos == noosh_ed_inlen) {
+    if (wait < 0 && ed) {
+      noosh_ed_refresh(ed);
+      // Keys, or command lookups that finished: their names change color.
+      // The refresh may have started the lookup thread, and its pipe.
+      pfd[1].fd = noosh_hl_wake[0];
+      if (poll(pfd, 2, -1) < 0) {
+        continue;
+      }
+      if (pfd[1].revents & POLLIN) {
+        noosh_hl_woken();
+      }
+      if (pfd[0].revents == 0) {
+        continue;
+      }
+    }
+    if (wait >= 0 && poll(pfd, 1, wait) <= 0) {
+      return -1;
+    }
+    if ((n = read(STDIN_FILENO, noosh_ed_in, sizeof(noosh_ed_in))) < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    noosh_ed_inpos = 0;
+    noosh_ed_inlen = n;
+  }
+  return (unsigned char) noosh_ed_in[noosh_ed_inpos++];
+}
+
+/*
+  keys the editor knows by more than their byte
+*/
+enum noosh_key {
+  NOOSH_KEY_NONE = 256,
+  NOOSH_KEY_UP,
+  NOOSH_KEY_DOWN,
+  NOOSH_KEY_LEFT,
+  NOOSH_KEY_RIGHT,
+  NOOSH_KEY_HOME,
+  NOOSH_KEY_END,
+  NOOSH_KEY_DELETE,
+  NOOSH_KEY_WORD_LEFT,
+  NOOSH_KEY_WORD_RIGHT,
+  NOOSH_KEY_WORD_RUBOUT,
+  NOOSH_KEY_PASTE
+};
+
+/*
+    @brief read the rest of a key that starts with ESC
+    @return the key, NOOSH_KEY_NONE for one the editor does not know
+*/
+int noosh_ed_escape(struct noosh_editor * ed) {
+  int c = noosh_ed_getc(ed, 50), arg = 0;
+
+  if (c == 'b' || c == 'f') {
+    return c == 'b' ? NOOSH_KEY_WORD_LEFT : NOOSH_KEY_WORD_RIGHT;
+  }
+  if (c == 127 || c == 8) {
+    return NOOSH_KEY_WORD_RUBOUT;
+  }
+  if (c != '[' && c != 'O') {
+    return NOOSH_KEY_NONE;
+  }
+  while ((c = noosh_ed_getc(ed, 50)) >= 0 && (isdigit(c) || c == ';')) {
+    arg = c == ';' ? 0 : arg * 10 + c - '0';
+  }
+  switch (c) {
+  case 'A':
+    return NOOSH_KEY_UP;
+  case 'B':
+    return NOOSH_KEY_DOWN;
+  case 'C':
+    return arg == 5 || arg == 3 ? NOOSH_KEY_WORD_RIGHT : NOOSH_KEY_RIGHT;
+  case 'D':
+    return arg == 5 || arg == 3 ? NOOSH_KEY_WORD_LEFT : NOOSH_KEY_LEFT;
+  case 'H':
+    return NOOSH_KEY_HOME;
+  case 'F':
+    return NOOSH_KEY_END;
+  case '~':
+    return arg == 1 || arg == 7 ? NOOSH_KEY_HOME : arg == 4 || arg == 8 ? NOOSH_KEY_END :
+           arg == 3 ? NOOSH_KEY_DELETE : arg == 200 ? NOOSH_KEY_PASTE : NOOSH_KEY_NONE;
+  }
+  return NOOSH_KEY_NONE;
+}
+
+/*
+    @brief take in a bracketed paste: all the terminal sends up to the
+        end mark goes into the line as it is, newlines included, and at
+        once, so the line is drawn again only after it
+*/
+void noosh_ed_paste(struct noosh_editor * ed) {
+  struct noosh_buf text = {0};
+  size_t from, i, j;
+  char * end;
+
+  __atomic_add_fetch(&noosh_ed_pastes, 1, __ATOMIC_RELAXED);
+  while (noosh_ed_getc(NULL, -1) >= 0) {
+    // Take all that was read; the end mark may be cut between reads.
+    noosh_ed_inpos--;
+    from = text.len > 5 ? text.len - 5 : 0;
+    noosh_buf_append(&text, noosh_ed_in + noosh_ed_inpos, noosh_ed_inlen - noosh_ed_inpos);
+    noosh_ed_inpos = noosh_ed_inlen;
+    if ((end = memmem(text.data + from, text.len - from, "\033[201~", 6)) != NULL) {
+      // What comes after it was typed after the paste.
+      noosh_ed_inpos -= text.len - (end - text.data) - 6;
+      text.len = end - text.data;
+      break;
+    }
+  }
+  // Terminals send the newlines of a paste as returns.
+  for (i = j = 0; i < text.len; i++) {
+    if (text.data[i] == '\r') {
+      text.data[j++] = '\n';
+      i += i + 1 < text.len && text.data[i + 1] == '\n';
+    } else {
+      text.data[j++] = text.data[i];
+    }
+  }
+  if (j > 0) {
+    noosh_ed_insert(ed, text.data, j);
+  }
+  free(text.data);
+}
+
+/*
+    @brief find the start of the word before a position, or the end of
+        the one after it
+*/
+size_t noosh_ed_word(const struct noosh_editor * ed, size_t pos, int dir) {
+  int in = 0, c;
+
+  // Skip what is not a word, then the word.
+  if (dir < 0) {
+    for (; pos > 0; pos--) {
+      c = noosh_rope_byte(&ed->text, pos - 1);
+      if (isalnum(c) || c & 0x80) {
+        in = 1;
+      } else if (in) {
+        break;
+      }
+    }
+  } else {
+    for (; (c = noosh_rope_byte(&ed->text, pos)) >= 0; pos++) {
+      if (isalnum(c) || c & 0x80) {
+        in = 1;
+      } else if (in) {
+        break;
+      }
+    }
+  }
+  return pos;
+}
+
+/*
+    @brief leave the line: move below it and give the terminal back
+*/
+void noosh_ed_finish(struct noosh_editor * ed, const char * mark) {
+  ed->cursor = noosh_rope_len(&ed->text);
+  noosh_ed_refresh(ed);
+  noosh_ed_attr(ed, NOOSH_HL_PLAIN);
+  noosh_buf_append(&ed->out, mark, strlen(mark));
+  noosh_buf_append(&ed->out, "\r\n", 2);
+  noosh_ed_flush(ed);
+}
+
+/*
+    @brief read a line with the editor
+    @param prompt: the prompt
+    @return the line, allocated, NULL at end of input
+*/
+char * noosh_edit_line(const char * prompt) {
+  struct noosh_editor ed;
+  struct termios raw;
+  char * line = NULL;
+  int c, done = 0, i, tab;
+
+  memset(&ed, 0, sizeof(ed));
+  ed.prompt = prompt;
+  ed.hist = noosh_history.n;
+  ed.alloc = 1;
+  ed.col = -1;
+  ed.hl.word = (size_t) -1;
+  ed.hl.known = (size_t) -1;
+  if (tcgetattr(STDIN_FILENO, &noosh_ed_cooked) < 0) {
+    return NULL;
+  }
+  raw = noosh_ed_cooked;
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  raw.c_oflag &= ~OPOST;
+  raw.c_cflag |= CS8;
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+  // Have pastes bracketed, while the line is edited only.
+  noosh_buf_append(&ed.out, "\033[?2004h", 8);
+
+  while (!done) {
+    c = noosh_ed_getc(&ed, -1);
+    __atomic_add_fetch(&noosh_ed_keys, 1, __ATOMIC_RELAXED);
+    tab = 0;
+    if (c == 27) {
+      c = noosh_ed_escape(&ed);
+    }
+    switch (c) {
+    case -1:
+      // End of input: the line so far, or nothing if it is empty.
+      done = 1;
+      if (noosh_rope_len(&ed.text) > 0) {
+        noosh_ed_finish(&ed, "");
+        line = noosh_rope_string(&ed.text);
+      }
+      break;
+    case '\r':
+    case '\n':
+      noosh_ed_finish(&ed, "");
+      line = noosh_rope_string(&ed.text);
+      noosh_history_add(line);
+      done = 1;
+      break;
+    case 3:
+      noosh_ed_finish(&ed, "^C");
+      line = noosh_strdup("");
+      noosh_ed_cancelled = 1;
+      done = 1;
+      break;
+    case 4:
+      if (noosh_rope_len(&ed.text) == 0) {
+        done = 1;
+        break;
+      }
+      noosh_ed_delete(&ed, ed.cursor, noosh_ed_next(&ed, ed.cursor));
+      break;
+    case NOOSH_KEY_DELETE:
+      noosh_ed_delete(&ed, ed.cursor, noosh_ed_next(&ed, ed.cursor));
+      break;
+    case 127:
+    case 8:
+      noosh_ed_delete(&ed, noosh_ed_prev(&ed, ed.cursor), ed.cursor);
+      break;
+    case 1:
+    case NOOSH_KEY_HOME:
+      ed.cursor = 0;
+      break;
+    case 5:
+    case NOOSH_KEY_END:
+      ed.cursor = noosh_rope_len(&ed.text);
+      break;
+    case 2:
+    case NOOSH_KEY_LEFT:
+      ed.cursor = noosh_ed_prev(&ed, ed.cursor);
+      break;
+    case 6:
+    case NOOSH_KEY_RIGHT:
+      ed.cursor = noosh_ed_next(&ed, ed.cursor);
+      break;
+    case NOOSH_KEY_WORD_LEFT:
+      ed.cursor = noosh_ed_word(&ed, ed.cursor, -1);
+      break;
+    case NOOSH_KEY_WORD_RIGHT:
+      ed.cursor = noosh_ed_word(&ed, ed.cursor, 1);
+      break;
+    case 23:
+    case NOOSH_KEY_WORD_RUBOUT:
+      noosh_ed_delete(&ed, noosh_ed_word(&ed, ed.cursor, -1), ed.cursor);
+      break;
+    case 11:
+      noosh_ed_delete(&ed, ed.cursor, noosh_rope_len(&ed.text));
+      break;
+    case 21:
+      noosh_ed_delete(&ed, 0, ed.cursor);
+      break;
+    case 12:
+      noosh_buf_append(&ed.out, "\033[H\033[2J", 7);
+      noosh_ed_forget(&ed);
+      ed.col = 0;
+      break;
+    case 16:
+    case NOOSH_KEY_UP:
+      noosh_ed_history(&ed, -1);
+      break;
+    case 14:
+    case NOOSH_KEY_DOWN:
+      noosh_ed_history(&ed, 1);
+      break;
+    case 9:
+      noosh_ed_complete(&ed);
+      tab = 1;
+      break;
+    case NOOSH_KEY_PASTE:
+      noosh_ed_paste(&ed);
+      break;
+    default:
+      if (c < 32 || c >= NOOSH_KEY_NONE) {
+        break;
+      }
+      // The key and any others typed ahead go in together.
+      for (i = noosh_ed_inpos; i < (int) noosh_ed_inlen && (unsigned char) noosh_ed_in[i] >= 32 &&
+                              noosh_ed_in[i] != 127; i++);
+      noosh_ed_insert(&ed, noosh_ed_in + noosh_ed_inpos - 1, i - noosh_ed_inpos + 1);
+      noosh_ed_inpos = i;
+    }
+    ed.tabs = tab ? ed.tabs + 1 : 0;
+  }
+
+  noosh_buf_append(&ed.out, "\033[?2004l", 8);
+  noosh_ed_flush(&ed);
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &noosh_ed_cooked);
+  for (i = 0; i < ed.caprows; i++) {
+    free(ed.rows[i].cells);
+  }
+  for (i = 0; i < ed.capnext; i++) {
+    free(ed.next[i].cells);
+  }
+  free(ed.rows);
+  free(ed.next);
+  free(ed.out.data);
+  noosh_rope_free(&ed.text);
+  free(ed.index.v);
+  free(ed.span.data);
+  free(ed.hl.v);
+  free(ed.saved);
+  return line;
+}
+
+/*
+    @brief print the editor counters, for stats
+    @param out: descriptor to print to
+    @param reset: zero them after
+*/
+void noosh_ed_stats(int out, int reset) {
+  dprintf(out, "editor keys %lu redraws %lu bytes %lu pastes %lu\n", __atomic_load_n(&noosh_ed_keys, __ATOMIC_RELAXED),
+          __atomic_load_n(&noosh_ed_redraws, __ATOMIC_RELAXED), __atomic_load_n(&noosh_ed_bytes, __ATOMIC_RELAXED),
+          __atomic_load_n(&noosh_ed_pastes, __ATOMIC_RELAXED));
+  if (reset) {
+    __atomic_store_n(&noosh_ed_keys, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&noosh_ed_redraws, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&noosh_ed_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&noosh_ed_pastes, 0, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+    @brief read a line of input from stdin, with the line editor when
+        it and stdout are a terminal
+        input is never consumed past the newline, so commands run from
+        a script on stdin see the rest of the script
+    @param prompt: prompt to show first, NULL for none
+    @return the line from stdin, NULL at end of input
+*/
+char * noosh_read_line(const char * prompt) {
+  struct noosh_buf line = {0};
+  const char * term = getenv("TERM");
+
+  fflush(stdout);
+  if (prompt && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) && !(term && strcmp(term, "dumb") == 0)) {
+    return noosh_edit_line(prompt);
+  }
+  if (prompt) {
+    dprintf(STDOUT_FILENO, "%s", prompt);
+  }
+  if (noosh_read_record(0, '\n', &line) <= 0) {
+    free(line.data);
+    return NULL;
+  }
+  return line.data;
+}
+
+
+/*
+  Execution
+
+  The syntax tree is walked in the shell process: lists, and-or lists,
+  conditionals, loops, case and groups never fork. Only external
+  commands, ( subshells ), command substitutions and compound commands
+  in the middle of a pipeline run in a child.
+*/
+
+int noosh_execute(struct noosh_node * n);
+int noosh_run_string(const char * src, size_t len);
+
+/*
+    @brief open the redirections of a node into a descriptor table
+    @param n: the node
+    @param io: table to update
+    @return 0 on success, -1 if a redirection failed
+*/
+int noosh_apply_redirs(struct noosh_node * n, struct noosh_io * io) {
+  char ** list = noosh_malloc((2 * n->nredirs + 1) * sizeof(*list));
+  char ** targets = noosh_malloc((n->nredirs + 1) * sizeof(*targets));
+  int i, r = 0;
+
+  for (i = 0; i < n->nredirs; i++) {
+    targets[i] = noosh_expand_string(&n->redirs[i].target, 0);
+    if (targets[i] == NULL) {
+      r = -1;
+      break;
+    }
+    list[2 * i] = n->redirs[i].op;
+    list[2 * i + 1] = targets[i];
+  }
+  if (r == 0) {
+    list[2 * n->nredirs] = NULL;
+    r = noosh_redirect(list, io);
+  }
+  while (i-- > 0) {
+    free(targets[i]);
+  }
+  free(targets);
+  free(list);
+  return r;
+}
+
+/*
+    @brief assign an array list to a variable, name=(...) or name+=(...);
+        the variable stays associative if it is, and is made an indexed
+        array otherwise
+    @param v: the cell
+    @param s: the text inside the parentheses
+    @param len: its length
+    @param append: add to the elements rather than replace them
+    @return 0, -1 after printing an error
+*/
+int noosh_assign_compound(struct noosh_var * v, const char * s, size_t len, int append) {
+  struct noosh_args keys = {0}, values = {0};
+  int i, r = 0;
+
+  if (noosh_compound_elems(s, len, &keys, &values) < 0 ||
+      noosh_var_reset_array(v, v->assoc != NULL, !append) < 0) {
+    r = -1;
+  }
+  for (i = 0; r == 0 && i < values.n; i++) {
+    if (keys.v[i]) {
+      r = noosh_var_set_elem(v, keys.v[i], strlen(keys.v[i]), values.v[i]);
+    } else {
+      r = noosh_var_push(v, values.v[i]);
+    }
+  }
+  noosh_args_free(&keys);
+  noosh_args_free(&values);
+  return r;
+}
+
+/*
+    @brief perform an assignment word in the current shell: NAME=value,
+        NAME+=value, NAME[key]=value, NAME[key]+=value, NAME=(...) or
+        NAME+=(...); += adds to an integer variable and appends otherwise
+    @param w: the word
+    @return 0, -1 after printing an error
+*/
+int noosh_assign_word(const struct noosh_word * w) {
+  struct noosh_assign_parts p;
+  struct noosh_word part;
+  struct noosh_var * v;
+  const char * old = NULL;
+  char * name, * key = NULL, * value, * joined = NULL, tmp[24];
+  long long a, b;
+  int r = -1;
+
+  noosh_split_assignment(w->s, w->len, &p);
+  name = noosh_strndup(w->s, p.name_len);
+  v = noosh_var_cell(name);
+  free(name);
+  if (p.compound) {
+    return noosh_assign_compound(v, p.value, p.value_len, p.append);
+  }
+  part = (struct noosh_word) {(char *) p.value, p.value_len, w->flags & (NOOSH_W_QUOTED | NOOSH_W_EXPAND | NOOSH_W_TILDE)};
+  if ((value = noosh_expand_string(&part, NOOSH_X_ASSIGN)) == NULL) {
+    return -1;
+  }
+  if (p.key) {
+    part = (struct noosh_word) {(char *) p.key, p.key_len, NOOSH_W_QUOTED | NOOSH_W_EXPAND};
+    if ((key = noosh_expand_string(&part, 0)) == NULL ||
+        (p.append && noosh_var_get_elem(v, key, strlen(key), &old) < 0)) {
+      goto done;
+    }
+  } else if (p.append) {
+    old = noosh_var_value(v);
+  }
+  if (p.append && (v->attrs & NOOSH_VAR_INTEGER)) {
+    if ((old && noosh_arith_string(old, &a) < 0) || noosh_arith_string(value, &b) < 0) {
+      goto done;
+    }
+    sprintf(tmp, "%lld", (old ? a : 0) + b);
+    old = NULL;
+    free(value);
+    value = noosh_strdup(tmp);
+  }
+  if (old) {
+    joined = noosh_malloc(strlen(old) + strlen(value) + 1);
+    sprintf(joined, "%s%s", old, value);
+  }
+  if (key) {
+    r = noosh_var_set_elem(v, key, strlen(key), joined ? joined : value);
+  } else {
+    r = noosh_var_set(v, joined ? joined : value);
+  }
+
+done:
+  free(key);
+  free(value);
+  free(joined);
+  return r;
+}
+
+/*
+    @brief perform an assignment operand of declare, which is already
+        expanded: only a list, name=(...), is taken apart
+    @param s: the operand
+    @return 0, -1 after printing an error
+*/
+int noosh_assign_text(const char * s) {
+  struct noosh_word w = {(char *) s, strlen(s), 0};
+
+  return noosh_assign_word(&w);
+}
+
+/*
+    @brief expand the assignments of a simple command into NAME=value;
+        only plain ones can precede a command
+    @param n: the command
+    @param out: receives the assignments
+    @return 0 on success, -1 after printing an error
+*/
+int noosh_expand_assigns(struct noosh_node * n, struct noosh_args * out) {
+  struct noosh_word value;
+  char * name, * v;
+  size_t len;
+  int i;
+
+  for (i = 0; i < n->nassigns; i++) {
+    if (!noosh_is_plain_assignment(&n->assigns[i])) {
+      if (n->nwords == 0) {
+        continue;
+      }
+      dprintf(NOOSH_FD(2), "noosh: %.*s: not allowed before a command\n", (int) n->assigns[i].len, n->assigns[i].s);
+      return -1;
+    }
+    name = n->assigns[i].s;
+    len = strchr(name, '=') - name;
+    value.s = name + len + 1;
+    value.len = n->assigns[i].len - len - 1;
+    value.flags = n->assigns[i].flags & (NOOSH_W_QUOTED | NOOSH_W_EXPAND | NOOSH_W_TILDE);
+    if ((v = noosh_expand_string(&value, NOOSH_X_ASSIGN)) == NULL) {
+      return -1;
+    }
+    noosh_args_push(out, noosh_malloc(len + strlen(v) + 2));
+    sprintf(out->v[out->n - 1], "%.*s=%s", (int) len, name, v);
+    free(v);
+  }
+  return 0;
+}
+
+/*
+    @brief set NAME=value assignments as shell variables
+    @param assigns: the assignments
+    @param saved: if not NULL, receives the previous values (NAME=value,
+        or NAME alone if unset) so they can be restored
+    @return 0, -1 if a variable could not be set
+*/
+int noosh_assign(struct noosh_args * assigns, struct noosh_args * saved) {
+  const char * old;
+  char * eq;
+  int i, r = 0;
+
+  for (i = 0; i < assigns->n; i++) {
+    eq = strchr(assigns->v[i], '=');
+    *eq = '\0';
+    if (saved) {
+      old = noosh_getvar(assigns->v[i]);
+      noosh_args_push(saved, noosh_malloc(strlen(assigns->v[i]) + (old ? strlen(old) : 0) + 2));
+      sprintf(saved->v[saved->n - 1], old ? "%s=%s" : "%s", assigns->v[i], old ? old : "");
+    }
+    if (noosh_setvar(assigns->v[i], eq + 1) < 0) {
+      r = -1;
+    }
+    *eq = '=';
+  }
+  return r;
+}
+
+/*
+    @brief put back variables saved by noosh_assign
+*/
+void noosh_unassign(struct noosh_args * saved) {
+  char * eq;
+  int i;
+
+  for (i = saved->n - 1; i >= 0; i--) {
+    if ((eq = strchr(saved->v[i], '=')) != NULL) {
+      *eq = '\0';
+      noosh_setvar(saved->v[i], eq + 1);
+    } else {
+      noosh_unsetvar(saved->v[i]);
+    }
+  }
+}
+
+/*
+  shell function
+    text is the source of the body, parsed on the first call into the
+    function's own arena so that the definition outlives the command that
+    made it and unused functions cost no parsing; code is the body
+    compiled to bytecode on the first call
+    refs counts calls in progress: a function redefined while it runs is
+    only freed when the last of them returns
+*/
+struct noosh_func {
+  char * name;
+  char * text;
+  struct noosh_arena arena;
+  struct noosh_node * body;
+  struct noosh_code * code;
+  int refs;
+  int dead;
+  struct noosh_func * next;
+};
+
+# define NOOSH_FUNC_BUCKETS 256
+
+struct noosh_func * noosh_funcs[NOOSH_FUNC_BUCKETS];
+int noosh_nfuncs = 0;
+
+/*
+  definition replaced by an in-process subshell, NULL if the name had
+  none, put back when it ends
+*/
+struct noosh_func_saved {
+  char * name;
+  struct noosh_func * func;
+};
+
+struct noosh_func_saved * noosh_cow_funcs = NULL;
+size_t noosh_ncow_funcs = 0;
+
+struct noosh_code * noosh_compile(struct noosh_node * n, const char * src);
+void noosh_code_free(struct noosh_code * code);
+int noosh_vm_run(struct noosh_code * code);
+char * noosh_autoload_text(const char * name);
+
+/*
+    @brief look up a function
+    @param name: function name
+    @return the function, NULL if there is none
+*/
+struct noosh_func * noosh_find_func(const char * name) {
+  struct noosh_func * f;
+
+  if (noosh_nfuncs == 0) {
+    return NULL;
+  }
+  f = noosh_funcs[noosh_hash(name, strlen(name)) % NOOSH_FUNC_BUCKETS];
+  while (f && strcmp(f->name, name) != 0) {
+    f = f->next;
+  }
+  return f;
+}
+
+/*
+    @brief free a function
+*/
+void noosh_func_free(struct noosh_func * f) {
+  noosh_arena_free(&f->arena);
+  noosh_code_free(f->code);
+  free(f->name);
+  free(f->text);
+  free(f);
+}
+
+/*
+    @brief define (or redefine) a function
+    @param name: function name
+    @param text: source of its body, a compound command, or NULL for a
+        function autoloaded from NOOSHFPATH when first called
+    @return 0
+*/
+int noosh_define_func(const char * name, const char * text) {
+  struct noosh_func ** link = &noosh_funcs[noosh_hash(name, strlen(name)) % NOOSH_FUNC_BUCKETS];
+  struct noosh_func * f, * old;
+
+  if (noosh_stage_isolated) {
+    // The function table belongs to the shell's own thread.
+    return 0;
+  }
+  f = noosh_malloc(sizeof(*f));
+  memset(f, 0, sizeof(*f));
+  f->text = text ? noosh_strdup(text) : NULL;
+  f->name = noosh_strdup(name);
+
+  while (*link && strcmp((*link)->name, name) != 0) {
+    link = &(*link)->next;
+  }
+  if ((old = *link) != NULL) {
+    f->next = old->next;
+  } else {
+    noosh_nfuncs++;
+  }
+  *link = f;
+  if (noosh_cow_level > 0) {
+    // An in-process subshell: the old definition comes back after it.
+    if ((noosh_ncow_funcs & (noosh_ncow_funcs - 1)) == 0) {
+      noosh_cow_funcs = noosh_realloc(noosh_cow_funcs, (noosh_ncow_funcs ? 2 * noosh_ncow_funcs : 1) *
+                                      sizeof(*noosh_cow_funcs));
+    }
+    noosh_cow_funcs[noosh_ncow_funcs++] = (struct noosh_func_saved) {noosh_strdup(name), old};
+  } else if (old && old->refs > 0) {
+    old->dead = 1;
+  } else if (old) {
+    noosh_func_free(old);
+  }
+  return 0;
+}
+
+/*
+    @brief put back the functions an in-process subshell defined over
+    @param n: length of noosh_cow_funcs when it started
+*/
+void noosh_func_rollback(size_t n) {
+  struct noosh_func_saved * s;
+  struct noosh_func ** link, * cur;
+
+  while (noosh_ncow_funcs > n) {
+    s = &noosh_cow_funcs[--noosh_ncow_funcs];
+    link = &noosh_funcs[noosh_hash(s->name, strlen(s->name)) % NOOSH_FUNC_BUCKETS];
+    while (strcmp((*link)->name, s->name) != 0) {
+      link = &(*link)->next;
+    }
+    cur = *link;
+    if (s->func) {
+      s->func->next = cur->next;
+      *link = s->func;
+    } else {
+      *link = cur->next;
+      noosh_nfuncs--;
+    }
+    if (cur->refs > 0) {
+      cur->dead = 1;
+    } else {
+      noosh_func_free(cur);
+    }
+    free(s->name);
+  }
+}
+
+/*
+    @brief call a function
+    @param f: the function
+    @param argv: name and arguments, which become the positional
+        parameters during the call
+    @return its exit status
+*/
+int noosh_call_func(struct noosh_func * f, char ** argv) {
+  char ** params = noosh_params;
+  int nparams = noosh_nparams, loops = noosh_loop_depth;
+  struct noosh_parser ps;
+
+  if (f->text == NULL && (f->text = noosh_autoload_text(f->name)) == NULL) {
+    return noosh_last_status = 1;
+  }
+  if (f->body == NULL) {
+    noosh_parser_init(&ps, f->text, strlen(f->text), 0, &f->arena);
+    if (noosh_parse(&ps, &f->body) != NOOSH_PARSE_OK || f->body == NULL) {
+      dprintf(NOOSH_FD(2), "noosh: %s: syntax error: %s\n", f->name, ps.error ? ps.error : "empty body");
+      f->body = NULL;
+      return noosh_last_status = 2;
+    }
+  }
+
+  for (noosh_nparams = 0; argv[noosh_nparams + 1]; noosh_nparams++);
+  noosh_params = argv + 1;
+  // The caller's loops cannot be left with a break inside the function.
+  noosh_loop_depth = 0;
+  noosh_func_depth++;
+  f->refs++;
+  if (noosh_opt_bytecode) {
+    if (f->code == NULL) {
+      f->code = noosh_compile(f->body, f->text);
+    }
+    noosh_vm_run(f->code);
+  } else {
+    noosh_execute(f->body);
+  }
+  if (--f->refs == 0 && f->dead) {
+    noosh_func_free(f);
+  }
+  noosh_returning = 0;
+  noosh_var_unwind(noosh_func_depth);
+  noosh_func_depth--;
+  noosh_loop_depth = loops;
+  noosh_params = params;
+  noosh_nparams = nparams;
+  return noosh_last_status;
+}
+
+/*
+    @brief run a simple command
+    @param n: the command
+    @return its exit status
+*/
+int noosh_run_simple(struct noosh_node * n) {
+  struct noosh_args argv = {0}, assigns = {0}, saved = {0};
+  struct noosh_io io, * saved_io = noosh_cur_io;
+  unsigned long substs = noosh_substs;
+  struct noosh_func * f;
+  int status = 0, i;
+
+  if (noosh_expand_words(n->words, n->nwords, &argv) < 0 ||
+      (n->nwords > 0 && noosh_expand_assigns(n, &assigns) < 0)) {
+    noosh_args_free(&argv);
+    noosh_args_free(&assigns);
+    return 1;
+  }
+  if (n->nredirs > 0) {
+    noosh_io_init(&io);
+    if (noosh_apply_redirs(n, &io) < 0) {
+      status = 1;
+      goto done;
+    }
+    noosh_cur_io = &io;
+  }
+
+  if (n->nwords == 0) {
+    // Only assignments and redirections, done in order: the status is
+    // that of the last command substitution, if any.
+    for (i = 0; i < n->nassigns && status == 0; i++) {
+      status = noosh_assign_word(&n->assigns[i]) < 0;
+    }
+    if (status == 0) {
+      status = substs != noosh_substs ? noosh_last_status : 0;
+    }
+  } else if (argv.n == 0) {
+    // The words expanded to nothing: the assignments still take effect.
+    if (noosh_assign(&assigns, NULL) < 0) {
+      status = 1;
+    } else {
+      status = substs != noosh_substs ? noosh_last_status : 0;
+    }
+  } else if ((f = noosh_find_func(argv.v[0])) != NULL) {
+    status = noosh_assign(&assigns, &saved) < 0 ? 1 : noosh_call_func(f, argv.v);
+    noosh_unassign(&saved);
+  } else if ((i = noosh_find_builtin(argv.v[0])) >= 0) {
+    status = noosh_assign(&assigns, &saved) < 0 ? 1 : ( * builtin_func[i])(argv.v);
+    noosh_unassign(&saved);
+  } else {
+    pid_t pid = noosh_spawn(argv.v, assigns.v, noosh_cur_io);
+    status = pid > 0 ? noosh_wait(pid) : 1;
+  }
+
+done:
+  if (n->nredirs > 0) {
+    noosh_cur_io = saved_io;
+    noosh_io_close(&io);
+    noosh_io_wait(&io);
+  }
+  noosh_args_free(&argv);
+  noosh_args_free(&assigns);
+  noosh_args_free(&saved);
+  return status;
+}
+
+/*
+    @brief run the body of a loop once, settling break and continue
+    @param body: the loop body
+    @param status: updated with the body's status
+    @return 1 if the loop goes on, 0 if it must stop
+*/
+int noosh_loop_body(struct noosh_node * body, int * status) {
+  *status = noosh_execute(body);
+  if (noosh_breaking) {
+    noosh_breaking--;
+    return 0;
+  }
+  if (noosh_continuing && --noosh_continuing > 0) {
+    // continue n: this loop is left, an outer one continues.
+    return 0;
+  }
+  return !noosh_exit_pending && !noosh_returning;
+}
+
+/*
+  Loop values
+
+  A for loop takes its values one at a time from a list of sources, so
+  the body runs while they are still being produced. Words are expanded
+  into lists when the loop starts, except three kinds that could be
+  huge: a brace range such as {1..10000000}, $(seq ...) with plain
+  numbers, and a glob with no other expansion. Those are counted or
+  read as the loop goes and never stored.
+*/
+
+enum noosh_source_type {
+  NOOSH_SRC_LIST,
+  NOOSH_SRC_RANGE,
+  NOOSH_SRC_SEQ,
+  NOOSH_SRC_GLOB
+};
+
+/*
+  source of loop values
+    LIST: values, next is the one to take
+    RANGE, SEQ: range, each value between prefix and suffix
+    GLOB: glob, or the pattern itself in text when it matches nothing
+*/
+struct noosh_source {
+  enum noosh_source_type type;
+  struct noosh_args values;
+  int next;
+  struct noosh_range range;
+  char * prefix;
+  char * suffix;
+  struct noosh_glob_iter * glob;
+  char * text;
+};
+
+/*
+  values of a for loop
+    sources are taken in turn from cur; value holds the last value made
+*/
+struct noosh_iter {
+  struct noosh_source * sources;
+  int n;
+  int cur;
+  struct noosh_buf value;
+};
+
+/*
+    @brief parse $(seq [first [step]] last) with integer arguments
+    @param s: text of the word
+    @param len: its length
+    @param r: the range it counts
+    @return 1 if it is one, 0 if not
+*/
+int noosh_seq_parse(const char * s, size_t len, struct noosh_range * r) {
+  long long arg[3];
+  char * text, * p, * end;
+  int n = 0;
+
+  if (len < 8 || strncmp(s, "$(seq ", 6) != 0 || s[len - 1] != ')') {
+    return 0;
+  }
+  text = noosh_strndup(s + 6, len - 7);
+  for (p = text; *p; p = end) {
+    p += strspn(p, " \t");
+    if (*p == '\0') {
+      break;
+    }
+    arg[n] = strtoll(p, &end, 10);
+    if (n == 3 || !isdigit((unsigned char) p[*p == '-']) || (*end && *end != ' ' && *end != '\t')) {
+      free(text);
+      return 0;
+    }
+    n++;
+  }
+  free(text);
+  if (n == 0 || (n == 3 && arg[1] == 0)) {
+    return 0;
+  }
+  *r = (struct noosh_range) {n == 1 ? 1 : arg[0], arg[n - 1], n == 3 ? arg[1] : 1, 0, 0, 0};
+  return 1;
+}
+
+/*
+    @brief check whether a word is one a loop can take lazily
+    @param w: the word
+    @param src: gets its source if it is one, NULL to only check
+    @return 1 if it is, 0 if it has to be expanded
+*/
+int noosh_lazy_parse(const struct noosh_word * w, struct noosh_source * src) {
+  struct noosh_range r;
+  const char * open, * close;
+  int type;
+
+  if (w->flags == NOOSH_W_GLOB && !memchr(w->s, '\\', w->len)) {
+    type = NOOSH_SRC_GLOB;
+  } else if (w->flags == NOOSH_W_EXPAND && noosh_seq_parse(w->s, w->len, &r)) {
+    type = NOOSH_SRC_SEQ;
+    open = close = w->s + w->len;
+  } else if (w->flags == NOOSH_W_BRACE && (open = memchr(w->s, '{', w->len)) != NULL &&
+             (close = memchr(open, '}', w->s + w->len - open)) != NULL &&
+             strcspn(close + 1, "{},") == (size_t) (w->s + w->len - close - 1) &&
+             strcspn(w->s, "},") >= (size_t) (open - w->s) &&
+             noosh_range_parse(open + 1, close - open - 1, &r)) {
+    type = NOOSH_SRC_RANGE;
+  } else {
+    return 0;
+  }
+  if (src) {
+    memset(src, 0, sizeof(*src));
+    src->type = type;
+    if (type == NOOSH_SRC_GLOB) {
+      src->text = noosh_strndup(w->s, w->len);
+      src->glob = noosh_glob_iter_new(src->text);
+    } else {
+      src->range = r;
+      src->prefix = noosh_strndup(w->s, type == NOOSH_SRC_SEQ ? 0 : open - w->s);
+      src->suffix = noosh_strdup(type == NOOSH_SRC_SEQ ? "" : close + 1);
+    }
+  }
+  return 1;
+}
+
+/*
+    @brief check that a lazy source gives what expanding its word would
+        now: seq is the command, IFS splits its output at newlines only,
+        and globs are on
+*/
+int noosh_lazy_usable(const struct noosh_word * w) {
+  const char * ifs;
+
+  if (w->flags == NOOSH_W_GLOB) {
+    return !noosh_opt_noglob;
+  }
+  if (w->flags == NOOSH_W_EXPAND) {
+    ifs = noosh_getvar("IFS");
+    return noosh_find_func("seq") == NULL && (ifs == NULL || (strchr(ifs, '\n') && !strpbrk(ifs, "-0123456789")));
+  }
+  return 1;
+}
+
+/*
+    @brief add an empty list source to a loop
+*/
+struct noosh_source * noosh_iter_add(struct noosh_iter * it) {
+  struct noosh_source * src;
+
+  if ((it->n & (it->n - 1)) == 0) {
+    it->sources = noosh_realloc(it->sources, (it->n ? 2 * it->n : 1) * sizeof(*it->sources));
+  }
+  src = &it->sources[it->n++];
+  memset(src, 0, sizeof(*src));
+  src->type = NOOSH_SRC_LIST;
+  return src;
+}
+
+/*
+    @brief get the last source of a loop if it is a list, else add one
+*/
+struct noosh_source * noosh_iter_list(struct noosh_iter * it) {
+  if (it->n > 0 && it->sources[it->n - 1].type == NOOSH_SRC_LIST) {
+    return &it->sources[it->n - 1];
+  }
+  return noosh_iter_add(it);
+}
+
+/*
+    @brief add values to a loop
+    @param it: the loop
+    @param v: the values, copied
+    @param n: their number
+*/
+void noosh_iter_add_values(struct noosh_iter * it, char * const * v, int n) {
+  struct noosh_source * src;
+  int i;
+
+  if (n == 0) {
+    return;
+  }
+  src = noosh_iter_list(it);
+  for (i = 0; i < n; i++) {
+    noosh_args_push(&src->values, noosh_strdup(v[i]));
+  }
+}
+
+/*
+    @brief add the values of a word to a loop, lazily if it can be
+    @param it: the loop
+    @param w: the word
+    @return 0, -1 after printing an expansion error
+*/
+int noosh_iter_add_word(struct noosh_iter * it, const struct noosh_word * w) {
+  struct noosh_source src;
+
+  if (!noosh_lazy_usable(w) || !noosh_lazy_parse(w, &src)) {
+    return noosh_expand_words(w, 1, &noosh_iter_list(it)->values);
+  }
+  *noosh_iter_add(it) = src;
+  return 0;
+}
+
+/*
+    @brief take the next value of a loop
+    @return the value, valid until the next call, NULL after the last
+*/
+const char * noosh_iter_next(struct noosh_iter * it) {
+  struct noosh_source * src;
+  const char * v;
+  char tmp[24];
+
+  for (; it->cur < it->n; it->cur++) {
+    src = &it->sources[it->cur];
+    switch (src->type) {
+    case NOOSH_SRC_LIST:
+      if (src->next < src->values.n) {
+        return src->values.v[src->next++];
+      }
+      break;
+    case NOOSH_SRC_RANGE:
+    case NOOSH_SRC_SEQ:
+      if (noosh_range_next(&src->range, tmp)) {
+        it->value.len = 0;
+        noosh_buf_append(&it->value, src->prefix, strlen(src->prefix));
+        noosh_buf_append(&it->value, tmp, strlen(tmp));
+        noosh_buf_append(&it->value, src->suffix, strlen(src->suffix));
+        return it->value.data;
+      }
+      break;
+    case NOOSH_SRC_GLOB:
+      if (src->glob && (v = noosh_glob_iter_next(src->glob)) != NULL) {
+        return v;
+      }
+      if (src->glob && src->glob->found == 0) {
+        // A glob that matches nothing stands for itself.
+        noosh_glob_iter_free(src->glob);
+        src->glob = NULL;
+        return src->text;
+      }
+      break;
+    }
+  }
+  return NULL;
+}
+
+/*
+    @brief free the values of a loop
+*/
+void noosh_iter_free(struct noosh_iter * it) {
+  struct noosh_source * src;
+  int i;
+
+  for (i = 0; i < it->n; i++) {
+    src = &it->sources[i];
+    noosh_args_free(&src->values);
+    free(src->prefix);
+    free(src->suffix);
+    free(src->text);
+    if (src->glob) {
+      noosh_glob_iter_free(src->glob);
+    }
+  }
+  free(it->sources);
+  free(it->value.data);
+  memset(it, 0, sizeof(*it));
+}
+
+/*
+    @brief run a while or until loop
+*/
+int noosh_run_while(struct noosh_node * n) {
+  int status = 0;
+
+  noosh_loop_depth++;
+  while ((noosh_execute(n->cond) == 0) == (n->type == NOOSH_N_WHILE)) {
+    if (NOOSH_UNWINDING || !noosh_loop_body(n->body, &status)) {
+      break;
+    }
+  }
+  noosh_loop_depth--;
+  return status;
+}
+
+/*
+    @brief run a for loop
+*/
+int noosh_run_for(struct noosh_node * n) {
+  struct noosh_iter values = {0};
+  const char * v;
+  int status = 0, i;
+
+  if (n->has_in) {
+    for (i = 0; i < n->nwords; i++) {
+      if (noosh_iter_add_word(&values, &n->words[i]) < 0) {
+        noosh_iter_free(&values);
+        return 1;
+      }
+    }
+  } else {
+    noosh_iter_add_values(&values, noosh_params, noosh_nparams);
+  }
+
+  noosh_loop_depth++;
+  while ((v = noosh_iter_next(&values)) != NULL) {
+    noosh_setvar(n->name, v);
+    if (!noosh_loop_body(n->body, &status)) {
+      break;
+    }
+  }
+  noosh_loop_depth--;
+  noosh_iter_free(&values);
+  return status;
+}
+
+/*
+    @brief run a case command
+*/
+int noosh_run_case(struct noosh_node * n) {
+  char * word = noosh_expand_string(&n->words[0], 0), * pat;
+  int i, j, match;
+
+  if (word == NULL) {
+    return 1;
+  }
+  for (i = 0; i < n->ncases; i++) {
+    for (j = 0; j < n->cases[i].npats; j++) {
+      if ((pat = noosh_expand_string(&n->cases[i].pats[j], NOOSH_X_PATTERN)) == NULL) {
+        free(word);
+        return 1;
+      }
+      match = fnmatch(pat, word, 0) == 0;
+      free(pat);
+      if (match) {
+        free(word);
+        return n->cases[i].body ? noosh_execute(n->cases[i].body) : 0;
+      }
+    }
+  }
+  free(word);
+  return 0;
+}
+
+/*
+  state of an in-process subshell
+    ncow, nlocals and nfuncs are the lengths of the save stacks when it
+    started, options the shell options, and cwd a descriptor of the
+    working directory, opened by the first cd; up is the enclosing one
+*/
+struct noosh_subshell {
+  size_t ncow;
+  size_t nlocals;
+  size_t nfuncs;
+  int * options;
+  int cwd;
+  int loop_depth;
+  struct noosh_subshell * up;
+};
+
+struct noosh_subshell * noosh_subshell_top = NULL;
+
+/*
+    @brief check whether a subshell can run in the shell process: not in
+        a pipeline stage thread, whose state is not the shell's, and not
+        with set -o forksubshells
+*/
+int noosh_subshell_inproc(void) {
+  return !noosh_stage_isolated && !noosh_opt_forksubshells;
+}
+
+/*
+    @brief start an in-process subshell: nothing is copied, the state it
+        changes is saved as it goes
+    @param sub: its state, filled in
+*/
+void noosh_subshell_enter(struct noosh_subshell * sub) {
+  int i;
+
+  sub->ncow = noosh_ncow;
+  sub->nlocals = noosh_nlocals;
+  sub->nfuncs = noosh_ncow_funcs;
+  sub->options = noosh_malloc(noosh_num_options() * sizeof(int));
+  for (i = 0; i < noosh_num_options(); i++) {
+    sub->options[i] = *option_flag[i];
+  }
+  sub->cwd = -1;
+  sub->loop_depth = noosh_loop_depth;
+  sub->up = noosh_subshell_top;
+  // Loops outside cannot be left with a break inside.
+  noosh_loop_depth = 0;
+  noosh_subshell_top = sub;
+  noosh_cow_level++;
+  __atomic_add_fetch(&noosh_inproc, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    @brief end an in-process subshell, undoing its changes
+    @param sub: its state
+    @param status: exit status of its commands
+    @return the subshell's exit status, that of exit if it ran
+*/
+int noosh_subshell_leave(struct noosh_subshell * sub, int status) {
+  int i;
+
+  if (noosh_exit_pending) {
+    status = noosh_exit_code;
+  }
+  noosh_exit_pending = noosh_returning = noosh_breaking = noosh_continuing = 0;
+  noosh_var_rollback(sub->ncow, sub->nlocals);
+  noosh_func_rollback(sub->nfuncs);
+  for (i = 0; i < noosh_num_options(); i++) {
+    *option_flag[i] = sub->options[i];
+  }
+  free(sub->options);
+  if (sub->cwd >= 0) {
+    if (fchdir(sub->cwd) != 0) {
+      perror("noosh");
+    }
+    close(sub->cwd);
+    noosh_stat_cwd++;
+  }
+  noosh_loop_depth = sub->loop_depth;
+  noosh_subshell_top = sub->up;
+  noosh_cow_level--;
+  return status;
+}
+
+/*
+    @brief keep the working directory before cd changes it in an
+        in-process subshell
+*/
+void noosh_subshell_cwd(void) {
+  if (noosh_subshell_top && noosh_subshell_top->cwd < 0 && !noosh_stage_isolated) {
+    noosh_subshell_top->cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+}
+
+/*
+    @brief run a command list in a subshell: in the shell process when it
+        can, its changes undone after, otherwise in a forked copy
+    @param body: what to run
+    @return its exit status
+*/
+int noosh_run_subshell(struct noosh_node * body) {
+  struct noosh_subshell sub;
+  pid_t pid;
+  int status;
+
+  if (noosh_subshell_inproc()) {
+    noosh_subshell_enter(&sub);
+    return noosh_subshell_leave(&sub, noosh_execute(body));
+  }
+  pid = noosh_fork();
+  if (pid == 0) {
+    noosh_child_setup(noosh_cur_io);
+    status = noosh_execute(body);
+    exit(noosh_exit_pending ? noosh_exit_code : status);
+  }
+  if (pid < 0) {
+    perror("noosh");
+    return 1;
+  }
+  return noosh_wait(pid);
+}
+
+/*
+    @brief run a compound command, its redirections already applied
+*/
+int noosh_run_compound(struct noosh_node * n) {
+  long long num;
+  int status;
+
+  switch (n->type) {
+  case NOOSH_N_IF:
+    status = noosh_execute(n->cond);
+    if (NOOSH_UNWINDING) {
+      return status;
+    }
+    if (status == 0) {
+      return noosh_execute(n->body);
+    }
+    return n->alt ? noosh_execute(n->alt) : 0;
+  case NOOSH_N_WHILE:
+  case NOOSH_N_UNTIL:
+    return noosh_run_while(n);
+  case NOOSH_N_FOR:
+    return noosh_run_for(n);
+  case NOOSH_N_CASE:
+    return noosh_run_case(n);
+  case NOOSH_N_GROUP:
+    return noosh_execute(n->body);
+  case NOOSH_N_SUBSHELL:
+    return noosh_run_subshell(n->body);
+  case NOOSH_N_ARITH:
+    return noosh_arith_expand(n->words[0].s, n->words[0].len, &num) < 0 ? 1 : num == 0;
+  case NOOSH_N_COND:
+    return noosh_cond_eval(n->test);
+  }
+  return 0;
+}
+
+/*
+    @brief execute a syntax tree
+    @param n: the tree
+    @return its exit status, also left in $?
+*/
+int noosh_execute(struct noosh_node * n) {
+  struct noosh_io io, * saved;
+  int status = 0, i;
+
+  switch (n->type) {
+  case NOOSH_N_CMD:
+    status = noosh_run_simple(n);
+    break;
+  case NOOSH_N_PIPE:
+    if (n->nkids == 1) {
+      // `! command' runs the command in the shell like any other.
+      status = !noosh_execute(n->kids[0]);
+    } else {
+      status = noosh_run_pipeline(n);
+    }
+    break;
+  case NOOSH_N_AND:
+  case NOOSH_N_OR:
+    status = noosh_execute(n->cond);
+    if (!NOOSH_UNWINDING && (status == 0) == (n->type == NOOSH_N_AND)) {
+      status = noosh_execute(n->body);
+    }
+    break;
+  case NOOSH_N_LIST:
+    for (i = 0; i < n->nkids && !NOOSH_UNWINDING; i++) {
+      status = noosh_execute(n->kids[i]);
+    }
+    break;
+  case NOOSH_N_FUNC:
+    status = noosh_define_func(n->name, n->words[0].s);
+    break;
+  default:
+    if (n->nredirs == 0) {
+      status = noosh_run_compound(n);
+      break;
+    }
+    noosh_io_init(&io);
+    if (noosh_apply_redirs(n, &io) < 0) {
+      status = 1;
+    } else {
+      saved = noosh_cur_io;
+      noosh_cur_io = &io;
+      status = noosh_run_compound(n);
+      noosh_cur_io = saved;
+    }
+    noosh_io_close(&io);
+    noosh_io_wait(&io);
+  }
+  noosh_last_status = status;
+  return status;
+}
+
+/*
+    @brief run a command substitution, in the shell process when it can
+        as an in-process subshell, otherwise in a forked copy
+    @param src: text of the commands
+    @param len: its length
+    @return their output without trailing newlines, allocated
+*/
+char * noosh_command_subst(const char * src, size_t len) {
+  struct noosh_io io, * saved = noosh_cur_io;
+  struct noosh_buf out = {0};
+  struct noosh_subshell sub;
+  pid_t pid;
+  int p[2], status;
+
+  __atomic_add_fetch(&noosh_substs, 1, __ATOMIC_RELAXED);
+  if (noosh_subshell_inproc() && (p[0] = memfd_create("noosh-subst", MFD_CLOEXEC)) >= 0) {
+    // The output goes to memory, read back when the commands are done:
+    // however much they write, nothing waits on a reader.
+    noosh_io_init(&io);
+    io.fd[1] = p[0];
+    noosh_cur_io = &io;
+    noosh_subshell_enter(&sub);
+    // The same text in a loop is compiled once.
+    status = noosh_subshell_leave(&sub, noosh_run_cached(src, len));
+    noosh_cur_io = saved;
+    lseek(p[0], 0, SEEK_SET);
+    noosh_slurp(p[0], &out);
+    close(p[0]);
+    noosh_last_status = status;
+  } else if (noosh_pipe(p) < 0) {
+    perror("noosh");
+    return noosh_strdup("");
+  } else {
+    noosh_io_init(&io);
+    io.fd[1] = p[1];
+    pid = noosh_fork();
+    if (pid == 0) {
+      noosh_child_setup(&io);
+      exit(noosh_run_string(src, len));
+    }
+    close(p[1]);
+    if (pid < 0) {
+      perror("noosh");
+    } else {
+      noosh_slurp(p[0], &out);
+      noosh_last_status = noosh_wait(pid);
+    }
+    close(p[0]);
+  }
+  while (out.len > 0 && out.data[out.len - 1] == '\n') {
+    out.data[--out.len] = '\0';
+  }
+  return out.data ? out.data : noosh_strdup("");
+}
+
+/*
+  Bytecode
+
+  Scripts and function bodies are compiled to a flat array of ints for a
+  stack machine. Words push strings onto the stack and commands consume
+  them; a word that is a plain literal, a variable or a quoted mix of
+  both needs no expansion pass at run time. Variables are numbered slots
+  bound to their cells once, and builtins are resolved when compiled.
+  Pipelines, subshells and commands with temporary assignments are kept
+  as source text, parsed on first use and handed to the tree walker.
+*/
+
+/*
+  opcodes, each followed by its operands (string offsets, slots, pc)
+*/
+enum noosh_op {
+  NOOSH_OP_LIT,          // off: push a string
+  NOOSH_OP_VAR,          // slot: push the fields of an unquoted $var
+  NOOSH_OP_QVAR,         // slot: push "$var"
+  NOOSH_OP_LEN,          // slot: push ${#var}
+  NOOSH_OP_WORD,         // off len flags: push the fields of a word
+  NOOSH_OP_STRWORD,      // off len flags mode: push a word as one string
+  NOOSH_OP_CAT,          // n: pop n strings, push them joined
+  NOOSH_OP_SET,          // slot: pop a string into a variable
+  NOOSH_OP_MARK,         // note the fork count for the status of $(...)
+  NOOSH_OP_ASSIGN_END,   // end of a command of assignments only
+  NOOSH_OP_RUN_BUILTIN,  // index: run the stack as a builtin
+  NOOSH_OP_RUN,          // run the stack as a function, builtin or program
+  NOOSH_OP_REDIR_PUSH,   // start a descriptor table
+  NOOSH_OP_REDIR_APPLY,  // pc: pop operator/target pairs into it, or jump
+  NOOSH_OP_REDIR_POP,    // drop the table
+  NOOSH_OP_JUMP,         // pc
+  NOOSH_OP_JUMP_IF_FAIL, // pc
+  NOOSH_OP_JUMP_IF_OK,   // pc
+  NOOSH_OP_NOT,          // invert $?
+  NOOSH_OP_STATUS,       // n: set $?
+  NOOSH_OP_LOOP_PUSH,    // break pc, continue pc
+  NOOSH_OP_LOOP_SAVE,    // the body ended: keep $? as the loop status
+  NOOSH_OP_LOOP_POP,     // leave the loop normally
+  NOOSH_OP_FOR_INIT,     // pc: pop the values of a for loop, or jump
+  NOOSH_OP_FOR_LAZY,     // str flags: pop values, then add a word taken lazily
+  NOOSH_OP_FOR_PARAMS,   // loop over the positional parameters
+  NOOSH_OP_FOR_NEXT,     // slot pc: set the next value, or jump when done
+  NOOSH_OP_CASE_SET,     // pc: pop the subject of a case; pc is its end
+  NOOSH_OP_CASE_LIT,     // off pc: jump if the subject matches a pattern
+  NOOSH_OP_CASE_MATCH,   // pc: pop a pattern, jump if the subject matches
+  NOOSH_OP_EXEC,         // off index: run source text with the tree walker
+  NOOSH_OP_DEFUN,        // name text: define a function
+  NOOSH_OP_NUM,          // low high: push a number
+  NOOSH_OP_LOAD,         // slot: push the value of a variable as a number
+  NOOSH_OP_STORE,        // slot: set a variable to the number on top
+  NOOSH_OP_ARITH,        // operator: apply it to the numbers on top
+  NOOSH_OP_INCR,         // slot step post: add to a variable, push its value
+  NOOSH_OP_JUMP_IF_ZERO, // pc: pop a number, jump if it is 0
+  NOOSH_OP_JUMP_IF_NONZERO, // pc: pop a number, jump unless it is 0
+  NOOSH_OP_DROP,         // pop a number
+  NOOSH_OP_NUM_STR,      // pop a number, push it as a string
+  NOOSH_OP_NUM_STATUS,   // pop a number, $? is 0 unless it is 0
+  NOOSH_OP_EVAL,         // pop a string, push its value as an expression
+  NOOSH_OP_ASSIGN_WORD,  // off len flags: name[key]=, name+= or name=(...)
+  NOOSH_OP_ELEMS,        // slot: push the elements of "${name[@]}"
+  NOOSH_OP_ERROR,        // off: report a syntax error and stop
+  NOOSH_OP_TEST,         // test site: pop its operands, set $? from a [[ ]] test
+  NOOSH_OP_END
+};
+
+/*
+  opcode names for --disasm, followed by their operand counts
+*/
+char * noosh_op_str[] = {
+  "LIT", "VAR", "QVAR", "LEN", "WORD", "STRWORD", "CAT", "SET", "MARK",
+  "ASSIGN_END", "RUN_BUILTIN", "RUN", "REDIR_PUSH", "REDIR_APPLY",
+  "REDIR_POP", "JUMP", "JUMP_IF_FAIL", "JUMP_IF_OK", "NOT", "STATUS",
+  "LOOP_PUSH", "LOOP_SAVE", "LOOP_POP", "FOR_INIT", "FOR_LAZY", "FOR_PARAMS",
+  "FOR_NEXT", "CASE_SET", "CASE_LIT", "CASE_MATCH", "EXEC", "DEFUN",
+  "NUM", "LOAD", "STORE", "ARITH", "INCR", "JUMP_IF_ZERO",
+  "JUMP_IF_NONZERO", "DROP", "NUM_STR", "NUM_STATUS", "EVAL",
+  "ASSIGN_WORD", "ELEMS", "ERROR", "TEST", "END"
+};
+
+int noosh_op_nargs[] = {
+  1, 1, 1, 1, 3, 4, 1, 1, 0,
+  0, 1, 0, 0, 1,
+  0, 1, 1, 1, 0, 1,
+  2, 0, 0, 1, 2, 0,
+  2, 1, 2, 1, 2, 2,
+  2, 1, 1, 1, 3, 1,
+  1, 0, 0, 0, 0,
+  3, 1, 1, 2, 0
+};
+
+/*
+  kinds of the operands of each opcode, checked when code is loaded from
+  the cache: s string offset, l length of the string before it, v slot,
+  p pc, b builtin, x EXEC node, a arithmetic operator, t test, n any
+  number
+*/
+char * noosh_op_operands[] = {
+  "s", "v", "v", "v", "sln", "slnn", "n", "v", "",
+  "", "b", "", "", "p",
+  "", "p", "p", "p", "", "n",
+  "pp", "", "", "p", "sn", "",
+  "vp", "p", "sp", "p", "sx", "ss",
+  "nn", "v", "v", "a", "vnn", "p",
+  "p", "", "", "", "",
+  "sln", "v", "s", "ts", ""
+};
+
+/*
+  compiled code
+    strs holds the null terminated strings operands refer to by offset
+    slots are the offsets of variable names; cells binds them when the
+    code first runs
+    nodes caches the trees of EXEC text, parsed into arena on first use
+    code loaded from the cache points into map, maplen bytes long
+*/
+struct noosh_code {
+  int * ops;
+  int nops;
+  int cap;
+  struct noosh_buf strs;
+  int * slots;
+  int nslots;
+  struct noosh_var ** cells;
+  struct noosh_node ** nodes;
+  int nnodes;
+  struct noosh_arena arena;
+  char * map;
+  size_t maplen;
+};
+
+/*
+  compiler state: code being emitted and the source text node spans
+  refer to
+*/
+struct noosh_cc {
+  struct noosh_code * code;
+  const char * src;
+};
+
+/*
+    @brief free compiled code
+*/
+void noosh_code_free(struct noosh_code * code) {
+  if (code == NULL) {
+    return;
+  }
+  if (code->map) {
+    munmap(code->map, code->maplen);
+  } else {
+    free(code->ops);
+    free(code->strs.data);
+    free(code->slots);
+  }
+  free(code->cells);
+  free(code->nodes);
+  noosh_arena_free(&code->arena);
+  free(code);
+}
+
+/*
+    @brief append an int to the code
+    @return its index
+*/
+int noosh_emit(struct noosh_cc * cc, int v) {
+  struct noosh_code * c = cc->code;
+
+  if (c->nops == c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 64;
+    c->ops = noosh_realloc(c->ops, c->cap * sizeof(*c->ops));
+  }
+  c->ops[c->nops] = v;
+  return c->nops++;
+}
+
+/*
+    @brief add a string to the code
+    @return its offset
+*/
+int noosh_emit_str(struct noosh_cc * cc, const char * s, size_t len) {
+  struct noosh_buf * b = &cc->code->strs;
+  int off = b->len;
+
+  noosh_buf_append(b, s, len);
+  noosh_buf_append(b, "", 1);
+  return off;
+}
+
+/*
+    @brief find or add the slot of a variable
+*/
+int noosh_emit_slot(struct noosh_cc * cc, const char * name, size_t len) {
+  struct noosh_code * c = cc->code;
+  const char * s;
+  int i;
+
+  for (i = 0; i < c->nslots; i++) {
+    s = c->strs.data + c->slots[i];
+    if (strlen(s) == len && memcmp(s, name, len) == 0) {
+      return i;
+    }
+  }
+  if ((c->nslots & (c->nslots - 1)) == 0) {
+    c->slots = noosh_realloc(c->slots, (c->nslots ? 2 * c->nslots : 1) * sizeof(*c->slots));
+  }
+  c->slots[c->nslots] = noosh_emit_str(cc, name, len);
+  return c->nslots++;
+}
+
+/*
+    @brief make the jump operand at the index point here
+*/
+void noosh_patch(struct noosh_cc * cc, int at) {
+  cc->code->ops[at] = cc->code->nops;
+}
+
+void noosh_compile_word(struct noosh_cc * cc, const struct noosh_word * w, int mode);
+
+/*
+    @brief compile an expression tree to ops leaving its value on the
+        number stack
+*/
+void noosh_compile_arith(struct noosh_cc * cc, struct noosh_arith * n) {
+  int at, at2, end;
+
+  switch (n->op) {
+  case NOOSH_A_NUM:
+    noosh_emit(cc, NOOSH_OP_NUM);
+    noosh_emit(cc, (int) (unsigned int) n->num);
+    noosh_emit(cc, (int) (unsigned int) ((unsigned long long) n->num >> 32));
+    return;
+  case NOOSH_A_VAR:
+    noosh_emit(cc, NOOSH_OP_LOAD);
+    noosh_emit(cc, noosh_emit_slot(cc, n->name, strlen(n->name)));
+    return;
+  case NOOSH_A_AND:
+  case NOOSH_A_OR:
+    // Either side may decide: both jump to the same result.
+    noosh_compile_arith(cc, n->a);
+    noosh_emit(cc, n->op == NOOSH_A_AND ? NOOSH_OP_JUMP_IF_ZERO : NOOSH_OP_JUMP_IF_NONZERO);
+    at = noosh_emit(cc, 0);
+    noosh_compile_arith(cc, n->b);
+    noosh_emit(cc, n->op == NOOSH_A_AND ? NOOSH_OP_JUMP_IF_ZERO : NOOSH_OP_JUMP_IF_NONZERO);
+    at2 = noosh_emit(cc, 0);
+    noosh_emit(cc, NOOSH_OP_NUM);
+    noosh_emit(cc, n->op == NOOSH_A_AND);
+    noosh_emit(cc, 0);
+    noosh_emit(cc, NOOSH_OP_JUMP);
+    end = noosh_emit(cc, 0);
+    noosh_patch(cc, at);
+    noosh_patch(cc, at2);
+    noosh_emit(cc, NOOSH_OP_NUM);
+    noosh_emit(cc, n->op == NOOSH_A_OR);
+    noosh_emit(cc, 0);
+    noosh_patch(cc, end);
+    return;
+  case NOOSH_A_COND:
+    noosh_compile_arith(cc, n->a);
+    noosh_emit(cc, NOOSH_OP_JUMP_IF_ZERO);
+    at = noosh_emit(cc, 0);
+    noosh_compile_arith(cc, n->b);
+    noosh_emit(cc, NOOSH_OP_JUMP);
+    end = noosh_emit(cc, 0);
+    noosh_patch(cc, at);
+    noosh_compile_arith(cc, n->c);
+    noosh_patch(cc, end);
+    return;
+  case NOOSH_A_ASSIGN:
+    at = noosh_emit_slot(cc, n->name, strlen(n->name));
+    if (n->sub >= 0) {
+      noosh_emit(cc, NOOSH_OP_LOAD);
+      noosh_emit(cc, at);
+    }
+    noosh_compile_arith(cc, n->b);
+    if (n->sub >= 0) {
+      noosh_emit(cc, NOOSH_OP_ARITH);
+      noosh_emit(cc, n->sub);
+    }
+    noosh_emit(cc, NOOSH_OP_STORE);
+    noosh_emit(cc, at);
+    return;
+  case NOOSH_A_PREINC:
+  case NOOSH_A_POSTINC:
+    noosh_emit(cc, NOOSH_OP_INCR);
+    noosh_emit(cc, noosh_emit_slot(cc, n->name, strlen(n->name)));
+    noosh_emit(cc, (int) n->num);
+    noosh_emit(cc, n->op == NOOSH_A_POSTINC);
+    return;
+  case NOOSH_A_COMMA:
+    noosh_compile_arith(cc, n->a);
+    noosh_emit(cc, NOOSH_OP_DROP);
+    noosh_compile_arith(cc, n->b);
+    return;
+  }
+  noosh_compile_arith(cc, n->a);
+  if (n->b) {
+    noosh_compile_arith(cc, n->b);
+  }
+  noosh_emit(cc, NOOSH_OP_ARITH);
+  noosh_emit(cc, n->op);
+}
+
+/*
+    @brief compile the text of a $((...)) or ((...)) to ops leaving its
+        value on the number stack: parsed now unless it has expansions
+        or errors, which are left to EVAL at run time
+*/
+void noosh_compile_arith_text(struct noosh_cc * cc, const char * s, size_t len) {
+  struct noosh_word w = {(char *) s, len, NOOSH_W_QUOTED | NOOSH_W_EXPAND};
+  struct noosh_arena arena = {0};
+  struct noosh_arith_parser ap = {s, len, 0, &arena, NULL, NULL, 0};
+  struct noosh_arith * n = NULL;
+
+  // Syntax errors are reported when the code runs, not now.
+  if (!noosh_arith_needs_expansion(s, len)) {
+    n = noosh_arith_top(&ap);
+  }
+  if (n && !ap.subscripts) {
+    noosh_compile_arith(cc, n);
+  } else {
+    noosh_compile_word(cc, &w, 0);
+    noosh_emit(cc, NOOSH_OP_EVAL);
+  }
+  noosh_arena_free(&arena);
+}
+
+/*
+    @brief compile a word made of literal text, single and double quotes
+        and $name, ${name} or ${#name} into pushes and a CAT
+    @param cc: compiler
+    @param w: the word
+    @param mode: NOOSH_X_SPLIT or 0
+    @return 1 if compiled, 0 if the word needs the general expansion
+*/
+int noosh_compile_pieces(struct noosh_cc * cc, const struct noosh_word * w, int mode) {
+  struct noosh_buf lit = {0};
+  const char * s = w->s;
+  size_t len = w->len, i = 0, j, k;
+  int dq = 0, n = 0, length, slot;
+
+  if ((w->flags & (NOOSH_W_BRACE | NOOSH_W_TILDE)) || ((mode & NOOSH_X_SPLIT) && (w->flags & NOOSH_W_GLOB))) {
+    return 0;
+  }
+  while (i < len) {
+    if (s[i] == '"') {
+      dq = !dq;
+      i++;
+    } else if (s[i] == '\'' && !dq) {
+      for (j = i + 1; j < len && s[j] != '\''; j++);
+      noosh_buf_append(&lit, s + i + 1, j - i - 1);
+      i = j + 1;
+    } else if (s[i] == '$') {
+      if (i + 2 < len && s[i + 1] == '(' && s[i + 2] == '(') {
+        // $((...)) is a number: never split, computed in place.
+        j = noosh_skip_nested(s, len, i + 1);
+        if (j == 0 || s[j - 2] != ')') {
+          goto generic;
+        }
+        if (lit.len > 0) {
+          noosh_emit(cc, NOOSH_OP_LIT);
+          noosh_emit(cc, noosh_emit_str(cc, lit.data, lit.len));
+          lit.len = 0;
+          n++;
+        }
+        noosh_compile_arith_text(cc, s + i + 3, j - i - 5);
+        noosh_emit(cc, NOOSH_OP_NUM_STR);
+        n++;
+        i = j;
+        continue;
+      }
+      // Unquoted values are split, which pieces cannot do.
+      if ((mode & NOOSH_X_SPLIT) && !dq) {
+        goto generic;
+      }
+      length = 0;
+      j = i + 1;
+      if (j < len && s[j] == '{') {
+        j++;
+        if (j < len && s[j] == '#') {
+          length = 1;
+          j++;
+        }
+      }
+      k = noosh_name_len(s + j, len - j);
+      if (k == 0 || (s[i + 1] == '{' && (j + k >= len || s[j + k] != '}'))) {
+        goto generic;
+      }
+      if (lit.len > 0) {
+        noosh_emit(cc, NOOSH_OP_LIT);
+        noosh_emit(cc, noosh_emit_str(cc, lit.data, lit.len));
+        lit.len = 0;
+        n++;
+      }
+      slot = noosh_emit_slot(cc, s + j, k);
+      noosh_emit(cc, length ? NOOSH_OP_LEN : NOOSH_OP_QVAR);
+      noosh_emit(cc, slot);
+      n++;
+      i = j + k + (s[i + 1] == '{');
+    } else if (s[i] == '\\' || s[i] == '`' || (s[i] == '(' && !dq)) {
+      // An unquoted `(' starts the list of name=(...).
+      goto generic;
+    } else {
+      noosh_buf_append(&lit, s + i, 1);
+      i++;
+    }
+  }
+  if (lit.len > 0 || n == 0) {
+    noosh_emit(cc, NOOSH_OP_LIT);
+    noosh_emit(cc, noosh_emit_str(cc, lit.data ? lit.data : "", lit.len));
+    n++;
+  }
+  if (n > 1) {
+    noosh_emit(cc, NOOSH_OP_CAT);
+    noosh_emit(cc, n);
+  }
+  free(lit.data);
+  return 1;
+
+generic:
+  // Drop what was emitted: the general expansion redoes the whole word.
+  free(lit.data);
+  return 0;
+}
+
+# define NOOSH_CC_MAX_FIELDS 64
+
+/*
+    @brief compile a word into pushes of its expansion
+    @param cc: compiler
+    @param w: the word
+    @param mode: NOOSH_X_SPLIT for command words (zero or more fields),
+        otherwise exactly one string; NOOSH_X_PATTERN for case patterns,
+        NOOSH_X_REGEX for the right side of =~
+*/
+void noosh_compile_word(struct noosh_cc * cc, const struct noosh_word * w, int mode) {
+  struct noosh_args fields = {0};
+  int start = cc->code->nops, nstrs = cc->code->strs.len, nslots = cc->code->nslots;
+  size_t k;
+
+  if (!(w->flags & (NOOSH_W_EXPAND | NOOSH_W_TILDE)) && !((mode & NOOSH_X_SPLIT) && (w->flags & NOOSH_W_GLOB))) {
+    // Quote removal and braces alone give the same fields every time;
+    // a long range is left to run time rather than kept in the code, and
+    // so are paths, which change.
+    if (noosh_expand_word(w, mode, &fields) == 0 && (fields.n == 1 || ((mode & NOOSH_X_SPLIT) &&
+        fields.n <= NOOSH_CC_MAX_FIELDS))) {
+      for (k = 0; k < (size_t) fields.n; k++) {
+        noosh_emit(cc, NOOSH_OP_LIT);
+        noosh_emit(cc, noosh_emit_str(cc, fields.v[k], strlen(fields.v[k])));
+      }
+      noosh_args_free(&fields);
+      return;
+    }
+    noosh_args_free(&fields);
+  } else if (w->s[0] == '$' && !(mode & NOOSH_X_PATTERN)) {
+    // A lone $name or ${name}
+    k = noosh_name_len(w->s + 1, w->len - 1);
+    if (k > 0 && k == w->len - 1) {
+      noosh_emit(cc, (mode & NOOSH_X_SPLIT) ? NOOSH_OP_VAR : NOOSH_OP_QVAR);
+      noosh_emit(cc, noosh_emit_slot(cc, w->s + 1, k));
+      return;
+    }
+    if (w->len > 3 && w->s[1] == '{' && w->s[w->len - 1] == '}' &&
+        noosh_name_len(w->s + 2, w->len - 3) == w->len - 3) {
+      noosh_emit(cc, (mode & NOOSH_X_SPLIT) ? NOOSH_OP_VAR : NOOSH_OP_QVAR);
+      noosh_emit(cc, noosh_emit_slot(cc, w->s + 2, w->len - 3));
+      return;
+    }
+  } else if ((mode & NOOSH_X_SPLIT) && w->len > 8 && memcmp(w->s, "\"${", 3) == 0 &&
+             memcmp(w->s + w->len - 5, "[@]}\"", 5) == 0 &&
+             noosh_name_len(w->s + 3, w->len - 8) == w->len - 8) {
+    // "${name[@]}": the elements go straight onto the stack.
+    noosh_emit(cc, NOOSH_OP_ELEMS);
+    noosh_emit(cc, noosh_emit_slot(cc, w->s + 3, w->len - 8));
+    return;
+  }
+  if (!(mode & (NOOSH_X_PATTERN | NOOSH_X_REGEX)) && noosh_compile_pieces(cc, w, mode)) {
+    return;
+  }
+  cc->code->nops = start;
+  cc->code->strs.len = nstrs;
+  cc->code->nslots = nslots;
+
+  noosh_emit(cc, (mode & NOOSH_X_SPLIT) ? NOOSH_OP_WORD : NOOSH_OP_STRWORD);
+  noosh_emit(cc, noosh_emit_str(cc, w->s, w->len));
+  noosh_emit(cc, w->len);
+  noosh_emit(cc, w->flags);
+  if (!(mode & NOOSH_X_SPLIT)) {
+    noosh_emit(cc, mode);
+  }
+}
+
+/*
+    @brief hand a node to the tree walker as its source text
+*/
+void noosh_compile_exec(struct noosh_cc * cc, struct noosh_node * n) {
+  noosh_emit(cc, NOOSH_OP_EXEC);
+  noosh_emit(cc, noosh_emit_str(cc, cc->src + n->start, n->end - n->start));
+  noosh_emit(cc, cc->code->nnodes++);
+}
+
+void noosh_compile_node(struct noosh_cc * cc, struct noosh_node * n);
+
+/*
+    @brief compile a simple command
+*/
+void noosh_compile_simple(struct noosh_cc * cc, struct noosh_node * n) {
+  struct noosh_word value;
+  size_t len;
+  int i, b;
+
+  if (n->nwords == 0) {
+    noosh_emit(cc, NOOSH_OP_MARK);
+    for (i = 0; i < n->nassigns; i++) {
+      if (!noosh_is_plain_assignment(&n->assigns[i])) {
+        noosh_emit(cc, NOOSH_OP_ASSIGN_WORD);
+        noosh_emit(cc, noosh_emit_str(cc, n->assigns[i].s, n->assigns[i].len));
+        noosh_emit(cc, n->assigns[i].len);
+        noosh_emit(cc, n->assigns[i].flags);
+        continue;
+      }
+      len = strchr(n->assigns[i].s, '=') - n->assigns[i].s;
+      value.s = n->assigns[i].s + len + 1;
+      value.len = n->assigns[i].len - len - 1;
+      value.flags = n->assigns[i].flags & (NOOSH_W_QUOTED | NOOSH_W_EXPAND | NOOSH_W_TILDE);
+      noosh_compile_word(cc, &value, NOOSH_X_ASSIGN);
+      noosh_emit(cc, NOOSH_OP_SET);
+      noosh_emit(cc, noosh_emit_slot(cc, n->assigns[i].s, len));
+    }
+    noosh_emit(cc, NOOSH_OP_ASSIGN_END);
+    return;
+  }
+  if (n->words[0].flags != 0) {
+    // The command may expand to nothing, leaving $? to a $(...).
+    noosh_emit(cc, NOOSH_OP_MARK);
+  }
+  for (i = 0; i < n->nwords; i++) {
+    noosh_compile_word(cc, &n->words[i], NOOSH_X_SPLIT);
+  }
+  if (n->words[0].flags == 0 && (b = noosh_find_builtin(n->words[0].s)) >= 0) {
+    noosh_emit(cc, NOOSH_OP_RUN_BUILTIN);
+    noosh_emit(cc, b);
+  } else {
+    noosh_emit(cc, NOOSH_OP_RUN);
+  }
+}
+
+/*
+    @brief compile a loop: while, until or for
+*/
+void noosh_compile_loop(struct noosh_cc * cc, struct noosh_node * n) {
+  int brk, cont, done, init = -1, i;
+
+  noosh_emit(cc, NOOSH_OP_LOOP_PUSH);
+  brk = noosh_emit(cc, 0);
+  cont = noosh_emit(cc, 0);
+  if (n->type == NOOSH_N_FOR) {
+    if (n->has_in) {
+      for (i = 0; i < n->nwords; i++) {
+        if (noosh_lazy_parse(&n->words[i], NULL)) {
+          noosh_emit(cc, NOOSH_OP_FOR_LAZY);
+          noosh_emit(cc, noosh_emit_str(cc, n->words[i].s, n->words[i].len));
+          noosh_emit(cc, n->words[i].flags);
+        } else {
+          noosh_compile_word(cc, &n->words[i], NOOSH_X_SPLIT);
+        }
+      }
+      noosh_emit(cc, NOOSH_OP_FOR_INIT);
+      init = noosh_emit(cc, 0);
+    } else {
+      noosh_emit(cc, NOOSH_OP_FOR_PARAMS);
+    }
+    noosh_patch(cc, cont);
+    noosh_emit(cc, NOOSH_OP_FOR_NEXT);
+    noosh_emit(cc, noosh_emit_slot(cc, n->name, strlen(n->name)));
+    done = noosh_emit(cc, 0);
+  } else {
+    noosh_patch(cc, cont);
+    noosh_compile_node(cc, n->cond);
+    noosh_emit(cc, n->type == NOOSH_N_WHILE ? NOOSH_OP_JUMP_IF_FAIL : NOOSH_OP_JUMP_IF_OK);
+    done = noosh_emit(cc, 0);
+  }
+  noosh_compile_node(cc, n->body);
+  noosh_emit(cc, NOOSH_OP_LOOP_SAVE);
+  noosh_emit(cc, NOOSH_OP_JUMP);
+  noosh_emit(cc, cc->code->ops[cont]);
+  noosh_patch(cc, done);
+  if (init >= 0) {
+    noosh_patch(cc, init);
+  }
+  noosh_emit(cc, NOOSH_OP_LOOP_POP);
+  noosh_patch(cc, brk);
+}
+
+/*
+    @brief compile a case command
+*/
+void noosh_compile_case(struct noosh_cc * cc, struct noosh_node * n) {
+  struct noosh_word * p;
+  int * bodies = noosh_malloc((n->ncases + 1) * sizeof(*bodies));
+  int * ends = noosh_malloc((n->ncases + 1) * sizeof(*ends));
+  char * pat;
+  int end, at, i, j;
+
+  noosh_compile_word(cc, &n->words[0], 0);
+  noosh_emit(cc, NOOSH_OP_CASE_SET);
+  end = noosh_emit(cc, 0);
+  for (i = 0; i < n->ncases; i++) {
+    // Every pattern jumps to a list of the body addresses, patched below.
+    bodies[i] = -1;
+    for (j = 0; j < n->cases[i].npats; j++) {
+      p = &n->cases[i].pats[j];
+      if (p->flags & (NOOSH_W_EXPAND | NOOSH_W_TILDE)) {
+        noosh_compile_word(cc, p, NOOSH_X_PATTERN);
+        noosh_emit(cc, NOOSH_OP_CASE_MATCH);
+      } else {
+        // Quote removal gives the same pattern every time.
+        pat = noosh_expand_string(p, NOOSH_X_PATTERN);
+        noosh_emit(cc, NOOSH_OP_CASE_LIT);
+        noosh_emit(cc, noosh_emit_str(cc, pat, strlen(pat)));
+        free(pat);
+      }
+      at = noosh_emit(cc, bodies[i]);
+      bodies[i] = at;
+    }
+  }
+  noosh_emit(cc, NOOSH_OP_STATUS);
+  noosh_emit(cc, 0);
+  noosh_emit(cc, NOOSH_OP_JUMP);
+  ends[n->ncases] = noosh_emit(cc, 0);
+  for (i = 0; i < n->ncases; i++) {
+    for (at = bodies[i]; at >= 0; at = j) {
+      j = cc->code->ops[at];
+      cc->code->ops[at] = cc->code->nops;
+    }
+    if (n->cases[i].body) {
+      noosh_compile_node(cc, n->cases[i].body);
+    } else {
+      noosh_emit(cc, NOOSH_OP_STATUS);
+      noosh_emit(cc, 0);
+    }
+    noosh_emit(cc, NOOSH_OP_JUMP);
+    ends[i] = noosh_emit(cc, 0);
+  }
+  for (i = 0; i <= n->ncases; i++) {
+    noosh_patch(cc, ends[i]);
+  }
+  noosh_patch(cc, end);
+  free(bodies);
+  free(ends);
+}
+
+/*
+    @brief compile the expression of a [[ ... ]]: && and || jump over
+        the tests they skip, and each test pushes its words and runs
+*/
+void noosh_compile_cond(struct noosh_cc * cc, struct noosh_cond * c) {
+  int at;
+
+  switch (c->type) {
+  case NOOSH_C_AND:
+  case NOOSH_C_OR:
+    noosh_compile_cond(cc, c->l);
+    noosh_emit(cc, c->type == NOOSH_C_AND ? NOOSH_OP_JUMP_IF_FAIL : NOOSH_OP_JUMP_IF_OK);
+    at = noosh_emit(cc, 0);
+    noosh_compile_cond(cc, c->r);
+    noosh_patch(cc, at);
+    return;
+  case NOOSH_C_NOT:
+    noosh_compile_cond(cc, c->l);
+    noosh_emit(cc, NOOSH_OP_NOT);
+    return;
+  }
+  noosh_compile_word(cc, &c->a, 0);
+  if (c->test >= NOOSH_TEST_MATCH) {
+    noosh_compile_word(cc, &c->b, noosh_test_mode(c->test));
+  }
+  noosh_emit(cc, NOOSH_OP_TEST);
+  noosh_emit(cc, c->test);
+  // The text of the right side is the site of its cached pattern.
+  noosh_emit(cc, c->test >= NOOSH_TEST_MATCH ? noosh_emit_str(cc, c->b.s, c->b.len) : 0);
+}
+
+/*
+    @brief compile a node
+*/
+void noosh_compile_node(struct noosh_cc * cc, struct noosh_node * n) {
+  int redirs = n->nredirs > 0 && n->type != NOOSH_N_SUBSHELL &&
+               !(n->type == NOOSH_N_CMD && n->nassigns > 0 && n->nwords > 0);
+  int fail = -1, at, i;
+
+  if (redirs) {
+    noosh_emit(cc, NOOSH_OP_REDIR_PUSH);
+    for (i = 0; i < n->nredirs; i++) {
+      noosh_emit(cc, NOOSH_OP_LIT);
+      noosh_emit(cc, noosh_emit_str(cc, n->redirs[i].op, strlen(n->redirs[i].op)));
+      noosh_compile_word(cc, &n->redirs[i].target, 0);
+    }
+    noosh_emit(cc, NOOSH_OP_REDIR_APPLY);
+    fail = noosh_emit(cc, 0);
+  }
+
+  switch (n->type) {
+  case NOOSH_N_CMD:
+    if (n->nassigns > 0 && n->nwords > 0) {
+      // Assignments for one command only: leave it to the tree walker.
+      noosh_compile_exec(cc, n);
+    } else {
+      noosh_compile_simple(cc, n);
+    }
+    break;
+  case NOOSH_N_PIPE:
+    if (n->nkids == 1) {
+      noosh_compile_node(cc, n->kids[0]);
+      noosh_emit(cc, NOOSH_OP_NOT);
+    } else {
+      noosh_compile_exec(cc, n);
+    }
+    break;
+  case NOOSH_N_AND:
+  case NOOSH_N_OR:
+    noosh_compile_node(cc, n->cond);
+    noosh_emit(cc, n->type == NOOSH_N_AND ? NOOSH_OP_JUMP_IF_FAIL : NOOSH_OP_JUMP_IF_OK);
+    at = noosh_emit(cc, 0);
+    noosh_compile_node(cc, n->body);
+    noosh_patch(cc, at);
+    break;
+  case NOOSH_N_LIST:
+    for (i = 0; i < n->nkids; i++) {
+      noosh_compile_node(cc, n->kids[i]);
+    }
+    break;
+  case NOOSH_N_IF:
+    noosh_compile_node(cc, n->cond);
+    noosh_emit(cc, NOOSH_OP_JUMP_IF_FAIL);
+    at = noosh_emit(cc, 0);
+    noosh_compile_node(cc, n->body);
+    noosh_emit(cc, NOOSH_OP_JUMP);
+    i = noosh_emit(cc, 0);
+    noosh_patch(cc, at);
+    if (n->alt) {
+      noosh_compile_node(cc, n->alt);
+    } else {
+      noosh_emit(cc, NOOSH_OP_STATUS);
+      noosh_emit(cc, 0);
+    }
+    noosh_patch(cc, i);
+    break;
+  case NOOSH_N_WHILE:
+  case NOOSH_N_UNTIL:
+  case NOOSH_N_FOR:
+    noosh_compile_loop(cc, n);
+    break;
+  case NOOSH_N_CASE:
+    noosh_compile_case(cc, n);
+    break;
+  case NOOSH_N_GROUP:
+    noosh_compile_node(cc, n->body);
+    break;
+  case NOOSH_N_SUBSHELL:
+    noosh_compile_exec(cc, n);
+    break;
+  case NOOSH_N_ARITH:
+    noosh_compile_arith_text(cc, n->words[0].s, n->words[0].len);
+    noosh_emit(cc, NOOSH_OP_NUM_STATUS);
+    break;
+  case NOOSH_N_COND:
+    noosh_compile_cond(cc, n->test);
+    break;
+  case NOOSH_N_FUNC:
+    noosh_emit(cc, NOOSH_OP_DEFUN);
+    noosh_emit(cc, noosh_emit_str(cc, n->name, strlen(n->name)));
+    noosh_emit(cc, noosh_emit_str(cc, n->words[0].s, n->words[0].len));
+    break;
+  }
+
+  if (redirs) {
+    noosh_emit(cc, NOOSH_OP_REDIR_POP);
+    noosh_patch(cc, fail);
+  }
+}
+
+/*
+    @brief compile a syntax tree
+    @param n: the tree
+    @param src: the text it was parsed from
+    @return the code, ending with END
+*/
+struct noosh_code * noosh_compile(struct noosh_node * n, const char * src) {
+  struct noosh_code * code = noosh_malloc(sizeof(*code));
+  struct noosh_cc cc = {code, src};
+
+  memset(code, 0, sizeof(*code));
+  noosh_compile_node(&cc, n);
+  noosh_emit(&cc, NOOSH_OP_END);
+  return code;
+}
+
+/*
+    @brief compile all the commands of a text; a syntax error compiles to
+        an ERROR where the bad command starts, so that the commands before
+        it still run
+    @param src: the text
+    @param len: its length
+    @return the code, ending with END
+*/
+struct noosh_code * noosh_compile_source(const char * src, size_t len) {
+  struct noosh_code * code = noosh_malloc(sizeof(*code));
+  struct noosh_cc cc = {code, src};
+  struct noosh_arena arena = {0};
+  struct noosh_parser ps;
+  struct noosh_node * node;
+  char * msg;
+  int r;
+
+  memset(code, 0, sizeof(*code));
+  noosh_parser_init(&ps, src, len, 0, &arena);
+  while ((r = noosh_parse(&ps, &node)) == NOOSH_PARSE_OK) {
+    if (node != NULL) {
+      noosh_compile_node(&cc, node);
+    }
+    noosh_arena_reset(&arena);
+  }
+  if (r != NOOSH_PARSE_END) {
+    // The commands before run, then the error stops the script.
+    msg = ps.error ? ps.error : "unexpected end of file";
+    noosh_emit(&cc, NOOSH_OP_ERROR);
+    noosh_emit(&cc, noosh_emit_str(&cc, msg, strlen(msg)));
+  }
+  noosh_emit(&cc, NOOSH_OP_END);
+  noosh_arena_free(&arena);
+  return code;
+}
+
+/*
+  loop being run by the VM
+    brk and cont are where break and continue go, io the depth of the
+    descriptor table stack at the loop; values are those of a for
+*/
+struct noosh_vm_loop {
+  int brk;
+  int cont;
+  int io;
+  int status;
+  struct noosh_iter values;
+};
+
+/*
+  descriptor table pushed by REDIR_PUSH, and the one it replaced once
+  applied
+*/
+struct noosh_vm_io {
+  struct noosh_io io;
+  struct noosh_io * saved;
+};
+
+/*
+  the cell of IFS, looked up once for word splitting
+*/
+struct noosh_var * noosh_ifs_cell = NULL;
+
+/*
+    @brief drop the top descriptor table of the VM
+*/
+void noosh_vm_io_pop(struct noosh_vm_io ** ios, int * nios) {
+  struct noosh_vm_io * e = ios[--*nios];
+
+  if (e->saved) {
+    noosh_cur_io = e->saved;
+  }
+  noosh_io_close(&e->io);
+  noosh_io_wait(&e->io);
+  free(e);
+}
+
+/*
+    @brief push the fields of an unquoted variable value, split on IFS
+    @param stack: the VM stack
+    @param scratch: arena the fields are made in
+    @param v: the value, NULL if unset
+*/
+void noosh_vm_split(struct noosh_args * stack, struct noosh_arena * scratch, const char * v) {
+  struct noosh_expander x = {NOOSH_X_SPLIT, NULL, stack, {0}, 0, stack->n, scratch, 0, 0, 0};
+
+  if (v == NULL || v[0] == '\0') {
+    return;
+  }
+  if (noosh_ifs_cell == NULL) {
+    noosh_ifs_cell = noosh_var_cell("IFS");
+  }
+  x.ifs = noosh_var_value(noosh_ifs_cell) ? noosh_ifs_cell->value : " \t\n";
+  if (!noosh_opt_noglob) {
+    x.mode |= NOOSH_X_GLOB;
+  }
+  if (strpbrk(v, x.ifs) == NULL && !((x.mode & NOOSH_X_GLOB) && noosh_has_glob_char(v, strlen(v)))) {
+    noosh_args_push(stack, noosh_arena_strndup(scratch, v, strlen(v)));
+    return;
+  }
+  noosh_x_value(&x, v, strlen(v), 0);
+  noosh_x_field(&x, 0);
+  free(x.field.data);
+}
+
+/*
+    @brief run compiled code
+        dispatch is threaded: every op jumps straight to the next one's
+        label
+    @param code: the code
+    @return exit status of the last command, also left in $?
+*/
+int noosh_vm_run(struct noosh_code * code) {
+  static void * labels[] = {
+    &&op_lit, &&op_var, &&op_qvar, &&op_len, &&op_word, &&op_strword,
+    &&op_cat, &&op_set, &&op_mark, &&op_assign_end, &&op_run_builtin,
+    &&op_run, &&op_redir_push, &&op_redir_apply, &&op_redir_pop,
+    &&op_jump, &&op_jump_if_fail, &&op_jump_if_ok, &&op_not, &&op_status,
+    &&op_loop_push, &&op_loop_save, &&op_loop_pop, &&op_for_init,
+    &&op_for_lazy, &&op_for_params, &&op_for_next, &&op_case_set,
+    &&op_case_lit, &&op_case_match, &&op_exec, &&op_defun, &&op_num,
+    &&op_load, &&op_store, &&op_arith, &&op_incr, &&op_jump_if_zero,
+    &&op_jump_if_nonzero, &&op_drop, &&op_num_str, &&op_num_status,
+    &&op_eval, &&op_assign_word, &&op_elems, &&op_error, &&op_test,
+    &&op_end
+  };
+  const int * ops = code->ops;
+  const char * strs = code->strs.data;
+  struct noosh_args stack = {0};
+  struct noosh_arena scratch = {0};
+  struct noosh_buf subject = {0};
+  struct noosh_vm_loop * loops = NULL, * l;
+  struct noosh_vm_io ** ios = NULL;
+  struct noosh_parser ps;
+  struct noosh_word w;
+  struct noosh_func * f;
+  unsigned long mark = noosh_substs;
+  int pc = 0, nloops = 0, nios = 0, failed = 0, case_end = 0, i, n;
+  long long * nums = NULL, a, b;
+  int nnums = 0, numcap = 0;
+  const char * v;
+  char * s;
+  size_t len;
+  pid_t pid;
+
+# define NOOSH_VM_NEXT goto * labels[ops[pc++]]
+# define NOOSH_VM_POP (stack.v[--stack.n])
+# define NOOSH_VM_DONE do { stack.n = nnums = 0; noosh_arena_reset(&scratch); } while (0)
+# define NOOSH_VM_PUSH_NUM(x) do { \
+    if (nnums == numcap) { \
+      numcap = numcap ? 2 * numcap : 16; \
+      nums = noosh_realloc(nums, numcap * sizeof(*nums)); \
+    } \
+    nums[nnums++] = (x); \
+  } while (0)
+
+  if (code->cells == NULL && code->nslots > 0) {
+    code->cells = noosh_malloc(code->nslots * sizeof(*code->cells));
+    for (i = 0; i < code->nslots; i++) {
+      code->cells[i] = noosh_var_cell(strs + code->slots[i]);
+    }
+  }
+  if (code->nodes == NULL && code->nnodes > 0) {
+    code->nodes = noosh_malloc(code->nnodes * sizeof(*code->nodes));
+    memset(code->nodes, 0, code->nnodes * sizeof(*code->nodes));
+  }
+  NOOSH_VM_NEXT;
+
+op_lit:
+  noosh_args_push(&stack, (char *) strs + ops[pc++]);
+  NOOSH_VM_NEXT;
+op_var:
+  noosh_vm_split(&stack, &scratch, noosh_var_value(code->cells[ops[pc++]]));
+  NOOSH_VM_NEXT;
+op_qvar:
+  v = noosh_var_value(code->cells[ops[pc++]]);
+  noosh_args_push(&stack, v ? noosh_arena_strndup(&scratch, v, strlen(v)) : "");
+  NOOSH_VM_NEXT;
+op_len:
+  v = noosh_var_value(code->cells[ops[pc++]]);
+  s = noosh_arena_alloc(&scratch, 24);
+  sprintf(s, "%zu", v ? strlen(v) : 0);
+  noosh_args_push(&stack, s);
+  NOOSH_VM_NEXT;
+op_word:
+  w.s = (char *) strs + ops[pc];
+  w.len = ops[pc + 1];
+  w.flags = ops[pc + 2];
+  pc += 3;
+  // The fields are made in the scratch arena, right on the stack.
+  if (!failed && noosh_expand_word_in(&w, NOOSH_X_SPLIT, &stack, &scratch) < 0) {
+    failed = 1;
+  }
+  NOOSH_VM_NEXT;
+op_strword:
+  w.s = (char *) strs + ops[pc];
+  w.len = ops[pc + 1];
+  w.flags = ops[pc + 2];
+  s = failed ? NULL : noosh_expand_string(&w, ops[pc + 3]);
+  pc += 4;
+  if (s == NULL) {
+    failed = 1;
+    noosh_args_push(&stack, "");
+  } else {
+    noosh_args_push(&stack, noosh_arena_strndup(&scratch, s, strlen(s)));
+    free(s);
+  }
+  NOOSH_VM_NEXT;
+op_cat:
+  n = ops[pc++];
+  for (i = stack.n - n, len = 0; i < stack.n; i++) {
+    len += strlen(stack.v[i]);
+  }
+  s = noosh_arena_alloc(&scratch, len + 1);
+  for (i = stack.n - n, len = 0; i < stack.n; i++) {
+    len = stpcpy(s + len, stack.v[i]) - s;
+  }
+  stack.n -= n;
+  noosh_args_push(&stack, s);
+  NOOSH_VM_NEXT;
+op_set:
+  s = NOOSH_VM_POP;
+  stack.v[stack.n] = NULL;
+  if (!failed && noosh_var_set(code->cells[ops[pc]], s) < 0) {
+    failed = 1;
+  }
+  pc++;
+  NOOSH_VM_NEXT;
+op_mark:
+  mark = noosh_substs;
+  NOOSH_VM_NEXT;
+op_assign_end:
+  noosh_last_status = failed ? 1 : mark != noosh_substs ? noosh_last_status : 0;
+  failed = 0;
+  NOOSH_VM_DONE;
+  NOOSH_VM_NEXT;
+op_run_builtin:
+  n = ops[pc++];
+  if (failed) {
+    failed = 0;
+    noosh_last_status = 1;
+  } else if (noosh_nfuncs > 0 && (f = noosh_find_func(stack.v[0])) != NULL) {
+    noosh_last_status = noosh_call_func(f, stack.v);
+  } else {
+    noosh_last_status = ( * builtin_func[n])(stack.v);
+  }
+  NOOSH_VM_DONE;
+  if (NOOSH_UNWINDING) {
+    goto unwind;
+  }
+  NOOSH_VM_NEXT;
+op_run:
+  if (failed) {
+    failed = 0;
+    noosh_last_status = 1;
+  } else if (stack.n == 0) {
+    noosh_last_status = mark != noosh_substs ? noosh_last_status : 0;
+  } else if ((f = noosh_find_func(stack.v[0])) != NULL) {
+    noosh_last_status = noosh_call_func(f, stack.v);
+  } else if ((n = noosh_find_builtin(stack.v[0])) >= 0) {
+    noosh_last_status = ( * builtin_func[n])(stack.v);
+  } else {
+    pid = noosh_spawn(stack.v, NULL, noosh_cur_io);
+    noosh_last_status = pid > 0 ? noosh_wait(pid) : 1;
+  }
+  NOOSH_VM_DONE;
+  if (NOOSH_UNWINDING) {
+    goto unwind;
+  }
+  NOOSH_VM_NEXT;
+op_redir_push:
+  if ((nios & (nios - 1)) == 0) {
+    ios = noosh_realloc(ios, (nios ? 2 * nios : 1) * sizeof(*ios));
+  }
+  ios[nios] = noosh_malloc(sizeof(**ios));
+  noosh_io_init(&ios[nios]->io);
+  ios[nios++]->saved = NULL;
+  NOOSH_VM_NEXT;
+op_redir_apply:
+  if (failed || noosh_redirect(stack.v, &ios[nios - 1]->io) < 0) {
+    failed = 0;
+    noosh_vm_io_pop(ios, &nios);
+    noosh_last_status = 1;
+    pc = ops[pc];
+  } else {
+    ios[nios - 1]->saved = noosh_cur_io;
+    noosh_cur_io = &ios[nios - 1]->io;
+    pc++;
+  }
+  NOOSH_VM_DONE;
+  NOOSH_VM_NEXT;
+op_redir_pop:
+  noosh_vm_io_pop(ios, &nios);
+  NOOSH_VM_NEXT;
+op_jump:
+  pc = ops[pc];
+  NOOSH_VM_NEXT;
+op_jump_if_fail:
+  pc = noosh_last_status != 0 ? ops[pc] : pc + 1;
+  NOOSH_VM_NEXT;
+op_jump_if_ok:
+  pc = noosh_last_status == 0 ? ops[pc] : pc + 1;
+  NOOSH_VM_NEXT;
+op_not:
+  noosh_last_status = !noosh_last_status;
+  NOOSH_VM_NEXT;
+op_status:
+  noosh_last_status = ops[pc++];
+  NOOSH_VM_NEXT;
+op_loop_push:
+  if ((nloops & (nloops - 1)) == 0) {
+    loops = noosh_realloc(loops, (nloops ? 2 * nloops : 1) * sizeof(*loops));
+  }
+  l = &loops[nloops++];
+  memset(l, 0, sizeof(*l));
+  l->brk = ops[pc];
+  l->cont = ops[pc + 1];
+  l->io = nios;
+  pc += 2;
+  noosh_loop_depth++;
+  NOOSH_VM_NEXT;
+op_loop_save:
+  loops[nloops - 1].status = noosh_last_status;
+  NOOSH_VM_NEXT;
+op_loop_pop:
+  l = &loops[--nloops];
+  noosh_last_status = l->status;
+  noosh_iter_free(&l->values);
+  noosh_loop_depth--;
+  NOOSH_VM_NEXT;
+op_for_init:
+  l = &loops[nloops - 1];
+  if (failed) {
+    failed = 0;
+    l->status = 1;
+    pc = ops[pc];
+  } else {
+    noosh_iter_add_values(&l->values, stack.v, stack.n);
+    pc++;
+  }
+  NOOSH_VM_DONE;
+  NOOSH_VM_NEXT;
+op_for_lazy:
+  l = &loops[nloops - 1];
+  noosh_iter_add_values(&l->values, stack.v, stack.n);
+  w = (struct noosh_word) {(char *) strs + ops[pc], strlen(strs + ops[pc]), ops[pc + 1]};
+  if (!failed && noosh_iter_add_word(&l->values, &w) < 0) {
+    failed = 1;
+  }
+  pc += 2;
+  NOOSH_VM_DONE;
+  NOOSH_VM_NEXT;
+op_for_params:
+  l = &loops[nloops - 1];
+  noosh_iter_add_values(&l->values, noosh_params, noosh_nparams);
+  NOOSH_VM_NEXT;
+op_for_next:
+  l = &loops[nloops - 1];
+  if ((v = noosh_iter_next(&l->values)) != NULL) {
+    noosh_var_set(code->cells[ops[pc]], v);
+    pc += 2;
+  } else {
+    pc = ops[pc + 1];
+  }
+  noosh_arena_reset(&scratch);
+  NOOSH_VM_NEXT;
+op_case_set:
+  s = NOOSH_VM_POP;
+  case_end = ops[pc++];
+  subject.len = 0;
+  noosh_buf_append(&subject, s, strlen(s));
+  if (failed) {
+    failed = 0;
+    noosh_last_status = 1;
+    pc = case_end;
+  }
+  NOOSH_VM_DONE;
+  NOOSH_VM_NEXT;
+op_case_lit:
+  pc = fnmatch(strs + ops[pc], subject.data, 0) == 0 ? ops[pc + 1] : pc + 2;
+  NOOSH_VM_NEXT;
+op_case_match:
+  s = NOOSH_VM_POP;
+  if (failed) {
+    failed = 0;
+    noosh_last_status = 1;
+    pc = case_end;
+  } else {
+    pc = fnmatch(s, subject.data, 0) == 0 ? ops[pc] : pc + 1;
+  }
+  NOOSH_VM_DONE;
+  NOOSH_VM_NEXT;
+op_exec:
+  if (code->nodes[ops[pc + 1]] == NULL) {
+    v = strs + ops[pc];
+    noosh_parser_init(&ps, v, strlen(v), 0, &code->arena);
+    noosh_parse(&ps, &code->nodes[ops[pc + 1]]);
+  }
+  if (code->nodes[ops[pc + 1]]) {
+    noosh_execute(code->nodes[ops[pc + 1]]);
+  }
+  pc += 2;
+  if (NOOSH_UNWINDING) {
+    goto unwind;
+  }
+  NOOSH_VM_NEXT;
+op_defun:
+  noosh_last_status = noosh_define_func(strs + ops[pc], strs + ops[pc + 1]);
+  pc += 2;
+  NOOSH_VM_NEXT;
+op_num:
+  NOOSH_VM_PUSH_NUM((long long) ((unsigned int) ops[pc] | (unsigned long long) (unsigned int) ops[pc + 1] << 32));
+  pc += 2;
+  NOOSH_VM_NEXT;
+op_load:
+  if (noosh_var_num(code->cells[ops[pc++]], &a) < 0) {
+    failed = 1;
+    a = 0;
+  }
+  NOOSH_VM_PUSH_NUM(a);
+  NOOSH_VM_NEXT;
+op_store:
+  if (noosh_var_set_num(code->cells[ops[pc++]], nums[nnums - 1]) < 0) {
+    failed = 1;
+  }
+  NOOSH_VM_NEXT;
+op_arith:
+  n = ops[pc++];
+  if (n >= NOOSH_A_NEG) {
+    a = nums[nnums - 1];
+    b = 0;
+  } else {
+    b = nums[--nnums];
+    a = nums[nnums - 1];
+  }
+  if (noosh_arith_apply(n, a, b, &nums[nnums - 1]) < 0) {
+    failed = 1;
+    nums[nnums - 1] = 0;
+  }
+  NOOSH_VM_NEXT;
+op_incr:
+  if (noosh_var_num(code->cells[ops[pc]], &a) < 0) {
+    failed = 1;
+    a = 0;
+  }
+  b = (long long) ((unsigned long long) a + ops[pc + 1]);
+  if (noosh_var_set_num(code->cells[ops[pc]], b) < 0) {
+    failed = 1;
+  }
+  NOOSH_VM_PUSH_NUM(ops[pc + 2] ? a : b);
+  pc += 3;
+  NOOSH_VM_NEXT;
+op_jump_if_zero:
+  pc = nums[--nnums] == 0 ? ops[pc] : pc + 1;
+  NOOSH_VM_NEXT;
+op_jump_if_nonzero:
+  pc = nums[--nnums] != 0 ? ops[pc] : pc + 1;
+  NOOSH_VM_NEXT;
+op_drop:
+  nnums--;
+  NOOSH_VM_NEXT;
+op_num_str:
+  s = noosh_arena_alloc(&scratch, 24);
+  sprintf(s, "%lld", nums[--nnums]);
+  noosh_args_push(&stack, s);
+  NOOSH_VM_NEXT;
+op_num_status:
+  a = nums[--nnums];
+  noosh_last_status = failed ? 1 : a == 0;
+  failed = 0;
+  NOOSH_VM_DONE;
+  NOOSH_VM_NEXT;
+op_test:
+  s = ops[pc] >= NOOSH_TEST_MATCH ? NOOSH_VM_POP : NULL;
+  v = NOOSH_VM_POP;
+  noosh_last_status = failed ? 1 : noosh_cond_test(ops[pc], v, s, strs + ops[pc + 1]);
+  pc += 2;
+  failed = 0;
+  NOOSH_VM_DONE;
+  NOOSH_VM_NEXT;
+op_eval:
+  s = NOOSH_VM_POP;
+  if (failed || noosh_arith_text(s, strlen(s), &a) < 0) {
+    failed = 1;
+    a = 0;
+  }
+  NOOSH_VM_PUSH_NUM(a);
+  NOOSH_VM_NEXT;
+op_assign_word:
+  w.s = (char *) strs + ops[pc];
+  w.len = ops[pc + 1];
+  w.flags = ops[pc + 2];
+  pc += 3;
+  if (!failed && noosh_assign_word(&w) < 0) {
+    failed = 1;
+  }
+  NOOSH_VM_NEXT;
+op_elems:
+  // Each element is its own field: nothing is joined or split.
+  for (len = 0; (v = noosh_var_next(code->cells[ops[pc]], &len, 0, NULL)) != NULL; ) {
+    noosh_args_push(&stack, noosh_arena_strndup(&scratch, v, strlen(v)));
+  }
+  pc++;
+  NOOSH_VM_NEXT;
+op_error:
+  fprintf(stderr, "noosh: syntax error: %s\n", strs + ops[pc]);
+  noosh_last_status = 2;
+  goto out;
+
+unwind:
+  // break, continue, return or exit: settle it with the innermost loop,
+  // or leave the code.
+  if (noosh_exit_pending || noosh_returning || nloops == 0) {
+    goto out;
+  }
+  l = &loops[nloops - 1];
+  while (nios > l->io) {
+    noosh_vm_io_pop(ios, &nios);
+  }
+  l->status = noosh_last_status;
+  if (noosh_breaking) {
+    noosh_breaking--;
+  } else if (--noosh_continuing == 0) {
+    pc = l->cont;
+    NOOSH_VM_NEXT;
+  }
+  noosh_last_status = l->status;
+  noosh_iter_free(&l->values);
+  nloops--;
+  noosh_loop_depth--;
+  if (NOOSH_UNWINDING) {
+    goto unwind;
+  }
+  pc = l->brk;
+  NOOSH_VM_NEXT;
+
+op_end:
+out:
+  while (nios > 0) {
+    noosh_vm_io_pop(ios, &nios);
+  }
+  while (nloops > 0) {
+    noosh_iter_free(&loops[--nloops].values);
+    noosh_loop_depth--;
+  }
+  free(ios);
+  free(loops);
+  free(nums);
+  free(stack.v);
+  free(subject.data);
+  noosh_arena_free(&scratch);
+  return noosh_last_status;
+
+# undef NOOSH_VM_NEXT
+# undef NOOSH_VM_POP
+# undef NOOSH_VM_DONE
+# undef NOOSH_VM_PUSH_NUM
+}
+
+/*
+    @brief print compiled code, and that of the functions it defines
+    @param code: the code
+    @param title: heading
+*/
+void noosh_disasm(struct noosh_code * code, const char * title) {
+  struct noosh_arena arena = {0};
+  struct noosh_parser ps;
+  struct noosh_node * body;
+  struct noosh_code * sub;
+  const char * strs = code->strs.data;
+  const int * ops = code->ops;
+  char * name;
+  int pc, op, i;
+
+  printf("%s:\n", title);
+  for (pc = 0; pc < code->nops; pc += 1 + noosh_op_nargs[op]) {
+    op = ops[pc];
+    printf(noosh_op_nargs[op] ? "%6d  %-12s" : "%6d  %s", pc, noosh_op_str[op]);
+    for (i = 1; i <= noosh_op_nargs[op]; i++) {
+      printf(" %d", ops[pc + i]);
+    }
+    switch (op) {
+    case NOOSH_OP_LIT:
+    case NOOSH_OP_CASE_LIT:
+    case NOOSH_OP_ERROR:
+      printf("\t; '%s'", strs + ops[pc + 1]);
+      break;
+    case NOOSH_OP_WORD:
+    case NOOSH_OP_STRWORD:
+    case NOOSH_OP_FOR_LAZY:
+    case NOOSH_OP_EXEC:
+    case NOOSH_OP_ASSIGN_WORD:
+      printf("\t; %s", strs + ops[pc + 1]);
+      break;
+    case NOOSH_OP_VAR:
+    case NOOSH_OP_QVAR:
+    case NOOSH_OP_LEN:
+    case NOOSH_OP_SET:
+    case NOOSH_OP_FOR_NEXT:
+    case NOOSH_OP_LOAD:
+    case NOOSH_OP_STORE:
+    case NOOSH_OP_INCR:
+    case NOOSH_OP_ELEMS:
+      printf("\t; %s", strs + code->slots[ops[pc + 1]]);
+      break;
+    case NOOSH_OP_NUM:
+      printf("\t; %lld", (long long) ((unsigned int) ops[pc + 1] | (unsigned long long) (unsigned int) ops[pc + 2] << 32));
+      break;
+    case NOOSH_OP_ARITH:
+      printf("\t; %s", noosh_arith_str[ops[pc + 1]]);
+      break;
+    case NOOSH_OP_RUN_BUILTIN:
+      printf("\t; %s", builtin_str[ops[pc + 1]]);
+      break;
+    case NOOSH_OP_TEST:
+      printf("\t; %s", noosh_test_name(ops[pc + 1]));
+      break;
+    case NOOSH_OP_DEFUN:
+      printf("\t; %s", strs + ops[pc + 1]);
+      break;
+    }
+    printf("\n");
+  }
+
+  for (pc = 0; pc < code->nops; pc += 1 + noosh_op_nargs[ops[pc]]) {
+    if (ops[pc] != NOOSH_OP_DEFUN) {
+      continue;
+    }
+    noosh_parser_init(&ps, strs + ops[pc + 2], strlen(strs + ops[pc + 2]), 0, &arena);
+    if (noosh_parse(&ps, &body) == NOOSH_PARSE_OK && body) {
+      sub = noosh_compile(body, strs + ops[pc + 2]);
+      name = noosh_malloc(strlen(strs + ops[pc + 1]) + 16);
+      sprintf(name, "\nfunction %s", strs + ops[pc + 1]);
+      noosh_disasm(sub, name);
+      free(name);
+      noosh_code_free(sub);
+    }
+    noosh_arena_reset(&arena);
+  }
+  noosh_arena_free(&arena);
+}
+
+/*
+    @brief compile a script and print its code, for --disasm
+    @param path: the script
+    @return 0, or 1 if it cannot be read
+*/
+int noosh_disasm_file(const char * path) {
+  struct noosh_buf text = {0};
+  struct noosh_code * code;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0 || noosh_slurp(fd, &text) < 0) {
+    fprintf(stderr, "noosh: %s: %s\n", path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+  close(fd);
+  code = noosh_compile_source(text.data ? text.data : "", text.len);
+  noosh_disasm(code, path);
+  noosh_code_free(code);
+  free(text.data);
+  return 0;
+}
+
+/*
+  Bytecode cache
+
+  The code compiled from a script file is saved in a cache directory and
+  mapped back instead of parsing and compiling the script again, as long
+  as (real path, size, mtime, build id) recorded with it still match. The
+  file is named after a hash of the path and build id, so an edited
+  script replaces its stale entry. Entries are written to a temporary
+  file and renamed into place, so a shell never maps a half written one.
+  Hit and miss counters live in a shared file of the directory, updated
+  atomically by all shells.
+
+  The build id is a hash of what the code means: the opcodes and the
+  kinds of their operands, the builtins, operators and tests they name
+  by number, the word flags and the layout of the file. Builds that
+  would read an entry alike share it, and no two that would not do,
+  whenever and however they were built. A loaded entry is checked
+  against a sum of its contents and op by op, and is compiled again
+  from the script if it is damaged.
+*/
+
+# define NOOSH_CACHE_MAGIC "NOOSHBC\2"
+
+/*
+  header of a cache file, followed by the script's real path, then ops,
+  slots and strings, each padded to a multiple of 8 bytes; sum is a hash
+  of all that follows the header
+*/
+struct noosh_cache_header {
+  char magic[8];
+  unsigned long long build;
+  unsigned long long sum;
+  unsigned long long size;
+  long long mtime_sec;
+  long long mtime_nsec;
+  unsigned int pathlen;
+  unsigned int nops;
+  unsigned int nslots;
+  unsigned int nnodes;
+  unsigned long long strslen;
+};
+
+/*
+  hits and misses of all shells using the cache directory
+*/
+struct noosh_cache_counters {
+  unsigned long long hits;
+  unsigned long long misses;
+};
+
+struct noosh_cache_counters * noosh_cache_counters = NULL;
+
+# define NOOSH_PAD8(n) (((n) + 7) & ~(size_t) 7)
+
+/*
+    @brief find the cache directory, creating it if needed: $NOOSH_CACHE_DIR,
+        or noosh under $XDG_CACHE_HOME or ~/.cache
+    @return allocated path, NULL if there is none (NOOSH_CACHE_DIR set
+        but empty turns the cache off)
+*/
+char * noosh_cache_dir(void) {
+  const char * dir = noosh_getvar("NOOSH_CACHE_DIR"), * base;
+  char * path;
+
+  if (dir) {
+    if (dir[0] == '\0') {
+      return NULL;
+    }
+    path = noosh_strdup(dir);
+  } else if ((base = noosh_getvar("XDG_CACHE_HOME")) != NULL && base[0] == '/') {
+    path = noosh_malloc(strlen(base) + 8);
+    sprintf(path, "%s/noosh", base);
+  } else if ((base = noosh_getvar("HOME")) != NULL && base[0] == '/') {
+    path = noosh_malloc(strlen(base) + 16);
+    sprintf(path, "%s/.cache", base);
+    mkdir(path, 0700);
+    strcat(path, "/noosh");
+  } else {
+    return NULL;
+  }
+  if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+    free(path);
+    return NULL;
+  }
+  return path;
+}
+
+/*
+    @brief map the shared hit and miss counters of a cache directory
+*/
+void noosh_cache_map_counters(const char * dir) {
+  char * path;
+  void * p;
+  int fd;
+
+  if (noosh_cache_counters != NULL) {
+    return;
+  }
+  path = noosh_malloc(strlen(dir) + 8);
+  sprintf(path, "%s/stats", dir);
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  free(path);
+  if (fd < 0) {
+    return;
+  }
+  if (ftruncate(fd, sizeof(struct noosh_cache_counters)) == 0) {
+    p = mmap(NULL, sizeof(struct noosh_cache_counters), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) {
+      noosh_cache_counters = p;
+    }
+  }
+  close(fd);
+}
+
+/*
+    @brief the build id of cached code, see above
+    @return a hash of the opcodes, operand kinds and the tables and
+        layout they depend on
+*/
+unsigned long noosh_cache_build(void) {
+  static unsigned long build = 0;
+  int layout[] = {
+    sizeof(struct noosh_cache_header), sizeof(int), NOOSH_OP_END, NOOSH_A_COMMA,
+    NOOSH_TEST_SAME, NOOSH_W_QUOTED, NOOSH_W_EXPAND, NOOSH_W_ASSIGN, NOOSH_W_BRACE,
+    NOOSH_W_TILDE, NOOSH_W_GLOB, NOOSH_X_SPLIT, NOOSH_X_PATTERN, NOOSH_X_ASSIGN,
+    NOOSH_X_REGEX, NOOSH_X_GLOB
+  };
+  unsigned long h;
+  size_t i;
+
+  if (build != 0) {
+    return build;
+  }
+  h = noosh_hash(NOOSH_CACHE_MAGIC, 8);
+  for (i = 0; i <= NOOSH_OP_END; i++) {
+    h = noosh_hash_more(h, noosh_op_str[i], strlen(noosh_op_str[i]) + 1);
+    h = noosh_hash_more(h, noosh_op_operands[i], strlen(noosh_op_operands[i]) + 1);
+  }
+  for (i = 0; i < (size_t) noosh_num_builtins(); i++) {
+    h = noosh_hash_more(h, builtin_str[i], strlen(builtin_str[i]) + 1);
+  }
+  for (i = 0; i < sizeof(noosh_arith_str) / sizeof(*noosh_arith_str); i++) {
+    h = noosh_hash_more(h, noosh_arith_str[i], strlen(noosh_arith_str[i]) + 1);
+  }
+  for (i = 0; i < sizeof(noosh_test_op) / sizeof(*noosh_test_op); i++) {
+    h = noosh_hash_more(h, noosh_test_op[i], strlen(noosh_test_op[i]) + 1);
+  }
+  h = noosh_hash_more(h, noosh_test_code, sizeof(noosh_test_code));
+  build = noosh_hash_more(h, layout, sizeof(layout));
+  return build;
+}
+
+/*
+    @brief name of the cache file of a script
+    @param dir: cache directory
+    @param real: real path of the script
+    @return allocated path
+*/
+char * noosh_cache_path(const char * dir, const char * real) {
+  unsigned long long build = noosh_cache_build();
+  char * path;
+  unsigned long h;
+
+  h = noosh_hash_more(noosh_hash(real, strlen(real)), &build, sizeof(build));
+  path = noosh_malloc(strlen(dir) + 24);
+  sprintf(path, "%s/%016lx.nbc", dir, h);
+  return path;
+}
+
+/*
+    @brief sum the contents of a cache file, 8 bytes at a time so that
+        checking an entry costs little next to mapping it
+    @param p: the contents after the header
+    @param len: their length
+    @return the sum
+*/
+unsigned long noosh_cache_sum(const char * p, size_t len) {
+  unsigned long h = 14695981039346656037UL, w;
+  size_t i;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 1099511628211UL;
+  }
+  return noosh_hash_more(h, p + i, len - i);
+}
+
+/*
+    @brief check that the ops of loaded code only refer to what it has:
+        known opcodes with all their operands, jumps to the start of an
+        op, and slots, strings, nodes, builtins, operators and tests that
+        exist, ending with END
+    @param code: the code
+    @return 0, -1 if it is damaged
+*/
+int noosh_code_check(struct noosh_code * code) {
+  const int * ops = code->ops;
+  long long strslen = code->strs.len;
+  char * starts = noosh_malloc(code->nops);
+  const char * k;
+  int pc, op = NOOSH_OP_END, arg, ok = 1;
+
+  memset(starts, 0, code->nops);
+  for (pc = 0; ok && pc < code->nops; pc += 1 + noosh_op_nargs[op]) {
+    op = ops[pc];
+    if (op < 0 || op > NOOSH_OP_END || pc + noosh_op_nargs[op] >= code->nops) {
+      ok = 0;
+      break;
+    }
+    starts[pc] = 1;
+  }
+  for (pc = 0; ok && pc < code->nops; pc += 1 + noosh_op_nargs[ops[pc]]) {
+    for (k = noosh_op_operands[ops[pc]], arg = pc + 1; ok && *k; k++, arg++) {
+      switch (*k) {
+      case 's':
+        ok = ops[arg] >= 0 && ops[arg] < strslen;
+        break;
+      case 'l':
+        ok = ops[arg] >= 0 && (long long) ops[arg - 1] + ops[arg] < strslen;
+        break;
+      case 'v':
+        ok = ops[arg] >= 0 && ops[arg] < code->nslots;
+        break;
+      case 'p':
+        ok = ops[arg] >= 0 && ops[arg] < code->nops && starts[ops[arg]];
+        break;
+      case 'b':
+        ok = ops[arg] >= 0 && ops[arg] < noosh_num_builtins();
+        break;
+      case 'x':
+        ok = ops[arg] >= 0 && ops[arg] < code->nnodes;
+        break;
+      case 'a':
+        ok = ops[arg] >= NOOSH_A_MUL && ops[arg] <= NOOSH_A_BNOT;
+        break;
+      case 't':
+        ok = ops[arg] >= 0 && ops[arg] <= NOOSH_TEST_SAME;
+        break;
+      }
+    }
+  }
+  for (pc = 0; ok && pc < code->nslots; pc++) {
+    ok = code->slots[pc] >= 0 && code->slots[pc] < strslen;
+  }
+  free(starts);
+  return ok && op == NOOSH_OP_END ? 0 : -1;
+}
+
+/*
+    @brief map a cache file and check it belongs to the script
+    @param path: cache file
+    @param real: real path of the script
+    @param st: status of the script
+    @return code that runs from the mapping, NULL if the entry is missing,
+        stale or damaged
+*/
+struct noosh_code * noosh_cache_load(const char * path, const char * real, struct stat * st) {
+  struct noosh_cache_header h;
+  struct noosh_code * code;
+  struct stat cst;
+  size_t off, need;
+  char * map;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &cst) < 0 || (size_t) cst.st_size < sizeof(h)) {
+    close(fd);
+    return NULL;
+  }
+  // Private and writable: nothing writes it, but the code is not const.
+  map = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  memcpy(&h, map, sizeof(h));
+  off = NOOSH_PAD8(sizeof(h));
+  need = off + NOOSH_PAD8(h.pathlen) + NOOSH_PAD8(h.nops * sizeof(int)) +
+         NOOSH_PAD8(h.nslots * sizeof(int)) + h.strslen;
+  if (memcmp(h.magic, NOOSH_CACHE_MAGIC, 8) != 0 || h.build != noosh_cache_build() ||
+      need != (size_t) cst.st_size || h.size != (unsigned long long) st->st_size ||
+      h.mtime_sec != st->st_mtim.tv_sec || h.mtime_nsec != st->st_mtim.tv_nsec ||
+      h.pathlen != strlen(real) || memcmp(map + off, real, h.pathlen) != 0 ||
+      h.nops == 0 || h.nops > INT_MAX / sizeof(int) || h.nslots > INT_MAX / sizeof(int) ||
+      h.nnodes > INT_MAX || h.strslen == 0 || map[cst.st_size - 1] != '\0' ||
+      h.sum != noosh_cache_sum(map + off, cst.st_size - off)) {
+    munmap(map, cst.st_size);
+    return NULL;
+  }
+
+  code = noosh_malloc(sizeof(*code));
+  memset(code, 0, sizeof(*code));
+  code->map = map;
+  code->maplen = cst.st_size;
+  off += NOOSH_PAD8(h.pathlen);
+  code->ops = (int *) (map + off);
+  code->nops = h.nops;
+  off += NOOSH_PAD8(h.nops * sizeof(int));
+  code->slots = (int *) (map + off);
+  code->nslots = h.nslots;
+  off += NOOSH_PAD8(h.nslots * sizeof(int));
+  code->strs.data = map + off;
+  code->strs.len = h.strslen;
+  code->nnodes = h.nnodes;
+  if (noosh_code_check(code) < 0) {
+    noosh_code_free(code);
+    return NULL;
+  }
+  return code;
+}
+
+/*
+    @brief replace a cache file atomically
+    @param path: cache file
+    @param data: its new contents
+    @param len: their length
+*/
+void noosh_cache_replace(const char * path, const char * data, size_t len) {
+  char * tmp;
+  int fd, ok;
+
+  // Other shells may be storing the same entry: each writes its own
+  // temporary file, and the last rename wins with a complete file.
+  tmp = noosh_malloc(strlen(path) + 32);
+  sprintf(tmp, "%s.%d.tmp", path, (int) getpid());
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd >= 0) {
+    ok = noosh_write_all(fd, data, len) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp, path) < 0) {
+      unlink(tmp);
+    }
+  }
+  free(tmp);
+}
+
+/*
+    @brief save compiled code to the cache, atomically
+    @param path: cache file
+    @param real: real path of the script
+    @param st: status of the script when it was read
+    @param code: the code
+*/
+void noosh_cache_store(const char * path, const char * real, struct stat * st,
+                       struct noosh_code * code) {
+  static const char zeros[8];
+  struct noosh_cache_header h;
+  struct noosh_buf out = {0};
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, NOOSH_CACHE_MAGIC, 8);
+  h.build = noosh_cache_build();
+  h.size = st->st_size;
+  h.mtime_sec = st->st_mtim.tv_sec;
+  h.mtime_nsec = st->st_mtim.tv_nsec;
+  h.pathlen = strlen(real);
+  h.nops = code->nops;
+  h.nslots = code->nslots;
+  h.nnodes = code->nnodes;
+  h.strslen = code->strs.len;
+
+  noosh_buf_append(&out, (char *) &h, sizeof(h));
+  noosh_buf_append(&out, zeros, NOOSH_PAD8(out.len) - out.len);
+  noosh_buf_append(&out, real, h.pathlen);
+  noosh_buf_append(&out, zeros, NOOSH_PAD8(out.len) - out.len);
+  noosh_buf_append(&out, (char *) code->ops, h.nops * sizeof(int));
+  noosh_buf_append(&out, zeros, NOOSH_PAD8(out.len) - out.len);
+  // Code without variables or strings has no arrays to copy.
+  if (h.nslots > 0) {
+    noosh_buf_append(&out, (char *) code->slots, h.nslots * sizeof(int));
+  }
+  noosh_buf_append(&out, zeros, NOOSH_PAD8(out.len) - out.len);
+  if (h.strslen > 0) {
+    noosh_buf_append(&out, code->strs.data, h.strslen);
+  }
+  h.sum = noosh_cache_sum(out.data + NOOSH_PAD8(sizeof(h)), out.len - NOOSH_PAD8(sizeof(h)));
+  memcpy(out.data, &h, sizeof(h));
+  noosh_cache_replace(path, out.data, out.len);
+  free(out.data);
+}
+
+/*
+    @brief get the code of a script file, from the cache when it is up to
+        date, otherwise compiled from the text and cached
+    @param path: the script
+    @return the code, NULL after printing an error if it cannot be read
+*/
+struct noosh_code * noosh_cache_code(const char * path) {
+  struct noosh_buf text = {0};
+  struct noosh_code * code = NULL;
+  struct stat st;
+  char * dir, * real = NULL, * entry = NULL;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    goto fail;
+  }
+  if ((dir = noosh_cache_dir()) != NULL && (real = realpath(path, NULL)) != NULL) {
+    noosh_cache_map_counters(dir);
+    entry = noosh_cache_path(dir, real);
+    if ((code = noosh_cache_load(entry, real, &st)) != NULL) {
+      if (noosh_cache_counters) {
+        __atomic_add_fetch(&noosh_cache_counters->hits, 1, __ATOMIC_RELAXED);
+      }
+      close(fd);
+      free(dir);
+      free(real);
+      free(entry);
+      return code;
+    }
+    if (noosh_cache_counters) {
+      __atomic_add_fetch(&noosh_cache_counters->misses, 1, __ATOMIC_RELAXED);
+    }
+  }
+  free(dir);
+
+  if (noosh_slurp(fd, &text) < 0) {
+    goto fail;
+  }
+  close(fd);
+  code = noosh_compile_source(text.data ? text.data : "", text.len);
+  if (entry) {
+    noosh_cache_store(entry, real, &st, code);
+  }
+  free(text.data);
+  free(real);
+  free(entry);
+  return code;
+
+fail:
+  fprintf(stderr, "noosh: %s: %s\n", path, strerror(errno));
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(text.data);
+  free(real);
+  free(entry);
+  return NULL;
+}
+
+/*
+    @brief report the cache counters and size, for --cache-stats
+    @return 0, or 1 if there is no cache directory
+*/
+int noosh_cache_stats(void) {
+  char * dir = noosh_cache_dir();
+  struct dirent * e;
+  struct stat st;
+  unsigned long long hits, misses, bytes = 0;
+  int entries = 0;
+  size_t n;
+  DIR * d;
+
+  if (dir == NULL) {
+    fprintf(stderr, "noosh: no bytecode cache directory\n");
+    return 1;
+  }
+  noosh_cache_map_counters(dir);
+  hits = noosh_cache_counters ? __atomic_load_n(&noosh_cache_counters->hits, __ATOMIC_RELAXED) : 0;
+  misses = noosh_cache_counters ? __atomic_load_n(&noosh_cache_counters->misses, __ATOMIC_RELAXED) : 0;
+  if ((d = opendir(dir)) != NULL) {
+    while ((e = readdir(d)) != NULL) {
+      n = strlen(e->d_name);
+      if (n > 4 && strcmp(e->d_name + n - 4, ".nbc") == 0 &&
+          fstatat(dirfd(d), e->d_name, &st, 0) == 0) {
+        entries++;
+        bytes += st.st_size;
+      }
+    }
+    closedir(d);
+  }
+  printf("directory  %s\n", dir);
+  printf("entries    %d (%llu bytes)\n", entries, bytes);
+  printf("hits       %llu\n", hits);
+  printf("misses     %llu\n", misses);
+  if (hits + misses > 0) {
+    printf("hit rate   %.1f%%\n", 100.0 * hits / (hits + misses));
+  }
+  free(dir);
+  return 0;
+}
+
+/*
+  Autoload
+
+  `autoload name' declares a function whose definition is read from the
+  directories of $NOOSHFPATH only when it is first called. Files there
+  are libraries: each function a file defines at its top level is
+  indexed by name with its file, offset and length, and a file that
+  defines none is, as in zsh, the body of the function it is named
+  after. The index is built by one scan of the directories, saved in the
+  cache directory and mapped back by later shells. It is rebuilt when a
+  directory changed since the scan (checked when the index is loaded),
+  or when the file of a function changed (checked when its body is
+  read). Declaring functions costs nothing, and a call reads and compiles
+  the one body it needs.
+*/
+
+# define NOOSH_FPATH_MAGIC "NOOSHFX\1"
+
+/*
+  index file: this header, then dirs, files and funcs, nslots open
+  addressed slots holding a func number plus one (0 is empty), and the
+  strings the others point to by offset, the first being the value of
+  NOOSHFPATH the index was built for
+*/
+struct noosh_fpath_header {
+  char magic[8];
+  unsigned int ndirs;
+  unsigned int nfiles;
+  unsigned int nfuncs;
+  unsigned int nslots;
+  unsigned long long strslen;
+};
+
+/*
+  directory scanned, mtime_sec is -1 if it did not exist
+*/
+struct noosh_fpath_dir {
+  unsigned long long path;
+  long long mtime_sec;
+  long long mtime_nsec;
+};
+
+struct noosh_fpath_file {
+  unsigned long long path;
+  unsigned long long size;
+  long long mtime_sec;
+  long long mtime_nsec;
+};
+
+/*
+  function found in a file: its body is len bytes at offset, the whole
+  file when whole is set
+*/
+struct noosh_fpath_func {
+  unsigned long long name;
+  unsigned long long offset;
+  unsigned long long len;
+  unsigned int file;
+  unsigned int whole;
+};
+
+/*
+  index in use: mapped from the cache directory, or built in memory when
+  there is none
+*/
+struct noosh_fpath_index {
+  char * data;
+  size_t len;
+  int mapped;
+  struct noosh_fpath_header * h;
+  struct noosh_fpath_dir * dirs;
+  struct noosh_fpath_file * files;
+  struct noosh_fpath_func * funcs;
+  unsigned int * slots;
+  char * strs;
+};
+
+struct noosh_fpath_index noosh_fpath = {0};
+
+/*
+  the index is shared with builtin stage threads calling functions
+*/
+pthread_mutex_t noosh_fpath_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  index being built
+*/
+struct noosh_fpath_build {
+  struct noosh_vec dirs;
+  struct noosh_vec files;
+  struct noosh_vec funcs;
+  struct noosh_buf strs;
+};
+
+/*
+    @brief add a string to an index being built
+    @return its offset
+*/
+unsigned long long noosh_fpath_str(struct noosh_fpath_build * b, const char * s, size_t len) {
+  size_t off = b->strs.len;
+
+  noosh_buf_append(&b->strs, s, len);
+  noosh_buf_append(&b->strs, "", 1);
+  return off;
+}
+
+/*
+    @brief add a function to an index being built
+*/
+void noosh_fpath_add(struct noosh_fpath_build * b, const char * name, size_t offset,
+                     size_t len, int whole) {
+  struct noosh_fpath_func fn;
+
+  memset(&fn, 0, sizeof(fn));
+  fn.name = noosh_fpath_str(b, name, strlen(name));
+  fn.offset = offset;
+  fn.len = len;
+  fn.file = b->files.n - 1;
+  fn.whole = whole;
+  noosh_vec_push(&b->funcs, &fn, sizeof(fn));
+}
+
+/*
+    @brief index the functions a library file defines
+    @param b: index being built
+    @param path: the file
+    @param base: its name in its directory
+*/
+void noosh_fpath_scan_file(struct noosh_fpath_build * b, const char * path, const char * base) {
+  struct noosh_fpath_file file;
+  struct noosh_buf text = {0};
+  struct noosh_arena arena = {0};
+  struct noosh_parser ps;
+  struct noosh_node * node, ** kids;
+  struct stat st;
+  size_t pos = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC), nkids, i, found = 0;
+
+  if (fd < 0) {
+    return;
+  }
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || noosh_slurp(fd, &text) < 0) {
+    close(fd);
+    free(text.data);
+    return;
+  }
+  close(fd);
+  memset(&file, 0, sizeof(file));
+  file.path = noosh_fpath_str(b, path, strlen(path));
+  file.size = st.st_size;
+  file.mtime_sec = st.st_mtim.tv_sec;
+  file.mtime_nsec = st.st_mtim.tv_nsec;
+  noosh_vec_push(&b->files, &file, sizeof(file));
+
+  for (;;) {
+    noosh_arena_reset(&arena);
+    noosh_parser_init(&ps, text.data ? text.data : "", text.len, pos, &arena);
+    if (noosh_parse(&ps, &node) != NOOSH_PARSE_OK) {
+      break;
+    }
+    pos = ps.pos;
+    if (node == NULL) {
+      continue;
+    }
+    kids = node->type == NOOSH_N_LIST ? node->kids : &node;
+    nkids = node->type == NOOSH_N_LIST ? node->nkids : 1;
+    for (i = 0; i < nkids; i++) {
+      if (kids[i]->type == NOOSH_N_FUNC) {
+        // The body is the end of the definition.
+        noosh_fpath_add(b, kids[i]->name, kids[i]->end - kids[i]->words[0].len,
+                        kids[i]->words[0].len, 0);
+        found++;
+      }
+    }
+  }
+  if (found == 0 && noosh_valid_name(base)) {
+    noosh_fpath_add(b, base, 0, text.len, 1);
+  }
+  noosh_arena_free(&arena);
+  free(text.data);
+}
+
+int noosh_fpath_cmp(const void * a, const void * b) {
+  return strcmp(*(char **) a, *(char **) b);
+}
+
+/*
+    @brief scan the directories of NOOSHFPATH into a new index
+    @param fpath: value of NOOSHFPATH
+    @param len: receives the size of the index
+    @return allocated index, in the format of the index file
+*/
+char * noosh_fpath_build(const char * fpath, size_t * len) {
+  static const char zeros[8];
+  struct noosh_fpath_build b = {0};
+  struct noosh_fpath_header h;
+  struct noosh_fpath_func * funcs;
+  struct noosh_fpath_dir d;
+  struct noosh_vec names = {0};
+  struct noosh_buf out = {0};
+  struct dirent * e;
+  struct stat st;
+  const char * end;
+  unsigned int * slots, nslots = 8, k, s;
+  char * dir, * path, * name;
+  DIR * dp;
+  int i;
+
+  noosh_fpath_str(&b, fpath, strlen(fpath));
+  for (; *fpath; fpath = *end ? end + 1 : end) {
+    end = strchrnul(fpath, ':');
+    if (end == fpath) {
+      continue;
+    }
+    dir = noosh_malloc(end - fpath + 1);
+    memcpy(dir, fpath, end - fpath);
+    dir[end - fpath] = '\0';
+    memset(&d, 0, sizeof(d));
+    d.path = noosh_fpath_str(&b, dir, strlen(dir));
+    d.mtime_sec = -1;
+    // Read the mtime first: a file added during the scan makes it stale.
+    if (stat(dir, &st) == 0) {
+      d.mtime_sec = st.st_mtim.tv_sec;
+      d.mtime_nsec = st.st_mtim.tv_nsec;
+    }
+    noosh_vec_push(&b.dirs, &d, sizeof(d));
+    if ((dp = opendir(dir)) != NULL) {
+      while ((e = readdir(dp)) != NULL) {
+        if (e->d_name[0] != '.' && (e->d_type == DT_REG || e->d_type == DT_LNK || e->d_type == DT_UNKNOWN)) {
+          name = noosh_strdup(e->d_name);
+          noosh_vec_push(&names, &name, sizeof(name));
+        }
+      }
+      closedir(dp);
+      // Directory order is arbitrary: make the first definition found
+      // the same in every scan.
+      qsort(names.data, names.n, sizeof(char *), noosh_fpath_cmp);
+      for (i = 0; i < names.n; i++) {
+        name = ((char **) names.data)[i];
+        path = noosh_malloc(strlen(dir) + strlen(name) + 2);
+        sprintf(path, "%s/%s", dir, name);
+        noosh_fpath_scan_file(&b, path, name);
+        free(path);
+        free(name);
+      }
+      names.n = 0;
+    }
+    free(dir);
+  }
+  free(names.data);
+
+  // The first directory defining a name wins, as in PATH; within a file
+  // the last definition does, as when the file is sourced.
+  funcs = b.funcs.data;
+  while (nslots < 2 * (unsigned int) b.funcs.n) {
+    nslots *= 2;
+  }
+  slots = noosh_malloc(nslots * sizeof(*slots));
+  memset(slots, 0, nslots * sizeof(*slots));
+  for (k = 0; k < (unsigned int) b.funcs.n; k++) {
+    name = b.strs.data + funcs[k].name;
+    for (s = noosh_hash(name, strlen(name)) & (nslots - 1); slots[s]; s = (s + 1) & (nslots - 1)) {
+      if (strcmp(b.strs.data + funcs[slots[s] - 1].name, name) == 0) {
+        break;
+      }
+    }
+    if (slots[s] == 0 || funcs[slots[s] - 1].file == funcs[k].file) {
+      slots[s] = k + 1;
+    }
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, NOOSH_FPATH_MAGIC, 8);
+  h.ndirs = b.dirs.n;
+  h.nfiles = b.files.n;
+  h.nfuncs = b.funcs.n;
+  h.nslots = nslots;
+  h.strslen = b.strs.len;
+  noosh_buf_append(&out, (char *) &h, sizeof(h));
+  noosh_buf_append(&out, b.dirs.data, b.dirs.n * sizeof(struct noosh_fpath_dir));
+  noosh_buf_append(&out, b.files.data, b.files.n * sizeof(struct noosh_fpath_file));
+  noosh_buf_append(&out, b.funcs.data, b.funcs.n * sizeof(struct noosh_fpath_func));
+  noosh_buf_append(&out, (char *) slots, nslots * sizeof(*slots));
+  noosh_buf_append(&out, zeros, NOOSH_PAD8(out.len) - out.len);
+  noosh_buf_append(&out, b.strs.data, b.strs.len);
+  free(slots);
+  free(b.dirs.data);
+  free(b.files.data);
+  free(b.funcs.data);
+  free(b.strs.data);
+  *len = out.len;
+  return out.data;
+}
+
+/*
+    @brief make an index the one in use after checking it
+    @param data: the index, taken over on success
+    @param len: its size
+    @param mapped: nonzero if data is mapped rather than allocated
+    @param fpath: value of NOOSHFPATH it must be for
+    @return 0, -1 if it is not a valid index for fpath
+*/
+int noosh_fpath_open(char * data, size_t len, int mapped, const char * fpath) {
+  struct noosh_fpath_header h;
+  size_t off = sizeof(h);
+
+  if (len < sizeof(h)) {
+    return -1;
+  }
+  memcpy(&h, data, sizeof(h));
+  if (memcmp(h.magic, NOOSH_FPATH_MAGIC, 8) != 0 || h.strslen == 0 ||
+      h.nslots == 0 || (h.nslots & (h.nslots - 1)) != 0 ||
+      off + h.ndirs * sizeof(struct noosh_fpath_dir) + h.nfiles * sizeof(struct noosh_fpath_file) +
+      h.nfuncs * sizeof(struct noosh_fpath_func) + NOOSH_PAD8(h.nslots * sizeof(int)) + h.strslen != len ||
+      data[len - 1] != '\0' || strcmp(data + len - h.strslen, fpath) != 0) {
+    return -1;
+  }
+  noosh_fpath.data = data;
+  noosh_fpath.len = len;
+  noosh_fpath.mapped = mapped;
+  noosh_fpath.h = (struct noosh_fpath_header *) data;
+  noosh_fpath.dirs = (struct noosh_fpath_dir *) (data + off);
+  off += h.ndirs * sizeof(struct noosh_fpath_dir);
+  noosh_fpath.files = (struct noosh_fpath_file *) (data + off);
+  off += h.nfiles * sizeof(struct noosh_fpath_file);
+  noosh_fpath.funcs = (struct noosh_fpath_func *) (data + off);
+  off += h.nfuncs * sizeof(struct noosh_fpath_func);
+  noosh_fpath.slots = (unsigned int *) (data + off);
+  noosh_fpath.strs = data + len - h.strslen;
+  return 0;
+}
+
+/*
+    @brief drop the index in use
+*/
+void noosh_fpath_close(void) {
+  if (noosh_fpath.mapped) {
+    munmap(noosh_fpath.data, noosh_fpath.len);
+  } else {
+    free(noosh_fpath.data);
+  }
+  memset(&noosh_fpath, 0, sizeof(noosh_fpath));
+}
+
+/*
+    @brief check that the index in use matches the directories
+    @param files: nonzero to check every indexed file as well
+    @return 1 if it does, 0 if it is stale
+*/
+int noosh_fpath_fresh(int files) {
+  struct stat st;
+  unsigned int i;
+
+  for (i = 0; i < noosh_fpath.h->ndirs; i++) {
+    if (stat(noosh_fpath.strs + noosh_fpath.dirs[i].path, &st) < 0) {
+      if (noosh_fpath.dirs[i].mtime_sec != -1) {
+        return 0;
+      }
+    } else if (st.st_mtim.tv_sec != noosh_fpath.dirs[i].mtime_sec ||
+               st.st_mtim.tv_nsec != noosh_fpath.dirs[i].mtime_nsec) {
+      return 0;
+    }
+  }
+  for (i = 0; files && i < noosh_fpath.h->nfiles; i++) {
+    if (stat(noosh_fpath.strs + noosh_fpath.files[i].path, &st) < 0 ||
+        (unsigned long long) st.st_size != noosh_fpath.files[i].size ||
+        st.st_mtim.tv_sec != noosh_fpath.files[i].mtime_sec ||
+        st.st_mtim.tv_nsec != noosh_fpath.files[i].mtime_nsec) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+    @brief make the index of NOOSHFPATH the one in use, from the cache
+        directory when it is up to date there, otherwise by a new scan
+    @param fpath: value of NOOSHFPATH
+    @param rebuild: nonzero to scan even if the index looks up to date
+*/
+void noosh_fpath_load(const char * fpath, int rebuild) {
+  char * dir, * path = NULL, * data;
+  struct stat st;
+  size_t len;
+  int fd;
+
+  if (!rebuild && noosh_fpath.h && strcmp(noosh_fpath.strs, fpath) == 0) {
+    return;
+  }
+  noosh_fpath_close();
+  if ((dir = noosh_cache_dir()) != NULL) {
+    path = noosh_malloc(strlen(dir) + 32);
+    sprintf(path, "%s/fpath-%016lx.idx", dir, noosh_hash(fpath, strlen(fpath)));
+    free(dir);
+  }
+  if (path && !rebuild && (fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+    data = fstat(fd, &st) == 0 && st.st_size > 0 ?
+           mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data != MAP_FAILED) {
+      if (noosh_fpath_open(data, st.st_size, 1, fpath) == 0) {
+        if (noosh_fpath_fresh(0)) {
+          free(path);
+          return;
+        }
+        noosh_fpath_close();
+      } else {
+        munmap(data, st.st_size);
+      }
+    }
+  }
+  data = noosh_fpath_build(fpath, &len);
+  if (path) {
+    noosh_cache_replace(path, data, len);
+  }
+  free(path);
+  noosh_fpath_open(data, len, 0, fpath);
+}
+
+/*
+    @brief look up a function in the index in use
+    @param name: function name
+    @return its entry, NULL if it is not indexed
+*/
+struct noosh_fpath_func * noosh_fpath_lookup(const char * name) {
+  struct noosh_fpath_func * fn;
+  unsigned int mask = noosh_fpath.h->nslots - 1, s;
+
+  for (s = noosh_hash(name, strlen(name)) & mask; noosh_fpath.slots[s]; s = (s + 1) & mask) {
+    fn = &noosh_fpath.funcs[noosh_fpath.slots[s] - 1];
+    if (strcmp(noosh_fpath.strs + fn->name, name) == 0) {
+      return fn;
+    }
+  }
+  return NULL;
+}
+
+/*
+    @brief read the body of a function from its file, if the file is
+        still the one indexed
+    @param fd: the file
+    @param fn: the function
+    @return allocated text, NULL if the file changed
+*/
+char * noosh_fpath_read(int fd, struct noosh_fpath_func * fn) {
+  struct noosh_fpath_file * file = &noosh_fpath.files[fn->file];
+  size_t wrap = fn->whole ? 2 : 0, got = 0;
+  struct stat st;
+  ssize_t r;
+  char * text;
+
+  if (fstat(fd, &st) < 0 || (unsigned long long) st.st_size != file->size ||
+      st.st_mtim.tv_sec != file->mtime_sec || st.st_mtim.tv_nsec != file->mtime_nsec) {
+    return NULL;
+  }
+  // A whole file is a list of commands: make it a group.
+  text = noosh_malloc(fn->len + 2 * wrap + 1);
+  memcpy(text, "{\n", wrap);
+  while (got < fn->len) {
+    r = pread(fd, text + wrap + got, fn->len - got, fn->offset + got);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      free(text);
+      return NULL;
+    }
+    got += r;
+  }
+  memcpy(text + wrap + fn->len, "\n}", wrap);
+  text[fn->len + 2 * wrap] = '\0';
+  return text;
+}
+
+/*
+    @brief find the body of an autoloaded function in NOOSHFPATH
+    @param name: function name
+    @return allocated text, NULL after printing an error if there is none
+*/
+char * noosh_autoload_text(const char * name) {
+  const char * fpath = noosh_getvar("NOOSHFPATH");
+  struct noosh_fpath_func * fn;
+  char * text = NULL;
+  int fd, rebuild;
+
+  pthread_mutex_lock(&noosh_fpath_lock);
+  // A stale index gets one new scan.
+  for (rebuild = 0; fpath && *fpath && rebuild < 2 && text == NULL; rebuild++) {
+    noosh_fpath_load(fpath, rebuild);
+    if ((fn = noosh_fpath_lookup(name)) == NULL) {
+      if (rebuild == 0 && !noosh_fpath_fresh(1)) {
+        continue;
+      }
+      break;
+    }
+    if ((fd = open(noosh_fpath.strs + noosh_fpath.files[fn->file].path, O_RDONLY | O_CLOEXEC)) >= 0) {
+      text = noosh_fpath_read(fd, fn);
+      close(fd);
+    }
+  }
+  pthread_mutex_unlock(&noosh_fpath_lock);
+  if (text == NULL) {
+    dprintf(NOOSH_FD(2), "noosh: %s: function definition not found in NOOSHFPATH\n", name);
+  }
+  return text;
+}
+
+/*
+    @brief list the functions of the NOOSHFPATH index, for autoload
+    @param out: descriptor to write to
+    @return 0, 1 if NOOSHFPATH is not set
+*/
+int noosh_autoload_list(int out) {
+  const char * fpath = noosh_getvar("NOOSHFPATH");
+  struct noosh_fpath_func * fn;
+  unsigned int s;
+
+  if (fpath == NULL || *fpath == '\0') {
+    dprintf(NOOSH_FD(2), "noosh: autoload: NOOSHFPATH is not set\n");
+    return 1;
+  }
+  pthread_mutex_lock(&noosh_fpath_lock);
+  noosh_fpath_load(fpath, 0);
+  if (!noosh_fpath_fresh(1)) {
+    noosh_fpath_load(fpath, 1);
+  }
+  for (s = 0; s < noosh_fpath.h->nslots; s++) {
+    if (noosh_fpath.slots[s]) {
+      fn = &noosh_fpath.funcs[noosh_fpath.slots[s] - 1];
+      dprintf(out, "%s\t%s\n", noosh_fpath.strs + fn->name,
+              noosh_fpath.strs + noosh_fpath.files[fn->file].path);
+    }
+  }
+  pthread_mutex_unlock(&noosh_fpath_lock);
+  return 0;
+}
+
+/*
+  Line cache
+
+  Lines typed or fed again and again (polling loops, health checks) and
+  the strings given to eval are looked up by a hash of their text in a
+  bounded cache of their compiled code, so a repeated line is neither
+  lexed nor parsed. Each entry owns its code and everything the code
+  allocates, freed together when the least recently used entry is
+  evicted; an entry still running is only unlinked, and freed when its
+  last run ends.
+*/
+
+# define NOOSH_LINE_CACHE_MAX 256
+# define NOOSH_LINE_CACHE_BUCKETS 512
+
+/*
+  cached line: its text and code, linked in a hash chain and in the
+  list from most to least recently used
+*/
+struct noosh_cached {
+  unsigned long hash;
+  char * text;
+  size_t len;
+  struct noosh_code * code;
+  int refs;
+  struct noosh_cached * next;
+  struct noosh_cached * newer;
+  struct noosh_cached * older;
+};
+
+struct noosh_cached * noosh_line_cache[NOOSH_LINE_CACHE_BUCKETS];
+struct noosh_cached * noosh_line_newest = NULL;
+struct noosh_cached * noosh_line_oldest = NULL;
+int noosh_line_count = 0;
+unsigned long noosh_line_hits = 0;
+unsigned long noosh_line_misses = 0;
+
+/*
+  the cache is shared with builtin stage threads running eval
+*/
+pthread_mutex_t noosh_line_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+    @brief unlink an entry from the use list
+*/
+void noosh_line_unlink(struct noosh_cached * e) {
+  if (e->newer) {
+    e->newer->older = e->older;
+  } else {
+    noosh_line_newest = e->older;
+  }
+  if (e->older) {
+    e->older->newer = e->newer;
+  } else {
+    noosh_line_oldest = e->newer;
+  }
+  e->newer = e->older = NULL;
+}
+
+/*
+    @brief put an entry first in the use list
+*/
+void noosh_line_touch(struct noosh_cached * e) {
+  e->older = noosh_line_newest;
+  e->newer = NULL;
+  if (noosh_line_newest) {
+    noosh_line_newest->newer = e;
+  } else {
+    noosh_line_oldest = e;
+  }
+  noosh_line_newest = e;
+}
+
+/*
+    @brief free an entry
+*/
+void noosh_line_free(struct noosh_cached * e) {
+  noosh_code_free(e->code);
+  free(e->text);
+  free(e);
+}
+
+/*
+    @brief evict the least recently used entry
+*/
+void noosh_line_evict(void) {
+  struct noosh_cached * e = noosh_line_oldest, ** link;
+
+  link = &noosh_line_cache[e->hash % NOOSH_LINE_CACHE_BUCKETS];
+  while (*link != e) {
+    link = &(*link)->next;
+  }
+  *link = e->next;
+  noosh_line_unlink(e);
+  noosh_line_count--;
+  // A running entry is freed by its last noosh_line_release.
+  e->hash = 0;
+  e->next = NULL;
+  if (e->refs == 0) {
+    noosh_line_free(e);
+  }
+}
+
+/*
+    @brief look up the code of a line
+    @param text: the line
+    @param len: its length
+    @return the entry, held until noosh_line_release, or NULL
+*/
+struct noosh_cached * noosh_line_get(const char * text, size_t len) {
+  unsigned long h = noosh_hash(text, len) | 1;
+  struct noosh_cached * e;
+
+  pthread_mutex_lock(&noosh_line_lock);
+  for (e = noosh_line_cache[h % NOOSH_LINE_CACHE_BUCKETS]; e; e = e->next) {
+    if (e->hash == h && e->len == len && memcmp(e->text, text, len) == 0) {
+      break;
+    }
+  }
+  if (e) {
+    noosh_line_hits++;
+    noosh_line_unlink(e);
+    noosh_line_touch(e);
+    e->refs++;
+  }
+  pthread_mutex_unlock(&noosh_line_lock);
+  return e;
+}
+
+/*
+    @brief add the code of a line, counting a miss
+    @param text: the line
+    @param len: its length
+    @param code: its code, now owned by the cache
+    @return the entry, held until noosh_line_release
+*/
+struct noosh_cached * noosh_line_put(const char * text, size_t len, struct noosh_code * code) {
+  struct noosh_cached * e = noosh_malloc(sizeof(*e));
+
+  e->hash = noosh_hash(text, len) | 1;
+  e->text = noosh_malloc(len + 1);
+  memcpy(e->text, text, len);
+  e->text[len] = '\0';
+  e->len = len;
+  e->code = code;
+  e->refs = 1;
+  pthread_mutex_lock(&noosh_line_lock);
+  noosh_line_misses++;
+  if (noosh_line_count == NOOSH_LINE_CACHE_MAX) {
+    noosh_line_evict();
+  }
+  e->next = noosh_line_cache[e->hash % NOOSH_LINE_CACHE_BUCKETS];
+  noosh_line_cache[e->hash % NOOSH_LINE_CACHE_BUCKETS] = e;
+  noosh_line_touch(e);
+  noosh_line_count++;
+  pthread_mutex_unlock(&noosh_line_lock);
+  return e;
+}
+
+/*
+    @brief let go of an entry after running it
+*/
+void noosh_line_release(struct noosh_cached * e) {
+  pthread_mutex_lock(&noosh_line_lock);
+  if (--e->refs == 0 && e->hash == 0) {
+    noosh_line_free(e);
+  }
+  pthread_mutex_unlock(&noosh_line_lock);
+}
+
+/*
+    @brief run commands from a string through the line cache
+    @param text: the commands
+    @param len: their length
+    @return exit status of the last command
+*/
+int noosh_run_cached(const char * text, size_t len) {
+  struct noosh_cached * e;
+
+  if (!noosh_opt_bytecode) {
+    return noosh_run_string(text, len);
+  }
+  if ((e = noosh_line_get(text, len)) == NULL) {
+    e = noosh_line_put(text, len, noosh_compile_source(text, len));
+  }
+  noosh_vm_run(e->code);
+  noosh_line_release(e);
+  return noosh_last_status;
+}
+
+/*
+    @brief show the line cache counters
+    @param out: descriptor to write to
+    @param reset: nonzero to reset them afterwards
+*/
+void noosh_line_stats(int out, int reset) {
+  unsigned long hits, misses;
+
+  pthread_mutex_lock(&noosh_line_lock);
+  hits = noosh_line_hits;
+  misses = noosh_line_misses;
+  if (reset) {
+    noosh_line_hits = noosh_line_misses = 0;
+  }
+  pthread_mutex_unlock(&noosh_line_lock);
+  dprintf(out, "line cache hits %lu misses %lu entries %d", hits, misses, noosh_line_count);
+  if (hits + misses) {
+    dprintf(out, " hit rate %.1f%%", 100.0 * hits / (hits + misses));
+  }
+  dprintf(out, "\n");
+}
+
+/*
+    @brief make the prompt, if input is a terminal
+    @param cont: nonzero for a continuation line
+    @return the prompt, allocated, NULL if input is not a terminal
+*/
+char * noosh_prompt(int cont) {
+  static char hostname[HOST_NAME_MAX];
+  static int loaded = 0;
+  const char * user;
+  char * cwd, * p;
+
+  if (!isatty(STDIN_FILENO)) {
+    return NULL;
+  }
+  if (cont) {
+    return noosh_strdup("> ");
+  }
+  if (!loaded) {
+    noosh_colors = read_config("noosh_config.txt");
+    gethostname(hostname, HOST_NAME_MAX);
+    loaded = 1;
+  }
+  cwd = get_cwd(NULL);
+  user = noosh_getvar("USER");
+  p = noosh_malloc(strlen(user ? user : "(null)") + strlen(hostname) + strlen(cwd) + 64);
+  sprintf(p, "\033[0;%dm%s@\033[0;%dm%s\033[0m:\033[0;%dm%s\033[0m$ ",
+          noosh_colors.username_color, user ? user : "(null)",
+          noosh_colors.username_color, hostname,
+          noosh_colors.cwd_color, cwd);
+  free(cwd);
+  return p;
+}
+
+/*
+    @brief parse and run commands from text, reading more lines from fd
+        when the text runs out or ends inside a command
+    @param text: the text, grown as lines are read
+    @param fd: descriptor to read more lines from, -1 for none
+    @return exit status of the last command
+*/
+int noosh_run_source(struct noosh_buf * text, int fd) {
+  struct noosh_arena arena = {0};
+  struct noosh_parser ps;
+  struct noosh_node * node;
+  struct noosh_code * code;
+  struct noosh_cached * e;
+  char * line, * prompt;
+  size_t start = 0;
+  int r, cont = 0, pasted = 0;
+
+  if (fd < 0 && noosh_opt_bytecode) {
+    // All the text is there: compile it in one go.
+    code = noosh_compile_source(text->data ? text->data : "", text->len);
+    noosh_vm_run(code);
+    noosh_code_free(code);
+    return noosh_exit_pending ? noosh_exit_code : noosh_last_status;
+  }
+  while (!noosh_exit_pending) {
+    if (start >= text->len || cont) {
+      if (!cont) {
+        text->len = start = 0;
+        pasted = 0;
+      }
+      prompt = noosh_prompt(cont);
+      line = fd < 0 ? NULL : noosh_read_line(prompt);
+      free(prompt);
+      if (line && noosh_ed_cancelled) {
+        // ^C gave up the line, and the command it was part of.
+        noosh_ed_cancelled = 0;
+        free(line);
+        text->len = start = 0;
+        cont = 0;
+        noosh_last_status = 130;
+        continue;
+      }
+      if (line == NULL) {
+        if (cont) {
+          fprintf(stderr, "noosh: syntax error: unexpected end of file\n");
+          noosh_last_status = 2;
+        } else if (fd >= 0 && isatty(fd)) {
+          printf("\n");
+        }
+        break;
+      }
+      // A paste brings many lines at once: what is left of them is not
+      // looked up in the line cache after each command.
+      pasted |= strchr(line, '\n') != NULL;
+      noosh_buf_append(text, line, strlen(line));
+      noosh_buf_append(text, "\n", 1);
+      free(line);
+    }
+
+    if (noosh_opt_bytecode && !pasted && (e = noosh_line_get(text->data + start, text->len - start)) != NULL) {
+      // Seen before: no need to parse it.
+      start = text->len;
+      cont = 0;
+      noosh_vm_run(e->code);
+      noosh_line_release(e);
+      continue;
+    }
+    noosh_arena_reset(&arena);
+    noosh_parser_init(&ps, text->data, text->len, start, &arena);
+    r = noosh_parse(&ps, &node);
+    cont = r == NOOSH_PARSE_MORE && fd >= 0;
+    if (cont) {
+      continue;
+    }
+    if (r == NOOSH_PARSE_MORE || r == NOOSH_PARSE_ERROR) {
+      fprintf(stderr, "noosh: syntax error: %s\n", ps.error);
+      noosh_last_status = 2;
+      if (fd < 0 || !isatty(fd)) {
+        break;
+      }
+      start = text->len;
+      continue;
+    }
+    if (node != NULL && noosh_opt_bytecode) {
+      code = noosh_compile(node, text->data);
+      if (ps.pos == text->len) {
+        // The command is all of the text read: remember it.
+        e = noosh_line_put(text->data + start, text->len - start, code);
+        start = ps.pos;
+        noosh_vm_run(e->code);
+        noosh_line_release(e);
+      } else {
+        start = ps.pos;
+        noosh_vm_run(code);
+        noosh_code_free(code);
+      }
+    } else if (node != NULL) {
+      start = ps.pos;
+      noosh_execute(node);
+    } else {
+      start = ps.pos;
+    }
+  }
+  noosh_arena_free(&arena);
+  return noosh_exit_pending ? noosh_exit_code : noosh_last_status;
+}
+
+/*
+    @brief parse and run commands from a string
+    @param src: the commands
+    @param len: their length
+    @return exit status of the last command
+*/
+int noosh_run_string(const char * src, size_t len) {
+  struct noosh_buf text = {0};
+  int status;
+
+  noosh_buf_append(&text, src, len);
+  status = noosh_run_source(&text, -1);
+  free(text.data);
+  return status;
+}
+
+/*
+    @brief run the commands of a script file
+    @param path: the script
+    @return exit status of the last command
+*/
+int noosh_run_file(const char * path) {
+  struct noosh_buf text = {0};
+  struct noosh_code * code;
+  int fd, status;
+
+  if (noosh_opt_bytecode) {
+    if ((code = noosh_cache_code(path)) == NULL) {
+      return 127;
+    }
+    noosh_vm_run(code);
+    noosh_code_free(code);
+    return noosh_exit_pending ? noosh_exit_code : noosh_last_status;
+  }
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0 || noosh_slurp(fd, &text) < 0) {
+    fprintf(stderr, "noosh: %s: %s\n", path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 127;
+  }
+  close(fd);
+  status = noosh_run_source(&text, -1);
+  free(text.data);
+  return status;
+}
+
+/*
+    @brief loop reading, parsing and executing commands from stdin
+    @return exit status of the last command
+*/
+int noosh_loop(void) {
+  struct noosh_buf text = {0};
+  int status;
+
+  noosh_interactive = isatty(STDIN_FILENO);
+  status = noosh_run_source(&text, STDIN_FILENO);
+
+  free(text.data);
+  return status;
+}
+
+/*
+    @brief main func entry point
+    @param argc arg count
+    @param argv arg vector
+    @return status code
+*/
+int main(int argc, char ** argv) {
+  // TODO: implement config files
+
+  // Builtins may write to pipes as threads of the shell: a closed pipe
+  // must be an EPIPE for them, not a signal that kills the shell.
+  signal(SIGPIPE, SIG_IGN);
+
+  // `kill -USR1' reports the fill level of running buffers, as dd does.
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = noosh_buffer_sigusr1;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  // A file read through a mapping may be truncated by another process.
+  noosh_page_size = sysconf(_SC_PAGESIZE);
+  sa.sa_handler = NULL;
+  sa.sa_sigaction = noosh_map_sigbus;
+  sa.sa_flags = SA_SIGINFO;
+  sigaction(SIGBUS, &sa, NULL);
+
+  pthread_atfork(noosh_atfork_prepare, noosh_atfork_release, noosh_atfork_release);
+  noosh_var_import();
+
+  if (argc > 1 && strcmp(argv[1], "--cache-stats") == 0) {
+    // noosh --cache-stats
+    return noosh_cache_stats();
+  }
+  if (argc > 2 && strcmp(argv[1], "--disasm") == 0) {
+    // noosh --disasm script
+    return noosh_disasm_file(argv[2]);
+  }
+  if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+    // noosh -c commands [name [arg ...]]
+    if (argc > 3) {
+      noosh_arg0 = argv[3];
+      noosh_params = argv + 4;
+      noosh_nparams = argc - 4;
+    }
+    return noosh_run_string(argv[2], strlen(argv[2]));
+  }
+  if (argc > 1) {
+    // noosh script [arg ...]
+    noosh_arg0 = argv[1];
+    noosh_params = argv + 2;
+    noosh_nparams = argc - 2;
+    return noosh_run_file(argv[1]);
+  }
+
+  // Run command loop.
+  return noosh_loop();
 }
\ No newline at end of file
@@ -0,0 +1,80 @@
+#!/bin/sh
+# Error handling tests: run small scripts through noosh and compare what
+# they print, standard error included, and their exit status with what
+# they should. Prints each case that fails, and exits 1 if any did.
+#   usage: tests/errors.sh [path/to/noosh]
+
+noosh=${1:-./noosh}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# check name expected [arguments...]: run noosh with the arguments and
+# compare its output, then "status" and its exit status, with expected
+check() {
+  name=$1
+  want=$2
+  shift 2
+  got=$(cd "$dir" && "$noosh" "$@" 2>&1; echo "status $?")
+  if [ "$got" != "$want" ]; then
+    printf 'FAIL %s\n--- want\n%s\n--- got\n%s\n' "$name" "$want" "$got"
+    failed=1
+  fi
+}
+
+# Input that ends inside a quote or a substitution.
+eof='noosh: syntax error: unexpected end of file'
+for word in '"x' "'x" '${x' '$((1' '$(echo' '`echo'; do
+  check "-c echo $word" "$eof
+status 2" -c "echo $word"
+  printf 'echo a\necho %s\n' "$word" > "$dir/open.sh"
+  check "script echo $word" "a
+$eof
+status 2" open.sh
+  printf 'set +o bytecode\necho a\necho %s\n' "$word" > "$dir/open.sh"
+  check "tree walker script echo $word" "a
+$eof
+status 2" open.sh
+done
+check 'eval echo "x' "$eof
+2
+status 0" -c 'eval "echo \"x"; echo $?'
+check 'tree walker eval echo "x' "$eof
+2
+status 0" -c 'set +o bytecode; eval "echo \"x"; echo $?'
+
+# ${name?word} on an unset name ends a script, but only a stage of a
+# pipeline, and the command in an interactive shell.
+for mode in -o +o; do
+  check "\${u?} set $mode bytecode" "noosh: u: parameter null or not set
+status 1" -c "set $mode bytecode; echo \${u?}; echo next"
+  check "\${u:?word} set $mode bytecode" "noosh: u: word
+status 1" -c "set $mode bytecode; u=; f() { : \${u:?word}; }; f; echo next"
+  check "\${u?} in a stage set $mode bytecode" "noosh: u: parameter null or not set
+next 1
+status 0" -c "set $mode bytecode; cat < /dev/null | echo \${u?}; echo next \$?"
+  check "\${u?} in a subshell set $mode bytecode" "noosh: u: parameter null or not set
+next 1
+status 0" -c "set $mode bytecode; (echo \${u?}); echo next \$?"
+done
+
+# cp fails on what it does not copy, and goes on with the rest.
+echo hi > "$dir/src"
+mkdir "$dir/tree"
+check 'cp into a missing directory' "noosh: cp: missing/y: No such file or directory
+1
+status 0" -c 'cp src missing/y; echo $?'
+check 'cp a file onto itself' "noosh: cp: src and src are the same file
+1
+status 0" -c 'cp src src; echo $?'
+check 'cp a directory without -r' "noosh: cp: -r not specified; omitting directory tree
+1
+hi
+status 0" -c 'cp tree src tree; echo $?; cat tree/src'
+check 'cp -r a missing tree' "noosh: cp: nosuch: No such file or directory
+1
+status 0" -c 'cp -r nosuch copy; echo $?'
+check 'cp that works' "0
+status 0" -c 'cp -r tree copy && cp src copy/src; echo $?'
+
+exit $failed